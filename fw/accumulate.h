@@ -0,0 +1,32 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+
+namespace fw {
+
+/// Add 'delta' to an integer accumulator, carrying the fractional
+/// part forward in 'remainder' so that increments smaller than one
+/// count are not lost.
+template <typename T>
+void Accumulate(T* total, float* remainder, float delta) {
+  *remainder += delta;
+  const auto whole = static_cast<int64_t>(*remainder);
+  *total += static_cast<T>(whole);
+  *remainder -= static_cast<float>(whole);
+}
+
+}
@@ -0,0 +1,192 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+#include "mjlib/base/visitor.h"
+
+namespace fw {
+
+/// How one group of analog channels is converted.
+struct AdcAcquisition {
+  // 2^oversample_log2 conversions are averaged in hardware, from 0
+  // (no oversampling) to 8 (256x).  The sum is shifted right by the
+  // same amount, so results are always 12 bits.
+  int8_t oversample_log2 = 5;
+
+  // An index into the sample times of the STM32G4, which are 2.5,
+  // 6.5, 12.5, 24.5, 47.5, 92.5, 247.5 and 640.5 ADC clock cycles.
+  int8_t sample_time = 2;
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(oversample_log2));
+    a->Visit(MJ_NVP(sample_time));
+  }
+
+  int oversample() const {
+    return std::max(0, std::min<int>(8, oversample_log2));
+  }
+
+  int sample_time_index() const {
+    return std::max(0, std::min<int>(7, sample_time));
+  }
+
+  /// The expected time for one oversampled result.
+  float conversion_us(float adc_clock_hz) const {
+    constexpr float kSampleCycles[] = {
+      2.5f, 6.5f, 12.5f, 24.5f, 47.5f, 92.5f, 247.5f, 640.5f,
+    };
+    // Each conversion takes a further 12.5 cycles at 12 bits.
+    const float cycles =
+        static_cast<float>(1 << oversample()) *
+        (kSampleCycles[sample_time_index()] + 12.5f);
+    return cycles / adc_clock_hz * 1e6f;
+  }
+};
+
+/// A complete set of acquisition settings, one for each group of
+/// channels.
+struct AdcProfile {
+  AdcAcquisition voltage;
+  AdcAcquisition current;
+  AdcAcquisition temperature;
+
+  // The voltages and currents are converted every millisecond, as
+  // they are integrated for energy.  The temperatures change slowly,
+  // and are converted once every this many milliseconds.
+  int16_t temperature_period_ms = 1;
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(voltage));
+    a->Visit(MJ_NVP(current));
+    a->Visit(MJ_NVP(temperature));
+    a->Visit(MJ_NVP(temperature_period_ms));
+  }
+};
+
+/// The named profiles, and which is used in each state.
+struct AdcProfileConfig {
+  enum Profile : int8_t {
+    kProtection,
+    kMetering,
+    kIdle,
+    kNumProfiles,
+  };
+
+  // Short conversions, so that the high rate precharge sampling and
+  // the analog watchdogs see fresh values.
+  AdcProfile protection = []() {
+    AdcProfile result;
+    result.voltage.oversample_log2 = 2;
+    result.current.oversample_log2 = 2;
+    result.temperature_period_ms = 10;
+    return result;
+  }();
+
+  // Heavily averaged, for the best energy accuracy.
+  AdcProfile metering;
+
+  // Little is happening while the output is off, so convert less.
+  AdcProfile idle = []() {
+    AdcProfile result;
+    result.voltage.oversample_log2 = 3;
+    result.current.oversample_log2 = 3;
+    result.temperature_period_ms = 100;
+    return result;
+  }();
+
+  Profile power_off = kIdle;
+  Profile precharging = kProtection;
+  Profile power_on = kMetering;
+  Profile fault = kIdle;
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(protection));
+    a->Visit(MJ_NVP(metering));
+    a->Visit(MJ_NVP(idle));
+    a->Visit(MJ_NVP(power_off));
+    a->Visit(MJ_NVP(precharging));
+    a->Visit(MJ_NVP(power_on));
+    a->Visit(MJ_NVP(fault));
+  }
+
+  /// A configuration can hold any value, so anything out of range
+  /// selects metering, as profile() does.
+  static Profile Validate(Profile which) {
+    return (which >= 0 && which < kNumProfiles) ? which : kMetering;
+  }
+
+  const AdcProfile& profile(Profile which) const {
+    switch (which) {
+      case kProtection: { return protection; }
+      case kMetering: { return metering; }
+      case kIdle: { return idle; }
+      case kNumProfiles: { break; }
+    }
+    return metering;
+  }
+};
+
+/// The measured cost of each profile, reported as the "adc"
+/// telemetry channel.
+struct AdcStatus {
+  AdcProfileConfig::Profile profile = AdcProfileConfig::kMetering;
+
+  // The time from trigger until every ADC has finished, filtered,
+  // while each profile was active.
+  std::array<float, AdcProfileConfig::kNumProfiles> conversion_us = {};
+  std::array<float, AdcProfileConfig::kNumProfiles> temperature_us = {};
+
+  // The same, as predicted from the sample times and oversampling.
+  std::array<float, AdcProfileConfig::kNumProfiles> expected_conversion_us = {};
+  std::array<float, AdcProfileConfig::kNumProfiles> expected_temperature_us = {};
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(profile));
+    a->Visit(MJ_NVP(conversion_us));
+    a->Visit(MJ_NVP(temperature_us));
+    a->Visit(MJ_NVP(expected_conversion_us));
+    a->Visit(MJ_NVP(expected_temperature_us));
+  }
+};
+
+}
+
+namespace mjlib {
+namespace base {
+
+template <>
+struct IsEnum<fw::AdcProfileConfig::Profile> {
+  static constexpr bool value = true;
+
+  using P = fw::AdcProfileConfig::Profile;
+  static std::array<std::pair<P, const char*>, P::kNumProfiles> map() {
+    return { {
+        { P::kProtection, "protection" },
+        { P::kMetering, "metering" },
+        { P::kIdle, "idle" },
+      } };
+  }
+};
+
+}
+}
@@ -0,0 +1,305 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#include "mjlib/base/visitor.h"
+
+#include "fw/accumulate.h"
+
+namespace fw {
+
+/// Estimates the state of charge of a battery connected to the input.
+///
+/// Charge is counted separately in each direction in integer nAh.
+/// The state of charge follows the net count, and is slowly pulled
+/// towards the value implied by the open circuit voltage table.  The
+/// open circuit voltage is inferred from the terminal voltage using an
+/// internal resistance estimated from the correlation of voltage and
+/// current.
+class BatteryEstimator {
+ public:
+  static constexpr int kOcvPoints = 11;
+
+  struct Config {
+    float capacity_Ah = 5.0f;
+
+    // The open circuit voltage at 0%, 10%, ... 100% state of charge.
+    // The default is a 6S lithium polymer pack.
+    std::array<float, kOcvPoints> ocv_V = { {
+        19.8f, 21.6f, 22.2f, 22.5f, 22.74f, 22.98f,
+        23.22f, 23.52f, 23.82f, 24.36f, 25.2f,
+      } };
+
+    float initial_resistance_ohm = 0.05f;
+
+    // The time constant of the correlation used to estimate
+    // resistance, and the minimum current standard deviation required
+    // to update it.
+    float resistance_filter_s = 30.0f;
+    float resistance_min_current_A = 1.0f;
+
+    // The time constant with which the state of charge is pulled
+    // towards the open circuit voltage estimate.
+    float ocv_time_constant_s = 300.0f;
+
+    // The time constant used to filter power for the runtime estimate.
+    float power_filter_s = 10.0f;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(capacity_Ah));
+      a->Visit(MJ_NVP(ocv_V));
+      a->Visit(MJ_NVP(initial_resistance_ohm));
+      a->Visit(MJ_NVP(resistance_filter_s));
+      a->Visit(MJ_NVP(resistance_min_current_A));
+      a->Visit(MJ_NVP(ocv_time_constant_s));
+      a->Visit(MJ_NVP(power_filter_s));
+    }
+  };
+
+  struct Status {
+    float soc_percent = 0.0f;
+    float remaining_Wh = 0.0f;
+    float runtime_s = 0.0f;
+    float resistance_ohm = 0.0f;
+    float ocv_V = 0.0f;
+    float charge_out_Ah = 0.0f;
+    float charge_in_Ah = 0.0f;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(soc_percent));
+      a->Visit(MJ_NVP(remaining_Wh));
+      a->Visit(MJ_NVP(runtime_s));
+      a->Visit(MJ_NVP(resistance_ohm));
+      a->Visit(MJ_NVP(ocv_V));
+      a->Visit(MJ_NVP(charge_out_Ah));
+      a->Visit(MJ_NVP(charge_in_Ah));
+    }
+  };
+
+  BatteryEstimator(const Config* config) : config_(config) {}
+
+  void Configure(float period_s) {
+    period_s_ = period_s;
+    resistance_alpha_ = Alpha(period_s, config_->resistance_filter_s);
+    ocv_alpha_ = Alpha(period_s, config_->ocv_time_constant_s);
+    power_alpha_ = Alpha(period_s, config_->power_filter_s);
+    capacity_nAh_ = std::max(0.0f, config_->capacity_Ah * 1e9f);
+    if (!initialized_) {
+      resistance_ohm_ = config_->initial_resistance_ohm;
+    } else {
+      // Keep the current state of charge across a capacity change.
+      SetSoc(soc_);
+    }
+  }
+
+  /// Update with the terminal voltage and the current drawn from the
+  /// battery, positive when discharging.
+  void Update(float voltage_V, float current_A) {
+    if (!initialized_) {
+      // We start out at rest, so the terminal voltage is the open
+      // circuit voltage.
+      reference_v_ = voltage_V;
+      reference_i_ = current_A;
+      initialized_ = true;
+      SetSoc(SocFromOcv(voltage_V));
+    }
+
+    // A single sample is only a few nAh at light load, so the
+    // fractional part is carried over rather than rounded away.
+    const float delta_nAh = current_A * period_s_ * (1e9f / 3600.0f);
+    if (delta_nAh >= 0.0f) {
+      Accumulate(&charge_out_nAh_, &charge_out_remainder_, delta_nAh);
+    } else {
+      Accumulate(&charge_in_nAh_, &charge_in_remainder_, -delta_nAh);
+    }
+
+    // The open circuit voltage changes slowly compared to the load,
+    // so the slope of voltage against current is the resistance.
+    //
+    // The filter steps are far smaller than a float's resolution at
+    // the battery voltage, so the means are kept as offsets from a
+    // reference which follows them in coarse steps.
+    const float a = resistance_alpha_;
+    const float offset_v = voltage_V - reference_v_;
+    const float offset_i = current_A - reference_i_;
+    mean_v_ += a * (offset_v - mean_v_);
+    mean_i_ += a * (offset_i - mean_i_);
+    const float dv = offset_v - mean_v_;
+    const float di = offset_i - mean_i_;
+    Rebase(&reference_v_, &mean_v_);
+    Rebase(&reference_i_, &mean_i_);
+    cov_vi_ += a * (dv * di - cov_vi_);
+    var_i_ += a * (di * di - var_i_);
+    const float min_var =
+        config_->resistance_min_current_A * config_->resistance_min_current_A;
+    if (var_i_ > min_var) {
+      const float estimate = -cov_vi_ / var_i_;
+      if (estimate > 0.0f) { resistance_ohm_ = estimate; }
+    }
+
+    ocv_V_ = voltage_V + current_A * resistance_ohm_;
+    const float ocv_soc = SocFromOcv(ocv_V_);
+    if (capacity_nAh_ > 0.0f) {
+      // The state of charge is derived from the integer charge
+      // counters, and the open circuit voltage estimate pulls on the
+      // point at which the battery would read full.
+      UpdateSoc();
+      Accumulate(&full_nAh_, &full_remainder_,
+                 ocv_alpha_ * (ocv_soc - soc_) * capacity_nAh_);
+      ClampFull();
+      UpdateSoc();
+    } else {
+      soc_ += ocv_alpha_ * (ocv_soc - soc_);
+      soc_ = std::max(0.0f, std::min(1.0f, soc_));
+    }
+
+    power_W_ += power_alpha_ * (voltage_V * current_A - power_W_);
+  }
+
+  /// Compute the derived quantities.  This is more expensive than
+  /// Update(), and need only be called at the reporting rate.
+  const Status& status() {
+    status_.soc_percent = soc_ * 100.0f;
+    status_.resistance_ohm = resistance_ohm_;
+    status_.ocv_V = ocv_V_;
+    status_.charge_out_Ah = static_cast<float>(charge_out_nAh_) * 1e-9f;
+    status_.charge_in_Ah = static_cast<float>(charge_in_nAh_) * 1e-9f;
+    status_.remaining_Wh = RemainingWh(soc_);
+    status_.runtime_s =
+        (power_W_ > kMinRuntimePower_W) ?
+        (status_.remaining_Wh * 3600.0f / power_W_) :
+        std::numeric_limits<float>::infinity();
+    return status_;
+  }
+
+  int64_t charge_out_nAh() const { return charge_out_nAh_; }
+  int64_t charge_in_nAh() const { return charge_in_nAh_; }
+
+ private:
+  static constexpr float kMinRuntimePower_W = 0.1f;
+
+  static float Alpha(float period_s, float time_constant_s) {
+    if (time_constant_s <= 0.0f) { return 1.0f; }
+    return 1.0f - std::exp(-period_s / time_constant_s);
+  }
+
+  /// Move an offset into its reference once it is large enough to
+  /// lose resolution.
+  static void Rebase(float* reference, float* offset) {
+    constexpr float kMaxOffset = 1.0f;
+    if (std::abs(*offset) > kMaxOffset) {
+      *reference += *offset;
+      *offset = 0.0f;
+    }
+  }
+
+  int64_t net_nAh() const { return charge_out_nAh_ - charge_in_nAh_; }
+
+  void SetSoc(float soc) {
+    soc_ = std::max(0.0f, std::min(1.0f, soc));
+    full_nAh_ = net_nAh() -
+        static_cast<int64_t>((1.0f - soc_) * capacity_nAh_);
+    full_remainder_ = 0.0f;
+  }
+
+  void UpdateSoc() {
+    const int64_t used_nAh = net_nAh() - full_nAh_;
+    soc_ = 1.0f - static_cast<float>(used_nAh) / capacity_nAh_;
+  }
+
+  // Keep the state of charge within [0, 1].
+  void ClampFull() {
+    const int64_t net = net_nAh();
+    const int64_t empty = net - static_cast<int64_t>(capacity_nAh_);
+    if (full_nAh_ > net) {
+      full_nAh_ = net;
+      full_remainder_ = 0.0f;
+    } else if (full_nAh_ < empty) {
+      full_nAh_ = empty;
+      full_remainder_ = 0.0f;
+    }
+  }
+
+  float SocFromOcv(float ocv_V) const {
+    const auto& table = config_->ocv_V;
+    if (ocv_V <= table[0]) { return 0.0f; }
+    for (int i = 1; i < kOcvPoints; i++) {
+      if (ocv_V < table[i]) {
+        const float span = table[i] - table[i - 1];
+        const float fraction =
+            (span > 0.0f) ? ((ocv_V - table[i - 1]) / span) : 0.0f;
+        return (static_cast<float>(i - 1) + fraction) / (kOcvPoints - 1);
+      }
+    }
+    return 1.0f;
+  }
+
+  // Integrate the open circuit voltage from empty up to 'soc'.
+  float RemainingWh(float soc) const {
+    const auto& table = config_->ocv_V;
+    const float step_Ah = config_->capacity_Ah / (kOcvPoints - 1);
+    const float position = soc * (kOcvPoints - 1);
+    float result = 0.0f;
+    for (int i = 1; i < kOcvPoints; i++) {
+      const float fraction =
+          std::max(0.0f, std::min(1.0f, position - static_cast<float>(i - 1)));
+      if (fraction <= 0.0f) { break; }
+      const float end_V = table[i - 1] + fraction * (table[i] - table[i - 1]);
+      result += 0.5f * (table[i - 1] + end_V) * fraction * step_Ah;
+    }
+    return result;
+  }
+
+  const Config* const config_;
+
+  float period_s_ = 0.001f;
+  float resistance_alpha_ = 0.0f;
+  float ocv_alpha_ = 0.0f;
+  float power_alpha_ = 0.0f;
+
+  bool initialized_ = false;
+  float soc_ = 0.0f;
+  float ocv_V_ = 0.0f;
+  float resistance_ohm_ = 0.0f;
+  float reference_v_ = 0.0f;
+  float reference_i_ = 0.0f;
+  float mean_v_ = 0.0f;
+  float mean_i_ = 0.0f;
+  float cov_vi_ = 0.0f;
+  float var_i_ = 0.0f;
+  float power_W_ = 0.0f;
+
+  int64_t charge_out_nAh_ = 0;
+  int64_t charge_in_nAh_ = 0;
+  float charge_out_remainder_ = 0.0f;
+  float charge_in_remainder_ = 0.0f;
+
+  float capacity_nAh_ = 0.0f;
+  // The net charge drawn at which the battery would read 100%.
+  int64_t full_nAh_ = 0;
+  float full_remainder_ = 0.0f;
+
+  Status status_;
+};
+
+}
@@ -0,0 +1,204 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+#include "mjlib/base/visitor.h"
+
+namespace fw {
+
+/// The persisted calibration of a single analog channel.
+///
+/// The nominal conversion of a channel is determined by the hardware.
+/// The calibrated value is:
+///
+///   y = gain * nominal + offset
+///
+/// optionally followed by a piecewise linear correction through the
+/// points (table_in[i], table_out[i]), which must be sorted by
+/// table_in.
+struct Calibration {
+  static constexpr int kMaxPoints = 8;
+
+  float gain = 1.0f;
+  float offset = 0.0f;
+
+  int8_t table_size = 0;
+  std::array<float, kMaxPoints> table_in = {};
+  std::array<float, kMaxPoints> table_out = {};
+
+  template <typename Archive>
+  void Serialize(Archive* a) {
+    a->Visit(MJ_NVP(gain));
+    a->Visit(MJ_NVP(offset));
+    a->Visit(MJ_NVP(table_size));
+    a->Visit(MJ_NVP(table_in));
+    a->Visit(MJ_NVP(table_out));
+  }
+
+  float ApplyTable(float value) const {
+    const int size = std::min<int>(table_size, kMaxPoints);
+    if (size < 2) { return value; }
+
+    int i = 1;
+    while (i < size - 1 && value > table_in[i]) { i++; }
+    const float span = table_in[i] - table_in[i - 1];
+    if (span <= 0.0f) { return table_out[i]; }
+    return table_out[i - 1] +
+        (value - table_in[i - 1]) / span * (table_out[i] - table_out[i - 1]);
+  }
+};
+
+/// A Calibration combined with the nominal conversion of a channel
+/// and reduced to a form which is cheap to evaluate per sample.
+/// Without a table, this is a single multiply-add.  With a table, the
+/// input domain is split into fixed segments, each with its own
+/// multiply-add.
+class CompiledCalibration {
+ public:
+  static constexpr int kSegments = 32;
+
+  /// @param nominal_scale, nominal_offset the nominal conversion from
+  ///   input counts to engineering units
+  /// @param min_counts, max_counts the range of inputs which will be
+  ///   evaluated, used to size the segments
+  void Compile(const Calibration& cal,
+               float nominal_scale, float nominal_offset,
+               float min_counts, float max_counts) {
+    scale_ = cal.gain * nominal_scale;
+    offset_ = cal.gain * nominal_offset + cal.offset;
+
+    use_table_ = cal.table_size >= 2 && max_counts > min_counts;
+    if (!use_table_) { return; }
+
+    min_counts_ = min_counts;
+    const float step = (max_counts - min_counts) / kSegments;
+    inverse_step_ = 1.0f / step;
+    for (int i = 0; i < kSegments; i++) {
+      const float x0 = min_counts + i * step;
+      const float x1 = x0 + step;
+      const float y0 = cal.ApplyTable(x0 * scale_ + offset_);
+      const float y1 = cal.ApplyTable(x1 * scale_ + offset_);
+      auto& segment = segments_[i];
+      segment.scale = (y1 - y0) / step;
+      segment.offset = y0 - segment.scale * x0;
+    }
+  }
+
+  /// Return the input counts which result in 'value', ignoring any
+  /// table correction.
+  float Inverse(float value) const {
+    if (scale_ == 0.0f) { return 0.0f; }
+    return (value - offset_) / scale_;
+  }
+
+  float operator()(float counts) const {
+    if (!use_table_) { return counts * scale_ + offset_; }
+
+    const int index = std::max(
+        0, std::min(kSegments - 1,
+                    static_cast<int>((counts - min_counts_) * inverse_step_)));
+    const auto& segment = segments_[index];
+    return counts * segment.scale + segment.offset;
+  }
+
+ private:
+  struct Segment {
+    float scale = 0.0f;
+    float offset = 0.0f;
+  };
+
+  float scale_ = 1.0f;
+  float offset_ = 0.0f;
+
+  bool use_table_ = false;
+  float min_counts_ = 0.0f;
+  float inverse_step_ = 0.0f;
+  std::array<Segment, kSegments> segments_ = {};
+};
+
+/// Accumulates reference points for a channel and fits a Calibration
+/// to them.
+class CalibrationFitter {
+ public:
+  void Clear() { count_ = 0; }
+
+  /// Record that the uncalibrated channel read 'nominal' while the
+  /// true value was 'reference'.
+  bool AddPoint(float nominal, float reference) {
+    if (count_ >= Calibration::kMaxPoints) { return false; }
+    nominal_[count_] = nominal;
+    reference_[count_] = reference;
+    count_++;
+    return true;
+  }
+
+  int count() const { return count_; }
+
+  /// With one point, only the offset is fit.  With two or more, the
+  /// gain and offset are fit by least squares.  With three or more,
+  /// the residual is additionally captured in the table.
+  bool Fit(Calibration* cal) {
+    if (count_ == 0) { return false; }
+
+    *cal = Calibration();
+    if (count_ == 1) {
+      cal->offset = reference_[0] - nominal_[0];
+      return true;
+    }
+
+    float sx = 0.0f, sy = 0.0f, sxx = 0.0f, sxy = 0.0f;
+    for (int i = 0; i < count_; i++) {
+      sx += nominal_[i];
+      sy += reference_[i];
+      sxx += nominal_[i] * nominal_[i];
+      sxy += nominal_[i] * reference_[i];
+    }
+    const float n = static_cast<float>(count_);
+    const float det = n * sxx - sx * sx;
+    if (det == 0.0f) { return false; }
+
+    cal->gain = (n * sxy - sx * sy) / det;
+    cal->offset = (sy - cal->gain * sx) / n;
+
+    if (count_ >= 3) {
+      // Store the points sorted by their linearly corrected value.
+      std::array<int, Calibration::kMaxPoints> order = {};
+      for (int i = 0; i < count_; i++) { order[i] = i; }
+      std::sort(order.begin(), order.begin() + count_,
+                [&](int lhs, int rhs) {
+                  return cal->gain * nominal_[lhs] < cal->gain * nominal_[rhs];
+                });
+      for (int i = 0; i < count_; i++) {
+        const int j = order[i];
+        cal->table_in[i] = cal->gain * nominal_[j] + cal->offset;
+        cal->table_out[i] = reference_[j];
+      }
+      cal->table_size = count_;
+    }
+
+    return true;
+  }
+
+ private:
+  int count_ = 0;
+  std::array<float, Calibration::kMaxPoints> nominal_ = {};
+  std::array<float, Calibration::kMaxPoints> reference_ = {};
+};
+
+}
@@ -0,0 +1,141 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+#include "mjlib/base/visitor.h"
+
+namespace fw {
+
+/// Combines the two conversions of the current sense signal: the
+/// amplified one, which resolves small currents but saturates well
+/// below the peak rating, and the buffered one, which covers the
+/// full range at a coarser resolution.
+///
+/// The amplified path is used alone below blend_start of its full
+/// scale, the buffered path alone above blend_end, and the two are
+/// weighted linearly in between, so that there is no step when the
+/// current crosses from one to the other.  The weight is determined
+/// from the buffered path, which is valid everywhere.
+class CurrentRangeSelector {
+ public:
+  struct Config {
+    // The magnitude of the inverting gain of the amplified path, one
+    // of 1, 3, 7, 15, 31 or 63.  Changes take effect the next time
+    // the output is off, as the zero current offset must be
+    // measured again.
+    int8_t high_gain = 7;
+
+    // Fractions of the amplified path's full scale current.
+    float blend_start = 0.6f;
+    float blend_end = 0.8f;
+
+    // The amplified path is treated as saturated if it reads within
+    // this many counts of either rail.
+    int16_t saturation_margin = 32;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(high_gain));
+      a->Visit(MJ_NVP(blend_start));
+      a->Visit(MJ_NVP(blend_end));
+      a->Visit(MJ_NVP(saturation_margin));
+    }
+  };
+
+  enum Range : int8_t {
+    kHigh = 0,
+    kLow = 1,
+    kBlend = 2,
+  };
+
+  struct Result {
+    float current_A = 0.0f;
+    Range range = kHigh;
+  };
+
+  CurrentRangeSelector(const Config* config) : config_(config) {}
+
+  static bool ValidGain(int gain) {
+    return gain == 1 || gain == 3 || gain == 7 || gain == 15 ||
+        gain == 31 || gain == 63;
+  }
+
+  /// @param high_full_scale_A the current at which the amplified
+  ///   path reaches the nearer rail
+  void Configure(float high_full_scale_A) {
+    start_A_ = config_->blend_start * high_full_scale_A;
+    const float end_A = std::max(config_->blend_end * high_full_scale_A,
+                                 start_A_ + 1e-3f);
+    inverse_width_ = 1.0f / (end_A - start_A_);
+  }
+
+  /// @param high_raw the ADC counts of the amplified path
+  /// @param high_A, low_A the calibrated current from each path
+  Result Update(uint16_t high_raw, float high_A, float low_A) const {
+    const int margin = config_->saturation_margin;
+    const bool saturated =
+        high_raw <= margin || high_raw >= 4095 - margin;
+
+    const float weight = saturated ? 1.0f :
+        std::max(0.0f, std::min(
+                     1.0f, (std::abs(low_A) - start_A_) * inverse_width_));
+
+    Result result;
+    if (weight <= 0.0f) {
+      result.current_A = high_A;
+      result.range = kHigh;
+    } else if (weight >= 1.0f) {
+      result.current_A = low_A;
+      result.range = kLow;
+    } else {
+      result.current_A = high_A + weight * (low_A - high_A);
+      result.range = kBlend;
+    }
+    return result;
+  }
+
+ private:
+  const Config* const config_;
+
+  float start_A_ = 0.0f;
+  float inverse_width_ = 1.0f;
+};
+
+}
+
+namespace mjlib {
+namespace base {
+
+template <>
+struct IsEnum<fw::CurrentRangeSelector::Range> {
+  static constexpr bool value = true;
+
+  using R = fw::CurrentRangeSelector::Range;
+  static std::array<std::pair<R, const char*>, 3> map() {
+    return { {
+        { R::kHigh, "high" },
+        { R::kLow, "low" },
+        { R::kBlend, "blend" },
+      } };
+  }
+};
+
+}
+}
@@ -0,0 +1,227 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+#include "mjlib/base/visitor.h"
+
+namespace fw {
+
+/// Decides when to send unsolicited event frames for changes in the
+/// power state, and encodes them.
+///
+/// Each event frame is a multiplex reply, as if to a read of:
+///
+///   0x000 - 0x002  int8   state, fault code, switch status
+///   0x003          int16  lock time
+///   0x008 - 0x009  int32  host time of the event, low then high
+///                         word, or 0 if the time is not synchronized
+///   0x031          int32  event sequence
+///   0x032          int8   the causes of this event, a bitmask of Cause
+///
+/// padded with NOPs to 32 bytes, so hosts can decode it with the same
+/// code as a register reply.
+///
+/// Changes closer together than 'min_interval_ms' are combined into
+/// one event.  Each event is then repeated 'repeat_count' times,
+/// 'repeat_interval_ms' apart, with the same sequence number, so that
+/// a host which misses one frame still learns of the event.
+class EventPublisher {
+ public:
+  enum Cause : uint8_t {
+    kStateChange = 0x01,
+    kSwitchChange = 0x02,
+    kFaultChange = 0x04,
+    kLockTimeChange = 0x08,
+    kAllCauses = 0x0f,
+  };
+
+  static constexpr int kFrameSize = 32;
+  static constexpr uint32_t kHostTimeRegister = 0x008;
+  static constexpr uint32_t kSequenceRegister = 0x031;
+  static constexpr uint32_t kCauseRegister = 0x032;
+
+  struct Config {
+    // The destination id of event frames.  The source is the
+    // multiplex id of the board.
+    uint8_t destination = 0x7f;
+
+    uint16_t min_interval_ms = 5;
+    uint8_t repeat_count = 2;
+    uint16_t repeat_interval_ms = 20;
+
+    // An event is sent each time the lock time crosses a multiple of
+    // this, and when it reaches zero.
+    int16_t lock_time_step_100ms = 10;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(destination));
+      a->Visit(MJ_NVP(min_interval_ms));
+      a->Visit(MJ_NVP(repeat_count));
+      a->Visit(MJ_NVP(repeat_interval_ms));
+      a->Visit(MJ_NVP(lock_time_step_100ms));
+    }
+  };
+
+  struct Status {
+    // A bitmask of Cause, written through register 0x030.
+    uint8_t subscriptions = 0;
+    uint32_t sequence = 0;
+    uint8_t last_causes = 0;
+    uint32_t frames_sent = 0;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(subscriptions));
+      a->Visit(MJ_NVP(sequence));
+      a->Visit(MJ_NVP(last_causes));
+      a->Visit(MJ_NVP(frames_sent));
+    }
+  };
+
+  struct Snapshot {
+    int8_t state = 0;
+    int8_t fault_code = 0;
+    int8_t switch_status = 0;
+    int16_t lock_time_100ms = 0;
+    // Not compared, only reported.
+    int64_t host_time_us = 0;
+  };
+
+  explicit EventPublisher(const Config* config) : config_(config) {}
+
+  const Status& status() const { return status_; }
+  Status* mutable_status() { return &status_; }
+
+  void Subscribe(uint8_t causes) {
+    status_.subscriptions = causes & kAllCauses;
+  }
+
+  /// Compare the latest values with those last seen, and schedule an
+  /// event for any subscribed change.
+  void Update(uint32_t now_ms, const Snapshot& snapshot) {
+    if (!initialized_) {
+      last_ = snapshot;
+      initialized_ = true;
+      return;
+    }
+
+    uint8_t causes = 0;
+    if (snapshot.state != last_.state) { causes |= kStateChange; }
+    if (snapshot.switch_status != last_.switch_status) {
+      causes |= kSwitchChange;
+    }
+    if (snapshot.fault_code != last_.fault_code) { causes |= kFaultChange; }
+    if (LockTimeCrossed(last_.lock_time_100ms, snapshot.lock_time_100ms)) {
+      causes |= kLockTimeChange;
+    }
+    last_ = snapshot;
+
+    pending_causes_ |= causes & status_.subscriptions;
+    if (pending_causes_ &&
+        (!sent_ || (now_ms - sent_ms_) >= config_->min_interval_ms)) {
+      status_.sequence++;
+      status_.last_causes = pending_causes_;
+      Encode(snapshot, pending_causes_);
+      pending_causes_ = 0;
+      sends_left_ = 1 + config_->repeat_count;
+      due_ms_ = now_ms;
+    }
+  }
+
+  /// The frame to send now, or empty if there is none.
+  std::string_view Due(uint32_t now_ms) const {
+    if (sends_left_ == 0 || static_cast<int32_t>(now_ms - due_ms_) < 0) {
+      return {};
+    }
+    return std::string_view(
+        reinterpret_cast<const char*>(frame_.data()), frame_.size());
+  }
+
+  /// Record that the frame from Due() was sent.
+  void Sent(uint32_t now_ms) {
+    if (sends_left_ == 0) { return; }
+    sends_left_--;
+    sent_ = true;
+    sent_ms_ = now_ms;
+    due_ms_ = now_ms + config_->repeat_interval_ms;
+    status_.frames_sent++;
+  }
+
+ private:
+  bool LockTimeCrossed(int16_t old_value, int16_t new_value) const {
+    if (old_value == new_value) { return false; }
+    if (new_value == 0) { return true; }
+    const int step = config_->lock_time_step_100ms;
+    if (step <= 0) { return false; }
+    // Round up, so that counting down through a multiple is a change.
+    const auto bin = [&](int value) { return (value + step - 1) / step; };
+    return bin(old_value) != bin(new_value);
+  }
+
+  void Encode(const Snapshot& snapshot, uint8_t causes) {
+    frame_.fill(0x50);
+    size_t pos = 0;
+    auto push = [&](uint8_t value) { frame_[pos++] = value; };
+    auto push32 = [&](uint32_t value) {
+      for (int i = 0; i < 4; i++) { push((value >> (8 * i)) & 0xff); }
+    };
+
+    // Reply subframes are 0x20 | (type << 2) | count.
+    push(0x20 | (0 << 2) | 3);
+    push(0x000);
+    push(static_cast<uint8_t>(snapshot.state));
+    push(static_cast<uint8_t>(snapshot.fault_code));
+    push(static_cast<uint8_t>(snapshot.switch_status));
+
+    push(0x20 | (1 << 2) | 1);
+    push(0x003);
+    push(static_cast<uint16_t>(snapshot.lock_time_100ms) & 0xff);
+    push(static_cast<uint16_t>(snapshot.lock_time_100ms) >> 8);
+
+    const auto host_time_us = static_cast<uint64_t>(snapshot.host_time_us);
+    push(0x20 | (2 << 2) | 2);
+    push(kHostTimeRegister);
+    push32(static_cast<uint32_t>(host_time_us));
+    push32(static_cast<uint32_t>(host_time_us >> 32));
+
+    push(0x20 | (2 << 2) | 1);
+    push(kSequenceRegister);
+    push32(status_.sequence);
+
+    push(0x20 | (0 << 2) | 1);
+    push(kCauseRegister);
+    push(causes);
+  }
+
+  const Config* const config_;
+  Status status_;
+
+  bool initialized_ = false;
+  Snapshot last_;
+  uint8_t pending_causes_ = 0;
+
+  std::array<uint8_t, kFrameSize> frame_ = {};
+  int sends_left_ = 0;
+  uint32_t due_ms_ = 0;
+  bool sent_ = false;
+  uint32_t sent_ms_ = 0;
+};
+
+}
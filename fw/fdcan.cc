@@ -287,6 +287,15 @@ void FDCan::Init() {
     }
   }
 
+  if (HAL_FDCAN_ConfigTimestampCounter(
+          &can, FDCAN_TIMESTAMP_PRESC_1) != HAL_OK) {
+    mbed_die();
+  }
+  if (HAL_FDCAN_EnableTimestampCounter(
+          &can, FDCAN_TIMESTAMP_INTERNAL) != HAL_OK) {
+    mbed_die();
+  }
+
   if (HAL_FDCAN_Start(&can) != HAL_OK) {
     mbed_die();
   }
@@ -364,12 +373,29 @@ void FDCan::RecoverBusOff() {
   hfdcan1_.Instance->CCCR &= ~FDCAN_CCCR_INIT;
 }
 
+bool FDCan::IsTxPending() {
+  return last_tx_request_ &&
+      HAL_FDCAN_IsTxBufferMessagePending(&hfdcan1_, last_tx_request_) != 0;
+}
+
 
 FDCAN_ProtocolStatusTypeDef FDCan::status() {
   HAL_FDCAN_GetProtocolStatus(&hfdcan1_, &status_result_);
   return status_result_;
 }
 
+uint16_t FDCan::timestamp() {
+  return HAL_FDCAN_GetTimestampCounter(&hfdcan1_);
+}
+
+uint32_t FDCan::timestamp_period_ns() const {
+  const auto& nominal = config_.nominal;
+  const uint64_t quanta =
+      static_cast<uint64_t>(nominal.prescaler) *
+      (1 + nominal.time_seg1 + nominal.time_seg2);
+  return static_cast<uint32_t>(quanta * 1000000000ull / config_.clock);
+}
+
 FDCan::Config FDCan::config() const {
   return config_;
 }
@@ -122,8 +122,20 @@ class FDCan {
 
   void RecoverBusOff();
 
+  /// @return true if the most recently sent frame has not yet been
+  /// transmitted.  Send() aborts such a frame.
+  bool IsTxPending();
+
   FDCAN_ProtocolStatusTypeDef status();
 
+  /// The hardware timestamp counter, which is captured in
+  /// FDCAN_RxHeaderTypeDef::RxTimestamp at the start of each received
+  /// frame.  It counts nominal bit times, and wraps at 65536.
+  uint16_t timestamp();
+
+  /// The duration of one timestamp count in nanoseconds.
+  uint32_t timestamp_period_ns() const;
+
   struct Config {
     int clock = 0;
     Rate nominal;
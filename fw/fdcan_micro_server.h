@@ -139,6 +139,16 @@ class FDCanMicroServer : public mjlib::multiplex::MicroDatagramServer {
 
   uint32_t can_reset_count() const { return can_reset_count_; }
 
+  /// The microseconds since the start of the most recently received
+  /// frame, from its hardware timestamp.  This is only valid for 65536
+  /// bit times after the frame, so it should be called while that
+  /// frame is still being processed.
+  uint32_t last_rx_age_us() {
+    const uint16_t ticks = fdcan_->timestamp() - fdcan_header_.RxTimestamp;
+    return static_cast<uint32_t>(
+        static_cast<uint64_t>(ticks) * fdcan_->timestamp_period_ns() / 1000);
+  }
+
  private:
   FDCan* const fdcan_;
 
@@ -0,0 +1,180 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "mjlib/base/visitor.h"
+
+namespace fw {
+
+/// Estimates the junction temperature of the output FETs.
+///
+/// The temperature sensor sits near, but not at, the FETs, so the
+/// junction is modeled as the low pass filtered sensor reading plus a
+/// single pole rise driven by the conduction loss I^2 * Rds(on).  The
+/// rate of change of the estimate is used to predict how long it will
+/// take to reach the fault limit.
+class FetThermalModel {
+ public:
+  struct Config {
+    // The effective on resistance of the output path at 25C and its
+    // fractional increase per degree C.
+    float rds_on_ohm = 0.004f;
+    float rds_on_tempco_per_C = 0.007f;
+
+    // Thermal resistance and time constant from the junction to the
+    // temperature sensor.
+    float thermal_resistance_C_per_W = 2.0f;
+    float thermal_time_constant_s = 5.0f;
+
+    // Time constants used to filter the sensor reading and the
+    // temperature slope.
+    float sensor_filter_s = 0.05f;
+    float slope_filter_s = 1.0f;
+
+    float warning_C = 100.0f;
+    float derate_C = 110.0f;
+    float fault_C = 125.0f;
+
+    // A warning is also reported if the fault limit is predicted to
+    // be reached in less than predict_warning_s, and a fault if in
+    // less than predict_fault_s.
+    float predict_warning_s = 10.0f;
+    float predict_fault_s = 1.0f;
+
+    // At fault_C, the I^2t limits are scaled by this factor.  Between
+    // derate_C and fault_C the scaling is linearly interpolated.  It
+    // is limited to [0.05, 1].
+    float derate_min = 0.5f;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(rds_on_ohm));
+      a->Visit(MJ_NVP(rds_on_tempco_per_C));
+      a->Visit(MJ_NVP(thermal_resistance_C_per_W));
+      a->Visit(MJ_NVP(thermal_time_constant_s));
+      a->Visit(MJ_NVP(sensor_filter_s));
+      a->Visit(MJ_NVP(slope_filter_s));
+      a->Visit(MJ_NVP(warning_C));
+      a->Visit(MJ_NVP(derate_C));
+      a->Visit(MJ_NVP(fault_C));
+      a->Visit(MJ_NVP(predict_warning_s));
+      a->Visit(MJ_NVP(predict_fault_s));
+      a->Visit(MJ_NVP(derate_min));
+    }
+  };
+
+  enum Result {
+    kOk,
+    kWarning,
+    kFault,
+  };
+
+  FetThermalModel(const Config* config) : config_(config) {}
+
+  void Configure(float period_s) {
+    period_s_ = period_s;
+    sensor_alpha_ = Alpha(period_s, config_->sensor_filter_s);
+    thermal_alpha_ = Alpha(period_s, config_->thermal_time_constant_s);
+    slope_alpha_ = Alpha(period_s, config_->slope_filter_s);
+  }
+
+  Result Update(float sensor_C, float current_A) {
+    if (!initialized_) {
+      sensor_C_ = sensor_C;
+      junction_C_ = sensor_C;
+      initialized_ = true;
+    }
+
+    sensor_C_ += sensor_alpha_ * (sensor_C - sensor_C_);
+
+    const float rds_on =
+        config_->rds_on_ohm *
+        (1.0f + config_->rds_on_tempco_per_C * (junction_C_ - 25.0f));
+    const float power_W = current_A * current_A * std::max(0.0f, rds_on);
+    rise_C_ += thermal_alpha_ *
+        (power_W * config_->thermal_resistance_C_per_W - rise_C_);
+
+    const float old_junction_C = junction_C_;
+    junction_C_ = sensor_C_ + rise_C_;
+    slope_C_s_ += slope_alpha_ *
+        ((junction_C_ - old_junction_C) / period_s_ - slope_C_s_);
+
+    time_to_limit_s_ =
+        (junction_C_ >= config_->fault_C) ? 0.0f :
+        (slope_C_s_ > 0.0f) ?
+        ((config_->fault_C - junction_C_) / slope_C_s_) :
+        std::numeric_limits<float>::infinity();
+
+    if (junction_C_ <= config_->derate_C) {
+      derate_ = 1.0f;
+    } else {
+      const float fraction =
+          std::min(1.0f, (junction_C_ - config_->derate_C) /
+                   std::max(1.0f, config_->fault_C - config_->derate_C));
+      const float derate_min =
+          std::max(kMinDerate, std::min(1.0f, config_->derate_min));
+      derate_ = 1.0f - fraction * (1.0f - derate_min);
+    }
+
+    if (time_to_limit_s_ <= config_->predict_fault_s) {
+      return kFault;
+    }
+    if (junction_C_ >= config_->warning_C ||
+        time_to_limit_s_ <= config_->predict_warning_s) {
+      return kWarning;
+    }
+    return kOk;
+  }
+
+  /// The filtered sensor temperature.
+  float sensor_C() const { return sensor_C_; }
+  float junction_C() const { return junction_C_; }
+  float slope_C_s() const { return slope_C_s_; }
+  float time_to_limit_s() const { return time_to_limit_s_; }
+
+  /// The factor by which current limits should be scaled.
+  float derate() const { return derate_; }
+
+ private:
+  // The I^2t model divides by the square of the derate, so it is
+  // kept away from zero.
+  static constexpr float kMinDerate = 0.05f;
+
+  static float Alpha(float period_s, float time_constant_s) {
+    if (time_constant_s <= 0.0f) { return 1.0f; }
+    return 1.0f - std::exp(-period_s / time_constant_s);
+  }
+
+  const Config* const config_;
+
+  float period_s_ = 0.001f;
+  float sensor_alpha_ = 1.0f;
+  float thermal_alpha_ = 1.0f;
+  float slope_alpha_ = 1.0f;
+
+  bool initialized_ = false;
+  float sensor_C_ = 0.0f;
+  float rise_C_ = 0.0f;
+  float junction_C_ = 0.0f;
+  float slope_C_s_ = 0.0f;
+  float time_to_limit_s_ = std::numeric_limits<float>::infinity();
+  float derate_ = 1.0f;
+};
+
+}
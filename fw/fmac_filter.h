@@ -0,0 +1,243 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+#include "mjlib/base/visitor.h"
+
+namespace fw {
+
+/// A low pass filter run on the STM32G4 FMAC.
+///
+/// The FMAC can only run one filter at a time, so several streams
+/// are filtered at once by interleaving their samples, and spacing
+/// every tap of the filter by the number of streams.  Each stream
+/// then only sees its own history.
+///
+/// Two filters are available, both with unity gain at DC:
+///
+///  * kIir, a single pole: y[n] = b x[n] + a y[n-K]
+///  * kFir, a Hamming windowed sinc with fir_taps taps
+///
+/// where K is the number of streams.
+///
+/// The FMAC truncates each output, which biases it low by half an
+/// LSB on average.  The IIR feeds that error back, amplifying it by
+/// 1 / (1 - a).  Both are removed by the 'bias' of the design.
+class FmacFilter {
+ public:
+  enum Type : int8_t {
+    kIir,
+    kFir,
+  };
+
+  struct Config {
+    bool enable = true;
+    Type type = kIir;
+    float cutoff_Hz = 20.0f;
+    int8_t fir_taps = 15;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(enable));
+      a->Visit(MJ_NVP(type));
+      a->Visit(MJ_NVP(cutoff_Hz));
+      a->Visit(MJ_NVP(fir_taps));
+    }
+  };
+
+  static constexpr int kMaxStreams = 4;
+  static constexpr int kMaxFirTaps = 16;
+  static constexpr int kMaxFeedForward = kMaxStreams * (kMaxFirTaps - 1) + 1;
+  static constexpr int kMaxFeedback = kMaxStreams;
+
+  /// The values to load into the FMAC.
+  struct Coefficients {
+    // The function, 8 for FIR or 9 for IIR.
+    int function = 9;
+
+    // The number of feed-forward and feedback taps.
+    int p = 1;
+    int q = 0;
+
+    // The output is shifted left by this many bits.
+    int r = 0;
+
+    std::array<int16_t, kMaxFeedForward> b = {};
+    std::array<int16_t, kMaxFeedback> a = {};
+
+    // The mean truncation error of the output, in LSBs.
+    float bias = 0.0f;
+  };
+
+  static Coefficients Design(const Config& config, float sample_rate_Hz,
+                             int streams) {
+    Coefficients result;
+    streams = std::max(1, std::min(kMaxStreams, streams));
+    const float normalized =
+        std::max(0.0f, std::min(0.5f, config.cutoff_Hz / sample_rate_Hz));
+
+    if (config.type == kFir) {
+      const int taps = std::max(1, std::min<int>(kMaxFirTaps, config.fir_taps));
+      result.function = 8;
+      result.p = streams * (taps - 1) + 1;
+      result.q = 0;
+
+      std::array<float, kMaxFirTaps> h = {};
+      float sum = 0.0f;
+      const float middle = 0.5f * static_cast<float>(taps - 1);
+      for (int i = 0; i < taps; i++) {
+        const float t = static_cast<float>(i) - middle;
+        const float sinc =
+            (t == 0.0f) ? 2.0f * normalized :
+            std::sin(2.0f * kPi * normalized * t) / (kPi * t);
+        const float window = (taps == 1) ? 1.0f :
+            0.54f - 0.46f * std::cos(2.0f * kPi * static_cast<float>(i) /
+                                     static_cast<float>(taps - 1));
+        h[i] = sinc * window;
+        sum += h[i];
+      }
+
+      // Quantize, then make the integer taps sum to exactly one by
+      // adjusting the center tap.
+      int total = 0;
+      int center = taps / 2;
+      for (int i = 0; i < taps; i++) {
+        const int16_t tap = Q15((sum != 0.0f) ? h[i] / sum : 0.0f);
+        result.b[i * streams] = tap;
+        total += tap;
+      }
+      result.b[center * streams] = static_cast<int16_t>(std::min(
+          32767, result.b[center * streams] + 32768 - total));
+      result.bias = 0.5f;
+    } else {
+      const float pole = std::exp(-2.0f * kPi * normalized);
+      result.function = 9;
+      result.p = 1;
+      result.q = streams;
+
+      // The feed-forward tap is chosen so that the integer
+      // coefficients sum to exactly one.
+      const int16_t a = std::max<int16_t>(1, Q15(pole));
+      result.a[streams - 1] = a;
+      result.b[0] = static_cast<int16_t>(32768 - a);
+      result.bias = 0.5f * 32768.0f / static_cast<float>(32768 - a);
+    }
+    return result;
+  }
+
+  /// Convert an unsigned 12 bit ADC result to the FMAC input format.
+  static int16_t FromCounts(uint16_t counts) {
+    return static_cast<int16_t>(std::min<int>(counts, 4095) << 3);
+  }
+
+  /// Convert an FMAC output back to ADC counts, keeping the extra
+  /// resolution gained by filtering.
+  static float ToCounts(int16_t value, const Coefficients& coefficients) {
+    return (static_cast<float>(value) + coefficients.bias) * 0.125f;
+  }
+
+ private:
+  static constexpr float kPi = 3.14159265f;
+
+  static int16_t Q15(float value) {
+    return static_cast<int16_t>(
+        std::max(-32768.0f, std::min(32767.0f, std::round(value * 32768.0f))));
+  }
+};
+
+/// A reference implementation of the FMAC FIR and IIR functions,
+/// following the arithmetic described in RM0440: q1.15 operands, products
+/// truncated into a 26 bit q4.22 accumulator, and the result shifted
+/// left by R and truncated to q1.15, saturating if clipping is
+/// enabled.
+///
+/// It is used on the host to check the filter designs against what
+/// the hardware will produce.
+class FmacModel {
+ public:
+  FmacModel(const FmacFilter::Coefficients& coefficients, bool clip = true)
+      : c_(coefficients), clip_(clip) {}
+
+  int16_t Push(int16_t x) {
+    // Shift in the new input.
+    for (int i = c_.p - 1; i > 0; i--) { x_[i] = x_[i - 1]; }
+    x_[0] = x;
+
+    int32_t acc = 0;
+    for (int i = 0; i < c_.p; i++) {
+      acc = Wrap26(acc + Product(c_.b[i], x_[i]));
+    }
+    for (int i = 0; i < c_.q; i++) {
+      acc = Wrap26(acc + Product(c_.a[i], y_[i]));
+    }
+
+    // Shift left by R, then take the q1.15 result.
+    const int64_t shifted = static_cast<int64_t>(acc) * (1 << c_.r);
+    const int64_t result = shifted >> 7;
+    int16_t y = 0;
+    if (clip_) {
+      y = static_cast<int16_t>(
+          std::max<int64_t>(-32768, std::min<int64_t>(32767, result)));
+    } else {
+      y = static_cast<int16_t>(static_cast<uint16_t>(result & 0xffff));
+    }
+
+    for (int i = c_.q - 1; i > 0; i--) { y_[i] = y_[i - 1]; }
+    if (c_.q > 0) { y_[0] = y; }
+    return y;
+  }
+
+ private:
+  // q1.15 * q1.15 = q2.30, truncated to q2.22.
+  static int32_t Product(int16_t a, int16_t b) {
+    return (static_cast<int32_t>(a) * static_cast<int32_t>(b)) >> 8;
+  }
+
+  static int32_t Wrap26(int32_t value) {
+    const uint32_t masked = static_cast<uint32_t>(value) & 0x3ffffff;
+    return static_cast<int32_t>(masked << 6) >> 6;
+  }
+
+  const FmacFilter::Coefficients c_;
+  const bool clip_;
+  std::array<int16_t, FmacFilter::kMaxFeedForward> x_ = {};
+  std::array<int16_t, FmacFilter::kMaxFeedback> y_ = {};
+};
+
+}
+
+namespace mjlib {
+namespace base {
+
+template <>
+struct IsEnum<fw::FmacFilter::Type> {
+  static constexpr bool value = true;
+
+  using T = fw::FmacFilter::Type;
+  static std::array<std::pair<T, const char*>, 2> map() {
+    return { {
+        { T::kIir, "iir" },
+        { T::kFir, "fir" },
+      } };
+  }
+};
+
+}
+}
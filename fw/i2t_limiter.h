@@ -0,0 +1,129 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "mjlib/base/visitor.h"
+
+namespace fw {
+
+/// Emulates a fuse by passing the square of the output current
+/// through two first order thermal models, one with a short time
+/// constant to bound peaks and one with a long time constant to bound
+/// the continuous rating.
+///
+/// Each model holds the low pass filtered I^2, so with a constant
+/// current I applied from cold, the model trips after:
+///
+///   t = -tau * ln(1 - (I_limit / I)^2)
+class I2tLimiter {
+ public:
+  struct Config {
+    // The current which each model can sustain indefinitely.
+    float fast_limit_A = 90.0f;
+    float fast_time_constant_s = 0.5f;
+
+    float slow_limit_A = 45.0f;
+    float slow_time_constant_s = 30.0f;
+
+    // A warning is reported once either model exceeds this fraction
+    // of its limit.
+    float warning_fraction = 0.8f;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(fast_limit_A));
+      a->Visit(MJ_NVP(fast_time_constant_s));
+      a->Visit(MJ_NVP(slow_limit_A));
+      a->Visit(MJ_NVP(slow_time_constant_s));
+      a->Visit(MJ_NVP(warning_fraction));
+    }
+  };
+
+  enum Result {
+    kOk,
+    kWarning,
+    kTrip,
+  };
+
+  I2tLimiter(const Config* config) : config_(config) {}
+
+  /// Precompute the per-sample filter constants.  This must be called
+  /// whenever the configuration or the sample period changes.
+  void Configure(float period_s) {
+    fast_alpha_ = Alpha(period_s, config_->fast_time_constant_s);
+    slow_alpha_ = Alpha(period_s, config_->slow_time_constant_s);
+    fast_scale_ = InverseSquare(config_->fast_limit_A);
+    slow_scale_ = InverseSquare(config_->slow_limit_A);
+  }
+
+  Result Update(float current_A) {
+    const float i2 = current_A * current_A;
+    fast_i2_ += fast_alpha_ * (i2 - fast_i2_);
+    slow_i2_ += slow_alpha_ * (i2 - slow_i2_);
+
+    const float fraction = std::max(fast_fraction(), slow_fraction());
+    if (fraction >= 1.0f) { return kTrip; }
+    if (fraction >= config_->warning_fraction) { return kWarning; }
+    return kOk;
+  }
+
+  /// Scale both current limits by 'factor', which should be in (0, 1].
+  void set_derate(float factor) {
+    derate_scale_ = 1.0f / (factor * factor);
+  }
+
+  float fast_fraction() const {
+    return fast_i2_ * fast_scale_ * derate_scale_;
+  }
+  float slow_fraction() const {
+    return slow_i2_ * slow_scale_ * derate_scale_;
+  }
+
+  /// Return the time it takes a model to trip when 'current_A' is
+  /// applied from cold, or infinity if it never does.
+  static float TripTime(float current_A, float limit_A, float time_constant_s) {
+    const float ratio = (limit_A * limit_A) / (current_A * current_A);
+    if (ratio >= 1.0f) { return std::numeric_limits<float>::infinity(); }
+    return -time_constant_s * std::log(1.0f - ratio);
+  }
+
+ private:
+  static float Alpha(float period_s, float time_constant_s) {
+    if (time_constant_s <= 0.0f) { return 1.0f; }
+    return 1.0f - std::exp(-period_s / time_constant_s);
+  }
+
+  static float InverseSquare(float value) {
+    if (value <= 0.0f) { return 0.0f; }
+    return 1.0f / (value * value);
+  }
+
+  const Config* const config_;
+
+  float fast_alpha_ = 0.0f;
+  float slow_alpha_ = 0.0f;
+  float fast_scale_ = 0.0f;
+  float slow_scale_ = 0.0f;
+  float derate_scale_ = 1.0f;
+
+  float fast_i2_ = 0.0f;
+  float slow_i2_ = 0.0f;
+};
+
+}
@@ -14,35 +14,92 @@
 
 #include "fw/lm5066.h"
 
+#include <algorithm>
+#include <cstdlib>
+
+#include "mjlib/base/tokenizer.h"
+
 #include "mjlib/micro/callback_table.h"
 
+#include "fw/calibration.h"
+
 namespace micro = mjlib::micro;
 
 namespace fw {
 namespace {
-// Maybe make this faster in order to get better average power
-// measurements.
-constexpr int kUpdatePeriodMs = 100;
-
 constexpr int PMBUS_READ = 0x01;
 
 constexpr float CURRENT_SENSE_MOHM = 0.3f;
 
-enum {
-  OPERATION = 0x01,
-  CLEAR_FAULTS = 0x03,
-  DEVICE_SETUP = 0xd9,
-  BLOCK_READ = 0xda,
-};
+using D = Lm5066Decoder;
+
+// The I2C kernel clock is HSI16.  These were generated by CubeMX for
+// each bus speed with the analog filter enabled.
+constexpr uint32_t kTiming100kHz = 0x00303D5B;
+constexpr uint32_t kTiming400kHz = 0x0010061A;
+constexpr uint32_t kTiming1MHz = 0x00000107;
+
+// SAMPLES_FOR_AVG accepts the base 2 logarithm of the count.
+constexpr int kMaxAverageLog2 = 12;
 
 template <typename T>
 uint32_t u32(T value) {
-  return reinterpret_cast<uint32_t>(value);
+  return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(value));
 }
 }
 
+// The HAL reports transfer completion through global callbacks,
+// which are forwarded to the driver through these.
+enum class SmbusEvent {
+  kTransmitComplete,
+  kReceiveComplete,
+  kError,
+};
+
+void (*g_smbus_event)(void*, SmbusEvent) = nullptr;
+void* g_smbus_event_context = nullptr;
+
 class Lm5066::Impl {
+  enum ReadState {
+    kIdle,
+    kReadBlock,
+    kClearFaults,
+    kReconfigure,
+  };
+
+  enum AlertState {
+    kAlertIdle,
+    kAlertResponse,
+    kAlertStatusWrite,
+    kAlertStatusRead,
+  };
+
  public:
+  struct Config {
+    // One of 100, 400 or 1000.
+    int32_t bus_khz = 400;
+
+    // How often to read the device, which may be as short as 1ms at
+    // the faster bus speeds.
+    int32_t update_period_ms = 10;
+
+    // The device averages 2^average_log2 samples of each channel.
+    // The averaged values are what is reported and integrated.
+    int8_t average_log2 = 4;
+
+    Calibration iin;
+    Calibration pin;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(bus_khz));
+      a->Visit(MJ_NVP(update_period_ms));
+      a->Visit(MJ_NVP(average_log2));
+      a->Visit(MJ_NVP(iin));
+      a->Visit(MJ_NVP(pin));
+    }
+  };
+
   Impl(micro::CommandManager* command_manager,
        micro::PersistentConfig* config,
        micro::TelemetryManager* telemetry,
@@ -56,9 +113,8 @@ class Lm5066::Impl {
         "lm5066", std::bind(&Impl::HandleCommand, this,
                             std::placeholders::_1, std::placeholders::_2));
 
-    // From CubeMX for 100kHz w/ 16MHz clock frequency
     smbus_.Instance = I2C2;
-    smbus_.Init.Timing = 0x00303D5B;
+    smbus_.Init.Timing = BusTiming();
     smbus_.Init.AnalogFilter = SMBUS_ANALOGFILTER_ENABLE;
     smbus_.Init.PacketErrorCheckMode = SMBUS_PEC_ENABLE;
     smbus_.Init.PeripheralMode = SMBUS_PERIPHERAL_MODE_SMBUS_HOST;
@@ -66,6 +122,25 @@ class Lm5066::Impl {
 
     HAL_SMBUS_Init(&smbus_);
 
+    g_smbus_event_context = this;
+    g_smbus_event = [](void* context, SmbusEvent event) {
+      auto* const impl = static_cast<Impl*>(context);
+      switch (event) {
+        case SmbusEvent::kTransmitComplete: {
+          impl->HandleTransmitComplete();
+          break;
+        }
+        case SmbusEvent::kReceiveComplete: {
+          impl->HandleReceiveComplete();
+          break;
+        }
+        case SmbusEvent::kError: {
+          impl->HandleError();
+          break;
+        }
+      }
+    };
+
     ev_callback_ = micro::CallbackTable::MakeFunction(
         [this]() {
           HAL_SMBUS_EV_IRQHandler(&smbus_);
@@ -85,6 +160,11 @@ class Lm5066::Impl {
     HAL_NVIC_EnableIRQ(smbus_er_irq);
 
     status_update_ = telemetry->Register("lm5066", &status_);
+    config->Register("lm5066", &config_, [this]() {
+        CompileCalibration();
+        reconfigure_pending_ = true;
+      });
+    CompileCalibration();
 
     // Configure the device.
     //
@@ -97,134 +177,375 @@ class Lm5066::Impl {
         | (0 << 3)  // CB/CL ratio = 0 (low setting 1.9x)
         | (1 << 2)  // Current limit configuration = 1 (Use SMBus)
         | 0;
-    SmbusWrite(DEVICE_SETUP, &device_setup, 1);
+    SmbusWrite(D::kDeviceSetup, &device_setup, 1);
 
     uint8_t verify_device_setup[2] = {};
-    SmbusRead(DEVICE_SETUP, verify_device_setup, 1);
+    SmbusRead(D::kDeviceSetup, verify_device_setup, 1);
     if (verify_device_setup[0] != device_setup) { mbed_die(); }
 
+    ConfigureAveraging();
+
     // Start out with all faults cleared.
-    ClearFaults();
+    SmbusSendByte(D::kClearFaults);
+
+    if (options.smba != NC) {
+      smba_callback_ = micro::CallbackTable::MakeFunction(
+          [this]() { HandleAlert(); });
+      smba_.fall(smba_callback_.raw_function);
+    }
   }
 
   void PollMillisecond() {
+    // The periodic read is split across multiple calls so that the
+    // main loop never waits on the bus.  The register address is
+    // written here, the data phase is started from the transmit
+    // complete interrupt, and the result is processed on a later
+    // call.  Thus one read can complete every millisecond.
+    const uint32_t start_us = timer_->read_us();
     count_--;
-    if (count_) { return; }
-
-    count_ = kUpdatePeriodMs;
-    uint8_t buf[16] = {};
-
-    SmbusRead(BLOCK_READ, buf, 13);
-
-    const auto& br = &buf[1];
-    Status& s = status_;
-    s.config_preset = br[0] & 0x80;
-    s.device_off    = br[0] & 0x40;
-    s.vin_uv_fault  = br[0] & 0x20;
-    s.vin_ov_fault  = br[0] & 0x10;
-    s.i_oc_fault    = br[0] & 0x08;
-    s.otemp_fault   = br[0] & 0x04;
-    s.cml_fault     = br[0] & 0x02;
-    s.cb_fault      = br[0] & 0x01;
-
-    s.vout_uv_warn       = br[1] & 0x80;
-    s.i_op_warn          = br[1] & 0x40;
-    s.vin_uv_warn        = br[1] & 0x20;
-    s.vin_ov_warn        = br[1] & 0x10;
-    s.power_good         = br[1] & 0x08;
-    s.otemp_warn         = br[1] & 0x04;
-    s.timer_latched_off  = br[1] & 0x02;
-    s.ext_mosfet_shorted = br[1] & 0x01;
-
-    const int16_t iin = (br[3] << 8) | br[2];
-    const int16_t vout = (br[5] << 8) | br[4];
-    const int16_t vin = (br[7] << 8) | br[6];
-    const int16_t pin = (br[9] << 8) | br[8];
-    const int16_t temp = (br[11] << 8) | br[10];
-
-    status_.iin_raw = iin;
-    status_.vout_raw = vout;
-    status_.vin_raw = vin;
-    status_.pin_raw = pin;
-    status_.temperature_raw = temp;
-
-    // These constants were calibrated by hand from the following dataset:
-    //  10 - 0A
-    //  28 - 0.97A
-    //  37 - 1.2A
-    //  48 - 1.4A
-    //  55 - 1.61
-    //  62 - 1.80
-    //  69 - 2.01
-    status_.iin_10mA = (iin < 12) ?
-        0 : static_cast<int16_t>(100.0f * (iin * 0.02512f + 0.267f));
-
-    status_.vout_10mv = static_cast<int16_t>(
-        100.0f * (vout * 100.0f + 2400.0f) / 4587.0f);
-    status_.vin_10mv = static_cast<int16_t>(
-        100.0f * (vin * 100.0f + 1200.0f) / 4578.0f);
-
-    // Calibrated from the following empirical dataset:
-    //  2 - 0W
-    //  5 - 16W
-    //  8 - 25W
-    //  12 - 36W
-    //  18 - 50W
-    //  24 - 65W
-    //  32 - 82W
-    status_.pin_100mW = (pin < 5) ?
-        0 : static_cast<int16_t>(10.0f * (pin * 2.375f + 6.0f));
-
-    status_.temperature_C = static_cast<int16_t>(
-        (temp * 1000.0f) / 16000.0f);
-
-    const float delta_uW_hr =
-        1.0e6f * // to get uW
-        static_cast<float>(status_.pin_100mW) / 10.0f   // to get W
-        / 3600.0f / (1000.0f / kUpdatePeriodMs);  // to get W*hr
-    status_.energy_uW_hr += static_cast<int32_t>(delta_uW_hr);
-
-
-    // We check for faults in priority order, so that the higher
-    // priority faults take precedence over the lower priority ones.
-    if (status_.cml_fault) {
-      status_.fault = Fault::kCommunications;
-    } else if (status_.ext_mosfet_shorted) {
-      status_.fault = Fault::kMosfetShorted;
-    } else if (status_.cb_fault) {
-      status_.fault = Fault::kCircuitBreaker;
-    } else if (status_.vin_ov_fault) {
-      status_.fault = Fault::kOverVoltage;
-    } else if (status_.otemp_fault) {
-      status_.fault = Fault::kOverTemperature;
-    // For some reason, the LM5066 _always_ seems to report
-    // undervoltage.  I haven't figured out why.  Until I do, treat
-    // it as not a fault.
-    //
-    // } else if (status_.vin_uv_fault) {
-    //   status_.fault = Fault::kUnderVoltage;
-    } else if (status_.i_oc_fault) {
-      status_.fault = Fault::kOverCurrent;
+
+    switch (read_state_) {
+      case kIdle: {
+        break;
+      }
+      case kReadBlock: {
+        if (!BusReady()) { return; }
+
+        read_state_ = kIdle;
+        if (!rx_started_) {
+          BusError();
+          return;
+        }
+        ProcessBlockRead();
+        update_cpu_us_ += timer_->read_us() - start_us;
+        FinishUpdate();
+        break;
+      }
+      case kClearFaults: {
+        if (!BusReady()) { return; }
+
+        read_state_ = kIdle;
+        break;
+      }
+      case kReconfigure: {
+        break;
+      }
+    }
+
+    // An alert which arrived while the bus was busy, and was not
+    // picked up when that transaction completed, is started here.
+    if (!ClaimBus(kIdle)) { return; }
+
+    if (reconfigure_pending_) {
+      // This happens only when the configuration is changed, so
+      // there is no need to avoid blocking.
+      if (!ClaimBus(kReconfigure)) { return; }
+      reconfigure_pending_ = false;
+      HAL_SMBUS_DeInit(&smbus_);
+      smbus_.Init.Timing = BusTiming();
+      HAL_SMBUS_Init(&smbus_);
+      ConfigureAveraging();
+      read_state_ = kIdle;
+    }
+
+    if (clear_pending_) {
+      if (!ClaimBus(kClearFaults)) { return; }
+      clear_pending_ = false;
+      busy_ms_ = 0;
+      read_reg_ = D::kClearFaults;
+      if (HAL_SMBUS_Master_Transmit_IT(
+              &smbus_, address_ << 1, &read_reg_, 1,
+              SMBUS_LAST_FRAME_NO_PEC) != HAL_OK) {
+        BusError();
+      }
+      return;
+    }
+
+    if (count_ > 0) { return; }
+
+    if (!ClaimBus(kReadBlock)) { return; }
+    count_ = UpdatePeriodMs();
+    busy_ms_ = 0;
+    read_reg_ = D::kAvgBlockRead;
+    rx_started_ = false;
+    update_cpu_us_ = 0;
+    if (HAL_SMBUS_Master_Transmit_IT(
+            &smbus_, address_ << 1, &read_reg_, 1,
+            SMBUS_FIRST_FRAME) != HAL_OK) {
+      BusError();
+      return;
+    }
+    update_cpu_us_ += timer_->read_us() - start_us;
+  }
+
+  // Take ownership of the bus for the poll loop, unless an alert
+  // sequence is using it.  If an alert is pending, it is started
+  // instead.
+  bool ClaimBus(ReadState state) {
+    __disable_irq();
+    if (alert_pending_ && alert_state_ == kAlertIdle) {
+      StartAlert();
+    }
+    const bool idle = alert_state_ == kAlertIdle;
+    if (idle) { read_state_ = state; }
+    __enable_irq();
+    return idle;
+  }
+
+  // The alert handling below runs entirely from interrupts, so that
+  // faults are reported within the time of three short transactions.
+
+  void HandleAlert() {
+    if (read_state_ == kIdle && alert_state_ == kAlertIdle) {
+      StartAlert();
     } else {
-      status_.fault = Fault::kNone;
+      // This will be started as soon as the current transaction
+      // completes.
+      alert_pending_ = true;
+    }
+  }
+
+  void StartAlert() {
+    // Reading from the alert response address returns the address
+    // of the alerting device and releases SMBA.
+    alert_pending_ = false;
+    alert_state_ = kAlertResponse;
+    if (HAL_SMBUS_Master_Receive_IT(
+            &smbus_, D::kAlertResponseAddress << 1, alert_buf_, 1,
+            SMBUS_FIRST_AND_LAST_FRAME_NO_PEC) != HAL_OK) {
+      alert_state_ = kAlertIdle;
+    }
+  }
+
+  void HandleTransmitComplete() {
+    if (alert_state_ == kAlertStatusWrite) {
+      alert_state_ = kAlertStatusRead;
+      if (HAL_SMBUS_Master_Receive_IT(
+              &smbus_, address_ << 1, alert_buf_, 2,
+              SMBUS_LAST_FRAME_NO_PEC) != HAL_OK) {
+        alert_state_ = kAlertIdle;
+      }
+      return;
+    }
+
+    if (alert_state_ == kAlertIdle && read_state_ == kReadBlock) {
+      rx_started_ =
+          HAL_SMBUS_Master_Receive_IT(
+              &smbus_, address_ << 1, read_buf_, D::kBlockReadSize,
+              SMBUS_LAST_FRAME_NO_PEC) == HAL_OK;
+      return;
+    }
+
+    MaybeStartPendingAlert();
+  }
+
+  void HandleReceiveComplete() {
+    switch (alert_state_) {
+      case kAlertResponse: {
+        alert_reg_ = D::kStatusWord;
+        alert_state_ = kAlertStatusWrite;
+        if (HAL_SMBUS_Master_Transmit_IT(
+                &smbus_, address_ << 1, &alert_reg_, 1,
+                SMBUS_FIRST_FRAME) != HAL_OK) {
+          alert_state_ = kAlertIdle;
+        }
+        return;
+      }
+      case kAlertStatusRead: {
+        alert_state_ = kAlertIdle;
+        HandleStatusWord(alert_buf_[0] | (alert_buf_[1] << 8));
+        break;
+      }
+      case kAlertStatusWrite:
+      case kAlertIdle: {
+        break;
+      }
+    }
+
+    MaybeStartPendingAlert();
+  }
+
+  void HandleError() {
+    alert_state_ = kAlertIdle;
+  }
+
+  void MaybeStartPendingAlert() {
+    if (alert_pending_ && alert_state_ == kAlertIdle &&
+        read_state_ != kReconfigure) {
+      StartAlert();
+    }
+  }
+
+  void HandleStatusWord(uint16_t status_word) {
+    status_.alert_count++;
+    status_.status_word = status_word;
+
+    const Fault fault = D::DecodeStatusWord(status_word);
+    if (fault == Fault::kNone) { return; }
+
+    status_.fault = fault;
+    if (alert_callback_) { alert_callback_(fault); }
+  }
+
+  bool BusReady() {
+    if (alert_state_ == kAlertIdle &&
+        HAL_SMBUS_GetState(&smbus_) == HAL_SMBUS_STATE_READY &&
+        HAL_SMBUS_GetError(&smbus_) == HAL_SMBUS_ERROR_NONE) {
+      return true;
     }
 
+    // A transaction which takes longer than an update period is
+    // treated as lost.
+    busy_ms_++;
+    if (busy_ms_ > std::max<int>(kMinTimeoutMs, UpdatePeriodMs()) ||
+        HAL_SMBUS_GetError(&smbus_) != HAL_SMBUS_ERROR_NONE) {
+      BusError();
+    }
+    return false;
+  }
+
+  void BusError() {
+    __disable_irq();
+    HAL_SMBUS_DeInit(&smbus_);
+    HAL_SMBUS_Init(&smbus_);
+    alert_state_ = kAlertIdle;
+    __enable_irq();
+
+    read_state_ = kIdle;
+    count_ = UpdatePeriodMs();
+    status_.bus_errors++;
+    status_.fault = Fault::kNoResponse;
     status_update_();
   }
 
+  void FinishUpdate() {
+    status_.update_count++;
+    status_.update_cpu_us = static_cast<uint16_t>(
+        std::min<uint32_t>(update_cpu_us_, 65535));
+
+    // Report throughput once per second.
+    const uint32_t now_us = timer_->read_us();
+    rate_count_++;
+    const uint32_t rate_elapsed_us = now_us - rate_start_us_;
+    if (rate_elapsed_us >= 1000000) {
+      status_.update_rate_hz =
+          static_cast<float>(rate_count_) * 1e6f /
+          static_cast<float>(rate_elapsed_us);
+      rate_count_ = 0;
+      rate_start_us_ = now_us;
+    }
+
+    status_update_();
+  }
+
+  uint32_t BusTiming() const {
+    switch (config_.bus_khz) {
+      case 1000: { return kTiming1MHz; }
+      case 400: { return kTiming400kHz; }
+    }
+    return kTiming100kHz;
+  }
+
+  int UpdatePeriodMs() const {
+    return std::max<int>(1, config_.update_period_ms);
+  }
+
+  void ConfigureAveraging() {
+    if (config_.bus_khz == 1000) {
+      HAL_SMBUSEx_EnableFastModePlus(SMBUS_FASTMODEPLUS_I2C2);
+    } else {
+      HAL_SMBUSEx_DisableFastModePlus(SMBUS_FASTMODEPLUS_I2C2);
+    }
+
+    uint8_t samples_for_avg = static_cast<uint8_t>(
+        std::max<int>(0, std::min<int>(kMaxAverageLog2,
+                                       config_.average_log2)));
+    SmbusWrite(D::kSamplesForAvg, &samples_for_avg, 1);
+  }
+
+  void ProcessBlockRead() {
+    const uint32_t now_us = timer_->read_us();
+    const float dt_s = static_cast<float>(now_us - last_update_us_) * 1e-6f;
+    last_update_us_ = now_us;
+
+    decoder_.DecodeBlock(read_buf_, dt_s, &status_);
+
+    const float average_alpha = std::min(
+        1.0f, static_cast<float>(UpdatePeriodMs()) / kCalibrationAverageMs);
+    iin_average_ += average_alpha * (status_.iin_raw - iin_average_);
+    pin_average_ += average_alpha * (status_.pin_raw - pin_average_);
+  }
+
   void HandleCommand(const std::string_view& message,
                      const micro::CommandManager::Response& response) {
-    if (message == "clear") {
+    mjlib::base::Tokenizer tokenizer(message, " ");
+    const auto cmd_text = tokenizer.next();
+    if (cmd_text == "clear") {
       ClearFaults();
 
       WriteOk(response);
+    } else if (cmd_text == "cal") {
+      HandleCalibrationCommand(&tokenizer, response);
     } else {
       WriteMessage(response, "ERR unknown lm5066\r\n");
     }
   }
 
+  void HandleCalibrationCommand(
+      mjlib::base::Tokenizer* tokenizer,
+      const micro::CommandManager::Response& response) {
+    const auto channel = tokenizer->next();
+    const bool is_iin = channel == "iin";
+    if (!is_iin && channel != "pin") {
+      WriteMessage(response, "ERR invalid channel\r\n");
+      return;
+    }
+
+    auto& fitter = is_iin ? iin_fitter_ : pin_fitter_;
+    auto* const cal = is_iin ? &config_.iin : &config_.pin;
+    const auto action = tokenizer->next();
+    if (action == "point") {
+      const auto reference_str = tokenizer->next();
+      if (reference_str.empty()) {
+        WriteMessage(response, "ERR invalid reference\r\n");
+        return;
+      }
+      const float reference = std::strtof(reference_str.data(), nullptr);
+      const float nominal =
+          is_iin ?
+          (iin_average_ * D::kIinScale + D::kIinOffset) :
+          (pin_average_ * D::kPinScale + D::kPinOffset);
+      if (!fitter.AddPoint(nominal, reference)) {
+        WriteMessage(response, "ERR too many points\r\n");
+        return;
+      }
+    } else if (action == "fit") {
+      if (!fitter.Fit(cal)) {
+        WriteMessage(response, "ERR could not fit\r\n");
+        return;
+      }
+      CompileCalibration();
+    } else if (action == "clear") {
+      fitter.Clear();
+    } else if (action == "reset") {
+      *cal = Calibration();
+      CompileCalibration();
+    } else {
+      WriteMessage(response, "ERR unknown cal\r\n");
+      return;
+    }
+
+    WriteOk(response);
+  }
+
+  void CompileCalibration() {
+    decoder_.Compile(config_.iin, config_.pin);
+  }
+
   void ClearFaults() {
-    SmbusSendByte(CLEAR_FAULTS);
+    // This shares the bus with the periodic read, so it is sent from
+    // PollMillisecond once the bus is idle.
+    clear_pending_ = true;
   }
 
   void SmbusRead(uint8_t reg, uint8_t* data, size_t size) {
@@ -276,12 +597,44 @@ class Lm5066::Impl {
   I2C i2c_;  // we use this just to initialize the pins appropriately
   SMBUS_HandleTypeDef smbus_ = {};
 
-  DigitalIn smba_;
+  InterruptIn smba_;
+  micro::CallbackTable::Callback smba_callback_;
   int address_ = 0x40;
 
+  Config config_;
+  Lm5066Decoder decoder_;
+  CalibrationFitter iin_fitter_;
+  CalibrationFitter pin_fitter_;
+
+  // Reference points for calibration are averaged over roughly this
+  // long.
+  static constexpr float kCalibrationAverageMs = 1000.0f;
+  float iin_average_ = 0.0f;
+  float pin_average_ = 0.0f;
+
   Status status_;
   mjlib::base::inplace_function<void()> status_update_;
-  int count_ = kUpdatePeriodMs;
+  int count_ = 1;
+
+  static constexpr int kMinTimeoutMs = 5;
+
+  volatile ReadState read_state_ = kIdle;
+  volatile AlertState alert_state_ = kAlertIdle;
+  volatile bool alert_pending_ = false;
+  uint8_t alert_reg_ = 0;
+  uint8_t alert_buf_[2] = {};
+  AlertCallback alert_callback_;
+  bool clear_pending_ = false;
+  bool reconfigure_pending_ = false;
+  volatile bool rx_started_ = false;
+  int busy_ms_ = 0;
+
+  uint32_t update_cpu_us_ = 0;
+  uint32_t last_update_us_ = 0;
+  uint32_t rate_start_us_ = 0;
+  uint32_t rate_count_ = 0;
+  uint8_t read_reg_ = 0;
+  uint8_t read_buf_[16] = {};
 
   micro::CallbackTable::Callback ev_callback_;
   micro::CallbackTable::Callback er_callback_;
@@ -307,4 +660,29 @@ const Lm5066::Status& Lm5066::status() const {
   return impl_->status_;
 }
 
+void Lm5066::set_alert_callback(AlertCallback callback) {
+  impl_->alert_callback_ = callback;
+}
+
+}
+
+// The HAL calls these from the I2C2 interrupts.
+void HAL_SMBUS_MasterTxCpltCallback(SMBUS_HandleTypeDef*) {
+  if (fw::g_smbus_event) {
+    fw::g_smbus_event(fw::g_smbus_event_context,
+                      fw::SmbusEvent::kTransmitComplete);
+  }
+}
+
+void HAL_SMBUS_MasterRxCpltCallback(SMBUS_HandleTypeDef*) {
+  if (fw::g_smbus_event) {
+    fw::g_smbus_event(fw::g_smbus_event_context,
+                      fw::SmbusEvent::kReceiveComplete);
+  }
+}
+
+void HAL_SMBUS_ErrorCallback(SMBUS_HandleTypeDef*) {
+  if (fw::g_smbus_event) {
+    fw::g_smbus_event(fw::g_smbus_event_context, fw::SmbusEvent::kError);
+  }
 }
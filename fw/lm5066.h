@@ -16,6 +16,7 @@
 
 #include "PinNames.h"
 
+#include "mjlib/base/inplace_function.h"
 #include "mjlib/base/visitor.h"
 
 #include "mjlib/micro/command_manager.h"
@@ -23,6 +24,7 @@
 #include "mjlib/micro/pool_ptr.h"
 #include "mjlib/micro/telemetry_manager.h"
 
+#include "fw/lm5066_decoder.h"
 #include "fw/millisecond_timer.h"
 
 namespace fw {
@@ -45,88 +47,13 @@ class Lm5066 {
 
   void PollMillisecond();
 
-  enum class Fault {
-    kNone = 0,
-    kOverCurrent = 1,
-    kUnderVoltage = 2,
-    kOverTemperature = 3,
-    kOverVoltage = 4,
-    kCircuitBreaker = 5,
-    kMosfetShorted = 6,
-    kCommunications = 7,
-    kSize,
-  };
-
-  struct Status {
-    bool vout_uv_warn = false;
-    bool i_op_warn = false;
-    bool vin_uv_warn = false;
-    bool vin_ov_warn = false;
-    bool power_good = false;
-    bool otemp_warn = false;
-    bool timer_latched_off = false;
-    bool ext_mosfet_shorted = false;
-    bool config_preset = false;
-    bool device_off = false;
-    bool vin_uv_fault = false;
-    bool vin_ov_fault = false;
-    bool i_oc_fault = false;
-    bool otemp_fault = false;
-    bool cml_fault = false;
-    bool cb_fault = false;
-
-    int16_t iin_raw = 0;
-    int16_t vout_raw = 0;
-    int16_t vin_raw = 0;
-    int16_t pin_raw = 0;
-    int16_t temperature_raw = 0;
-
-    int16_t iin_10mA = 0;
-    int16_t vout_10mv = 0;
-    int16_t vin_10mv = 0;
-    int16_t pin_100mW = 0;
-    int16_t temperature_C = 0;
-
-    uint32_t energy_uW_hr = 0;
-
-    Fault fault = Fault::kNone;
-
-    template <typename Archive>
-    void Serialize(Archive* a) {
-      a->Visit(MJ_NVP(vout_uv_warn));
-      a->Visit(MJ_NVP(i_op_warn));
-      a->Visit(MJ_NVP(vin_uv_warn));
-      a->Visit(MJ_NVP(vin_ov_warn));
-      a->Visit(MJ_NVP(power_good));
-      a->Visit(MJ_NVP(otemp_warn));
-      a->Visit(MJ_NVP(timer_latched_off));
-      a->Visit(MJ_NVP(ext_mosfet_shorted));
-      a->Visit(MJ_NVP(config_preset));
-      a->Visit(MJ_NVP(device_off));
-      a->Visit(MJ_NVP(vin_uv_fault));
-      a->Visit(MJ_NVP(vin_ov_fault));
-      a->Visit(MJ_NVP(i_oc_fault));
-      a->Visit(MJ_NVP(otemp_fault));
-      a->Visit(MJ_NVP(cml_fault));
-      a->Visit(MJ_NVP(cb_fault));
-
-      a->Visit(MJ_NVP(iin_raw));
-      a->Visit(MJ_NVP(vout_raw));
-      a->Visit(MJ_NVP(vin_raw));
-      a->Visit(MJ_NVP(pin_raw));
-      a->Visit(MJ_NVP(temperature_raw));
-
-      a->Visit(MJ_NVP(iin_10mA));
-      a->Visit(MJ_NVP(vout_10mv));
-      a->Visit(MJ_NVP(vin_10mv));
-      a->Visit(MJ_NVP(pin_100mW));
-      a->Visit(MJ_NVP(temperature_C));
+  using Fault = Lm5066Decoder::Fault;
+  using Status = Lm5066Decoder::Status;
 
-      a->Visit(MJ_NVP(energy_uW_hr));
-
-      a->Visit(MJ_NVP(fault));
-    }
-  };
+  /// Invoked from interrupt context when the device asserts SMBA
+  /// with a fault.
+  using AlertCallback = mjlib::base::inplace_function<void(Fault)>;
+  void set_alert_callback(AlertCallback);
 
   const Status& status() const;
 
@@ -136,28 +63,3 @@ class Lm5066 {
 };
 
 }
-
-namespace mjlib {
-namespace base {
-
-template <>
-struct IsEnum<fw::Lm5066::Fault> {
-  static constexpr bool value = true;
-
-  using F = fw::Lm5066::Fault;
-  static std::array<std::pair<F, const char*>, static_cast<size_t>(F::kSize)> map() {
-    return { {
-        { F::kNone, "none" },
-        { F::kOverCurrent, "over_current" },
-        { F::kUnderVoltage, "under_voltage" },
-        { F::kOverTemperature, "over_temp" },
-        { F::kOverVoltage, "over_voltage" },
-        { F::kCircuitBreaker, "circuit_breaker" },
-        { F::kMosfetShorted, "mosfet_shorted" },
-        { F::kCommunications, "communications" },
-      }};
-  }
-};
-
-}
-}
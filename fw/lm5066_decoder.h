@@ -0,0 +1,351 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "mjlib/base/visitor.h"
+
+#include "fw/accumulate.h"
+#include "fw/calibration.h"
+
+namespace fw {
+
+/// Converts the responses of an LM5066 into engineering units and
+/// faults.  This has no hardware dependencies, so that it can be
+/// exercised on the host against a model of the device.
+class Lm5066Decoder {
+ public:
+  enum Command : uint8_t {
+    kOperation = 0x01,
+    kClearFaults = 0x03,
+    kStatusWord = 0x79,
+    kDeviceSetup = 0xd9,
+    kBlockRead = 0xda,
+    kSamplesForAvg = 0xdb,
+    kAvgBlockRead = 0xe2,
+  };
+
+  // BLOCK_READ and AVG_BLOCK_READ respond with a byte count followed
+  // by six words.
+  static constexpr int kBlockReadSize = 13;
+
+  // The SMBus alert response address.
+  static constexpr int kAlertResponseAddress = 0x0c;
+
+  // STATUS_WORD bits.
+  enum StatusWordBits : uint16_t {
+    kStatusCml = 1 << 1,
+    kStatusTemperature = 1 << 2,
+    kStatusVinUv = 1 << 3,
+    kStatusIoutOc = 1 << 4,
+    kStatusMfr = 1 << 12,
+    kStatusInput = 1 << 13,
+  };
+
+  // The nominal current and power conversions, calibrated by hand
+  // from the following datasets:
+  //
+  // current
+  //  10 - 0A
+  //  28 - 0.97A
+  //  37 - 1.2A
+  //  48 - 1.4A
+  //  55 - 1.61
+  //  62 - 1.80
+  //  69 - 2.01
+  //
+  // power
+  //  2 - 0W
+  //  5 - 16W
+  //  8 - 25W
+  //  12 - 36W
+  //  18 - 50W
+  //  24 - 65W
+  //  32 - 82W
+  static constexpr float kIinScale = 0.02512f;
+  static constexpr float kIinOffset = 0.267f;
+  static constexpr float kPinScale = 2.375f;
+  static constexpr float kPinOffset = 6.0f;
+
+  // Below these counts, current and power read as zero.
+  static constexpr int kIinMinCounts = 12;
+  static constexpr int kPinMinCounts = 5;
+
+  // The device reports 12 bit values.
+  static constexpr float kMaxCounts = 4096.0f;
+
+  enum class Fault {
+    kNone = 0,
+    kOverCurrent = 1,
+    kUnderVoltage = 2,
+    kOverTemperature = 3,
+    kOverVoltage = 4,
+    kCircuitBreaker = 5,
+    kMosfetShorted = 6,
+    kCommunications = 7,
+    kNoResponse = 8,
+    kSize,
+  };
+
+  struct Status {
+    bool vout_uv_warn = false;
+    bool i_op_warn = false;
+    bool vin_uv_warn = false;
+    bool vin_ov_warn = false;
+    bool power_good = false;
+    bool otemp_warn = false;
+    bool timer_latched_off = false;
+    bool ext_mosfet_shorted = false;
+    bool config_preset = false;
+    bool device_off = false;
+    bool vin_uv_fault = false;
+    bool vin_ov_fault = false;
+    bool i_oc_fault = false;
+    bool otemp_fault = false;
+    bool cml_fault = false;
+    bool cb_fault = false;
+
+    int16_t iin_raw = 0;
+    int16_t vout_raw = 0;
+    int16_t vin_raw = 0;
+    int16_t pin_raw = 0;
+    int16_t temperature_raw = 0;
+
+    int16_t iin_10mA = 0;
+    int16_t vout_10mv = 0;
+    int16_t vin_10mv = 0;
+    int16_t pin_100mW = 0;
+    int16_t temperature_C = 0;
+
+    uint32_t energy_uW_hr = 0;
+
+    Fault fault = Fault::kNone;
+
+    // The number of completed reads, their rate over the last second,
+    // and the processor time spent on the most recent one.
+    uint32_t update_count = 0;
+    float update_rate_hz = 0.0f;
+    uint16_t update_cpu_us = 0;
+    uint32_t bus_errors = 0;
+
+    // The number of alerts handled, and the STATUS_WORD read in
+    // response to the most recent.
+    uint32_t alert_count = 0;
+    uint16_t status_word = 0;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(vout_uv_warn));
+      a->Visit(MJ_NVP(i_op_warn));
+      a->Visit(MJ_NVP(vin_uv_warn));
+      a->Visit(MJ_NVP(vin_ov_warn));
+      a->Visit(MJ_NVP(power_good));
+      a->Visit(MJ_NVP(otemp_warn));
+      a->Visit(MJ_NVP(timer_latched_off));
+      a->Visit(MJ_NVP(ext_mosfet_shorted));
+      a->Visit(MJ_NVP(config_preset));
+      a->Visit(MJ_NVP(device_off));
+      a->Visit(MJ_NVP(vin_uv_fault));
+      a->Visit(MJ_NVP(vin_ov_fault));
+      a->Visit(MJ_NVP(i_oc_fault));
+      a->Visit(MJ_NVP(otemp_fault));
+      a->Visit(MJ_NVP(cml_fault));
+      a->Visit(MJ_NVP(cb_fault));
+
+      a->Visit(MJ_NVP(iin_raw));
+      a->Visit(MJ_NVP(vout_raw));
+      a->Visit(MJ_NVP(vin_raw));
+      a->Visit(MJ_NVP(pin_raw));
+      a->Visit(MJ_NVP(temperature_raw));
+
+      a->Visit(MJ_NVP(iin_10mA));
+      a->Visit(MJ_NVP(vout_10mv));
+      a->Visit(MJ_NVP(vin_10mv));
+      a->Visit(MJ_NVP(pin_100mW));
+      a->Visit(MJ_NVP(temperature_C));
+
+      a->Visit(MJ_NVP(energy_uW_hr));
+
+      a->Visit(MJ_NVP(fault));
+
+      a->Visit(MJ_NVP(update_count));
+      a->Visit(MJ_NVP(update_rate_hz));
+      a->Visit(MJ_NVP(update_cpu_us));
+      a->Visit(MJ_NVP(bus_errors));
+      a->Visit(MJ_NVP(alert_count));
+      a->Visit(MJ_NVP(status_word));
+    }
+  };
+
+  Lm5066Decoder() {
+    Compile(Calibration(), Calibration());
+  }
+
+  void Compile(const Calibration& iin, const Calibration& pin) {
+    iin_cal_.Compile(iin, kIinScale, kIinOffset, 0.0f, kMaxCounts);
+    pin_cal_.Compile(pin, kPinScale, kPinOffset, 0.0f, kMaxCounts);
+  }
+
+  /// Decode a BLOCK_READ or AVG_BLOCK_READ response, starting with
+  /// its byte count, which was received dt_s after the previous one.
+  void DecodeBlock(const uint8_t* data, float dt_s, Status* status) {
+    const auto& br = &data[1];
+    Status& s = *status;
+    s.config_preset = br[0] & 0x80;
+    s.device_off    = br[0] & 0x40;
+    s.vin_uv_fault  = br[0] & 0x20;
+    s.vin_ov_fault  = br[0] & 0x10;
+    s.i_oc_fault    = br[0] & 0x08;
+    s.otemp_fault   = br[0] & 0x04;
+    s.cml_fault     = br[0] & 0x02;
+    s.cb_fault      = br[0] & 0x01;
+
+    s.vout_uv_warn       = br[1] & 0x80;
+    s.i_op_warn          = br[1] & 0x40;
+    s.vin_uv_warn        = br[1] & 0x20;
+    s.vin_ov_warn        = br[1] & 0x10;
+    s.power_good         = br[1] & 0x08;
+    s.otemp_warn         = br[1] & 0x04;
+    s.timer_latched_off  = br[1] & 0x02;
+    s.ext_mosfet_shorted = br[1] & 0x01;
+
+    const int16_t iin = (br[3] << 8) | br[2];
+    const int16_t vout = (br[5] << 8) | br[4];
+    const int16_t vin = (br[7] << 8) | br[6];
+    const int16_t pin = (br[9] << 8) | br[8];
+    const int16_t temp = (br[11] << 8) | br[10];
+
+    s.iin_raw = iin;
+    s.vout_raw = vout;
+    s.vin_raw = vin;
+    s.pin_raw = pin;
+    s.temperature_raw = temp;
+
+    s.iin_10mA = (iin < kIinMinCounts) ?
+        0 : static_cast<int16_t>(100.0f * iin_cal_(iin));
+
+    s.vout_10mv = static_cast<int16_t>(
+        100.0f * (vout * 100.0f + 2400.0f) / 4587.0f);
+    s.vin_10mv = static_cast<int16_t>(
+        100.0f * (vin * 100.0f + 1200.0f) / 4578.0f);
+
+    s.pin_100mW = (pin < kPinMinCounts) ?
+        0 : static_cast<int16_t>(10.0f * pin_cal_(pin));
+
+    s.temperature_C = static_cast<int16_t>(
+        (temp * 1000.0f) / 16000.0f);
+
+    // The power is averaged by the device, so integrating it over
+    // the actual time between reads captures the energy between
+    // samples too.
+    const float delta_uW_hr =
+        1.0e6f * // to get uW
+        static_cast<float>(s.pin_100mW) / 10.0f   // to get W
+        * dt_s / 3600.0f;  // to get W*hr
+    Accumulate(&s.energy_uW_hr, &energy_remainder_uW_hr_, delta_uW_hr);
+
+    // We check for faults in priority order, so that the higher
+    // priority faults take precedence over the lower priority ones.
+    if (s.cml_fault) {
+      s.fault = Fault::kCommunications;
+    } else if (s.ext_mosfet_shorted) {
+      s.fault = Fault::kMosfetShorted;
+    } else if (s.cb_fault) {
+      s.fault = Fault::kCircuitBreaker;
+    } else if (s.vin_ov_fault) {
+      s.fault = Fault::kOverVoltage;
+    } else if (s.otemp_fault) {
+      s.fault = Fault::kOverTemperature;
+    // For some reason, the LM5066 _always_ seems to report
+    // undervoltage.  I haven't figured out why.  Until I do, treat
+    // it as not a fault.
+    //
+    // } else if (s.vin_uv_fault) {
+    //   s.fault = Fault::kUnderVoltage;
+    } else if (s.i_oc_fault) {
+      s.fault = Fault::kOverCurrent;
+    } else {
+      s.fault = Fault::kNone;
+    }
+  }
+
+  /// STATUS_WORD only summarizes the causes, a block read is needed
+  /// to fill in the details.  In particular, a circuit breaker or
+  /// shorted MOSFET are both reported as manufacturer specific.
+  static Fault DecodeStatusWord(uint16_t status_word) {
+    if (status_word & kStatusCml) {
+      return Fault::kCommunications;
+    } else if (status_word & kStatusMfr) {
+      return Fault::kCircuitBreaker;
+    } else if ((status_word & kStatusInput) &&
+               !(status_word & kStatusVinUv)) {
+      return Fault::kOverVoltage;
+    } else if (status_word & kStatusTemperature) {
+      return Fault::kOverTemperature;
+    } else if (status_word & kStatusIoutOc) {
+      return Fault::kOverCurrent;
+    }
+    return Fault::kNone;
+  }
+
+  /// Compute the SMBus packet error code, a CRC-8 with polynomial
+  /// x^8 + x^2 + x + 1, over 'size' bytes, continuing from 'crc'.
+  static uint8_t Pec(const uint8_t* data, size_t size, uint8_t crc = 0) {
+    for (size_t i = 0; i < size; i++) {
+      crc ^= data[i];
+      for (int bit = 0; bit < 8; bit++) {
+        crc = (crc & 0x80) ?
+            static_cast<uint8_t>((crc << 1) ^ 0x07) :
+            static_cast<uint8_t>(crc << 1);
+      }
+    }
+    return crc;
+  }
+
+ private:
+  CompiledCalibration iin_cal_;
+  CompiledCalibration pin_cal_;
+  float energy_remainder_uW_hr_ = 0.0f;
+};
+
+}
+
+namespace mjlib {
+namespace base {
+
+template <>
+struct IsEnum<fw::Lm5066Decoder::Fault> {
+  static constexpr bool value = true;
+
+  using F = fw::Lm5066Decoder::Fault;
+  static std::array<std::pair<F, const char*>, static_cast<size_t>(F::kSize)> map() {
+    return { {
+        { F::kNone, "none" },
+        { F::kOverCurrent, "over_current" },
+        { F::kUnderVoltage, "under_voltage" },
+        { F::kOverTemperature, "over_temp" },
+        { F::kOverVoltage, "over_voltage" },
+        { F::kCircuitBreaker, "circuit_breaker" },
+        { F::kMosfetShorted, "mosfet_shorted" },
+        { F::kCommunications, "communications" },
+        { F::kNoResponse, "no_response" },
+      }};
+  }
+};
+
+}
+}
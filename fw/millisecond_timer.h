@@ -48,13 +48,31 @@ class MillisecondTimer {
   }
 
   uint32_t read_ms() {
-    return TIM5->CNT / 1000;
+    return static_cast<uint32_t>(read_us64() / 1000);
   }
 
   uint32_t read_us() {
     return TIM5->CNT;
   }
 
+  /// The microseconds since power on.
+  ///
+  /// TIM5 wraps every 2^32 us, about 71.6 minutes, and a wrap is only
+  /// counted when this sees it, so this must be called at least once
+  /// in every 2^32 us or the result falls behind by a whole wrap.
+  /// The main loop does so through read_ms() on every pass.  It may
+  /// also be called from interrupts.
+  uint64_t read_us64() {
+    const uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    const uint32_t now = TIM5->CNT;
+    if (now < last_us_) { wraps_++; }
+    last_us_ = now;
+    const uint32_t wraps = wraps_;
+    if (!primask) { __enable_irq(); }
+    return (static_cast<uint64_t>(wraps) << 32) | now;
+  }
+
   void wait_ms(uint32_t delay_ms) {
     wait_us(delay_ms * 1000);
   }
@@ -74,6 +92,8 @@ class MillisecondTimer {
 
  private:
   TIM_HandleTypeDef handle_ = {};
+  uint32_t last_us_ = 0;
+  uint32_t wraps_ = 0;
 };
 
 }
@@ -12,7 +12,8 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-#include <numeric>
+#include <cstdio>
+#include <optional>
 
 #include "mbed.h"
 
@@ -29,14 +30,25 @@
 #include "mjlib/multiplex/micro_server.h"
 #include "mjlib/multiplex/micro_stream_datagram.h"
 
+#include "fw/adc_profile.h"
+#include "fw/calibration.h"
+#include "fw/event_publisher.h"
 #include "fw/fdcan.h"
 #include "fw/fdcan_micro_server.h"
 #include "fw/firmware_info.h"
+#include "fw/fmac_filter.h"
 #include "fw/git_info.h"
 #include "fw/lm5066.h"
 #include "fw/millisecond_timer.h"
+#include "fw/power_dist_control.h"
+#include "fw/power_history.h"
 #include "fw/power_dist_hw.h"
+#include "fw/sample_stream.h"
+#include "fw/spectrum_analyzer.h"
 #include "fw/stm32g4_flash.h"
+#include "fw/telemetry_decimator.h"
+#include "fw/telemetry_rate_watcher.h"
+#include "fw/time_sync.h"
 #include "fw/uuid.h"
 
 namespace base = mjlib::base;
@@ -45,6 +57,7 @@ namespace multiplex = mjlib::multiplex;
 using Value = multiplex::MicroServer::Value;
 using mjlib::base::Limit;
 using FDCan = fw::FDCan;
+using fw::PowerDistControl;
 
 namespace {
 
@@ -65,6 +78,21 @@ Value IntMapping(T value, size_t type) {
   return static_cast<int8_t>(0);
 }
 
+// Like IntMapping, but values beyond the range of the requested type
+// are limited to +- its maximum rather than wrapped.
+Value SaturateIntMapping(int32_t value, size_t type) {
+  switch (type) {
+    case 0: return static_cast<int8_t>(Limit<int32_t>(value, -127, 127));
+    case 1: {
+      return static_cast<int16_t>(Limit<int32_t>(value, -32767, 32767));
+    }
+    case 2: return value;
+    case 3: return static_cast<float>(value);
+  }
+  MJ_ASSERT(false);
+  return static_cast<int8_t>(0);
+}
+
 template <typename T>
 Value ScaleSaturate(float value, float scale) {
   if (!std::isfinite(value)) {
@@ -104,6 +132,47 @@ Value ScaleVoltage(float value, size_t type) {
   return ScaleMapping(value, 0.5f, 0.1f, 0.001f, type);
 }
 
+Value ScalePercent(float value, size_t type) {
+  return ScaleMapping(value, 1.0f, 0.01f, 0.0001f, type);
+}
+
+Value ScaleEnergy(float value_Wh, size_t type) {
+  return ScaleMapping(value_Wh, 1.0f, 0.01f, 0.000001f, type);
+}
+
+Value ScaleDuration(float value_s, size_t type) {
+  return ScaleMapping(value_s, 60.0f, 1.0f, 0.001f, type);
+}
+
+Value ScalePower(float value_W, size_t type) {
+  return ScaleMapping(value_W, 10.0f, 0.05f, 0.0001f, type);
+}
+
+Value ScaleResistance(float value_ohm, size_t type) {
+  return ScaleMapping(value_ohm, 0.001f, 0.00001f, 0.000001f, type);
+}
+
+Value ScaleFrequency(float value_Hz, size_t type) {
+  return ScaleMapping(value_Hz, 100.0f, 1.0f, 0.001f, type);
+}
+
+Value ScaleSkew(float value_ppm, size_t type) {
+  return ScaleMapping(value_ppm, 1.0f, 0.01f, 0.0001f, type);
+}
+
+// Energy and charge are accumulated in units of micro W*hr or micro
+// A*hr.
+Value AccumulatorMapping(int64_t value, size_t type) {
+  switch (type) {
+    case 0: return Value(static_cast<int8_t>(value / 1000000));
+    case 1: return Value(static_cast<int16_t>(value / 10000));
+    case 2: return Value(static_cast<int32_t>(value));
+    case 3: return Value(static_cast<float>(value) / 1000000.0f);
+  }
+  MJ_ASSERT(false);
+  return Value(static_cast<int8_t>(0));
+}
+
 int16_t ReadInt16Mapping(Value value) {
   return std::visit([](auto a) {
       return static_cast<int16_t>(a);
@@ -153,10 +222,65 @@ enum class Register {
   kSwitchStatus = 0x002,
   kLockTime = 0x003,
   kBootTime = 0x004,
+  kWarning = 0x005,
+  kUptimeLow = 0x006,
+  kUptimeHigh = 0x007,
+  kHostTimeLow = 0x008,
+  kHostTimeHigh = 0x009,
+  kTimeSyncState = 0x00a,
+  kTimeSkew = 0x00b,
+  kTimeSyncError = 0x00c,
   kOutputVoltage = 0x010,
   kOutputCurrent = 0x011,
   kTemperature = 0x012,
   kEnergy = 0x013,
+  kEnergyDelivered = 0x014,
+  kEnergyRegenerated = 0x015,
+  kChargeOut = 0x016,
+  kChargeIn = 0x017,
+  kPower = 0x018,
+  kAveragePower = 0x019,
+  kFilteredInputVoltage = 0x01a,
+  kFilteredOutputVoltage = 0x01b,
+  kFilteredOutputCurrent = 0x01c,
+
+  kStateOfCharge = 0x020,
+  kRemainingEnergy = 0x021,
+  kRuntime = 0x022,
+  kBatteryResistance = 0x023,
+
+  kEventSubscribe = 0x030,
+  kEventSequence = 0x031,
+  kEventCause = 0x032,
+
+  kSpectrumState = 0x040,
+  kSpectrumSampleRate = 0x041,
+  kCurrentRipple = 0x042,
+  kVoltageRipple = 0x043,
+  kCurrentPeakFrequency1 = 0x044,
+  kCurrentPeakAmplitude1 = 0x045,
+  kCurrentPeakFrequency2 = 0x046,
+  kCurrentPeakAmplitude2 = 0x047,
+  kCurrentPeakFrequency3 = 0x048,
+  kCurrentPeakAmplitude3 = 0x049,
+  kCurrentPeakFrequency4 = 0x04a,
+  kCurrentPeakAmplitude4 = 0x04b,
+  kVoltagePeakFrequency1 = 0x04c,
+  kVoltagePeakAmplitude1 = 0x04d,
+  kVoltagePeakFrequency2 = 0x04e,
+  kVoltagePeakAmplitude2 = 0x04f,
+  kVoltagePeakFrequency3 = 0x050,
+  kVoltagePeakAmplitude3 = 0x051,
+  kVoltagePeakFrequency4 = 0x052,
+  kVoltagePeakAmplitude4 = 0x053,
+
+  kHistoryResolution = 0x200,
+  kHistoryAge = 0x201,
+  kHistoryCount = 0x202,
+  kHistoryTotal = 0x203,
+
+  // kHistoryWindowBuckets buckets of kHistoryBucketRegisters each.
+  kHistoryWindow = 0x210,
 
   kUuid1 = 0x150,
   kUuid2 = 0x151,
@@ -171,38 +295,10 @@ enum class Register {
   kUuidMaskCapable = 0x158,
 };
 
-enum State {
-  kPowerOff,
-  kPrecharging,
-  kPowerOn,
-  kFault,
-
-  kNumStates,
-};
-}
-
-namespace mjlib {
-namespace base {
-
-template <>
-struct IsEnum<State> {
-  static constexpr bool value = true;
-
-  using S = State;
-  static std::array<std::pair<S, const char*>, S::kNumStates> map() {
-    return { {
-        { S::kPowerOff, "power_off" },
-        { S::kPrecharging, "precharging" },
-        { S::kPowerOn, "power_on" },
-        { S::kFault, "fault" },
-      }};
-  }
-};
-
-}
-}
-
-namespace {
+constexpr int kHistoryWindowBuckets = 4;
+constexpr int kHistoryBucketRegisters = 8;
+constexpr int kHistoryWindowRegisters =
+    kHistoryWindowBuckets * kHistoryBucketRegisters;
 
 void SetClock2() {
   RCC_ClkInitTypeDef RCC_ClkInitStruct;
@@ -267,6 +363,29 @@ class OpAmpInvertingAmplifier {
     HAL_OPAMP_Stop(&ctx_);
   }
 
+  /// Change the magnitude of the inverting gain, which must be one of
+  /// 1, 3, 7, 15, 31 or 63.  This can be done while running.
+  void SetGain(int gain) {
+    const uint32_t pga_gain = [&]() -> uint32_t {
+      switch (gain) {
+        case 1: return OPAMP_PGA_GAIN_2_OR_MINUS_1;
+        case 3: return OPAMP_PGA_GAIN_4_OR_MINUS_3;
+        case 7: return OPAMP_PGA_GAIN_8_OR_MINUS_7;
+        case 15: return OPAMP_PGA_GAIN_16_OR_MINUS_15;
+        case 31: return OPAMP_PGA_GAIN_32_OR_MINUS_31;
+        case 63: return OPAMP_PGA_GAIN_64_OR_MINUS_63;
+      }
+      return OPAMP_PGA_GAIN_8_OR_MINUS_7;
+    }();
+    ctx_.Init.PgaGain = pga_gain;
+
+    // The top two bits of PGGAIN select the connection, which is
+    // unchanged.
+    constexpr uint32_t kGainMask =
+        OPAMP_CSR_PGGAIN_0 | OPAMP_CSR_PGGAIN_1 | OPAMP_CSR_PGGAIN_2;
+    MODIFY_REG(ctx_.Instance->CSR, kGainMask, pga_gain);
+  }
+
   OPAMP_HandleTypeDef ctx_ = {};
 };
 
@@ -317,6 +436,86 @@ class OpAmpBuffer {
   OPAMP_HandleTypeDef ctx_ = {};
 };
 
+// Runs a filter designed by fw::FmacFilter on the FMAC.  Samples are
+// written and results read one at a time by the CPU.
+//
+// The local memory is laid out as the coefficients in X2, then the
+// input history in X1, then the output history in Y.
+class Fmac {
+ public:
+  Fmac() {
+    __HAL_RCC_FMAC_CLK_ENABLE();
+  }
+
+  void Configure(const fw::FmacFilter::Coefficients& c) {
+    // Stop any running function and empty every buffer.
+    FMAC->PARAM = 0;
+    FMAC->CR = FMAC_CR_RESET;
+    while (FMAC->CR & FMAC_CR_RESET);
+
+    const int x2_size = c.p + c.q;
+    const int x1_size = c.p + 1;
+    const int y_size = c.q + 1;
+    FMAC->X2BUFCFG =
+        (0 << FMAC_X2BUFCFG_X2_BASE_Pos) |
+        (x2_size << FMAC_X2BUFCFG_X2_BUF_SIZE_Pos);
+    FMAC->X1BUFCFG =
+        (x2_size << FMAC_X1BUFCFG_X1_BASE_Pos) |
+        (x1_size << FMAC_X1BUFCFG_X1_BUF_SIZE_Pos) |
+        (0 << FMAC_X1BUFCFG_FULL_WM_Pos);  // full at 1 free space
+    FMAC->YBUFCFG =
+        ((x2_size + x1_size) << FMAC_YBUFCFG_Y_BASE_Pos) |
+        (y_size << FMAC_YBUFCFG_Y_BUF_SIZE_Pos) |
+        (0 << FMAC_YBUFCFG_EMPTY_WM_Pos);  // empty with no results
+
+    // The feed-forward taps, then the feedback taps.
+    Load(2, c.p, c.q);
+    for (int i = 0; i < c.p; i++) { Write(c.b[i]); }
+    for (int i = 0; i < c.q; i++) { Write(c.a[i]); }
+
+    // Start from a zero history, one sample short of a full input
+    // window so that each sample written produces one output.
+    if (c.p > 1) {
+      Load(1, c.p - 1, 0);
+      for (int i = 0; i < c.p - 1; i++) { Write(0); }
+    }
+    if (c.q > 0) {
+      Load(3, c.q, 0);
+      for (int i = 0; i < c.q; i++) { Write(0); }
+    }
+
+    FMAC->CR = FMAC_CR_CLIPEN;
+    FMAC->PARAM =
+        (c.function << FMAC_PARAM_FUNC_Pos) |
+        (c.p << FMAC_PARAM_P_Pos) |
+        (c.q << FMAC_PARAM_Q_Pos) |
+        (c.r << FMAC_PARAM_R_Pos) |
+        FMAC_PARAM_START;
+  }
+
+  int16_t Filter(int16_t sample) {
+    while (FMAC->SR & FMAC_SR_X1FULL);
+    Write(sample);
+    while (FMAC->SR & FMAC_SR_YEMPTY);
+    return static_cast<int16_t>(FMAC->RDATA & 0xffff);
+  }
+
+ private:
+  // Start one of the load functions, which completes once
+  // 'p' + 'q' values have been written.
+  static void Load(int function, int p, int q) {
+    FMAC->PARAM =
+        (function << FMAC_PARAM_FUNC_Pos) |
+        (p << FMAC_PARAM_P_Pos) |
+        (q << FMAC_PARAM_Q_Pos) |
+        FMAC_PARAM_START;
+  }
+
+  static void Write(int16_t value) {
+    FMAC->WDATA = static_cast<uint16_t>(value);
+  }
+};
+
 void ConfigureDAC1(fw::MillisecondTimer* timer) {
   __HAL_RCC_DAC1_CLK_ENABLE();
 
@@ -392,6 +591,60 @@ void ConfigureDAC3(fw::MillisecondTimer* timer) {
   DAC3->DHR12R2 = 2048;
 }
 
+// TIM6 is used only as a common trigger for the ADCs.  With MMS
+// left at reset, writing UG pulses TRGO, which starts a conversion
+// on every ADC which has been armed with ADSTART on the same edge.
+void ConfigureTIM6() {
+  __HAL_RCC_TIM6_CLK_ENABLE();
+
+  TIM6->CR1 = 0;
+  TIM6->CR2 = (0 << TIM_CR2_MMS_Pos);  // UG is TRGO
+}
+
+void TriggerAdcs() {
+  TIM6->EGR = TIM_EGR_UG;
+}
+
+// With a hardware trigger, ADSTART is not cleared at the end of a
+// conversion, and the ADC would convert again on the next trigger.
+// The sequence, sample times and oversampling can only be changed
+// once it is stopped.
+void StopAdc(ADC_TypeDef* adc) {
+  adc->CR |= ADC_CR_ADSTP;
+  while (adc->CR & ADC_CR_ADSTART);
+}
+
+// Copy each conversion of 'adc' into 'buffer' until 'count' have been
+// made.  The transfer is complete when TCIF of the channel is set.
+void StartAdcDma(ADC_TypeDef* adc, DMA_Channel_TypeDef* dma,
+                 DMAMUX_Channel_TypeDef* dmamux, uint32_t request,
+                 uint16_t* buffer, uint32_t count) {
+  dma->CCR = 0;
+  dmamux->CCR = request;
+  dma->CPAR = reinterpret_cast<uint32_t>(&adc->DR);
+  dma->CMAR = reinterpret_cast<uint32_t>(buffer);
+  dma->CNDTR = count;
+  dma->CCR =
+      DMA_CCR_MINC |
+      DMA_CCR_PSIZE_0 |  // 16 bit
+      DMA_CCR_MSIZE_0 |  // 16 bit
+      DMA_CCR_EN;
+
+  // One shot mode, as the DMA channel stops after 'count'.
+  adc->CFGR = (adc->CFGR & ~ADC_CFGR_DMACFG) | ADC_CFGR_DMAEN;
+}
+
+void StopAdcDma(ADC_TypeDef* adc, DMA_Channel_TypeDef* dma) {
+  adc->CFGR &= ~ADC_CFGR_DMAEN;
+  dma->CCR = 0;
+}
+
+// The prescaler must be at least 6x to be able to accurately read
+// across all channels.  If it is too low, you'll see errors that
+// look like quantization, but not in a particularly uniform way
+// and not consistently across each of the channels.
+constexpr int kAdcPrescale = 8;
+
 void ConfigureADC(ADC_TypeDef* adc, int channel_sqr, fw::MillisecondTimer* timer) {
   // Disable it to ensure we are in a known state.
   if (adc->CR & ADC_CR_ADEN) {
@@ -399,10 +652,6 @@ void ConfigureADC(ADC_TypeDef* adc, int channel_sqr, fw::MillisecondTimer* timer
     while (adc->CR & ADC_CR_ADEN);
   }
 
-  // The prescaler must be at least 6x to be able to accurately read
-  // across all channels.  If it is too low, you'll see errors that
-  // look like quantization, but not in a particularly uniform way
-  // and not consistently across each of the channels.
   auto map_adc_prescale = [](int prescale) {
     if (prescale == 1) { return 0; }
     if (prescale == 2) { return 1; }
@@ -420,8 +669,6 @@ void ConfigureADC(ADC_TypeDef* adc, int channel_sqr, fw::MillisecondTimer* timer
     return 0;
   };
 
-  constexpr int kAdcPrescale = 8;
-
   ADC12_COMMON->CCR =
       (map_adc_prescale(kAdcPrescale) << ADC_CCR_PRESC_Pos);
   ADC345_COMMON->CCR =
@@ -440,6 +687,14 @@ void ConfigureADC(ADC_TypeDef* adc, int channel_sqr, fw::MillisecondTimer* timer
 
   adc->ISR |= ADC_ISR_ADRDY;
   adc->CFGR &= ~(ADC_CFGR_CONT);
+
+  // Conversions start on TIM6_TRGO, which is external trigger 13 for
+  // both ADC12 and ADC345, so that all channels are sampled at the
+  // same instant.  ADSTART only arms the ADC.
+  adc->CFGR =
+      (adc->CFGR & ~(ADC_CFGR_EXTEN | ADC_CFGR_EXTSEL)) |
+      (1 << ADC_CFGR_EXTEN_Pos) |  // rising edge
+      (13 << ADC_CFGR_EXTSEL_Pos);
   adc->CFGR2 = (
       (0 << ADC_CFGR2_SMPTRIG_Pos) |
       (0 << ADC_CFGR2_BULB_Pos) |
@@ -469,10 +724,75 @@ void ConfigureADC(ADC_TypeDef* adc, int channel_sqr, fw::MillisecondTimer* timer
                            (v << 21) |
                            (v << 24);
                      };
-  adc->SMPR1 = make_cycles(2);  // 47 ADC cycles
+  adc->SMPR1 = make_cycles(2);  // 12.5 ADC cycles
   adc->SMPR2 = make_cycles(2);
 }
 
+// Set the oversampling of 'adc' and the sample time of 'channel' for
+// the next conversion.
+//
+// This may only be called while no regular conversion is ongoing.
+void ApplyAcquisition(ADC_TypeDef* adc, int channel,
+                      const fw::AdcAcquisition& acquisition) {
+  const int oversample = acquisition.oversample();
+  adc->CFGR2 =
+      (oversample == 0) ? 0 :
+      ((oversample << ADC_CFGR2_OVSS_Pos) |
+       ((oversample - 1) << ADC_CFGR2_OVSR_Pos) |
+       (1 << ADC_CFGR2_ROVSE_Pos));
+
+  const uint32_t sample_time = acquisition.sample_time_index();
+  if (channel < 10) {
+    const int shift = channel * 3;
+    adc->SMPR1 = (adc->SMPR1 & ~(7u << shift)) | (sample_time << shift);
+  } else {
+    const int shift = (channel - 10) * 3;
+    adc->SMPR2 = (adc->SMPR2 & ~(7u << shift)) | (sample_time << shift);
+  }
+}
+
+// Arm the analog watchdogs of 'adc' on a single regular channel.
+// AWD1 trips when a conversion falls below 'low' and AWD2 trips when
+// one rises above 'high', both in raw 12 bit counts.  A side whose
+// threshold lies outside of the ADC range is left disabled.
+//
+// AWD2 only compares the 8 MSBs of each conversion, so the high
+// threshold has a resolution of 16 counts.
+//
+// This may only be called while no regular conversion is ongoing.
+void ConfigureAnalogWatchdog(ADC_TypeDef* adc, int channel,
+                             int low, int high) {
+  const bool enable_low = low > 0;
+  const bool enable_high = high < 4095;
+
+  adc->CFGR =
+      (adc->CFGR & ~(ADC_CFGR_AWD1CH | ADC_CFGR_AWD1SGL | ADC_CFGR_AWD1EN)) |
+      (channel << ADC_CFGR_AWD1CH_Pos) |
+      ADC_CFGR_AWD1SGL |
+      (enable_low ? ADC_CFGR_AWD1EN : 0);
+  adc->TR1 =
+      (Limit(low, 0, 4095) << ADC_TR1_LT1_Pos) |
+      (4095 << ADC_TR1_HT1_Pos);
+
+  adc->AWD2CR = enable_high ? (1 << channel) : 0;
+  adc->TR2 =
+      (0 << ADC_TR2_LT2_Pos) |
+      (Limit(high >> 4, 0, 255) << ADC_TR2_HT2_Pos);
+
+  adc->ISR = ADC_ISR_AWD1 | ADC_ISR_AWD2;
+  adc->IER =
+      (adc->IER & ~(ADC_IER_AWD1IE | ADC_IER_AWD2IE)) |
+      (enable_low ? ADC_IER_AWD1IE : 0) |
+      (enable_high ? ADC_IER_AWD2IE : 0);
+}
+
+void DisableAnalogWatchdog(ADC_TypeDef* adc) {
+  adc->IER &= ~(ADC_IER_AWD1IE | ADC_IER_AWD2IE);
+  adc->CFGR &= ~ADC_CFGR_AWD1EN;
+  adc->AWD2CR = 0;
+  adc->ISR = ADC_ISR_AWD1 | ADC_ISR_AWD2;
+}
+
 struct CanConfig {
   uint32_t prefix = 0;
 
@@ -486,86 +806,45 @@ struct CanConfig {
   }
 };
 
-const int kShutdownTimeoutMs = 5000;
-const int kMinOffTimeMs = 500;
-
+template <typename Hw>
 class PowerDist : public mjlib::multiplex::MicroServer::Server {
  public:
-  struct Config {
-    float current_sense_ohm = 0.0005f;
-    bool disable_sleep = false;
+  // Each analog channel is converted with a nominal scale derived
+  // from the hardware, which is then corrected by these.
+  struct CalibrationConfig {
+    fw::Calibration input_voltage;
+    fw::Calibration output_voltage;
+    fw::Calibration output_current;
+    fw::Calibration fet_temp;
+    fw::Calibration output_current_low;
 
     template <typename Archive>
     void Serialize(Archive* a) {
-      a->Visit(MJ_NVP(current_sense_ohm));
-      a->Visit(MJ_NVP(disable_sleep));
+      a->Visit(MJ_NVP(input_voltage));
+      a->Visit(MJ_NVP(output_voltage));
+      a->Visit(MJ_NVP(output_current));
+      a->Visit(MJ_NVP(fet_temp));
+      a->Visit(MJ_NVP(output_current_low));
     }
   };
 
-  struct Status {
-    State state = kPowerOff;
-    int8_t fault_code = 0;
-    int8_t tps2490_fault = 0;
-    int8_t switch_status = 0;
-    int16_t lock_time_100ms = 0;
-
-    float input_voltage_V = 0.0f;
-    float output_voltage_V = 0.0f;
-    float output_current_A = 0.0f;
-    float fet_temp_C = 0.0f;
-    int32_t energy_uW_hr = 0;
-
-    int16_t int_temp_raw = 0;
-    float int_temp_C = 0.0f;
-
-
-    int32_t precharge_timeout_ms = 0;
-    int32_t shutdown_timeout_ms = 0;
-
-    int32_t off_time_ms = 0;
-
-    uint16_t isamp_offset = 0;
-    uint16_t isamp_average = 0;
-
-    int8_t force_output = 0;
-
-    template <typename Archive>
-    void Serialize(Archive* a) {
-      a->Visit(MJ_NVP(state));
-      a->Visit(MJ_NVP(fault_code));
-      a->Visit(MJ_NVP(tps2490_fault));
-      a->Visit(MJ_NVP(switch_status));
-      a->Visit(MJ_NVP(lock_time_100ms));
-
-      a->Visit(MJ_NVP(input_voltage_V));
-      a->Visit(MJ_NVP(output_voltage_V));
-      a->Visit(MJ_NVP(output_current_A));
-      a->Visit(MJ_NVP(fet_temp_C));
-      a->Visit(MJ_NVP(energy_uW_hr));
-
-      a->Visit(MJ_NVP(int_temp_raw));
-      a->Visit(MJ_NVP(int_temp_C));
-
-      a->Visit(MJ_NVP(precharge_timeout_ms));
-      a->Visit(MJ_NVP(shutdown_timeout_ms));
-
-      a->Visit(MJ_NVP(off_time_ms));
-
-      a->Visit(MJ_NVP(isamp_offset));
-      a->Visit(MJ_NVP(isamp_average));
-
-      a->Visit(MJ_NVP(force_output));
-    }
+  enum CalibrationChannel {
+    kCalInputVoltage,
+    kCalOutputVoltage,
+    kCalOutputCurrent,
+    kCalFetTemp,
+    kCalOutputCurrentLow,
+    kNumCalibrationChannels,
   };
 
   PowerDist() :
-      gpio1_(GPIO1, 1),
-      gpio2_(GPIO2, 0),
-      can_shdn_(CAN_SHDN, 0),
+      gpio1_(Hw::kGpio1, 1),
+      gpio2_(Hw::kGpio2, 0),
+      can_shdn_(Hw::kCanShdn, 0),
       can_([&]() {
              fw::FDCan::Options options;
-             options.td = CAN_TX;
-             options.rd = CAN_RX;
+             options.td = Hw::kCanTx;
+             options.rd = Hw::kCanRx;
              options.slow_bitrate = 1000000;
              options.fast_bitrate = 5000000;
 
@@ -583,6 +862,7 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
       fdcan_micro_server_(&can_),
       multiplex_protocol_(&pool_, &fdcan_micro_server_, {}) {
     multiplex_protocol_.config()->id = 32;
+    control_.mutable_config()->current_sense_ohm = Hw::kCurrentSenseOhm;
   }
 
   void MaybeUpdateFilters() {
@@ -636,12 +916,23 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
 
   void StartFrame() override {
     discard_all_ = false;
+    frame_uptime_us_ = timer_.read_us64();
+    sync_written_ = 0;
   }
 
   Action CompleteFrame() override {
     if (discard_all_) {
       return kDiscard;
     }
+    if (sync_written_ == (kSyncLowWritten | kSyncHighWritten)) {
+      // The host time was sent at the start of the frame, which is
+      // when the hardware timestamp was taken.
+      const uint64_t rx_us =
+          timer_.read_us64() - fdcan_micro_server_.last_rx_age_us();
+      const int64_t host_us = static_cast<int64_t>(
+          (static_cast<uint64_t>(sync_host_high_) << 32) | sync_host_low_);
+      time_sync_.Update(rx_us, host_us);
+    }
     return kAccept;
   }
 
@@ -649,22 +940,97 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
                     const Value& value) override __attribute__((optimize("O3"))) {
     if (discard_all_) { return kDiscardRemaining; }
 
+    if (HistoryWindowIndex(reg) >= 0) { return kNotWriteable; }
+
     switch (static_cast<Register>(reg)) {
       case Register::kState: {
         // TODO: For now, mark as not writeable.
         return kNotWriteable;
       }
       case Register::kLockTime: {
-        status_.lock_time_100ms = ReadInt16Mapping(value);
+        control_.set_lock_time(ReadInt16Mapping(value));
+        return kSuccess;
+      }
+      case Register::kSpectrumState: {
+        // Any non-zero value requests a new capture.
+        if (ReadInt16Mapping(value) != 0) {
+          spectrum_requested_ = true;
+        }
+        return kSuccess;
+      }
+      case Register::kEventSubscribe: {
+        events_.Subscribe(static_cast<uint8_t>(ReadInt16Mapping(value)));
+        return kSuccess;
+      }
+      case Register::kHostTimeLow: {
+        sync_host_low_ = static_cast<uint32_t>(ReadInt32Mapping(value));
+        sync_written_ |= kSyncLowWritten;
+        return kSuccess;
+      }
+      case Register::kHostTimeHigh: {
+        sync_host_high_ = static_cast<uint32_t>(ReadInt32Mapping(value));
+        sync_written_ |= kSyncHighWritten;
+        return kSuccess;
+      }
+      case Register::kHistoryResolution: {
+        history_resolution_ = (ReadInt16Mapping(value) == 0) ?
+            fw::PowerHistory::kSeconds : fw::PowerHistory::kMinutes;
+        return kSuccess;
+      }
+      case Register::kHistoryAge: {
+        history_age_ = std::max<int>(0, ReadInt16Mapping(value));
         return kSuccess;
       }
       case Register::kFaultCode:
       case Register::kSwitchStatus:
       case Register::kBootTime:
+      case Register::kWarning:
+      case Register::kUptimeLow:
+      case Register::kUptimeHigh:
+      case Register::kTimeSyncState:
+      case Register::kTimeSkew:
+      case Register::kTimeSyncError:
       case Register::kOutputVoltage:
       case Register::kOutputCurrent:
       case Register::kTemperature:
       case Register::kEnergy:
+      case Register::kEnergyDelivered:
+      case Register::kEnergyRegenerated:
+      case Register::kChargeOut:
+      case Register::kChargeIn:
+      case Register::kPower:
+      case Register::kAveragePower:
+      case Register::kFilteredInputVoltage:
+      case Register::kFilteredOutputVoltage:
+      case Register::kFilteredOutputCurrent:
+      case Register::kStateOfCharge:
+      case Register::kRemainingEnergy:
+      case Register::kRuntime:
+      case Register::kBatteryResistance:
+      case Register::kEventSequence:
+      case Register::kEventCause:
+      case Register::kSpectrumSampleRate:
+      case Register::kCurrentRipple:
+      case Register::kVoltageRipple:
+      case Register::kCurrentPeakFrequency1:
+      case Register::kCurrentPeakAmplitude1:
+      case Register::kCurrentPeakFrequency2:
+      case Register::kCurrentPeakAmplitude2:
+      case Register::kCurrentPeakFrequency3:
+      case Register::kCurrentPeakAmplitude3:
+      case Register::kCurrentPeakFrequency4:
+      case Register::kCurrentPeakAmplitude4:
+      case Register::kVoltagePeakFrequency1:
+      case Register::kVoltagePeakAmplitude1:
+      case Register::kVoltagePeakFrequency2:
+      case Register::kVoltagePeakAmplitude2:
+      case Register::kVoltagePeakFrequency3:
+      case Register::kVoltagePeakAmplitude3:
+      case Register::kVoltagePeakFrequency4:
+      case Register::kVoltagePeakAmplitude4:
+      case Register::kHistoryCount:
+      case Register::kHistoryTotal:
+      case Register::kHistoryWindow:
       case Register::kUuid1:
       case Register::kUuid2:
       case Register::kUuid3:
@@ -705,6 +1071,11 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
       return static_cast<uint32_t>(1);
     }
 
+    const int history_index = HistoryWindowIndex(reg);
+    if (history_index >= 0) {
+      return ReadHistory(history_index, type);
+    }
+
     switch (static_cast<Register>(reg)) {
       case Register::kState: {
         return IntMapping(static_cast<int8_t>(status_.state), type);
@@ -719,7 +1090,42 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
         return IntMapping(static_cast<int16_t>(status_.lock_time_100ms), type);
       }
       case Register::kBootTime: {
-        return IntMapping(static_cast<int16_t>(0), type);
+        const uint64_t uptime_ms = frame_uptime_us_ / 1000;
+        if (type == 2) {
+          // A float can not hold every millisecond past a few hours.
+          return Value(static_cast<int32_t>(std::min<uint64_t>(
+              uptime_ms, std::numeric_limits<int32_t>::max())));
+        }
+        return ScaleDuration(static_cast<float>(uptime_ms) * 0.001f, type);
+      }
+      case Register::kWarning: {
+        return IntMapping(static_cast<int16_t>(status_.warning), type);
+      }
+      case Register::kUptimeLow:
+      case Register::kUptimeHigh: {
+        if (type != 2) { break; }
+        const int shift =
+            (static_cast<Register>(reg) == Register::kUptimeHigh) ? 32 : 0;
+        return Value(static_cast<int32_t>(frame_uptime_us_ >> shift));
+      }
+      case Register::kHostTimeLow:
+      case Register::kHostTimeHigh: {
+        if (type != 2) { break; }
+        const int shift =
+            (static_cast<Register>(reg) == Register::kHostTimeHigh) ? 32 : 0;
+        const auto host_us = static_cast<uint64_t>(
+            time_sync_.HostTime(frame_uptime_us_));
+        return Value(static_cast<int32_t>(host_us >> shift));
+      }
+      case Register::kTimeSyncState: {
+        return IntMapping(
+            static_cast<int8_t>(time_sync_.status().synchronized), type);
+      }
+      case Register::kTimeSkew: {
+        return ScaleSkew(time_sync_.status().skew_ppm, type);
+      }
+      case Register::kTimeSyncError: {
+        return SaturateIntMapping(time_sync_.status().last_error_us, type);
       }
       case Register::kOutputVoltage: {
         return ScaleVoltage(status_.output_voltage_V, type);
@@ -731,14 +1137,119 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
         return ScaleTemperature(status_.fet_temp_C, type);
       }
       case Register::kEnergy: {
-        const auto e = status_.energy_uW_hr;
-        switch (type) {
-          case 0: return Value(static_cast<int8_t>(e / 1000000));
-          case 1: return Value(static_cast<int16_t>(e / 10000));
-          case 2: return Value(static_cast<int32_t>(e));
-          case 3: return Value(static_cast<float>(e) / 1000000.0f);
-        }
-        MJ_ASSERT(false);
+        return AccumulatorMapping(status_.energy_uW_hr, type);
+      }
+      case Register::kEnergyDelivered: {
+        return AccumulatorMapping(status_.energy_delivered_uW_hr, type);
+      }
+      case Register::kEnergyRegenerated: {
+        return AccumulatorMapping(status_.energy_regenerated_uW_hr, type);
+      }
+      case Register::kChargeOut: {
+        return AccumulatorMapping(status_.charge_out_uA_hr, type);
+      }
+      case Register::kChargeIn: {
+        return AccumulatorMapping(status_.charge_in_uA_hr, type);
+      }
+      case Register::kPower: {
+        return ScalePower(status_.power_W, type);
+      }
+      case Register::kAveragePower: {
+        return ScalePower(status_.average_power_W, type);
+      }
+      case Register::kFilteredInputVoltage: {
+        return ScaleVoltage(status_.filtered_input_voltage_V, type);
+      }
+      case Register::kFilteredOutputVoltage: {
+        return ScaleVoltage(status_.filtered_output_voltage_V, type);
+      }
+      case Register::kFilteredOutputCurrent: {
+        return ScaleCurrent(status_.filtered_output_current_A, type);
+      }
+      case Register::kStateOfCharge: {
+        return ScalePercent(battery_status_.soc_percent, type);
+      }
+      case Register::kRemainingEnergy: {
+        return ScaleEnergy(battery_status_.remaining_Wh, type);
+      }
+      case Register::kRuntime: {
+        return ScaleDuration(battery_status_.runtime_s, type);
+      }
+      case Register::kBatteryResistance: {
+        return ScaleResistance(battery_status_.resistance_ohm, type);
+      }
+      case Register::kEventSubscribe: {
+        return IntMapping(
+            static_cast<int8_t>(events_.status().subscriptions), type);
+      }
+      case Register::kEventSequence: {
+        return IntMapping(
+            static_cast<int32_t>(events_.status().sequence), type);
+      }
+      case Register::kEventCause: {
+        return IntMapping(
+            static_cast<int8_t>(events_.status().last_causes), type);
+      }
+      case Register::kSpectrumState: {
+        return IntMapping(static_cast<int8_t>(spectrum_.status().state), type);
+      }
+      case Register::kSpectrumSampleRate: {
+        return ScaleFrequency(spectrum_.status().sample_rate_Hz, type);
+      }
+      case Register::kCurrentRipple: {
+        return ScaleCurrent(spectrum_.status().current.ripple_rms, type);
+      }
+      case Register::kVoltageRipple: {
+        return ScaleVoltage(spectrum_.status().voltage.ripple_rms, type);
+      }
+      case Register::kCurrentPeakFrequency1:
+      case Register::kCurrentPeakAmplitude1:
+      case Register::kCurrentPeakFrequency2:
+      case Register::kCurrentPeakAmplitude2:
+      case Register::kCurrentPeakFrequency3:
+      case Register::kCurrentPeakAmplitude3:
+      case Register::kCurrentPeakFrequency4:
+      case Register::kCurrentPeakAmplitude4: {
+        const auto index =
+            static_cast<int>(reg) -
+            static_cast<int>(Register::kCurrentPeakFrequency1);
+        const auto& peak = spectrum_.status().current.peaks[index / 2];
+        return (index % 2) == 0 ?
+            ScaleFrequency(peak.frequency_Hz, type) :
+            ScaleCurrent(peak.amplitude, type);
+      }
+      case Register::kVoltagePeakFrequency1:
+      case Register::kVoltagePeakAmplitude1:
+      case Register::kVoltagePeakFrequency2:
+      case Register::kVoltagePeakAmplitude2:
+      case Register::kVoltagePeakFrequency3:
+      case Register::kVoltagePeakAmplitude3:
+      case Register::kVoltagePeakFrequency4:
+      case Register::kVoltagePeakAmplitude4: {
+        const auto index =
+            static_cast<int>(reg) -
+            static_cast<int>(Register::kVoltagePeakFrequency1);
+        const auto& peak = spectrum_.status().voltage.peaks[index / 2];
+        return (index % 2) == 0 ?
+            ScaleFrequency(peak.frequency_Hz, type) :
+            ScaleVoltage(peak.amplitude, type);
+      }
+      case Register::kHistoryResolution: {
+        return IntMapping(static_cast<int8_t>(history_resolution_), type);
+      }
+      case Register::kHistoryAge: {
+        return IntMapping(static_cast<int16_t>(history_age_), type);
+      }
+      case Register::kHistoryCount: {
+        return IntMapping(
+            static_cast<int16_t>(history_.count(history_resolution_)), type);
+      }
+      case Register::kHistoryTotal: {
+        return IntMapping(
+            static_cast<int32_t>(history_.total(history_resolution_)), type);
+      }
+      case Register::kHistoryWindow: {
+        // Handled above.
         break;
       }
       case Register::kUuid1:
@@ -771,6 +1282,49 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
 
   /// Non-overriden methods
 
+  static int HistoryWindowIndex(multiplex::MicroServer::Register reg) {
+    const int index = static_cast<int>(reg) -
+        static_cast<int>(Register::kHistoryWindow);
+    return (index >= 0 && index < kHistoryWindowRegisters) ? index : -1;
+  }
+
+  // Each bucket of the window is its current mean, minimum and
+  // maximum, voltage mean, minimum and maximum, energy, and its
+  // number since power on.  Buckets which do not exist read as NaN.
+  multiplex::MicroServer::ReadResult ReadHistory(
+      int index, size_t type) const {
+    const int age = history_age_ + index / kHistoryBucketRegisters;
+    fw::PowerHistory::Bucket bucket;
+    const bool valid = history_.Get(history_resolution_, age, &bucket);
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    const auto field = [&](float value) { return valid ? value : nan; };
+
+    switch (index % kHistoryBucketRegisters) {
+      case 0: return ScaleCurrent(field(bucket.current_mean_A), type);
+      case 1: return ScaleCurrent(field(bucket.current_min_A), type);
+      case 2: return ScaleCurrent(field(bucket.current_max_A), type);
+      case 3: return ScaleVoltage(field(bucket.voltage_mean_V), type);
+      case 4: return ScaleVoltage(field(bucket.voltage_min_V), type);
+      case 5: return ScaleVoltage(field(bucket.voltage_max_V), type);
+      case 6: {
+        // The accumulator mapping has no NaN of its own, so use the
+        // reserved minimum value of a scaled mapping.
+        return valid ?
+            AccumulatorMapping(bucket.energy_uW_hr, type) :
+            ScaleEnergy(nan, type);
+      }
+      case 7: {
+        return IntMapping(
+            valid ?
+            static_cast<int32_t>(
+                history_.total(history_resolution_) - 1 -
+                static_cast<uint32_t>(age)) :
+            -1, type);
+      }
+    }
+    return static_cast<uint32_t>(1);
+  }
+
   void SetupAnalogGpio() {
     GPIO_InitTypeDef init = {};
     init.Mode = GPIO_MODE_ANALOG;
@@ -809,6 +1363,10 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
     //  VSAMP_IN -> PB14 -> OPAMP2_VINP -> ADC2/IN16
     //  FET_TEMP -> PC5 -> ADC2/IN5
     //  ISAMP -> PB0 -> OPAMP3 -> PB1 -> ADC3/IN1 -> PB15 -> OPAMP5 -> PA8 -> ADC5/IN1
+    //
+    //  ADC3 sees the buffered current sense, which covers the full
+    //  current range.  ADC5 sees it amplified, which resolves small
+    //  currents but saturates below the peak rating.
     //  DAC1 -> PA4 -> ISAMP_BIAS -> PA1 -> ADC12_IN2
     //  DAC3 -> internal
     //  DAC4 -> internal -> OPAMP5/VINP
@@ -818,12 +1376,109 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
     ConfigureDAC3(&timer_);
     ConfigureDAC4(&timer_);
 
+    ConfigureTIM6();
+
     ConfigureADC(ADC1, 13, &timer_);
     ConfigureADC(ADC2, 16, &timer_);
     ConfigureADC(ADC3, 1, &timer_);
     ConfigureADC(ADC5, 1, &timer_);
 
     ADC345_COMMON->CCR |= ADC_CCR_VSENSESEL;
+
+    adc12_callback_ = micro::CallbackTable::MakeFunction(
+        [this]() {
+          this->HandleAdc12Interrupt();
+        });
+    adc3_callback_ = micro::CallbackTable::MakeFunction(
+        [this]() {
+          this->HandleAdc3Interrupt();
+        });
+
+    NVIC_SetVector(ADC1_2_IRQn,
+                   reinterpret_cast<uint32_t>(adc12_callback_.raw_function));
+    NVIC_SetVector(ADC3_IRQn,
+                   reinterpret_cast<uint32_t>(adc3_callback_.raw_function));
+    HAL_NVIC_EnableIRQ(ADC1_2_IRQn);
+    HAL_NVIC_EnableIRQ(ADC3_IRQn);
+  }
+
+  // Thresholds beyond the converter's range are limited to its ends,
+  // which leaves that side of the watchdog disarmed.
+  static int ThresholdCounts(float counts) {
+    return static_cast<int>(Limit(counts, 0.0f, 4095.0f));
+  }
+
+  int VoltageToCounts(CalibrationChannel channel, float voltage) const {
+    return ThresholdCounts(compiled_cal_[channel].Inverse(voltage));
+  }
+
+  // The current watchdog uses the buffered path, as the amplified
+  // one saturates below any reasonable over-current limit.
+  int CurrentToCounts(float current) const {
+    return ThresholdCounts(
+        static_cast<float>(status_.isamp_low_offset) +
+        compiled_cal_[kCalOutputCurrentLow].Inverse(current));
+  }
+
+  void ConfigureWatchdogs() {
+    watchdog_state_ = status_.state;
+
+    const bool precharging = status_.state == fw::kPrecharging;
+    const bool power_on = status_.state == fw::kPowerOn;
+
+    if (!precharging && !power_on) {
+      DisableAnalogWatchdog(ADC1);
+      DisableAnalogWatchdog(ADC2);
+      DisableAnalogWatchdog(ADC3);
+      return;
+    }
+
+    // The output voltage is expected to be low while precharging, so
+    // only the over-voltage side is armed then.
+    ConfigureAnalogWatchdog(
+        ADC1, 13,
+        power_on ?
+        VoltageToCounts(kCalOutputVoltage, config_.output_undervoltage_V) : 0,
+        VoltageToCounts(kCalOutputVoltage, config_.output_overvoltage_V));
+    ConfigureAnalogWatchdog(
+        ADC2, 16,
+        VoltageToCounts(kCalInputVoltage, config_.input_undervoltage_V),
+        VoltageToCounts(kCalInputVoltage, config_.input_overvoltage_V));
+    ConfigureAnalogWatchdog(
+        ADC3, 1,
+        CurrentToCounts(-config_.regen_overcurrent_A),
+        CurrentToCounts(config_.overcurrent_A));
+  }
+
+  void HandleAdc12Interrupt() {
+    const uint32_t adc1_isr = ADC1->ISR & (ADC_ISR_AWD1 | ADC_ISR_AWD2);
+    const uint32_t adc2_isr = ADC2->ISR & (ADC_ISR_AWD1 | ADC_ISR_AWD2);
+    ADC1->ISR = adc1_isr;
+    ADC2->ISR = adc2_isr;
+
+    if (adc1_isr & ADC_ISR_AWD1) {
+      control_.AsyncFault(fw::kFaultOutputUnderVoltage);
+    } else if (adc1_isr & ADC_ISR_AWD2) {
+      control_.AsyncFault(fw::kFaultOutputOverVoltage);
+    }
+    if (adc2_isr & ADC_ISR_AWD1) {
+      control_.AsyncFault(fw::kFaultInputUnderVoltage);
+    } else if (adc2_isr & ADC_ISR_AWD2) {
+      control_.AsyncFault(fw::kFaultInputOverVoltage);
+    }
+  }
+
+  void HandleAdc3Interrupt() {
+    const uint32_t adc3_isr = ADC3->ISR & (ADC_ISR_AWD1 | ADC_ISR_AWD2);
+    ADC3->ISR = adc3_isr;
+
+    // The buffered current sense is not inverted, so positive
+    // current results in higher counts.
+    if (adc3_isr & ADC_ISR_AWD1) {
+      control_.AsyncFault(fw::kFaultRegenOverCurrent);
+    } else if (adc3_isr & ADC_ISR_AWD2) {
+      control_.AsyncFault(fw::kFaultOverCurrent);
+    }
   }
 
   void Setup() {
@@ -833,11 +1488,66 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
 
     persistent_config_.Register("id", multiplex_protocol_.config(), [this]() { MaybeUpdateFilters(); });
     persistent_config_.Register("can", &can_config_, [this]() { MaybeUpdateFilters(); });
-    persistent_config_.Register("power", &config_, [](){});
+    persistent_config_.Register(
+        "power", control_.mutable_config(),
+        [this]() { CompileCalibration(); });
+    persistent_config_.Register(
+        "cal", &cal_config_, [this]() { CompileCalibration(); });
+    persistent_config_.Register(
+        "current_range", &current_range_config_,
+        [this]() { CompileCalibration(); });
+    persistent_config_.Register(
+        "adc", &adc_config_, [this]() { UpdateAdcExpected(); });
+    persistent_config_.Register(
+        "filter", &filter_config_, [this]() { ConfigureFilter(); });
+    persistent_config_.Register("spectrum", &spectrum_config_, [](){});
+    persistent_config_.Register("stream", &stream_config_, [](){});
+    persistent_config_.Register("event", &event_config_, [](){});
+    persistent_config_.Register("time_sync", &time_sync_config_, [](){});
+    persistent_config_.Register(
+        "power_decimated", &decimator_config_, [](){});
+    persistent_config_.Register(
+        "i2t", control_.mutable_i2t_config(),
+        [this]() { control_.Configure(); });
+    persistent_config_.Register(
+        "precharge", control_.mutable_precharge_config(), [](){});
+    persistent_config_.Register(
+        "fet_thermal", control_.mutable_fet_thermal_config(),
+        [this]() { control_.Configure(); });
     telemetry_manager_.Register("git", &git_info_);
-    telemetry_manager_.Register("power", &status_);
+    telemetry_manager_.Register("power", control_.mutable_status());
+    decimated_update_ = telemetry_manager_.Register(
+        "power_decimated", decimator_.mutable_status());
+    battery_update_ =
+        telemetry_manager_.Register(
+            "battery", control_.mutable_battery_status());
+    adc_update_ = telemetry_manager_.Register("adc", &adc_status_);
+    spectrum_update_ = telemetry_manager_.Register(
+        "spectrum", spectrum_.mutable_status());
+    telemetry_manager_.Register("stream", sample_stream_.mutable_status());
+    telemetry_manager_.Register("event", events_.mutable_status());
+    telemetry_manager_.Register("time_sync", time_sync_.mutable_status());
+    persistent_config_.Register(
+        "battery", control_.mutable_battery_config(),
+        [this]() { control_.Configure(); });
+    if constexpr (Hw::kHasLm5066) {
+      fw::Lm5066::Options options;
+      options.sda = Hw::kLm5066Sda;
+      options.scl = Hw::kLm5066Scl;
+      options.smba = Hw::kLm5066Smba;
+      lm5066_.emplace(&pool_, &command_manager_, &persistent_config_,
+                      &telemetry_manager_, &timer_, options);
+      lm5066_->set_alert_callback([this](fw::Lm5066::Fault fault) {
+          control_.HandleLm5066Alert(fault);
+        });
+    }
     persistent_config_.Load();
 
+    control_.Configure();
+    CompileCalibration();
+    UpdateAdcExpected();
+    ConfigureFilter();
+
     SetupAnalogGpio();
     SetupAnalog();
   }
@@ -853,19 +1563,19 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
         return;
       }
 
-      status_.lock_time_100ms =
-          std::strtol(time_100ms.data(), nullptr, 10);
+      control_.set_lock_time(
+          std::strtol(time_100ms.data(), nullptr, 10));
 
       WriteOk(response);
       return;
     } else if (cmd_text == "force") {
       const auto force_str = tokenizer.next();
       if (force_str == "off") {
-        status_.force_output = 1;
+        control_.set_force_output(1);
       } else if (force_str == "on") {
-        status_.force_output = 2;
+        control_.set_force_output(2);
       } else if (force_str == "disable") {
-        status_.force_output = 0;
+        control_.set_force_output(0);
       } else {
         WriteMessage(response, "ERR invalid force\r\n");
         return;
@@ -873,11 +1583,179 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
 
       WriteOk(response);
       return;
+    } else if (cmd_text == "cal") {
+      HandleCalibrationCommand(&tokenizer, response);
+      return;
+    } else if (cmd_text == "spectrum") {
+      if (spectrum_.busy() || spectrum_requested_) {
+        WriteMessage(response, "ERR busy\r\n");
+        return;
+      }
+      spectrum_requested_ = true;
+      WriteOk(response);
+      return;
+    } else if (cmd_text == "history") {
+      HandleHistoryCommand(&tokenizer, response);
+      return;
+    } else if (cmd_text == "stream") {
+      const auto action = tokenizer.next();
+      if (action == "start") {
+        sample_stream_.Start();
+      } else if (action == "stop") {
+        sample_stream_.Stop();
+      } else {
+        WriteMessage(response, "ERR invalid stream\r\n");
+        return;
+      }
+
+      WriteOk(response);
+      return;
+    } else if (cmd_text == "selftest") {
+      HandleSelfTestCommand(response);
+      return;
     }
 
     WriteMessage(response, "ERR unknown command\r\n");
   }
 
+  void HandleCalibrationCommand(
+      base::Tokenizer* tokenizer,
+      const micro::CommandManager::Response& response) {
+    const auto channel_str = tokenizer->next();
+    const int channel =
+        (channel_str == "vin") ? kCalInputVoltage :
+        (channel_str == "vout") ? kCalOutputVoltage :
+        (channel_str == "current") ? kCalOutputCurrent :
+        (channel_str == "current_low") ? kCalOutputCurrentLow :
+        (channel_str == "fet_temp") ? kCalFetTemp :
+        -1;
+    if (channel < 0) {
+      WriteMessage(response, "ERR invalid channel\r\n");
+      return;
+    }
+
+    auto& fitter = cal_fitter_[channel];
+    const auto action = tokenizer->next();
+    if (action == "point") {
+      const auto reference_str = tokenizer->next();
+      if (reference_str.empty()) {
+        WriteMessage(response, "ERR invalid reference\r\n");
+        return;
+      }
+      const float reference = std::strtof(reference_str.data(), nullptr);
+      const auto nominal = NominalConversion(channel);
+      if (!fitter.AddPoint(
+              cal_raw_average_[channel] * nominal.scale + nominal.offset,
+              reference)) {
+        WriteMessage(response, "ERR too many points\r\n");
+        return;
+      }
+    } else if (action == "fit") {
+      if (!fitter.Fit(calibration(channel))) {
+        WriteMessage(response, "ERR could not fit\r\n");
+        return;
+      }
+      CompileCalibration();
+    } else if (action == "clear") {
+      fitter.Clear();
+    } else if (action == "reset") {
+      *calibration(channel) = fw::Calibration();
+      CompileCalibration();
+    } else {
+      WriteMessage(response, "ERR unknown cal\r\n");
+      return;
+    }
+
+    WriteOk(response);
+  }
+
+  // Replies with one line per bucket, newest first:
+  //
+  //  <number> <current mean> <min> <max> <voltage mean> <min> <max> <energy>
+  //
+  // The current is in A, the voltage in V, and the energy in uW*hr.
+  void HandleHistoryCommand(
+      base::Tokenizer* tokenizer,
+      const micro::CommandManager::Response& response) {
+    const auto resolution_str = tokenizer->next();
+    const auto resolution =
+        (resolution_str == "s") ? fw::PowerHistory::kSeconds :
+        (resolution_str == "m") ? fw::PowerHistory::kMinutes :
+        fw::PowerHistory::kNumResolutions;
+    if (resolution == fw::PowerHistory::kNumResolutions) {
+      WriteMessage(response, "ERR invalid resolution\r\n");
+      return;
+    }
+
+    const auto age_str = tokenizer->next();
+    const auto count_str = tokenizer->next();
+    const int age = age_str.empty() ?
+        0 : std::strtol(age_str.data(), nullptr, 10);
+    const int count = count_str.empty() ?
+        kHistoryCommandBuckets :
+        std::strtol(count_str.data(), nullptr, 10);
+    if (age < 0 || count <= 0 || count > kHistoryCommandBuckets) {
+      WriteMessage(response, "ERR invalid range\r\n");
+      return;
+    }
+
+    // Values are formatted as fixed point, since printf may lack
+    // floating point support.
+    const auto centi = [](float value) {
+      return static_cast<int>(std::round(value * 100.0f));
+    };
+    const auto format = [](char* out, size_t size, int value) {
+      const int magnitude = std::abs(value);
+      return std::snprintf(out, size, " %s%d.%02d",
+                           value < 0 ? "-" : "", magnitude / 100,
+                           magnitude % 100);
+    };
+
+    size_t pos = 0;
+    const size_t size = sizeof(history_output_);
+    for (int i = 0; i < count; i++) {
+      fw::PowerHistory::Bucket bucket;
+      if (!history_.Get(resolution, age + i, &bucket)) { break; }
+
+      pos += std::snprintf(
+          &history_output_[pos], size - pos, "%lu",
+          static_cast<unsigned long>(
+              history_.total(resolution) - 1 -
+              static_cast<uint32_t>(age + i)));
+      for (const float value : {
+              bucket.current_mean_A, bucket.current_min_A,
+              bucket.current_max_A, bucket.voltage_mean_V,
+              bucket.voltage_min_V, bucket.voltage_max_V }) {
+        pos += format(&history_output_[pos], size - pos, centi(value));
+      }
+      pos += std::snprintf(&history_output_[pos], size - pos, " %ld\r\n",
+                           static_cast<long>(bucket.energy_uW_hr));
+    }
+    pos += std::snprintf(&history_output_[pos], size - pos, "OK\r\n");
+
+    WriteMessage(response, std::string_view(history_output_, pos));
+  }
+
+  // Check the DSP instructions used by the sample reductions against
+  // the scalar reference, on the hardware which runs them.
+  void HandleSelfTestCommand(
+      const micro::CommandManager::Response& response) {
+    const auto result = fw::SampleBlock::SelfTest(timer_.read_us());
+    if (result.failures == 0) {
+      WriteOk(response);
+      return;
+    }
+
+    const int size = std::snprintf(
+        selftest_output_, sizeof(selftest_output_),
+        "ERR sample_block %d of %d failed, first %s length %lu\r\n",
+        result.failures, result.checks, result.failed_pattern,
+        static_cast<unsigned long>(result.failed_length));
+    WriteMessage(response, std::string_view(
+                     selftest_output_,
+                     std::min<size_t>(size, sizeof(selftest_output_) - 1)));
+  }
+
   void WriteOk(const micro::CommandManager::Response& response) {
     WriteMessage(response, "OK\r\n");
   }
@@ -898,11 +1776,7 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
     auto callback = mjlib::micro::CallbackTable::MakeFunction(
         [this]() {
           this->gpio2_.write(!this->gpio2_.read());
-          if (this->status_.state == kPrecharging ||
-              this->status_.state == kPowerOn) {
-            this->status_.fault_code = 3;
-            this->status_.state = kFault;
-          }
+          this->control_.AsyncFault(fw::kFaultTps2490Interrupt);
         });
 
     tps2490_flt_.fall(callback.raw_function);
@@ -915,12 +1789,33 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
   }
 
   void SingleLoop() {
-    status_.switch_status =
-        (power_switch_.read() == 0) ? 0 : 1;
-    status_.tps2490_fault = tps2490_flt_.read();
+    PowerDistControl::Inputs inputs;
+    inputs.now_us = timer_.read_us();
+    inputs.switch_status = (power_switch_.read() == 0) ? 0 : 1;
+    inputs.tps2490_fault = tps2490_flt_.read();
+    if (lm5066_) {
+      inputs.lm5066_fault = lm5066_->status().fault;
+    }
+    control_.SetInputs(inputs);
+    SelectAdcProfile();
+
+    if (control_.PrechargeSampleDue()) {
+      SamplePrecharge();
+    }
 
     SetOutputsFromState();
-    MaybeChangeState();
+    control_.MaybeChangeState();
+    if (status_.state != watchdog_state_) {
+      // The watchdogs and precharge sampling need ADC1 and ADC5 back.
+      if (spectrum_.status().state == fw::SpectrumAnalyzer::kCapturing) {
+        StopSpectrumCapture();
+        spectrum_.Abort();
+        spectrum_update_();
+      }
+      ConfigureWatchdogs();
+    }
+    PollEvents();
+    PollSpectrum();
     const auto new_time = timer_.read_ms();
     if (new_time != old_time_) {
       old_time_ = new_time;
@@ -933,27 +1828,31 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
       }
     }
 
+    PollSampleStream();
+
     fdcan_micro_server_.Poll();
     multiplex_protocol_.Poll();
   }
 
   void PollMillisecond() {
+    MaybeUpdateCurrentGain();
     telemetry_manager_.PollMillisecond();
-    UpdateMillisecondTimers();
-    if (status_.state == kPowerOff) {
-      status_.off_time_ms = std::min<int32_t>(
-          status_.off_time_ms + 1, kMinOffTimeMs);
-    } else {
-      status_.off_time_ms = 0;
-    }
-  }
-
-  void UpdateMillisecondTimers() {
-    if (status_.shutdown_timeout_ms) {
-      status_.shutdown_timeout_ms--;
+    if (lm5066_) {
+      lm5066_->PollMillisecond();
     }
-    if (status_.precharge_timeout_ms) {
-      status_.precharge_timeout_ms--;
+    control_.PollMillisecond();
+    history_.Add(status_.output_current_A, status_.output_voltage_V,
+                 status_.energy_uW_hr);
+
+    using D = fw::TelemetryDecimator;
+    D::Values values = {};
+    values[D::kInputVoltage] = status_.input_voltage_V;
+    values[D::kOutputVoltage] = status_.output_voltage_V;
+    values[D::kOutputCurrent] = status_.output_current_A;
+    values[D::kPower] = status_.power_W;
+    values[D::kFetTemp] = status_.fet_temp_C;
+    if (decimator_.Add(values)) {
+      decimated_update_();
     }
   }
 
@@ -963,204 +1862,551 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
       can_.RecoverBusOff();
     }
 
-    if (status_.lock_time_100ms > 0) {
-      status_.lock_time_100ms--;
+    control_.PollHundredMillisecond();
+    battery_update_();
+    adc_update_();
+
+    control_.CheckLm5066(lm5066_ ? &lm5066_->status() : nullptr);
+  }
+
+  struct NominalScale {
+    float scale = 1.0f;
+    float offset = 0.0f;
+    float min_counts = 0.0f;
+    float max_counts = 4096.0f;
+  };
+
+  // Return the uncalibrated conversion from ADC counts to engineering
+  // units for each channel.  The current channel is measured relative
+  // to the zero current offset.
+  NominalScale NominalConversion(int channel) const {
+    constexpr float kVolts_per_Count = 3.3f / 4096.0f;
+    switch (static_cast<CalibrationChannel>(channel)) {
+      case kCalInputVoltage:
+      case kCalOutputVoltage: {
+        return {kVolts_per_Count / Hw::kVsampDivide, 0.0f, 0.0f, 4096.0f};
+      }
+      case kCalOutputCurrent: {
+        // The amplified current sense is inverting, so positive
+        // current results in lower counts.
+        const float V_per_A =
+            config_.current_sense_ohm * 8 * applied_current_gain_;
+        return {-kVolts_per_Count / V_per_A, 0.0f, -4096.0f, 4096.0f};
+      }
+      case kCalOutputCurrentLow: {
+        const float V_per_A = config_.current_sense_ohm * 8;
+        return {kVolts_per_Count / V_per_A, 0.0f, -4096.0f, 4096.0f};
+      }
+      case kCalFetTemp: {
+        return {kVolts_per_Count / -0.01169f, 1.8663f / 0.01169f,
+                0.0f, 4096.0f};
+      }
+      case kNumCalibrationChannels: {
+        break;
+      }
     }
+    return {};
   }
 
-  void MeasureEnergy() {
-    ADC2->SQR1 =
-        (0 << ADC_SQR1_L_Pos) | // length 1
-        (16 << ADC_SQR1_SQ1_Pos);
+  fw::Calibration* calibration(int channel) {
+    switch (static_cast<CalibrationChannel>(channel)) {
+      case kCalInputVoltage: { return &cal_config_.input_voltage; }
+      case kCalOutputVoltage: { return &cal_config_.output_voltage; }
+      case kCalOutputCurrent: { return &cal_config_.output_current; }
+      case kCalFetTemp: { return &cal_config_.fet_temp; }
+      case kCalOutputCurrentLow: { return &cal_config_.output_current_low; }
+      case kNumCalibrationChannels: { break; }
+    }
+    MJ_ASSERT(false);
+    return nullptr;
+  }
+
+  void CompileCalibration() {
+    for (int i = 0; i < kNumCalibrationChannels; i++) {
+      const auto nominal = NominalConversion(i);
+      compiled_cal_[i].Compile(
+          *calibration(i), nominal.scale, nominal.offset,
+          nominal.min_counts, nominal.max_counts);
+    }
+
+    // The amplified path saturates when it is driven from the
+    // nominal midpoint to within the margin of a rail.
+    current_range_.Configure(std::abs(compiled_cal_[kCalOutputCurrent](
+        2048.0f - current_range_config_.saturation_margin)));
+
+    // The watchdog thresholds depend upon the conversion.
+    watchdog_state_ = fw::kNumStates;
+  }
+
+  float ConvertInputVoltage(uint16_t raw) const {
+    return compiled_cal_[kCalInputVoltage](raw);
+  }
+
+  float ConvertOutputVoltage(uint16_t raw) const {
+    return compiled_cal_[kCalOutputVoltage](raw);
+  }
+
+  // The counts may be fractional, as they are for filtered values.
+  fw::CurrentRangeSelector::Result ConvertCurrent(
+      float high_counts, float low_counts) const {
+    const float high_A = compiled_cal_[kCalOutputCurrent](
+        high_counts - status_.isamp_offset);
+    const float low_A = compiled_cal_[kCalOutputCurrentLow](
+        low_counts - status_.isamp_low_offset);
+    return current_range_.Update(
+        static_cast<uint16_t>(high_counts + 0.5f), high_A, low_A);
+  }
+
+  // A change to the amplifier gain is only applied while the output
+  // is off, so that the zero current offset is measured again before
+  // it is next used.
+  void MaybeUpdateCurrentGain() {
+    const int desired = current_range_config_.high_gain;
+    if (desired == applied_current_gain_ ||
+        status_.state != fw::kPowerOff ||
+        !fw::CurrentRangeSelector::ValidGain(desired)) {
+      return;
+    }
+
+    opamp5_.SetGain(desired);
+    applied_current_gain_ = desired;
+    CompileCalibration();
+  }
+
+  float ConvertFetTemp(uint16_t raw) const {
+    return compiled_cal_[kCalFetTemp](raw);
+  }
+
+  void UpdateCalibrationAverage(int channel, float raw) {
+    cal_raw_average_[channel] +=
+        kCalibrationAverageAlpha * (raw - cal_raw_average_[channel]);
+  }
+
+  void SamplePrecharge() {
+    // Only the output voltage and current are needed to track the
+    // charge curve, so sample just those two at a high rate.
     ADC5->SQR1 =
         (0 << ADC_SQR1_L_Pos) | // length 1
         (1 << ADC_SQR1_SQ1_Pos);
 
-    // Sample the ADCs.
+    ApplyAcquisition(ADC1, 13, adc_profile_->voltage);
+    ApplyAcquisition(ADC3, 1, adc_profile_->current);
+    ApplyAcquisition(ADC5, 1, adc_profile_->current);
+
     ADC1->CR |= ADC_CR_ADSTART;
-    ADC2->CR |= ADC_CR_ADSTART;
     ADC3->CR |= ADC_CR_ADSTART;
     ADC5->CR |= ADC_CR_ADSTART;
+    TriggerAdcs();
 
     while (((ADC1->ISR & ADC_ISR_EOC) == 0) ||
-           ((ADC2->ISR & ADC_ISR_EOC) == 0) ||
            ((ADC3->ISR & ADC_ISR_EOC) == 0) ||
            ((ADC5->ISR & ADC_ISR_EOC) == 0));
 
     const uint16_t vsamp_out_raw = ADC1->DR;
-    const uint16_t vsamp_in_raw = ADC2->DR;
-    const uint16_t isamp_in_raw = ADC3->DR;
-    (void) isamp_in_raw;
+    const uint16_t isamp_low_raw = ADC3->DR;
     const uint16_t isamp_in = ADC5->DR;
+    StopAdc(ADC1);
+    StopAdc(ADC3);
+    StopAdc(ADC5);
+
+    control_.SamplePrecharge(
+        timer_.read_us(), ConvertOutputVoltage(vsamp_out_raw),
+        ConvertCurrent(isamp_in, isamp_low_raw).current_A);
+  }
 
-    const float vsamp_out =
-        static_cast<float>(vsamp_out_raw) / 4096.0f * 3.3f / vsamp_divide_;
-    const float vsamp_in =
-        static_cast<float>(vsamp_in_raw) / 4096.0f * 3.3f / vsamp_divide_;
-    const float V_per_A = config_.current_sense_ohm * 8 * 7;
-    const float isamp =
-        -((static_cast<float>(isamp_in) -
-           status_.isamp_offset) / 4096.0f * 3.3f) / V_per_A;
+  void MeasureEnergy() {
+    // During a spectrum capture, ADC1 and ADC5 are converting
+    // continuously, and TIM6 is free running, so only ADC2 and ADC3
+    // are armed here.  The most recent captured samples stand in for
+    // the others.
+    const bool capturing =
+        spectrum_.status().state == fw::SpectrumAnalyzer::kCapturing;
 
     ADC2->SQR1 =
         (0 << ADC_SQR1_L_Pos) | // length 1
-        (5 << ADC_SQR1_SQ1_Pos);
-    ADC5->SQR1 =
-        (0 << ADC_SQR1_L_Pos) | // length 1
-        (4 << ADC_SQR1_SQ1_Pos);
+        (16 << ADC_SQR1_SQ1_Pos);
+
+    const auto& profile = *adc_profile_;
+    ApplyAcquisition(ADC2, 16, profile.voltage);
+    ApplyAcquisition(ADC3, 1, profile.current);
+    if (!capturing) {
+      ADC5->SQR1 =
+          (0 << ADC_SQR1_L_Pos) | // length 1
+          (1 << ADC_SQR1_SQ1_Pos);
+      ApplyAcquisition(ADC1, 13, profile.voltage);
+      ApplyAcquisition(ADC5, 1, profile.current);
+    }
 
+    // Sample the ADCs.  The voltages and currents are latched on the
+    // same trigger edge, so their product is the power at that
+    // instant even when the load is switching.
+    if (!capturing) {
+      ADC1->CR |= ADC_CR_ADSTART;
+      ADC5->CR |= ADC_CR_ADSTART;
+    }
     ADC2->CR |= ADC_CR_ADSTART;
-    ADC5->CR |= ADC_CR_ADSTART;
+    ADC3->CR |= ADC_CR_ADSTART;
+    const uint32_t start_us = timer_.read_us();
+    if (!capturing) { TriggerAdcs(); }
 
-    while (((ADC2->ISR & ADC_ISR_EOC) == 0) ||
-           ((ADC5->ISR & ADC_ISR_EOC) == 0));
+    while ((!capturing && ((ADC1->ISR & ADC_ISR_EOC) == 0)) ||
+           ((ADC2->ISR & ADC_ISR_EOC) == 0) ||
+           ((ADC3->ISR & ADC_ISR_EOC) == 0) ||
+           (!capturing && ((ADC5->ISR & ADC_ISR_EOC) == 0)));
+    RecordAdcCost(&adc_status_.conversion_us, timer_.read_us() - start_us);
 
-    const auto fet_temp_raw = ADC2->DR;
-    const auto int_temp_raw = ADC5->DR;
+    const uint16_t vsamp_in_raw = ADC2->DR;
+    const uint16_t isamp_low_raw = ADC3->DR;
+    StopAdc(ADC2);
+    StopAdc(ADC3);
+    if (capturing) {
+      LatestCapturedSamples(&last_vsamp_out_raw_, &last_isamp_raw_);
+    } else {
+      last_vsamp_out_raw_ = ADC1->DR;
+      last_isamp_raw_ = ADC5->DR;
+      StopAdc(ADC1);
+      StopAdc(ADC5);
+    }
+    const uint16_t vsamp_out_raw = last_vsamp_out_raw_;
+    const uint16_t isamp_in = last_isamp_raw_;
+
+    const float vsamp_out = ConvertOutputVoltage(vsamp_out_raw);
+    const float vsamp_in = ConvertInputVoltage(vsamp_in_raw);
+    const auto isamp = ConvertCurrent(isamp_in, isamp_low_raw);
+
+    UpdateCalibrationAverage(kCalInputVoltage, vsamp_in_raw);
+    UpdateCalibrationAverage(kCalOutputVoltage, vsamp_out_raw);
+    UpdateCalibrationAverage(
+        kCalOutputCurrent,
+        static_cast<float>(isamp_in) - status_.isamp_offset);
+    UpdateCalibrationAverage(
+        kCalOutputCurrentLow,
+        static_cast<float>(isamp_low_raw) - status_.isamp_low_offset);
+
+    // The internal temperature is converted on ADC5, so waits for
+    // any capture to finish.
+    temperature_countdown_ms_--;
+    if (temperature_countdown_ms_ <= 0 && !capturing) {
+      temperature_countdown_ms_ = std::max<int>(
+          1, profile.temperature_period_ms);
+      MeasureTemperatures(profile);
+    }
+    const auto fet_temp_raw = fet_temp_raw_;
+    const auto int_temp_raw = int_temp_raw_;
 
-    const float fet_temp_C =
-        ((static_cast<float>(fet_temp_raw) / 4096.0f * 3.3f) - 1.8663f) /
-        -0.01169f;
+    const float fet_temp_C = ConvertFetTemp(fet_temp_raw);
+    UpdateCalibrationAverage(kCalFetTemp, fet_temp_raw);
 
     const float int_temp_C =
         (static_cast<float>(int_temp_raw) - ts_cal1_) / static_cast<float>(ts_cal2_ - ts_cal1_) * 100.0f + 30.0f;
 
-    if (vsamp_out > 4.0f) {
-      const float delta_energy_uW_hr = vsamp_in * isamp * 0.001f / 3600.0f * 1e6f;
-      status_.energy_uW_hr += static_cast<int32_t>(delta_energy_uW_hr);
+    PowerDistControl::Measurement measurement;
+    measurement.input_voltage_V = vsamp_in;
+    measurement.output_voltage_V = vsamp_out;
+    measurement.current_A = isamp.current_A;
+    measurement.current_range = isamp.range;
+    measurement.fet_temp_C = fet_temp_C;
+    measurement.isamp_raw = isamp_in;
+    measurement.isamp_low_raw = isamp_low_raw;
+    control_.MeasureEnergy(measurement);
+
+    fw::SampleStream::Samples samples = {};
+    samples[fw::SampleStream::kInputVoltage] = vsamp_in_raw;
+    samples[fw::SampleStream::kOutputVoltage] = vsamp_out_raw;
+    samples[fw::SampleStream::kCurrent] = isamp_in;
+    samples[fw::SampleStream::kCurrentLow] = isamp_low_raw;
+    samples[fw::SampleStream::kFetTemp] = fet_temp_raw;
+    const uint64_t start_us64 =
+        timer_.read_us64() - (timer_.read_us() - start_us);
+    sample_stream_.Add(start_us, time_sync_.HostTime(start_us64), samples);
+
+    auto* const status = control_.mutable_status();
+    status->int_temp_raw = int_temp_raw;
+    status->int_temp_C = int_temp_C;
+
+    if (filter_config_.enable) {
+      FilterMeasurements(
+          vsamp_in_raw, vsamp_out_raw, isamp_in, isamp_low_raw);
+    } else {
+      status->filtered_input_voltage_V = vsamp_in;
+      status->filtered_output_voltage_V = vsamp_out;
+      status->filtered_output_current_A = isamp.current_A;
     }
+  }
 
-    status_.input_voltage_V = vsamp_in;
-    status_.output_voltage_V = vsamp_out;
-    status_.output_current_A = isamp;
-    status_.fet_temp_C = fet_temp_C;
-    status_.int_temp_raw = int_temp_raw;
-    status_.int_temp_C = int_temp_C;
-
+  // The four streams are interleaved through the one filter in this
+  // order, every millisecond.
+  enum FilterStream {
+    kFilterInputVoltage,
+    kFilterOutputVoltage,
+    kFilterCurrent,
+    kFilterCurrentLow,
+    kNumFilterStreams,
+  };
 
-    isamp_sample_window_[isamp_sample_offset_] = isamp_in;
-    isamp_sample_offset_ = (isamp_sample_offset_ + 1) % isamp_sample_window_.size();
-    status_.isamp_average =
-        std::accumulate(isamp_sample_window_.begin(),
-                        isamp_sample_window_.end(),
-                        0) /
-        static_cast<float>(isamp_sample_window_.size());
+  void ConfigureFilter() {
+    filter_coefficients_ = fw::FmacFilter::Design(
+        filter_config_, 1000.0f, kNumFilterStreams);
+    if (filter_config_.enable) {
+      fmac_.Configure(filter_coefficients_);
+    }
   }
 
-  void SetOutputsFromState() {
-    // First, do our things that depend upon our current state.
-    switch (status_.state) {
-      case kPowerOff: {
-        switch_led_.write(0);
-        override_pwr_.write(0);
-        led1_.write(1);
-        override_3v3_.write(config_.disable_sleep ||
-                            status_.shutdown_timeout_ms > 0);
-        break;
-      }
-      case kPrecharging: {
-        override_pwr_.write(1);
-        override_3v3_.write(1);
-        switch_led_.write((timer_.read_ms() / 20) % 2);
-        led1_.write(0);
-        break;
-      }
-      case kPowerOn: {
-        override_pwr_.write(1);
-        override_3v3_.write(1);
-        switch_led_.write(1);
-        led1_.write(0);
-        break;
-      }
-      case kFault: {
-        override_pwr_.write(0);
-        override_3v3_.write(1);
-        const int cycle = (timer_.read_ms() / 200);
-        const bool on =
-            (cycle % 2) && (cycle % 8) < (status_.fault_code * 2);
-        switch_led_.write(on ? 1 : 0);
-        led1_.write(on ? 0 : 1);
-        break;
-      }
-      case kNumStates: {
-        break;
-      }
+  void FilterMeasurements(uint16_t vsamp_in_raw, uint16_t vsamp_out_raw,
+                          uint16_t isamp_in, uint16_t isamp_low_raw) {
+    std::array<uint16_t, kNumFilterStreams> raw = {};
+    raw[kFilterInputVoltage] = vsamp_in_raw;
+    raw[kFilterOutputVoltage] = vsamp_out_raw;
+    raw[kFilterCurrent] = isamp_in;
+    raw[kFilterCurrentLow] = isamp_low_raw;
+
+    std::array<float, kNumFilterStreams> counts = {};
+    for (int i = 0; i < kNumFilterStreams; i++) {
+      counts[i] = fw::FmacFilter::ToCounts(
+          fmac_.Filter(fw::FmacFilter::FromCounts(raw[i])),
+          filter_coefficients_);
     }
+
+    auto* const status = control_.mutable_status();
+    status->filtered_input_voltage_V =
+        compiled_cal_[kCalInputVoltage](counts[kFilterInputVoltage]);
+    status->filtered_output_voltage_V =
+        compiled_cal_[kCalOutputVoltage](counts[kFilterOutputVoltage]);
+    status->filtered_output_current_A = ConvertCurrent(
+        counts[kFilterCurrent], counts[kFilterCurrentLow]).current_A;
   }
 
-  void MaybeChangeState() {
-    auto& state = status_.state;
-    auto& fault_code = status_.fault_code;
-    auto& precharge_timeout_ms = status_.precharge_timeout_ms;
-    auto& shutdown_timeout_ms = status_.shutdown_timeout_ms;
-    auto& power_switch_status = status_.switch_status;
+  void MeasureTemperatures(const fw::AdcProfile& profile) {
+    ADC2->SQR1 =
+        (0 << ADC_SQR1_L_Pos) | // length 1
+        (5 << ADC_SQR1_SQ1_Pos);
+    ADC5->SQR1 =
+        (0 << ADC_SQR1_L_Pos) | // length 1
+        (4 << ADC_SQR1_SQ1_Pos);
 
-    int8_t desired_output = status_.switch_status;
-    if (status_.switch_status == 1) {
-      if (status_.force_output == 1) {
-        desired_output = 0;
-      } else if (status_.force_output == 2) {
-        desired_output = 1;
-      }
-    }
+    ApplyAcquisition(ADC2, 5, profile.temperature);
+    ApplyAcquisition(ADC5, 4, profile.temperature);
 
-    switch (state) {
-      case kPowerOff: {
-        fault_code = 0;
-        if (power_switch_status == 1 ||
-            desired_output == 1) {
-          // We don't want to turn off if the user is trying to turn
-          // us back on.
-          shutdown_timeout_ms = kShutdownTimeoutMs;
-        }
-        if (desired_output == 1 &&
-            status_.off_time_ms == kMinOffTimeMs) {
-          precharge_timeout_ms = 100;
-          state = kPrecharging;
+    ADC2->CR |= ADC_CR_ADSTART;
+    ADC5->CR |= ADC_CR_ADSTART;
+    const uint32_t start_us = timer_.read_us();
+    TriggerAdcs();
 
-          // Read ADC5 before we start powering anything.
-          status_.isamp_offset = status_.isamp_average;
-        }
-        break;
+    while (((ADC2->ISR & ADC_ISR_EOC) == 0) ||
+           ((ADC5->ISR & ADC_ISR_EOC) == 0));
+    RecordAdcCost(&adc_status_.temperature_us, timer_.read_us() - start_us);
+
+    fet_temp_raw_ = ADC2->DR;
+    int_temp_raw_ = ADC5->DR;
+    StopAdc(ADC2);
+    StopAdc(ADC5);
+  }
+
+  void SelectAdcProfile() {
+    const auto profile = [&]() {
+      switch (status_.state) {
+        case fw::kPowerOff: { return adc_config_.power_off; }
+        case fw::kPrecharging: { return adc_config_.precharging; }
+        case fw::kPowerOn: { return adc_config_.power_on; }
+        case fw::kFault: { return adc_config_.fault; }
+        case fw::kNumStates: { break; }
       }
-      case kPrecharging: {
-        fault_code = 0;
-        if (status_.tps2490_fault == 1) {
-          state = kPowerOn;
-        } else if (desired_output == 0) {
-          state = kPowerOff;
-        } else if (precharge_timeout_ms == 0) {
-          fault_code = 1;
-          state = kFault;
+      return fw::AdcProfileConfig::kMetering;
+    }();
+    // This indexes the per profile costs.
+    adc_status_.profile = fw::AdcProfileConfig::Validate(profile);
+    adc_profile_ = &adc_config_.profile(profile);
+  }
+
+  void RecordAdcCost(
+      std::array<float, fw::AdcProfileConfig::kNumProfiles>* costs,
+      uint32_t elapsed_us) {
+    auto& cost = (*costs)[adc_status_.profile];
+    const float value = static_cast<float>(elapsed_us);
+    cost = (cost == 0.0f) ? value : (cost + kAdcCostAlpha * (value - cost));
+  }
+
+  void UpdateAdcExpected() {
+    const float adc_clock_hz =
+        static_cast<float>(SystemCoreClock) / kAdcPrescale;
+    for (int i = 0; i < fw::AdcProfileConfig::kNumProfiles; i++) {
+      const auto& profile =
+          adc_config_.profile(static_cast<fw::AdcProfileConfig::Profile>(i));
+      // The voltages and currents are converted in parallel.
+      adc_status_.expected_conversion_us[i] = std::max(
+          profile.voltage.conversion_us(adc_clock_hz),
+          profile.current.conversion_us(adc_clock_hz));
+      adc_status_.expected_temperature_us[i] =
+          profile.temperature.conversion_us(adc_clock_hz);
+      adc_status_.conversion_us[i] = 0.0f;
+      adc_status_.temperature_us[i] = 0.0f;
+    }
+  }
+
+  void PollSpectrum() {
+    using SA = fw::SpectrumAnalyzer;
+    switch (spectrum_.status().state) {
+      case SA::kIdle:
+      case SA::kComplete:
+      case SA::kAborted: {
+        // Precharge sampling needs ADC1 and ADC5.
+        if (spectrum_requested_ && status_.state != fw::kPrecharging) {
+          spectrum_requested_ = false;
+          StartSpectrumCapture();
         }
-        shutdown_timeout_ms = kShutdownTimeoutMs;
         break;
       }
-      case kPowerOn: {
-        fault_code = 0;
-        if (status_.tps2490_fault == 0) {
-          state = kFault;
-          fault_code = 2;
-        } else if (desired_output == 0 &&
-                   status_.lock_time_100ms == 0) {
-          state = kPowerOff;
+      case SA::kCapturing: {
+        if ((DMA1->ISR & DMA_ISR_TCIF1) && (DMA1->ISR & DMA_ISR_TCIF2)) {
+          StopSpectrumCapture();
+          StartSpectrumAnalysis();
         }
-        shutdown_timeout_ms = kShutdownTimeoutMs;
         break;
       }
-      case kFault: {
-        if (desired_output == 0) {
-          state = kPowerOff;
+      case SA::kAnalyzing: {
+        if (spectrum_.Poll()) {
+          spectrum_update_();
         }
-        shutdown_timeout_ms = kShutdownTimeoutMs;
-        break;
-      }
-      case kNumStates: {
         break;
       }
     }
   }
 
+  void StartSpectrumCapture() {
+    __HAL_RCC_DMA1_CLK_ENABLE();
+    __HAL_RCC_DMAMUX1_CLK_ENABLE();
+
+    // TIM6 runs from twice PCLK1, which is the system clock.
+    const float timer_Hz = static_cast<float>(SystemCoreClock);
+    const uint32_t period = static_cast<uint32_t>(Limit(
+        timer_Hz / spectrum_config_.sample_rate_Hz, 1700.0f, 65536.0f));
+
+    ADC5->SQR1 =
+        (0 << ADC_SQR1_L_Pos) | // length 1
+        (1 << ADC_SQR1_SQ1_Pos);
+    ApplyAcquisition(ADC1, 13, spectrum_config_.acquisition);
+    ApplyAcquisition(ADC5, 1, spectrum_config_.acquisition);
+
+    using SA = fw::SpectrumAnalyzer;
+    DMA1->IFCR = DMA_IFCR_CGIF1 | DMA_IFCR_CGIF2;
+    StartAdcDma(ADC1, DMA1_Channel1, DMAMUX1_Channel0, DMA_REQUEST_ADC1,
+                spectrum_.capture(SA::kVoltage)->data(), SA::kSize);
+    StartAdcDma(ADC5, DMA1_Channel2, DMAMUX1_Channel1, DMA_REQUEST_ADC5,
+                spectrum_.capture(SA::kCurrent)->data(), SA::kSize);
+
+    ADC1->CR |= ADC_CR_ADSTART;
+    ADC5->CR |= ADC_CR_ADSTART;
+
+    // Each update event is now a trigger.
+    TIM6->ARR = period - 1;
+    TIM6->CNT = 0;
+    TIM6->CR2 = (2 << TIM_CR2_MMS_Pos);  // update is TRGO
+    TIM6->CR1 = TIM_CR1_CEN;
+
+    spectrum_.BeginCapture(timer_Hz / static_cast<float>(period));
+    spectrum_update_();
+  }
+
+  void StopSpectrumCapture() {
+    TIM6->CR1 = 0;
+    TIM6->CR2 = (0 << TIM_CR2_MMS_Pos);  // UG is TRGO
+
+    StopAdc(ADC1);
+    StopAdc(ADC5);
+    StopAdcDma(ADC1, DMA1_Channel1);
+    StopAdcDma(ADC5, DMA1_Channel2);
+    DMA1->IFCR = DMA_IFCR_CGIF1 | DMA_IFCR_CGIF2;
+  }
+
+  // The analysis works in ADC counts, so needs the local slope of
+  // each calibration to report engineering units.
+  float CountScale(CalibrationChannel channel, float counts) const {
+    return compiled_cal_[channel](counts + 0.5f) -
+        compiled_cal_[channel](counts - 0.5f);
+  }
+
+  void StartSpectrumAnalysis() {
+    using SA = fw::SpectrumAnalyzer;
+    const float current_mean = fw::SampleBlock::Reduce(
+        spectrum_.capture(SA::kCurrent)->data(), SA::kSize).mean();
+    const float voltage_mean = fw::SampleBlock::Reduce(
+        spectrum_.capture(SA::kVoltage)->data(), SA::kSize).mean();
+
+    std::array<float, SA::kNumChannels> scale = {};
+    scale[SA::kCurrent] = CountScale(
+        kCalOutputCurrent, current_mean - status_.isamp_offset);
+    scale[SA::kVoltage] = CountScale(kCalOutputVoltage, voltage_mean);
+    spectrum_.Start(scale);
+  }
+
+  // Return the most recent sample of each channel which the DMA has
+  // written, or leave the values unchanged if there are none yet.
+  void LatestCapturedSamples(uint16_t* vsamp_out_raw, uint16_t* isamp_raw) {
+    using SA = fw::SpectrumAnalyzer;
+    const int voltage_count = SA::kSize - DMA1_Channel1->CNDTR;
+    const int current_count = SA::kSize - DMA1_Channel2->CNDTR;
+    if (voltage_count > 0) {
+      *vsamp_out_raw = (*spectrum_.capture(SA::kVoltage))[voltage_count - 1];
+    }
+    if (current_count > 0) {
+      *isamp_raw = (*spectrum_.capture(SA::kCurrent))[current_count - 1];
+    }
+  }
+
+  void PollEvents() {
+    const uint32_t now_ms = timer_.read_ms();
+    fw::EventPublisher::Snapshot snapshot;
+    snapshot.state = static_cast<int8_t>(status_.state);
+    snapshot.fault_code = status_.fault_code;
+    snapshot.switch_status = status_.switch_status;
+    snapshot.lock_time_100ms = status_.lock_time_100ms;
+    snapshot.host_time_us = time_sync_.HostTime(timer_.read_us64());
+    events_.Update(now_ms, snapshot);
+
+    // Sending would abort a reply which has not yet gone out, so the
+    // event waits for it instead.
+    const auto frame = events_.Due(now_ms);
+    if (frame.empty() || can_.IsTxPending()) { return; }
+
+    FDCan::SendOptions send_options;
+    send_options.fdcan_frame = FDCan::Override::kRequire;
+    const uint32_t id =
+        (can_config_.prefix << 16) |
+        (multiplex_protocol_.config()->id << 8) |
+        event_config_.destination;
+    can_.Send(id, frame, send_options);
+    events_.Sent(now_ms);
+  }
+
+  // At most one frame is written at a time.  When the host is not
+  // polling the tunnel, that write waits, and the stream drops frames
+  // rather than this loop.
+  void PollSampleStream() {
+    if (stream_writing_ || !sample_stream_.pending()) { return; }
+
+    stream_writing_ = true;
+    write_stream_.AsyncStart(
+        [this](micro::AsyncWriteStream* stream, micro::VoidCallback release) {
+          stream_release_ = release;
+          AsyncWrite(*stream, sample_stream_.front(),
+                     [this](const micro::error_code&) {
+                       sample_stream_.Pop();
+                       stream_writing_ = false;
+                       auto release = stream_release_;
+                       stream_release_ = {};
+                       release();
+                     });
+        });
+  }
+
+  void SetOutputsFromState() {
+    const auto outputs = control_.SetOutputsFromState();
+    override_pwr_.write(outputs.override_pwr);
+    override_3v3_.write(outputs.override_3v3);
+    switch_led_.write(outputs.switch_led);
+    led1_.write(outputs.led1);
+  }
+
 
   DigitalOut gpio1_;
   DigitalOut gpio2_;
@@ -1175,7 +2421,17 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
   multiplex::MicroServer multiplex_protocol_;
   micro::AsyncStream* serial_ = multiplex_protocol_.MakeTunnel(1);
   micro::AsyncExclusive<micro::AsyncWriteStream> write_stream_{serial_};
-  micro::CommandManager command_manager_{&pool_, serial_, &write_stream_};
+  // The decimated telemetry is reduced over the period the host asks
+  // for it at.
+  fw::TelemetryRateWatcher serial_watcher_{
+    serial_, [this](const std::string_view& name, uint32_t rate_ms) {
+      if (name == "power_decimated" && rate_ms > 0) {
+        decimator_config_.period_ms = static_cast<uint16_t>(
+            std::min<uint32_t>(rate_ms, 65535));
+      }
+    }};
+  micro::CommandManager command_manager_{
+    &pool_, &serial_watcher_, &write_stream_};
   char micro_output_buffer[2048] = {};
   micro::TelemetryManager telemetry_manager_{
     &pool_, &command_manager_, &write_stream_, micro_output_buffer};
@@ -1192,16 +2448,16 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
   fw::FirmwareInfo firmware_info_{pool_, telemetry_manager_, 0, 0};
 
 
-  DigitalOut led1_{DEBUG_LED1, 1};
-  DigitalOut led2_{DEBUG_LED2, 1};
+  DigitalOut led1_{Hw::kDebugLed1, 1};
+  DigitalOut led2_{Hw::kDebugLed2, 1};
 
-  DigitalOut switch_led_{PWR_LED};
-  DigitalIn power_switch_{PWR_SW};
-  InterruptIn tps2490_flt_{TPS2490_FLT};
+  DigitalOut switch_led_{Hw::kPwrLed};
+  DigitalIn power_switch_{Hw::kPwrSw};
+  InterruptIn tps2490_flt_{Hw::kTps2490Flt};
 
   // We start overriding 3V3, but not overall power.
-  DigitalOut override_pwr_{OVERRIDE_PWR, 0};
-  DigitalOut override_3v3_{OVERRIDE_3V3, 1};
+  DigitalOut override_pwr_{Hw::kOverridePwr, 0};
+  DigitalOut override_3v3_{Hw::kOverride3v3, 1};
 
 
   OpAmpBuffer opamp1_{OPAMP1, 2};  // PA7 == VINP2
@@ -1209,29 +2465,97 @@ class PowerDist : public mjlib::multiplex::MicroServer::Server {
   OpAmpBuffer opamp3_{OPAMP3, 0, OpAmpBuffer::kExternal};  // PB0 == VINP0, output = PB1
   OpAmpInvertingAmplifier opamp5_{OPAMP5};  // PB15 == VINM0
 
-  Config config_;
-  Status status_;
-
-  std::array<uint16_t, 16> isamp_sample_window_ = {};
-  int isamp_sample_offset_ = 0;
-
+  PowerDistControl control_;
+  const PowerDistControl::Config& config_ = control_.config();
+  const PowerDistControl::Status& status_ = control_.status();
+  const fw::BatteryEstimator::Status& battery_status_ =
+      control_.battery_status();
+  mjlib::base::inplace_function<void()> battery_update_;
+
+  fw::EventPublisher::Config event_config_;
+  fw::EventPublisher events_{&event_config_};
+
+  fw::TimeSync::Config time_sync_config_;
+  fw::TimeSync time_sync_{&time_sync_config_};
+  // Latched at the start of each multiplex frame, so that every
+  // register in it reports the same time.
+  uint64_t frame_uptime_us_ = 0;
+  static constexpr uint8_t kSyncLowWritten = 0x01;
+  static constexpr uint8_t kSyncHighWritten = 0x02;
+  uint8_t sync_written_ = 0;
+  uint32_t sync_host_low_ = 0;
+  uint32_t sync_host_high_ = 0;
+
+  fw::PowerHistory history_;
+  fw::PowerHistory::Resolution history_resolution_ =
+      fw::PowerHistory::kSeconds;
+  int history_age_ = 0;
+
+  // Each line is at most 8 fields of 12 characters.
+  static constexpr int kHistoryCommandBuckets = 16;
+  char history_output_[kHistoryCommandBuckets * 96 + 8] = {};
+  char selftest_output_[80] = {};
+
+  fw::TelemetryDecimator::Config decimator_config_;
+  fw::TelemetryDecimator decimator_{&decimator_config_};
+  mjlib::base::inplace_function<void()> decimated_update_;
+
+  CalibrationConfig cal_config_;
+  std::array<fw::CompiledCalibration, kNumCalibrationChannels> compiled_cal_;
+  std::array<fw::CalibrationFitter, kNumCalibrationChannels> cal_fitter_;
+
+  // Reference points are fit against these, so that a single noisy
+  // sample does not skew the calibration.
+  static constexpr float kCalibrationAverageAlpha = 0.01f;
+  std::array<float, kNumCalibrationChannels> cal_raw_average_ = {};
+
+  fw::AdcProfileConfig adc_config_;
+  fw::AdcStatus adc_status_;
+  mjlib::base::inplace_function<void()> adc_update_;
+  const fw::AdcProfile* adc_profile_ = &adc_config_.metering;
+  int temperature_countdown_ms_ = 0;
+  uint16_t fet_temp_raw_ = 0;
+  uint16_t int_temp_raw_ = 0;
+  static constexpr float kAdcCostAlpha = 0.01f;
+
+  fw::SpectrumAnalyzer::Config spectrum_config_;
+  fw::SpectrumAnalyzer spectrum_;
+  mjlib::base::inplace_function<void()> spectrum_update_;
+  bool spectrum_requested_ = false;
+  uint16_t last_vsamp_out_raw_ = 0;
+  uint16_t last_isamp_raw_ = 0;
+
+  fw::SampleStream::Config stream_config_;
+  fw::SampleStream sample_stream_{&stream_config_};
+  bool stream_writing_ = false;
+  micro::VoidCallback stream_release_;
+
+  fw::FmacFilter::Config filter_config_;
+  fw::FmacFilter::Coefficients filter_coefficients_;
+  Fmac fmac_;
+
+  fw::CurrentRangeSelector::Config current_range_config_;
+  fw::CurrentRangeSelector current_range_{&current_range_config_};
+  int applied_current_gain_ = 7;
+
+  std::optional<fw::Lm5066> lm5066_;
   uint32_t old_time_ = 0;
 
-  float vsamp_divide_ =
-              (fw::g_measured_hw_rev <= 2 ? (200.0f / (200.0f + 3000.0f)) :
-               (fw::g_measured_hw_rev == 3 ? (200.0f / (200.0f + 4700.0f)) :
-                1.0f));
-
   const uint16_t* ts_cal1_addr_ = reinterpret_cast<const uint16_t*>(0x1fff75a8);
   const uint16_t* ts_cal2_addr_ = reinterpret_cast<const uint16_t*>(0x1fff75ca);
   const uint16_t ts_cal1_ = *ts_cal1_addr_;
   const uint16_t ts_cal2_ = *ts_cal2_addr_;
 
   bool discard_all_ = false;
+
+  fw::State watchdog_state_ = fw::kNumStates;
+  micro::CallbackTable::Callback adc12_callback_;
+  micro::CallbackTable::Callback adc3_callback_;
 };
 
-void RunRev2() {
-  PowerDist power_dist;
+template <typename Hw>
+void RunPowerDist() {
+  PowerDist<Hw> power_dist;
   power_dist.Run();
 }
 }
@@ -1246,11 +2570,8 @@ volatile uint8_t g_measured_hw_rev;
 int main(void) {
   rcc_csr = RCC->CSR;
 
-#if POWER_DIST_HW_REV >= 2
+  // All supported revisions share the same clock tree.
   SetClock2();
-#else
-#error "Unsupported target"
-#endif
 
   // We use ADC5 for VSAMP_OUT
   __HAL_RCC_ADC12_CLK_ENABLE();
@@ -1279,23 +2600,20 @@ int main(void) {
 
   fw::g_measured_hw_rev = measured_hw_rev;
 
-  // Check if the detected board revision level is in our compatible
-  // set.
-  const bool compatible = [&]() {
-    for (auto possible_version : kCompatibleHwRev) {
-      if (measured_hw_rev == possible_version) { return true; }
+  // Only those board revisions with a hardware description are
+  // compatible with this firmware.
+  switch (measured_hw_rev) {
+    case 2: {
+      RunPowerDist<fw::PowerDistHw<2>>();
+      break;
     }
-    return false;
-  }();
-  MJ_ASSERT(compatible);
-
-
+    case 3: {
+      RunPowerDist<fw::PowerDistHw<3>>();
+      break;
+    }
+  }
 
-#if POWER_DIST_HW_REV >= 2
-  RunRev2();
-#else
-#error "Unsupported target"
-#endif
+  MJ_ASSERT(false);
 }
 
 extern "C" {
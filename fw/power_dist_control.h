@@ -0,0 +1,788 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+#include "mjlib/base/visitor.h"
+
+#include "fw/accumulate.h"
+#include "fw/battery_estimator.h"
+#include "fw/current_range.h"
+#include "fw/fet_thermal_model.h"
+#include "fw/i2t_limiter.h"
+#include "fw/lm5066_decoder.h"
+#include "fw/precharge_supervisor.h"
+#include "fw/sample_block.h"
+
+namespace fw {
+
+enum State {
+  kPowerOff,
+  kPrecharging,
+  kPowerOn,
+  kFault,
+
+  kNumStates,
+};
+
+enum FaultCode {
+  kFaultNone = 0,
+  kFaultPrechargeTimeout = 1,
+  kFaultTps2490 = 2,
+  kFaultTps2490Interrupt = 3,
+  kFaultInputUnderVoltage = 4,
+  kFaultInputOverVoltage = 5,
+  kFaultOutputUnderVoltage = 6,
+  kFaultOutputOverVoltage = 7,
+  kFaultOverCurrent = 8,
+  kFaultRegenOverCurrent = 9,
+  kFaultI2t = 10,
+  kFaultPrechargeShort = 11,
+  kFaultFetOverTemperature = 12,
+  kFaultLm5066 = 13,
+};
+
+enum WarningBits {
+  kWarningI2t = 1 << 0,
+  kWarningFetTemperature = 1 << 1,
+  kWarningLm5066Mismatch = 1 << 2,
+  kWarningLm5066NoResponse = 1 << 3,
+};
+
+/// The power state machine and the measurements derived from the
+/// analog inputs, independent of the hardware which samples them and
+/// drives the outputs.
+///
+/// The firmware calls these in the same order from its main loop:
+///
+///  * SetInputs() with the digital inputs and the current time
+///  * SamplePrecharge() whenever PrechargeSampleDue()
+///  * SetOutputsFromState() and MaybeChangeState()
+///  * once per millisecond, PollMillisecond() and MeasureEnergy()
+///  * once per 100ms, PollHundredMillisecond() and CheckLm5066()
+///
+/// so that the same sequence can be driven against models of the
+/// hardware on the host.
+class PowerDistControl {
+ public:
+  static constexpr int kShutdownTimeoutMs = 5000;
+  static constexpr int kMinOffTimeMs = 500;
+
+  // The number of 200ms periods in one repetition of the fault code
+  // blinks, which fits the largest code and a gap of at least 1s.
+  static constexpr int kFaultBlinkCycles = 32;
+  static_assert(kFaultLm5066 * 2 + 5 <= kFaultBlinkCycles);
+
+  struct Config {
+    float current_sense_ohm = 0.0005f;
+    bool disable_sleep = false;
+
+    // These limits are enforced in hardware by the ADC analog
+    // watchdogs while precharging or powered on.  A limit which lies
+    // outside the measurable range is effectively disabled.
+    float input_undervoltage_V = 8.0f;
+    float input_overvoltage_V = 100.0f;
+    float output_undervoltage_V = 0.0f;
+    float output_overvoltage_V = 100.0f;
+    float overcurrent_A = 100.0f;
+    float regen_overcurrent_A = 100.0f;
+
+    // When an LM5066 is populated, its faults turn off the output
+    // and its power measurement is cross-checked against our own.
+    // The two are considered to disagree when they differ by more
+    // than lm5066_tolerance_W plus lm5066_tolerance_fraction of the
+    // measured power, after filtering with lm5066_filter_s.
+    bool lm5066_enable = true;
+    float lm5066_tolerance_W = 5.0f;
+    float lm5066_tolerance_fraction = 0.1f;
+    float lm5066_filter_s = 2.0f;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(current_sense_ohm));
+      a->Visit(MJ_NVP(disable_sleep));
+      a->Visit(MJ_NVP(input_undervoltage_V));
+      a->Visit(MJ_NVP(input_overvoltage_V));
+      a->Visit(MJ_NVP(output_undervoltage_V));
+      a->Visit(MJ_NVP(output_overvoltage_V));
+      a->Visit(MJ_NVP(overcurrent_A));
+      a->Visit(MJ_NVP(regen_overcurrent_A));
+      a->Visit(MJ_NVP(lm5066_enable));
+      a->Visit(MJ_NVP(lm5066_tolerance_W));
+      a->Visit(MJ_NVP(lm5066_tolerance_fraction));
+      a->Visit(MJ_NVP(lm5066_filter_s));
+    }
+  };
+
+  struct Status {
+    State state = kPowerOff;
+    int8_t fault_code = 0;
+    int16_t warning = 0;
+    int8_t tps2490_fault = 0;
+    int8_t switch_status = 0;
+    int16_t lock_time_100ms = 0;
+
+    float input_voltage_V = 0.0f;
+    float output_voltage_V = 0.0f;
+    float output_current_A = 0.0f;
+    CurrentRangeSelector::Range current_range = CurrentRangeSelector::kHigh;
+    float fet_temp_C = 0.0f;
+    int32_t energy_uW_hr = 0;
+
+    // The product of the input voltage and current of the most
+    // recent sample, and its mean over the most recent 100ms.
+    float power_W = 0.0f;
+    float average_power_W = 0.0f;
+
+    // The same measurements after the low pass filter.
+    float filtered_input_voltage_V = 0.0f;
+    float filtered_output_voltage_V = 0.0f;
+    float filtered_output_current_A = 0.0f;
+
+    // These accumulate separately in each direction, so that
+    // regenerated energy does not cancel consumption.
+    uint64_t energy_delivered_uW_hr = 0;
+    uint64_t energy_regenerated_uW_hr = 0;
+    uint64_t charge_out_uA_hr = 0;
+    uint64_t charge_in_uA_hr = 0;
+
+    int16_t int_temp_raw = 0;
+    float int_temp_C = 0.0f;
+
+
+    int32_t precharge_timeout_ms = 0;
+    int32_t shutdown_timeout_ms = 0;
+
+    // The results of the most recent precharge.
+    float precharge_capacitance_uF = 0.0f;
+    float precharge_leakage_S = 0.0f;
+    float precharge_time_ms = 0.0f;
+    float precharge_gate_delay_ms = 0.0f;
+
+    int32_t off_time_ms = 0;
+
+    uint16_t isamp_offset = 0;
+    uint16_t isamp_average = 0;
+    uint16_t isamp_low_offset = 0;
+    uint16_t isamp_low_average = 0;
+
+    int8_t force_output = 0;
+
+    float i2t_fast = 0.0f;
+    float i2t_slow = 0.0f;
+    bool i2t_trip = false;
+    // Set while either model is above its warning level, which
+    // prevents the output from being enabled again.
+    bool i2t_cooldown = false;
+
+    float fet_temp_raw_C = 0.0f;
+    float fet_junction_C = 0.0f;
+    float fet_temp_slope_C_s = 0.0f;
+    float fet_time_to_limit_s = 0.0f;
+    float fet_derate = 1.0f;
+    bool fet_fault = false;
+
+    Lm5066Decoder::Fault lm5066_fault = Lm5066Decoder::Fault::kNone;
+    float lm5066_power_W = 0.0f;
+    float lm5066_power_error_W = 0.0f;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(state));
+      a->Visit(MJ_NVP(fault_code));
+      a->Visit(MJ_NVP(warning));
+      a->Visit(MJ_NVP(tps2490_fault));
+      a->Visit(MJ_NVP(switch_status));
+      a->Visit(MJ_NVP(lock_time_100ms));
+
+      a->Visit(MJ_NVP(input_voltage_V));
+      a->Visit(MJ_NVP(output_voltage_V));
+      a->Visit(MJ_NVP(output_current_A));
+      a->Visit(MJ_NVP(current_range));
+      a->Visit(MJ_NVP(fet_temp_C));
+      a->Visit(MJ_NVP(energy_uW_hr));
+
+      a->Visit(MJ_NVP(power_W));
+      a->Visit(MJ_NVP(average_power_W));
+      a->Visit(MJ_NVP(filtered_input_voltage_V));
+      a->Visit(MJ_NVP(filtered_output_voltage_V));
+      a->Visit(MJ_NVP(filtered_output_current_A));
+
+      a->Visit(MJ_NVP(energy_delivered_uW_hr));
+      a->Visit(MJ_NVP(energy_regenerated_uW_hr));
+      a->Visit(MJ_NVP(charge_out_uA_hr));
+      a->Visit(MJ_NVP(charge_in_uA_hr));
+
+      a->Visit(MJ_NVP(int_temp_raw));
+      a->Visit(MJ_NVP(int_temp_C));
+
+      a->Visit(MJ_NVP(precharge_timeout_ms));
+      a->Visit(MJ_NVP(shutdown_timeout_ms));
+
+      a->Visit(MJ_NVP(precharge_capacitance_uF));
+      a->Visit(MJ_NVP(precharge_leakage_S));
+      a->Visit(MJ_NVP(precharge_time_ms));
+      a->Visit(MJ_NVP(precharge_gate_delay_ms));
+
+      a->Visit(MJ_NVP(off_time_ms));
+
+      a->Visit(MJ_NVP(isamp_offset));
+      a->Visit(MJ_NVP(isamp_average));
+      a->Visit(MJ_NVP(isamp_low_offset));
+      a->Visit(MJ_NVP(isamp_low_average));
+
+      a->Visit(MJ_NVP(force_output));
+
+      a->Visit(MJ_NVP(i2t_fast));
+      a->Visit(MJ_NVP(i2t_slow));
+      a->Visit(MJ_NVP(i2t_trip));
+      a->Visit(MJ_NVP(i2t_cooldown));
+
+      a->Visit(MJ_NVP(fet_temp_raw_C));
+      a->Visit(MJ_NVP(fet_junction_C));
+      a->Visit(MJ_NVP(fet_temp_slope_C_s));
+      a->Visit(MJ_NVP(fet_time_to_limit_s));
+      a->Visit(MJ_NVP(fet_derate));
+      a->Visit(MJ_NVP(fet_fault));
+
+      a->Visit(MJ_NVP(lm5066_fault));
+      a->Visit(MJ_NVP(lm5066_power_W));
+      a->Visit(MJ_NVP(lm5066_power_error_W));
+    }
+  };
+
+  /// The digital inputs, sampled at the start of each loop.
+  struct Inputs {
+    uint32_t now_us = 0;
+    int8_t switch_status = 0;
+    int8_t tps2490_fault = 0;
+    Lm5066Decoder::Fault lm5066_fault = Lm5066Decoder::Fault::kNone;
+  };
+
+  /// The levels to drive on each digital output.
+  struct Outputs {
+    bool override_pwr = false;
+    bool override_3v3 = true;
+    bool switch_led = false;
+    bool led1 = true;
+  };
+
+  /// One set of converted analog readings, taken once per
+  /// millisecond.
+  struct Measurement {
+    float input_voltage_V = 0.0f;
+    float output_voltage_V = 0.0f;
+    float current_A = 0.0f;
+    CurrentRangeSelector::Range current_range = CurrentRangeSelector::kHigh;
+    float fet_temp_C = 0.0f;
+
+    // The raw readings of the amplified and buffered current sense
+    // paths, used to find their zero current offsets before the
+    // output is powered.
+    uint16_t isamp_raw = 0;
+    uint16_t isamp_low_raw = 0;
+  };
+
+  PowerDistControl() {
+    Configure();
+  }
+
+  /// Precompute the filter constants of the models.  This must be
+  /// called whenever any of their configurations change.
+  void Configure() {
+    i2t_.Configure(kPeriod_s);
+    fet_thermal_.Configure(kPeriod_s);
+    battery_.Configure(kPeriod_s);
+  }
+
+  const Config& config() const { return config_; }
+  Config* mutable_config() { return &config_; }
+  I2tLimiter::Config* mutable_i2t_config() { return &i2t_config_; }
+  FetThermalModel::Config* mutable_fet_thermal_config() {
+    return &fet_thermal_config_;
+  }
+  BatteryEstimator::Config* mutable_battery_config() {
+    return &battery_config_;
+  }
+  PrechargeSupervisor::Config* mutable_precharge_config() {
+    return &precharge_config_;
+  }
+
+  const Status& status() const { return status_; }
+  Status* mutable_status() { return &status_; }
+
+  const BatteryEstimator::Status& battery_status() const {
+    return battery_status_;
+  }
+  BatteryEstimator::Status* mutable_battery_status() {
+    return &battery_status_;
+  }
+
+  void set_lock_time(int16_t lock_time_100ms) {
+    status_.lock_time_100ms = lock_time_100ms;
+  }
+
+  /// 0 follows the switch, 1 forces the output off, and 2 forces it
+  /// on while the switch is on.
+  void set_force_output(int8_t force_output) {
+    status_.force_output = force_output;
+  }
+
+  void SetInputs(const Inputs& inputs) {
+    inputs_ = inputs;
+    status_.switch_status = inputs.switch_status;
+    status_.tps2490_fault = inputs.tps2490_fault;
+  }
+
+  bool PrechargeSampleDue() const {
+    return status_.state == kPrecharging &&
+        static_cast<int32_t>(inputs_.now_us - precharge_sample_us_) >=
+        precharge_config_.sample_period_us;
+  }
+
+  void SamplePrecharge(uint32_t now_us, float output_V, float current_A) {
+    precharge_sample_us_ = now_us;
+    precharge_result_ = precharge_.Update(now_us, output_V, current_A);
+
+    status_.precharge_timeout_ms =
+        static_cast<int32_t>(precharge_.remaining_ms());
+    status_.precharge_capacitance_uF = precharge_.capacitance_F() * 1e6f;
+    status_.precharge_leakage_S = precharge_.leakage_S();
+    status_.precharge_time_ms = precharge_.elapsed_ms();
+    status_.precharge_gate_delay_ms = precharge_.gate_delay_ms();
+  }
+
+  /// Turn off the output with the given fault if it is on or
+  /// precharging.  This may be called from interrupt context.
+  void AsyncFault(FaultCode fault_code) {
+    if (status_.state == kPrecharging ||
+        status_.state == kPowerOn) {
+      status_.fault_code = fault_code;
+      status_.state = kFault;
+    }
+  }
+
+  // This is called from interrupt context as soon as the LM5066
+  // signals a fault, in the same manner as the TPS2490 fault
+  // interrupt.
+  void HandleLm5066Alert(Lm5066Decoder::Fault fault) {
+    if (!config_.lm5066_enable || !IsLm5066Fault(fault)) { return; }
+
+    status_.lm5066_fault = fault;
+    AsyncFault(kFaultLm5066);
+  }
+
+  Outputs SetOutputsFromState() const {
+    const uint32_t now_ms = inputs_.now_us / 1000;
+
+    Outputs result;
+    switch (status_.state) {
+      case kPowerOff: {
+        result.switch_led = false;
+        result.override_pwr = false;
+        result.led1 = true;
+        result.override_3v3 = (config_.disable_sleep ||
+                               status_.shutdown_timeout_ms > 0);
+        break;
+      }
+      case kPrecharging: {
+        result.override_pwr = true;
+        result.override_3v3 = true;
+        result.switch_led = (now_ms / 20) % 2;
+        result.led1 = false;
+        break;
+      }
+      case kPowerOn: {
+        result.override_pwr = true;
+        result.override_3v3 = true;
+        result.switch_led = true;
+        result.led1 = false;
+        break;
+      }
+      case kFault: {
+        result.override_pwr = false;
+        result.override_3v3 = true;
+        // The switch LED blinks fault_code times, then pauses.
+        const int cycle = (now_ms / 200);
+        const bool on =
+            (cycle % 2) &&
+            (cycle % kFaultBlinkCycles) < (status_.fault_code * 2);
+        result.switch_led = on;
+        result.led1 = !on;
+        break;
+      }
+      case kNumStates: {
+        break;
+      }
+    }
+    return result;
+  }
+
+  void MaybeChangeState() {
+    auto& state = status_.state;
+    auto& fault_code = status_.fault_code;
+    auto& shutdown_timeout_ms = status_.shutdown_timeout_ms;
+    auto& power_switch_status = status_.switch_status;
+
+    int8_t desired_output = status_.switch_status;
+    if (status_.switch_status == 1) {
+      if (status_.force_output == 1) {
+        desired_output = 0;
+      } else if (status_.force_output == 2) {
+        desired_output = 1;
+      }
+    }
+
+    switch (state) {
+      case kPowerOff: {
+        fault_code = 0;
+        if (power_switch_status == 1 ||
+            desired_output == 1) {
+          // We don't want to turn off if the user is trying to turn
+          // us back on.
+          shutdown_timeout_ms = kShutdownTimeoutMs;
+        }
+        // Once the output is off the I^2t models fall below their
+        // trip level almost at once, so wait for them to cool to the
+        // warning level before allowing it back on.
+        if (desired_output == 1 &&
+            status_.off_time_ms == kMinOffTimeMs &&
+            !status_.i2t_cooldown) {
+          if (!InputVoltageInRange()) {
+            // The analog watchdogs only guard the input once we are
+            // powered, so enforce the lockout here before starting.
+            fault_code =
+                (status_.input_voltage_V < config_.input_undervoltage_V) ?
+                kFaultInputUnderVoltage : kFaultInputOverVoltage;
+            state = kFault;
+            break;
+          }
+
+          state = kPrecharging;
+
+          // Read the current offsets before we start powering
+          // anything.
+          status_.isamp_offset = status_.isamp_average;
+          status_.isamp_low_offset = status_.isamp_low_average;
+
+          StartPrecharge();
+        }
+        break;
+      }
+      case kPrecharging: {
+        fault_code = 0;
+        if (status_.tps2490_fault == 1) {
+          state = kPowerOn;
+        } else if (desired_output == 0) {
+          state = kPowerOff;
+        } else if (Lm5066Fault()) {
+          fault_code = kFaultLm5066;
+          state = kFault;
+        } else if (status_.i2t_trip) {
+          fault_code = kFaultI2t;
+          state = kFault;
+        } else if (status_.fet_fault) {
+          fault_code = kFaultFetOverTemperature;
+          state = kFault;
+        } else if (precharge_result_ == PrechargeSupervisor::kShort) {
+          fault_code = kFaultPrechargeShort;
+          state = kFault;
+        } else if (precharge_result_ == PrechargeSupervisor::kTimeout) {
+          fault_code = kFaultPrechargeTimeout;
+          state = kFault;
+        }
+        shutdown_timeout_ms = kShutdownTimeoutMs;
+        break;
+      }
+      case kPowerOn: {
+        fault_code = 0;
+        if (status_.tps2490_fault == 0) {
+          state = kFault;
+          fault_code = kFaultTps2490;
+        } else if (Lm5066Fault()) {
+          state = kFault;
+          fault_code = kFaultLm5066;
+        } else if (status_.i2t_trip) {
+          state = kFault;
+          fault_code = kFaultI2t;
+        } else if (status_.fet_fault) {
+          state = kFault;
+          fault_code = kFaultFetOverTemperature;
+        } else if (desired_output == 0 &&
+                   status_.lock_time_100ms == 0) {
+          state = kPowerOff;
+        }
+        shutdown_timeout_ms = kShutdownTimeoutMs;
+        break;
+      }
+      case kFault: {
+        if (desired_output == 0) {
+          state = kPowerOff;
+        }
+        shutdown_timeout_ms = kShutdownTimeoutMs;
+        break;
+      }
+      case kNumStates: {
+        break;
+      }
+    }
+  }
+
+  void PollMillisecond() {
+    if (status_.shutdown_timeout_ms) {
+      status_.shutdown_timeout_ms--;
+    }
+    if (status_.state == kPowerOff) {
+      status_.off_time_ms = std::min<int32_t>(
+          status_.off_time_ms + 1, kMinOffTimeMs);
+    } else {
+      status_.off_time_ms = 0;
+    }
+  }
+
+  void MeasureEnergy(const Measurement& m) {
+    const float vsamp_in = m.input_voltage_V;
+    const float vsamp_out = m.output_voltage_V;
+    const float isamp = m.current_A;
+
+    // The voltage and current are sampled together, so this is the
+    // power at that instant.
+    const float power_W = (vsamp_out > 4.0f) ? vsamp_in * isamp : 0.0f;
+    status_.power_W = power_W;
+
+    adc_power_count_++;
+    if (vsamp_out > 4.0f) {
+      adc_power_sum_W_ += power_W;
+      const float delta_energy_uW_hr =
+          power_W * kPeriod_s / 3600.0f * 1e6f;
+      Accumulate(&status_.energy_uW_hr,
+                 &energy_remainder_, delta_energy_uW_hr);
+
+      const float delta_charge_uA_hr = isamp * kPeriod_s / 3600.0f * 1e6f;
+      if (isamp >= 0.0f) {
+        Accumulate(&status_.energy_delivered_uW_hr,
+                   &energy_delivered_remainder_, delta_energy_uW_hr);
+        Accumulate(&status_.charge_out_uA_hr,
+                   &charge_out_remainder_, delta_charge_uA_hr);
+      } else {
+        Accumulate(&status_.energy_regenerated_uW_hr,
+                   &energy_regenerated_remainder_, -delta_energy_uW_hr);
+        Accumulate(&status_.charge_in_uA_hr,
+                   &charge_in_remainder_, -delta_charge_uA_hr);
+      }
+    }
+
+    status_.input_voltage_V = vsamp_in;
+    status_.output_voltage_V = vsamp_out;
+    status_.output_current_A = isamp;
+    status_.current_range = m.current_range;
+    status_.fet_temp_raw_C = m.fet_temp_C;
+
+    UpdateFetThermal(m.fet_temp_C, isamp);
+    UpdateI2t(isamp);
+
+    // The current offset is only valid once we have started powering
+    // the output, and nothing is drawn through the switch otherwise.
+    const bool output_active =
+        status_.state == kPrecharging || status_.state == kPowerOn;
+    battery_.Update(vsamp_in, output_active ? isamp : 0.0f);
+
+
+    isamp_sample_window_[isamp_sample_offset_] = m.isamp_raw;
+    isamp_low_sample_window_[isamp_sample_offset_] = m.isamp_low_raw;
+    isamp_sample_offset_ = (isamp_sample_offset_ + 1) % isamp_sample_window_.size();
+    status_.isamp_average = SampleBlock::Reduce(
+        isamp_sample_window_.data(), isamp_sample_window_.size()).mean();
+    status_.isamp_low_average = SampleBlock::Reduce(
+        isamp_low_sample_window_.data(),
+        isamp_low_sample_window_.size()).mean();
+  }
+
+  void PollHundredMillisecond() {
+    if (status_.lock_time_100ms > 0) {
+      status_.lock_time_100ms--;
+    }
+
+    battery_status_ = battery_.status();
+
+    status_.average_power_W =
+        (adc_power_count_ > 0) ? (adc_power_sum_W_ / adc_power_count_) : 0.0f;
+    adc_power_sum_W_ = 0.0f;
+    adc_power_count_ = 0;
+  }
+
+  /// Cross-check the LM5066, or pass nullptr if none is populated.
+  /// This must follow PollHundredMillisecond().
+  void CheckLm5066(const Lm5066Decoder::Status* lm5066) {
+    const float power_W = status_.average_power_W;
+
+    if (!lm5066 || !config_.lm5066_enable) {
+      status_.lm5066_fault = Lm5066Decoder::Fault::kNone;
+      status_.warning &= ~(kWarningLm5066Mismatch | kWarningLm5066NoResponse);
+      return;
+    }
+
+    status_.lm5066_fault = lm5066->fault;
+    status_.lm5066_power_W = static_cast<float>(lm5066->pin_100mW) * 0.1f;
+
+    const float error_W = status_.lm5066_power_W - power_W;
+    const float alpha =
+        (config_.lm5066_filter_s > 0.0f) ?
+        (1.0f - std::exp(-0.1f / config_.lm5066_filter_s)) : 1.0f;
+    status_.lm5066_power_error_W +=
+        alpha * (error_W - status_.lm5066_power_error_W);
+
+    const float tolerance_W =
+        config_.lm5066_tolerance_W +
+        config_.lm5066_tolerance_fraction * std::abs(power_W);
+    if (std::abs(status_.lm5066_power_error_W) > tolerance_W) {
+      status_.warning |= kWarningLm5066Mismatch;
+    } else {
+      status_.warning &= ~kWarningLm5066Mismatch;
+    }
+
+    if (lm5066->fault == Lm5066Decoder::Fault::kNoResponse) {
+      status_.warning |= kWarningLm5066NoResponse;
+    } else {
+      status_.warning &= ~kWarningLm5066NoResponse;
+    }
+  }
+
+ private:
+  static constexpr float kPeriod_s = 0.001f;
+
+  // A lost connection to the LM5066 is only reported as a warning,
+  // as our own measurements still protect the output.
+  static bool IsLm5066Fault(Lm5066Decoder::Fault fault) {
+    return fault != Lm5066Decoder::Fault::kNone &&
+        fault != Lm5066Decoder::Fault::kNoResponse;
+  }
+
+  bool Lm5066Fault() const {
+    return config_.lm5066_enable && IsLm5066Fault(inputs_.lm5066_fault);
+  }
+
+  bool InputVoltageInRange() const {
+    return status_.input_voltage_V >= config_.input_undervoltage_V &&
+        status_.input_voltage_V <= config_.input_overvoltage_V;
+  }
+
+  void StartPrecharge() {
+    const auto now_us = inputs_.now_us;
+    precharge_sample_us_ = now_us;
+    precharge_result_ = PrechargeSupervisor::kContinue;
+    precharge_.Start(now_us, status_.input_voltage_V,
+                     status_.output_voltage_V);
+    status_.precharge_timeout_ms =
+        static_cast<int32_t>(precharge_.remaining_ms());
+  }
+
+  void UpdateFetThermal(float sensor_C, float current_A) {
+    const auto result = fet_thermal_.Update(sensor_C, current_A);
+
+    status_.fet_temp_C = fet_thermal_.sensor_C();
+    status_.fet_junction_C = fet_thermal_.junction_C();
+    status_.fet_temp_slope_C_s = fet_thermal_.slope_C_s();
+    status_.fet_time_to_limit_s = fet_thermal_.time_to_limit_s();
+    status_.fet_derate = fet_thermal_.derate();
+    status_.fet_fault = (result == FetThermalModel::kFault);
+
+    // A hot FET reduces how much current the fuse emulation permits,
+    // so sustained loads are shed before the hardware limit.
+    i2t_.set_derate(fet_thermal_.derate());
+
+    if (result != FetThermalModel::kOk) {
+      status_.warning |= kWarningFetTemperature;
+    } else {
+      status_.warning &= ~kWarningFetTemperature;
+    }
+  }
+
+  void UpdateI2t(float current_A) {
+    // While the output is off, the model continues to cool.
+    const bool output_active =
+        status_.state == kPrecharging || status_.state == kPowerOn;
+    const auto result = i2t_.Update(output_active ? current_A : 0.0f);
+
+    status_.i2t_fast = i2t_.fast_fraction();
+    status_.i2t_slow = i2t_.slow_fraction();
+    status_.i2t_trip = (result == I2tLimiter::kTrip);
+    status_.i2t_cooldown = (result != I2tLimiter::kOk);
+    if (result != I2tLimiter::kOk) {
+      status_.warning |= kWarningI2t;
+    } else {
+      status_.warning &= ~kWarningI2t;
+    }
+  }
+
+  Config config_;
+  Status status_;
+  Inputs inputs_;
+
+  I2tLimiter::Config i2t_config_;
+  I2tLimiter i2t_{&i2t_config_};
+
+  FetThermalModel::Config fet_thermal_config_;
+  FetThermalModel fet_thermal_{&fet_thermal_config_};
+
+  BatteryEstimator::Config battery_config_;
+  BatteryEstimator battery_{&battery_config_};
+  BatteryEstimator::Status battery_status_;
+
+  PrechargeSupervisor::Config precharge_config_;
+  PrechargeSupervisor precharge_{&precharge_config_};
+  PrechargeSupervisor::Result precharge_result_ = PrechargeSupervisor::kContinue;
+  uint32_t precharge_sample_us_ = 0;
+
+  float adc_power_sum_W_ = 0.0f;
+  int adc_power_count_ = 0;
+
+  float energy_remainder_ = 0.0f;
+  float energy_delivered_remainder_ = 0.0f;
+  float energy_regenerated_remainder_ = 0.0f;
+  float charge_out_remainder_ = 0.0f;
+  float charge_in_remainder_ = 0.0f;
+
+  std::array<uint16_t, 16> isamp_sample_window_ = {};
+  std::array<uint16_t, 16> isamp_low_sample_window_ = {};
+  int isamp_sample_offset_ = 0;
+};
+
+}
+
+namespace mjlib {
+namespace base {
+
+template <>
+struct IsEnum<fw::State> {
+  static constexpr bool value = true;
+
+  using S = fw::State;
+  static std::array<std::pair<S, const char*>, S::kNumStates> map() {
+    return { {
+        { S::kPowerOff, "power_off" },
+        { S::kPrecharging, "precharging" },
+        { S::kPowerOn, "power_on" },
+        { S::kFault, "fault" },
+      }};
+  }
+};
+
+}
+}
@@ -14,6 +14,8 @@
 
 #pragma once
 
+#include "PinNames.h"
+
 // r2 and r3 silk is hw rev 0
 // r4.0, r4.1 silk is hw rev 1
 // r4.2 is hw rev 2, but is undistributed
@@ -26,12 +28,6 @@ extern volatile uint8_t g_measured_hw_rev;
 
 }
 
-// The most recent version of the HW.
-#ifndef POWER_DIST_HW_REV
-// r4.3b silk
-#define POWER_DIST_HW_REV 2
-#endif
-
 constexpr int kHardwareInterlock[] = {
   0,   // r2, r3
   1,   // r4.0, r4.1
@@ -39,11 +35,6 @@ constexpr int kHardwareInterlock[] = {
   3,   // r4.5
 };
 
-// This firmware is compatible with the following hardware revisions.
-constexpr int kCompatibleHwRev[] = {
-  2, 3
-};
-
 #define HWREV_PIN0 PC_6
 #define HWREV_PIN1 PA_15
 #define HWREV_PIN2 PC_13
@@ -76,3 +67,66 @@ constexpr int kCompatibleHwRev[] = {
 #define TPS2490_FLT PA_5
 #define TSP2490_TIMER PB_11
 #define FET_TEMP PC_5
+
+namespace fw {
+
+/// The compile time description of a board revision.  PowerDist is
+/// instantiated once for each specialization, and main() selects the
+/// instance matching the measured revision.  This firmware is
+/// compatible with exactly those revisions which have a
+/// specialization.
+///
+/// A new board, for instance the mjpower-ss, is supported by adding a
+/// specialization here and a case to the dispatch in main().
+template <int HwRev>
+struct PowerDistHw;
+
+/// The pin map and defaults shared by all revisions so far.
+/// Specializations may shadow any of these.
+struct PowerDistHwBase {
+  static constexpr PinName kDebugLed1 = DEBUG_LED1;
+  static constexpr PinName kDebugLed2 = DEBUG_LED2;
+
+  static constexpr PinName kPwrLed = PWR_LED;
+  static constexpr PinName kPwrSw = PWR_SW;
+
+  static constexpr PinName kCanTx = CAN_TX;
+  static constexpr PinName kCanRx = CAN_RX;
+  static constexpr PinName kCanShdn = CAN_SHDN;
+
+  static constexpr PinName kGpio1 = GPIO1;
+  static constexpr PinName kGpio2 = GPIO2;
+
+  static constexpr PinName kOverridePwr = OVERRIDE_PWR;
+  static constexpr PinName kOverride3v3 = OVERRIDE_3V3;
+  static constexpr PinName kTps2490Flt = TPS2490_FLT;
+
+  // The nominal output current sense resistor.
+  static constexpr float kCurrentSenseOhm = 0.0005f;
+
+  // Whether an LM5066 hot swap controller is populated, and if so,
+  // where it is connected.
+  static constexpr bool kHasLm5066 = false;
+  static constexpr PinName kLm5066Sda = NC;
+  static constexpr PinName kLm5066Scl = NC;
+  static constexpr PinName kLm5066Smba = NC;
+};
+
+// r4.3, r4.3b, r4.4
+template <>
+struct PowerDistHw<2> : PowerDistHwBase {
+  static constexpr int kHwRev = 2;
+
+  // The ratio of the voltage at the ADC to that being sensed.
+  static constexpr float kVsampDivide = 200.0f / (200.0f + 3000.0f);
+};
+
+// r4.5
+template <>
+struct PowerDistHw<3> : PowerDistHwBase {
+  static constexpr int kHwRev = 3;
+
+  static constexpr float kVsampDivide = 200.0f / (200.0f + 4700.0f);
+};
+
+}
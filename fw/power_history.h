@@ -0,0 +1,229 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+namespace fw {
+
+/// Keeps a history of the output current, voltage and energy at two
+/// resolutions, in fixed memory.
+///
+/// Measurements are added every millisecond.  Each second, and each
+/// minute, the mean, minimum and maximum current and voltage, and the
+/// energy delivered in that time, are stored as one bucket in a ring.
+/// The newest buckets overwrite the oldest.
+class PowerHistory {
+ public:
+  enum Resolution : int8_t {
+    kSeconds,
+    kMinutes,
+    kNumResolutions,
+  };
+
+  static constexpr int kSecondBuckets = 600;
+  static constexpr int kMinuteBuckets = 360;
+  static constexpr int kSamplesPerSecond = 1000;
+  static constexpr int kSecondsPerMinute = 60;
+
+  struct Bucket {
+    float current_mean_A = 0.0f;
+    float current_min_A = 0.0f;
+    float current_max_A = 0.0f;
+    float voltage_mean_V = 0.0f;
+    float voltage_min_V = 0.0f;
+    float voltage_max_V = 0.0f;
+    int32_t energy_uW_hr = 0;
+  };
+
+  /// Add one measurement.
+  ///
+  /// @param energy_uW_hr the running total of energy, which may wrap
+  void Add(float current_A, float voltage_V, int32_t energy_uW_hr) {
+    if (!std::isfinite(current_A) || !std::isfinite(voltage_V)) { return; }
+
+    auto& second = accumulators_[kSeconds];
+    if (second.count == 0) {
+      second.Begin(current_A, current_A, voltage_V, voltage_V, energy_uW_hr);
+    }
+    second.Add(current_A, current_A, current_A,
+               voltage_V, voltage_V, voltage_V);
+    if (second.count < kSamplesPerSecond) { return; }
+
+    const auto bucket = second.Finish(energy_uW_hr);
+    Push(kSeconds, bucket);
+
+    auto& minute = accumulators_[kMinutes];
+    if (minute.count == 0) {
+      minute.Begin(bucket.current_min_A, bucket.current_max_A,
+                   bucket.voltage_min_V, bucket.voltage_max_V,
+                   static_cast<int32_t>(
+                       static_cast<uint32_t>(energy_uW_hr) -
+                       static_cast<uint32_t>(bucket.energy_uW_hr)));
+    }
+    minute.Add(bucket.current_mean_A, bucket.current_min_A,
+               bucket.current_max_A, bucket.voltage_mean_V,
+               bucket.voltage_min_V, bucket.voltage_max_V);
+    if (minute.count < kSecondsPerMinute) { return; }
+
+    Push(kMinutes, minute.Finish(energy_uW_hr));
+  }
+
+  /// The number of buckets which can be read.
+  int count(Resolution resolution) const {
+    return static_cast<int>(std::min<uint32_t>(
+        total_[resolution], capacity(resolution)));
+  }
+
+  /// The number of buckets completed since power on, so that a reader
+  /// can tell which it has already seen.
+  uint32_t total(Resolution resolution) const {
+    return total_[resolution];
+  }
+
+  /// Read the bucket 'age' before the most recent one.  Returns false
+  /// if there is no such bucket.
+  bool Get(Resolution resolution, int age, Bucket* bucket) const {
+    if (age < 0 || age >= count(resolution)) { return false; }
+    const int size = capacity(resolution);
+    const int index = static_cast<int>(
+        (total_[resolution] - 1 - static_cast<uint32_t>(age)) %
+        static_cast<uint32_t>(size));
+    const auto& stored = (resolution == kSeconds) ?
+        seconds_[index] : minutes_[index];
+    *bucket = Unpack(stored);
+    return true;
+  }
+
+  static int capacity(Resolution resolution) {
+    return (resolution == kSeconds) ? kSecondBuckets : kMinuteBuckets;
+  }
+
+ private:
+  struct Accumulator {
+    uint32_t count = 0;
+    float current_sum = 0.0f;
+    float current_min = 0.0f;
+    float current_max = 0.0f;
+    float voltage_sum = 0.0f;
+    float voltage_min = 0.0f;
+    float voltage_max = 0.0f;
+    int32_t start_energy_uW_hr = 0;
+    bool started = false;
+
+    // Each bucket's energy starts where the previous one finished,
+    // so that none is lost between them.
+    void Begin(float current_min_A, float current_max_A,
+               float voltage_min_V, float voltage_max_V,
+               int32_t energy_uW_hr) {
+      current_sum = 0.0f;
+      voltage_sum = 0.0f;
+      current_min = current_min_A;
+      current_max = current_max_A;
+      voltage_min = voltage_min_V;
+      voltage_max = voltage_max_V;
+      if (!started) {
+        start_energy_uW_hr = energy_uW_hr;
+        started = true;
+      }
+    }
+
+    void Add(float current_mean_A, float current_min_A, float current_max_A,
+             float voltage_mean_V, float voltage_min_V, float voltage_max_V) {
+      count++;
+      current_sum += current_mean_A;
+      current_min = std::min(current_min, current_min_A);
+      current_max = std::max(current_max, current_max_A);
+      voltage_sum += voltage_mean_V;
+      voltage_min = std::min(voltage_min, voltage_min_V);
+      voltage_max = std::max(voltage_max, voltage_max_V);
+    }
+
+    Bucket Finish(int32_t energy_uW_hr) {
+      Bucket result;
+      result.current_mean_A = current_sum / static_cast<float>(count);
+      result.current_min_A = current_min;
+      result.current_max_A = current_max;
+      result.voltage_mean_V = voltage_sum / static_cast<float>(count);
+      result.voltage_min_V = voltage_min;
+      result.voltage_max_V = voltage_max;
+      result.energy_uW_hr = static_cast<int32_t>(
+          static_cast<uint32_t>(energy_uW_hr) -
+          static_cast<uint32_t>(start_energy_uW_hr));
+      start_energy_uW_hr = energy_uW_hr;
+      count = 0;
+      return result;
+    }
+  };
+
+  // Buckets are stored in 10mA and 10mV units, to fit 960 of them in
+  // 15kB.
+  struct Packed {
+    std::array<int16_t, 6> values = {};
+    int32_t energy_uW_hr = 0;
+  };
+
+  static constexpr float kPackedScale = 0.01f;
+
+  static int16_t PackValue(float value) {
+    const float scaled = std::round(value / kPackedScale);
+    const float max = std::numeric_limits<int16_t>::max();
+    return static_cast<int16_t>(std::max(-max, std::min(max, scaled)));
+  }
+
+  static Packed Pack(const Bucket& bucket) {
+    Packed result;
+    result.values = {{
+        PackValue(bucket.current_mean_A), PackValue(bucket.current_min_A),
+        PackValue(bucket.current_max_A), PackValue(bucket.voltage_mean_V),
+        PackValue(bucket.voltage_min_V), PackValue(bucket.voltage_max_V),
+      }};
+    result.energy_uW_hr = bucket.energy_uW_hr;
+    return result;
+  }
+
+  static Bucket Unpack(const Packed& packed) {
+    Bucket result;
+    result.current_mean_A = packed.values[0] * kPackedScale;
+    result.current_min_A = packed.values[1] * kPackedScale;
+    result.current_max_A = packed.values[2] * kPackedScale;
+    result.voltage_mean_V = packed.values[3] * kPackedScale;
+    result.voltage_min_V = packed.values[4] * kPackedScale;
+    result.voltage_max_V = packed.values[5] * kPackedScale;
+    result.energy_uW_hr = packed.energy_uW_hr;
+    return result;
+  }
+  static_assert(sizeof(Packed) == 16);
+
+  void Push(Resolution resolution, const Bucket& bucket) {
+    const int index = static_cast<int>(
+        total_[resolution] % static_cast<uint32_t>(capacity(resolution)));
+    auto& stored = (resolution == kSeconds) ?
+        seconds_[index] : minutes_[index];
+    stored = Pack(bucket);
+    total_[resolution]++;
+  }
+
+  std::array<Accumulator, kNumResolutions> accumulators_ = {};
+  std::array<uint32_t, kNumResolutions> total_ = {};
+  std::array<Packed, kSecondBuckets> seconds_ = {};
+  std::array<Packed, kMinuteBuckets> minutes_ = {};
+};
+
+}
@@ -0,0 +1,198 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "mjlib/base/visitor.h"
+
+namespace fw {
+
+/// Watches the output voltage and current while precharging.
+///
+/// The load is modeled as a capacitance in parallel with a leakage
+/// conductance, I = C * dV/dt + G * V, which is fit by least squares
+/// over all samples.  The rate of rise is used to project when the
+/// precharge will complete, and the timeout is adapted to that
+/// projection.  An output which fails to rise shortly after the FET
+/// gate turns on, as seen by current starting to flow, is reported
+/// as a short.
+class PrechargeSupervisor {
+ public:
+  struct Config {
+    int32_t sample_period_us = 500;
+
+    // The timeout is never shorter than min_timeout_ms and never
+    // longer than max_timeout_ms.  In between, it is the projected
+    // completion time scaled by timeout_margin.
+    float min_timeout_ms = 20.0f;
+    float max_timeout_ms = 300.0f;
+    float timeout_margin = 1.5f;
+
+    // The output is considered to be charged once it reaches this
+    // fraction of the input.
+    float complete_fraction = 0.95f;
+
+    // The gate of the FETs takes some milliseconds to turn on, so the
+    // short detection starts only once the current exceeds
+    // gate_on_A, or the output has risen.  If the output has not
+    // risen by short_min_rise_V short_detect_ms after that, the load
+    // is treated as a short.  The defaults allow 5A of inrush into
+    // up to 250mF.
+    float gate_on_A = 0.5f;
+    float short_detect_ms = 10.0f;
+    float short_min_rise_V = 0.2f;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(sample_period_us));
+      a->Visit(MJ_NVP(min_timeout_ms));
+      a->Visit(MJ_NVP(max_timeout_ms));
+      a->Visit(MJ_NVP(timeout_margin));
+      a->Visit(MJ_NVP(complete_fraction));
+      a->Visit(MJ_NVP(gate_on_A));
+      a->Visit(MJ_NVP(short_detect_ms));
+      a->Visit(MJ_NVP(short_min_rise_V));
+    }
+  };
+
+  enum Result {
+    kContinue,
+    kShort,
+    kTimeout,
+  };
+
+  PrechargeSupervisor(const Config* config) : config_(config) {}
+
+  void Start(uint32_t now_us, float input_V, float output_V) {
+    start_us_ = now_us;
+    last_us_ = now_us;
+    input_V_ = input_V;
+    start_V_ = output_V;
+    last_V_ = output_V;
+    dvdt_ = 0.0f;
+    sdd_ = sdv_ = svv_ = sdi_ = svi_ = 0.0f;
+    count_ = 0;
+    gate_on_ = false;
+    gate_delay_ms_ = 0.0f;
+    elapsed_ms_ = 0.0f;
+    timeout_ms_ = config_->max_timeout_ms;
+  }
+
+  Result Update(uint32_t now_us, float output_V, float current_A) {
+    const float dt_s = static_cast<float>(now_us - last_us_) * 1e-6f;
+    elapsed_ms_ = static_cast<float>(now_us - start_us_) * 1e-3f;
+    if (dt_s <= 0.0f) { return kContinue; }
+
+    const float dvdt = (output_V - last_V_) / dt_s;
+    const float v = 0.5f * (output_V + last_V_);
+    last_V_ = output_V;
+    last_us_ = now_us;
+
+    sdd_ += dvdt * dvdt;
+    sdv_ += dvdt * v;
+    svv_ += v * v;
+    sdi_ += dvdt * current_A;
+    svi_ += v * current_A;
+    count_++;
+
+    // A lightly filtered rate of rise is used for the projection.
+    dvdt_ += 0.25f * (dvdt - dvdt_);
+
+    const float rise_V = output_V - start_V_;
+    if (!gate_on_ &&
+        (current_A >= config_->gate_on_A ||
+         rise_V >= config_->short_min_rise_V)) {
+      gate_on_ = true;
+      gate_delay_ms_ = elapsed_ms_;
+    }
+    if (gate_on_ &&
+        (elapsed_ms_ - gate_delay_ms_) >= config_->short_detect_ms &&
+        rise_V < config_->short_min_rise_V) {
+      return kShort;
+    }
+
+    const float target_V = config_->complete_fraction * input_V_;
+    const float projected_ms =
+        (dvdt_ > 0.0f) ?
+        (elapsed_ms_ + std::max(0.0f, target_V - output_V) / dvdt_ * 1e3f) :
+        config_->max_timeout_ms;
+    timeout_ms_ = std::min(
+        config_->max_timeout_ms,
+        std::max(config_->min_timeout_ms,
+                 projected_ms * config_->timeout_margin));
+
+    if (elapsed_ms_ >= timeout_ms_) { return kTimeout; }
+    return kContinue;
+  }
+
+  /// The estimated load capacitance in farads.
+  float capacitance_F() const {
+    const float det = sdd_ * svv_ - sdv_ * sdv_;
+    if (std::abs(det) <= kMinDeterminant * sdd_ * svv_) {
+      // The voltage and its rate of change are nearly collinear, so
+      // fall back to a purely capacitive fit.
+      return (sdd_ > 0.0f) ? (sdi_ / sdd_) : 0.0f;
+    }
+    return (sdi_ * svv_ - svi_ * sdv_) / det;
+  }
+
+  /// The estimated leakage conductance in siemens.
+  float leakage_S() const {
+    const float det = sdd_ * svv_ - sdv_ * sdv_;
+    if (std::abs(det) <= kMinDeterminant * sdd_ * svv_) { return 0.0f; }
+    return (svi_ * sdd_ - sdi_ * sdv_) / det;
+  }
+
+  int32_t sample_count() const { return count_; }
+
+  /// The time from the start until current began to flow, or 0 if
+  /// it has not yet.
+  float gate_delay_ms() const { return gate_delay_ms_; }
+  float elapsed_ms() const { return elapsed_ms_; }
+  float timeout_ms() const { return timeout_ms_; }
+  float remaining_ms() const {
+    return std::max(0.0f, timeout_ms_ - elapsed_ms_);
+  }
+
+ private:
+  static constexpr float kMinDeterminant = 1e-3f;
+
+  const Config* const config_;
+
+  uint32_t start_us_ = 0;
+  uint32_t last_us_ = 0;
+  float input_V_ = 0.0f;
+  float start_V_ = 0.0f;
+  float last_V_ = 0.0f;
+  float dvdt_ = 0.0f;
+
+  // Sums for the least squares normal equations.
+  float sdd_ = 0.0f;
+  float sdv_ = 0.0f;
+  float svv_ = 0.0f;
+  float sdi_ = 0.0f;
+  float svi_ = 0.0f;
+  int32_t count_ = 0;
+
+  bool gate_on_ = false;
+  float gate_delay_ms_ = 0.0f;
+  float elapsed_ms_ = 0.0f;
+  float timeout_ms_ = 0.0f;
+};
+
+}
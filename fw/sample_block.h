@@ -0,0 +1,295 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#if defined(__ARM_FEATURE_DSP)
+#include "cmsis.h"
+#endif
+
+namespace fw {
+
+/// Reductions over blocks of 12 bit ADC samples.
+///
+/// The samples are processed two at a time, packed into one 32 bit
+/// word, using the dual 16 bit instructions of the Cortex-M4 when
+/// they are available.  Elsewhere, the same instructions are
+/// emulated, so that the host runs exactly the same algorithm and
+/// can check it against the simple Scalar versions.
+///
+/// Samples must be less than 32768, as the multiplies are signed.
+class SampleBlock {
+ public:
+  struct Stats {
+    uint32_t count = 0;
+    uint32_t sum = 0;
+    uint64_t sum_squares = 0;
+    uint16_t min = 0;
+    uint16_t max = 0;
+
+    bool operator==(const Stats& rhs) const {
+      return count == rhs.count &&
+          sum == rhs.sum &&
+          sum_squares == rhs.sum_squares &&
+          min == rhs.min &&
+          max == rhs.max;
+    }
+
+    float mean() const {
+      return count ? (static_cast<float>(sum) / static_cast<float>(count)) :
+          0.0f;
+    }
+
+    float rms() const {
+      return count ?
+          std::sqrt(static_cast<float>(sum_squares) /
+                    static_cast<float>(count)) : 0.0f;
+    }
+  };
+
+  static Stats Reduce(const uint16_t* data, uint32_t count) {
+    Stats result;
+    result.count = count;
+    if (count == 0) { return result; }
+
+    uint32_t sum = 0;
+    uint64_t sum_squares = 0;
+    uint32_t min = Pair(data[0], data[0]);
+    uint32_t max = min;
+
+    uint32_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+      const uint32_t x = Load(&data[i]);
+      sum = Smlad(x, kOnes, sum);
+      sum_squares = Smlald(x, x, sum_squares);
+      min = Min16(x, min);
+      max = Max16(x, max);
+    }
+    if (i < count) {
+      // The odd sample is paired with zero for the sums, and with
+      // itself for the extremes.
+      const uint32_t x = Pair(data[i], 0);
+      sum = Smlad(x, kOnes, sum);
+      sum_squares = Smlald(x, x, sum_squares);
+      const uint32_t both = Pair(data[i], data[i]);
+      min = Min16(both, min);
+      max = Max16(both, max);
+    }
+
+    result.sum = sum;
+    result.sum_squares = sum_squares;
+    result.min = std::min(Low(min), High(min));
+    result.max = std::max(Low(max), High(max));
+    return result;
+  }
+
+  /// The sum of the elementwise products of two blocks, as used to
+  /// integrate raw voltage and current samples.
+  static uint64_t Dot(const uint16_t* a, const uint16_t* b, uint32_t count) {
+    uint64_t result = 0;
+    uint32_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+      result = Smlald(Load(&a[i]), Load(&b[i]), result);
+    }
+    if (i < count) {
+      result += static_cast<uint64_t>(a[i]) * b[i];
+    }
+    return result;
+  }
+
+  static Stats ReduceScalar(const uint16_t* data, uint32_t count) {
+    Stats result;
+    result.count = count;
+    if (count == 0) { return result; }
+
+    result.min = data[0];
+    result.max = data[0];
+    for (uint32_t i = 0; i < count; i++) {
+      result.sum += data[i];
+      result.sum_squares += static_cast<uint64_t>(data[i]) * data[i];
+      result.min = std::min(result.min, data[i]);
+      result.max = std::max(result.max, data[i]);
+    }
+    return result;
+  }
+
+  static uint64_t DotScalar(const uint16_t* a, const uint16_t* b,
+                            uint32_t count) {
+    uint64_t result = 0;
+    for (uint32_t i = 0; i < count; i++) {
+      result += static_cast<uint64_t>(a[i]) * b[i];
+    }
+    return result;
+  }
+
+  static constexpr uint32_t kSelfTestMaxLength = 32;
+
+  struct SelfTestResult {
+    int checks = 0;
+    int failures = 0;
+
+    // The first mismatch, if any.
+    const char* failed_pattern = nullptr;
+    uint32_t failed_length = 0;
+  };
+
+  /// Compare the packed reductions against the scalar ones for every
+  /// block length up to kSelfTestMaxLength, over patterns which put
+  /// the extremes in each half of the pairs.  This is run on the
+  /// target, where it checks the DSP instructions, as well as on the
+  /// host.
+  static SelfTestResult SelfTest(uint32_t seed) {
+    static constexpr const char* kPatterns[] = {
+      "random", "zero", "full", "ramp_up", "ramp_down",
+      "alternate", "alternate_low", "high_half",
+    };
+
+    SelfTestResult result;
+    uint32_t state = seed ? seed : 1;
+    const auto random = [&]() {
+      // xorshift32
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      return static_cast<uint16_t>(state % 4096);
+    };
+
+    uint16_t a[kSelfTestMaxLength] = {};
+    uint16_t b[kSelfTestMaxLength] = {};
+    int pattern = 0;
+    for (const char* name : kPatterns) {
+      for (uint32_t length = 0; length <= kSelfTestMaxLength; length++) {
+        for (uint32_t i = 0; i < length; i++) {
+          a[i] = SelfTestSample(pattern, i, random());
+          b[i] = random();
+        }
+
+        result.checks += 2;
+        const bool reduce_ok = Reduce(a, length) == ReduceScalar(a, length);
+        const bool dot_ok = Dot(a, b, length) == DotScalar(a, b, length);
+        if (!reduce_ok || !dot_ok) {
+          if (!result.failed_pattern) {
+            result.failed_pattern = name;
+            result.failed_length = length;
+          }
+          result.failures += (reduce_ok ? 0 : 1) + (dot_ok ? 0 : 1);
+        }
+      }
+      pattern++;
+    }
+    return result;
+  }
+
+ private:
+  static constexpr uint32_t kOnes = 0x00010001;
+
+  // Sample 'index' of the self test pattern number 'pattern', in the
+  // order of the names in SelfTest.
+  static uint16_t SelfTestSample(int pattern, uint32_t index,
+                                 uint16_t random) {
+    const bool odd = index % 2;
+    switch (pattern) {
+      case 0: { return random; }
+      case 1: { return 0; }
+      case 2: { return 4095; }
+      case 3: { return static_cast<uint16_t>((index * 131) % 4096); }
+      case 4: { return static_cast<uint16_t>(4095 - (index * 127) % 4096); }
+      case 5: { return odd ? 4095 : 0; }
+      case 6: { return odd ? 0 : 4095; }
+      case 7: {
+        // The larger of each pair is always in the high half.
+        return static_cast<uint16_t>(odd ? (random | 2048) : (random & 2047));
+      }
+    }
+    return 0;
+  }
+
+  // The first sample of the pair is in the low half, as it would be
+  // for a little endian load.
+  static uint32_t Pair(uint16_t low, uint16_t high) {
+    return static_cast<uint32_t>(low) | (static_cast<uint32_t>(high) << 16);
+  }
+
+  static uint32_t Load(const uint16_t* data) {
+    return Pair(data[0], data[1]);
+  }
+
+  static uint16_t Low(uint32_t value) {
+    return static_cast<uint16_t>(value & 0xffff);
+  }
+
+  static uint16_t High(uint32_t value) {
+    return static_cast<uint16_t>(value >> 16);
+  }
+
+#if defined(__ARM_FEATURE_DSP)
+  static uint32_t Smlad(uint32_t x, uint32_t y, uint32_t acc) {
+    return __SMLAD(x, y, acc);
+  }
+
+  static uint64_t Smlald(uint32_t x, uint32_t y, uint64_t acc) {
+    return __SMLALD(x, y, acc);
+  }
+
+  // USUB16 sets the GE flag of each half where the first operand is
+  // the larger or equal, which SEL then uses to pick from it.  They
+  // are a single asm statement, as the compiler does not know SEL
+  // reads the GE flags and could otherwise move anything between
+  // them.
+  static uint32_t Max16(uint32_t a, uint32_t b) {
+    uint32_t result;
+    asm("usub16 %0, %1, %2\n\t"
+        "sel %0, %1, %2"
+        : "=&r"(result) : "r"(a), "r"(b) : "cc");
+    return result;
+  }
+
+  static uint32_t Min16(uint32_t a, uint32_t b) {
+    uint32_t result;
+    asm("usub16 %0, %1, %2\n\t"
+        "sel %0, %2, %1"
+        : "=&r"(result) : "r"(a), "r"(b) : "cc");
+    return result;
+  }
+#else
+  static int32_t Signed(uint16_t value) {
+    return static_cast<int16_t>(value);
+  }
+
+  static uint32_t Smlad(uint32_t x, uint32_t y, uint32_t acc) {
+    return acc + static_cast<uint32_t>(
+        Signed(Low(x)) * Signed(Low(y)) + Signed(High(x)) * Signed(High(y)));
+  }
+
+  static uint64_t Smlald(uint32_t x, uint32_t y, uint64_t acc) {
+    return acc + static_cast<uint64_t>(
+        static_cast<int64_t>(Signed(Low(x)) * Signed(Low(y))) +
+        static_cast<int64_t>(Signed(High(x)) * Signed(High(y))));
+  }
+
+  static uint32_t Max16(uint32_t a, uint32_t b) {
+    return Pair(std::max(Low(a), Low(b)), std::max(High(a), High(b)));
+  }
+
+  static uint32_t Min16(uint32_t a, uint32_t b) {
+    return Pair(std::min(Low(a), Low(b)), std::min(High(a), High(b)));
+  }
+#endif
+};
+
+}
@@ -0,0 +1,266 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "mjlib/base/visitor.h"
+
+namespace fw {
+
+/// Packs raw ADC samples into binary frames for streaming over the
+/// diagnostic tunnel.
+///
+/// Samples are added every millisecond, averaged over 'decimation'
+/// of them, and collected into frames of 'samples_per_frame'.
+/// Completed frames wait in a short queue until the caller can write
+/// them.  When the queue is full, a completed frame is dropped and
+/// counted rather than waiting, so a slow reader never delays the
+/// caller.
+///
+/// Each frame is, with all fields little endian:
+///
+///   0  uint8   kMagic0
+///   1  uint8   kMagic1
+///   2  uint8   kVersion
+///   3  uint8   channel mask, bit N set if Channel N is present
+///   4  uint16  payload size in bytes
+///   6  uint16  sequence number, which counts dropped frames too
+///   8  uint16  total frames dropped, modulo 65536
+///   10 uint16  decimation
+///   12 uint32  timestamp of the first sample in microseconds
+///   16 int64   host time of the first sample in microseconds, or 0
+///              if the time is not synchronized
+///   24 uint16  samples, each the present channels in Channel order,
+///              in 1/16 of an ADC count
+///   .. uint16  Fletcher-16 checksum of everything before it
+class SampleStream {
+ public:
+  enum Channel {
+    kInputVoltage,
+    kOutputVoltage,
+    kCurrent,
+    kCurrentLow,
+    kFetTemp,
+    kNumChannels,
+  };
+
+  static constexpr uint8_t kMagic0 = 0x5a;
+  static constexpr uint8_t kMagic1 = 0xa5;
+  static constexpr uint8_t kVersion = 2;
+  static constexpr int kHeaderSize = 24;
+  static constexpr int kChecksumSize = 2;
+  static constexpr int kMaxSamples = 32;
+  static constexpr int kMaxFrameSize =
+      kHeaderSize + kMaxSamples * kNumChannels * 2 + kChecksumSize;
+  static constexpr int kQueueSize = 4;
+  static constexpr int kMaxDecimation = 1000;
+  static constexpr int kFractionBits = 4;
+
+  struct Config {
+    uint8_t channels = 0x0f;
+    uint16_t decimation = 1;
+    uint8_t samples_per_frame = 16;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(channels));
+      a->Visit(MJ_NVP(decimation));
+      a->Visit(MJ_NVP(samples_per_frame));
+    }
+  };
+
+  struct Status {
+    bool active = false;
+    uint16_t sequence = 0;
+    uint32_t frames_sent = 0;
+    uint32_t frames_dropped = 0;
+    uint32_t bytes_sent = 0;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(active));
+      a->Visit(MJ_NVP(sequence));
+      a->Visit(MJ_NVP(frames_sent));
+      a->Visit(MJ_NVP(frames_dropped));
+      a->Visit(MJ_NVP(bytes_sent));
+    }
+  };
+
+  using Samples = std::array<uint16_t, kNumChannels>;
+
+  explicit SampleStream(const Config* config) : config_(config) {}
+
+  const Status& status() const { return status_; }
+  Status* mutable_status() { return &status_; }
+
+  /// Begin a new frame with the next sample.  Frames already queued
+  /// are kept.
+  void Start() {
+    status_.active = true;
+    frame_samples_ = 0;
+    accumulated_ = 0;
+    sums_ = {};
+  }
+
+  void Stop() {
+    status_.active = false;
+  }
+
+  void Add(uint32_t now_us, int64_t host_time_us, const Samples& raw) {
+    if (!status_.active) { return; }
+
+    if (frame_samples_ == 0 && accumulated_ == 0) {
+      BeginFrame(now_us, host_time_us);
+    }
+
+    for (int i = 0; i < kNumChannels; i++) { sums_[i] += raw[i]; }
+    accumulated_++;
+    if (accumulated_ < decimation_) { return; }
+
+    // Round the mean to the nearest fraction of a count.
+    for (int i = 0; i < kNumChannels; i++) {
+      if ((channels_ & (1 << i)) == 0) { continue; }
+      const uint32_t value =
+          ((sums_[i] << kFractionBits) + decimation_ / 2) / decimation_;
+      building_[size_++] = static_cast<uint8_t>(value & 0xff);
+      building_[size_++] = static_cast<uint8_t>(value >> 8);
+    }
+    sums_ = {};
+    accumulated_ = 0;
+    frame_samples_++;
+
+    if (frame_samples_ == samples_per_frame_) {
+      FinishFrame();
+      frame_samples_ = 0;
+    }
+  }
+
+  /// True if a completed frame is waiting to be written.
+  bool pending() const { return queued_ > 0; }
+
+  /// The oldest completed frame, which stays valid until Pop().
+  std::string_view front() const {
+    const auto& frame = queue_[head_];
+    return std::string_view(
+        reinterpret_cast<const char*>(frame.data.data()), frame.size);
+  }
+
+  /// Discard the oldest completed frame, once it has been written.
+  void Pop() {
+    if (queued_ == 0) { return; }
+    status_.frames_sent++;
+    status_.bytes_sent += queue_[head_].size;
+    head_ = (head_ + 1) % kQueueSize;
+    queued_--;
+  }
+
+  static uint16_t Checksum(const uint8_t* data, size_t size) {
+    uint32_t sum1 = 0;
+    uint32_t sum2 = 0;
+    for (size_t i = 0; i < size; i++) {
+      sum1 = (sum1 + data[i]) % 255;
+      sum2 = (sum2 + sum1) % 255;
+    }
+    return static_cast<uint16_t>((sum2 << 8) | sum1);
+  }
+
+  static int ChannelCount(uint8_t channels) {
+    int result = 0;
+    for (int i = 0; i < kNumChannels; i++) {
+      if (channels & (1 << i)) { result++; }
+    }
+    return result;
+  }
+
+ private:
+  struct Frame {
+    std::array<uint8_t, kMaxFrameSize> data = {};
+    uint16_t size = 0;
+  };
+
+  // The configuration is latched for each frame, so that every
+  // sample in it has the same layout.
+  void BeginFrame(uint32_t now_us, int64_t host_time_us) {
+    channels_ = config_->channels & ((1 << kNumChannels) - 1);
+    decimation_ = std::max<uint32_t>(
+        1, std::min<uint32_t>(config_->decimation, kMaxDecimation));
+    samples_per_frame_ = std::max<int>(
+        1, std::min<int>(config_->samples_per_frame, kMaxSamples));
+
+    building_[0] = kMagic0;
+    building_[1] = kMagic1;
+    building_[2] = kVersion;
+    building_[3] = channels_;
+    Write32(12, now_us);
+    Write32(16, static_cast<uint32_t>(host_time_us));
+    Write32(20, static_cast<uint32_t>(
+        static_cast<uint64_t>(host_time_us) >> 32));
+    size_ = kHeaderSize;
+  }
+
+  void FinishFrame() {
+    const uint16_t sequence = status_.sequence++;
+    if (queued_ == kQueueSize) {
+      status_.frames_dropped++;
+      return;
+    }
+
+    Write16(4, static_cast<uint16_t>(size_ - kHeaderSize));
+    Write16(6, sequence);
+    Write16(8, static_cast<uint16_t>(status_.frames_dropped));
+    Write16(10, static_cast<uint16_t>(decimation_));
+    const uint16_t checksum = Checksum(building_.data(), size_);
+    Write16(size_, checksum);
+
+    auto& frame = queue_[(head_ + queued_) % kQueueSize];
+    std::copy(building_.begin(), building_.begin() + size_ + kChecksumSize,
+              frame.data.begin());
+    frame.size = static_cast<uint16_t>(size_ + kChecksumSize);
+    queued_++;
+  }
+
+  void Write16(int offset, uint16_t value) {
+    building_[offset] = static_cast<uint8_t>(value & 0xff);
+    building_[offset + 1] = static_cast<uint8_t>(value >> 8);
+  }
+
+  void Write32(int offset, uint32_t value) {
+    Write16(offset, static_cast<uint16_t>(value & 0xffff));
+    Write16(offset + 2, static_cast<uint16_t>(value >> 16));
+  }
+
+  const Config* const config_;
+  Status status_;
+
+  std::array<uint8_t, kMaxFrameSize> building_ = {};
+  int size_ = 0;
+  uint8_t channels_ = 0;
+  uint32_t decimation_ = 1;
+  int samples_per_frame_ = 1;
+  int frame_samples_ = 0;
+  uint32_t accumulated_ = 0;
+  std::array<uint32_t, kNumChannels> sums_ = {};
+
+  std::array<Frame, kQueueSize> queue_ = {};
+  int head_ = 0;
+  int queued_ = 0;
+};
+
+}
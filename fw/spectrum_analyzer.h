@@ -0,0 +1,358 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+#include "mjlib/base/visitor.h"
+
+#include "fw/adc_profile.h"
+#include "fw/sample_block.h"
+
+namespace fw {
+
+/// Finds the largest spectral components of a burst of samples of
+/// the output current and voltage.
+///
+/// The samples are captured elsewhere into the buffers returned by
+/// capture().  After Start(), each call to Poll() performs one small
+/// step of the analysis, one pass of the FFT or the peak search, so
+/// that the caller is never blocked for long.
+///
+/// Each channel has its mean removed, is weighted with a Hann window,
+/// and is transformed with a real FFT of kSize points, computed as a
+/// complex FFT of half the size.  Peaks are located to a fraction of a
+/// bin by fitting a parabola through the logarithm of the three
+/// largest bins.
+class SpectrumAnalyzer {
+ public:
+  static constexpr int kSize = 512;
+  static constexpr int kMaxPeaks = 4;
+
+  enum Channel {
+    kCurrent,
+    kVoltage,
+    kNumChannels,
+  };
+
+  enum State : int8_t {
+    kIdle,
+    kCapturing,
+    kAnalyzing,
+    kComplete,
+    kAborted,
+  };
+
+  struct Config {
+    // The rate of the burst, which is limited by the timer to 2.6kHz
+    // through 100kHz.  Frequencies above half of this alias.
+    float sample_rate_Hz = 20000.0f;
+
+    // Used for both channels during the burst.  The conversion time
+    // must be less than the sample period.
+    AdcAcquisition acquisition = []() {
+      AdcAcquisition result;
+      result.oversample_log2 = 2;
+      return result;
+    }();
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(sample_rate_Hz));
+      a->Visit(MJ_NVP(acquisition));
+    }
+  };
+
+  struct Peak {
+    float frequency_Hz = 0.0f;
+    float amplitude = 0.0f;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(frequency_Hz));
+      a->Visit(MJ_NVP(amplitude));
+    }
+  };
+
+  struct ChannelResult {
+    // The RMS of everything but the mean.
+    float ripple_rms = 0.0f;
+
+    // The amplitudes are of the sinusoid at that frequency, in
+    // descending order.  Unused entries are zero.
+    std::array<Peak, kMaxPeaks> peaks = {};
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(ripple_rms));
+      a->Visit(MJ_NVP(peaks));
+    }
+  };
+
+  struct Status {
+    State state = kIdle;
+    uint32_t count = 0;
+    float sample_rate_Hz = 0.0f;
+
+    ChannelResult current;
+    ChannelResult voltage;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(state));
+      a->Visit(MJ_NVP(count));
+      a->Visit(MJ_NVP(sample_rate_Hz));
+      a->Visit(MJ_NVP(current));
+      a->Visit(MJ_NVP(voltage));
+    }
+  };
+
+  SpectrumAnalyzer() {
+    for (int i = 0; i <= kSize / 2; i++) {
+      const float angle = 2.0f * kPi * static_cast<float>(i) /
+          static_cast<float>(kSize);
+      cos_[i] = std::cos(angle);
+      sin_[i] = std::sin(angle);
+    }
+  }
+
+  std::array<uint16_t, kSize>* capture(Channel channel) {
+    return &capture_[channel];
+  }
+
+  const Status& status() const { return status_; }
+  Status* mutable_status() { return &status_; }
+
+  bool busy() const {
+    return status_.state == kCapturing || status_.state == kAnalyzing;
+  }
+
+  void BeginCapture(float sample_rate_Hz) {
+    status_.state = kCapturing;
+    status_.sample_rate_Hz = sample_rate_Hz;
+  }
+
+  void Abort() {
+    status_.state = kAborted;
+  }
+
+  /// Begin analyzing the captured samples.
+  ///
+  /// @param scale the units per ADC count of each channel, which may
+  ///   be negative if the conversion is inverting
+  void Start(const std::array<float, kNumChannels>& scale) {
+    scale_ = scale;
+    channel_ = 0;
+    step_ = 0;
+    status_.state = kAnalyzing;
+  }
+
+  /// Perform one step of the analysis, returning true if it is now
+  /// complete.
+  bool Poll() {
+    if (status_.state != kAnalyzing) { return false; }
+
+    auto& result = (channel_ == kCurrent) ? status_.current : status_.voltage;
+    if (step_ == 0) {
+      Load(&result);
+    } else if (step_ <= kStages) {
+      Butterflies(step_ - 1);
+    } else if (step_ == kStages + 1) {
+      Split();
+    } else {
+      FindPeaks(&result);
+      step_ = 0;
+      channel_++;
+      if (channel_ == kNumChannels) {
+        status_.count++;
+        status_.state = kComplete;
+        return true;
+      }
+      return false;
+    }
+    step_++;
+    return false;
+  }
+
+ private:
+  static constexpr float kPi = 3.14159265f;
+  static constexpr float kTiny = 1e-12f;
+  static constexpr int kHalf = kSize / 2;
+  static constexpr int kStages = 8;
+  static_assert((1 << kStages) == kHalf);
+
+  struct Complex {
+    float re = 0.0f;
+    float im = 0.0f;
+  };
+
+  static int Reverse(int value) {
+    int result = 0;
+    for (int i = 0; i < kStages; i++) {
+      result = (result << 1) | ((value >> i) & 1);
+    }
+    return result;
+  }
+
+  float Window(int n) const {
+    const int folded = (n <= kHalf) ? n : (kSize - n);
+    return 0.5f - 0.5f * cos_[folded];
+  }
+
+  // Remove the mean, apply the window, and pack pairs of samples as
+  // complex values in bit reversed order.
+  void Load(ChannelResult* result) {
+    const auto& samples = capture_[channel_];
+    const auto stats = SampleBlock::Reduce(samples.data(), kSize);
+    const float mean = stats.mean();
+    const float mean_square =
+        static_cast<float>(stats.sum_squares) / static_cast<float>(kSize);
+    const float scale = scale_[channel_];
+
+    result->ripple_rms =
+        std::sqrt(std::max(0.0f, mean_square - mean * mean)) *
+        std::abs(scale);
+
+    for (int i = 0; i < kHalf; i++) {
+      const int even = 2 * i;
+      const int odd = even + 1;
+      auto& out = work_[Reverse(i)];
+      out.re = (static_cast<float>(samples[even]) - mean) * Window(even);
+      out.im = (static_cast<float>(samples[odd]) - mean) * Window(odd);
+    }
+  }
+
+  // One radix-2 pass of the complex FFT.  The twiddle factor for a
+  // transform of kHalf points at index k is that of kSize at 2k.
+  void Butterflies(int stage) {
+    const int span = 1 << stage;
+    const int stride = kHalf / (2 * span);
+    for (int start = 0; start < kHalf; start += 2 * span) {
+      for (int j = 0; j < span; j++) {
+        const int t = 2 * j * stride;
+        const float wr = cos_[t];
+        const float wi = -sin_[t];
+        auto& a = work_[start + j];
+        auto& b = work_[start + j + span];
+        const float br = b.re * wr - b.im * wi;
+        const float bi = b.re * wi + b.im * wr;
+        b.re = a.re - br;
+        b.im = a.im - bi;
+        a.re += br;
+        a.im += bi;
+      }
+    }
+  }
+
+  // Recover the spectrum of the real input from that of the packed
+  // complex one, keeping only the magnitudes.
+  void Split() {
+    for (int k = 0; k <= kHalf; k++) {
+      const auto& z = work_[k % kHalf];
+      const auto& zc = work_[(kHalf - k) % kHalf];
+
+      // Even and odd sample spectra.
+      const float er = 0.5f * (z.re + zc.re);
+      const float ei = 0.5f * (z.im - zc.im);
+      const float orr = 0.5f * (z.im + zc.im);
+      const float oi = -0.5f * (z.re - zc.re);
+
+      // Multiply the odd part by exp(-j 2 pi k / kSize).
+      const float xr = er + orr * cos_[k] + oi * sin_[k];
+      const float xi = ei + oi * cos_[k] - orr * sin_[k];
+      magnitude_[k] = std::sqrt(xr * xr + xi * xi);
+    }
+  }
+
+  void FindPeaks(ChannelResult* result) {
+    // The amplitude of a sinusoid with a Hann window is twice the
+    // magnitude divided by the sum of the window, which is kSize / 2.
+    const float to_amplitude = 4.0f / kSize * std::abs(scale_[channel_]);
+    const float bin_Hz = status_.sample_rate_Hz / kSize;
+
+    result->peaks = {};
+    // The first two bins contain the remains of the mean after
+    // windowing.
+    for (int k = 2; k < kHalf; k++) {
+      if (!(magnitude_[k] > magnitude_[k - 1] &&
+            magnitude_[k] >= magnitude_[k + 1])) {
+        continue;
+      }
+
+      // The main lobe of the window is close to a Gaussian, so the
+      // parabola is fit to the logarithm of the magnitudes.
+      const float a = std::log(magnitude_[k - 1] + kTiny);
+      const float b = std::log(magnitude_[k] + kTiny);
+      const float c = std::log(magnitude_[k + 1] + kTiny);
+      const float denominator = a - 2.0f * b + c;
+      const float offset =
+          (denominator < 0.0f) ? (0.5f * (a - c) / denominator) : 0.0f;
+
+      Peak peak;
+      peak.frequency_Hz = (static_cast<float>(k) + offset) * bin_Hz;
+      peak.amplitude =
+          std::exp(b - 0.25f * (a - c) * offset) * to_amplitude;
+
+      // Insert in descending order of amplitude.
+      auto& peaks = result->peaks;
+      for (int i = 0; i < kMaxPeaks; i++) {
+        if (peak.amplitude > peaks[i].amplitude) {
+          for (int j = kMaxPeaks - 1; j > i; j--) { peaks[j] = peaks[j - 1]; }
+          peaks[i] = peak;
+          break;
+        }
+      }
+    }
+  }
+
+  std::array<std::array<uint16_t, kSize>, kNumChannels> capture_ = {};
+  std::array<Complex, kHalf> work_ = {};
+  std::array<float, kHalf + 1> magnitude_ = {};
+  std::array<float, kHalf + 1> cos_ = {};
+  std::array<float, kHalf + 1> sin_ = {};
+
+  std::array<float, kNumChannels> scale_ = {};
+  int channel_ = 0;
+  int step_ = 0;
+
+  Status status_;
+};
+
+}
+
+namespace mjlib {
+namespace base {
+
+template <>
+struct IsEnum<fw::SpectrumAnalyzer::State> {
+  static constexpr bool value = true;
+
+  using S = fw::SpectrumAnalyzer::State;
+  static std::array<std::pair<S, const char*>, 5> map() {
+    return { {
+        { S::kIdle, "idle" },
+        { S::kCapturing, "capturing" },
+        { S::kAnalyzing, "analyzing" },
+        { S::kComplete, "complete" },
+        { S::kAborted, "aborted" },
+      } };
+  }
+};
+
+}
+}
@@ -0,0 +1,190 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+#include "mjlib/base/visitor.h"
+
+namespace fw {
+
+/// Reduces the millisecond measurements to one value per channel for
+/// each telemetry period, so that slow telemetry does not alias.
+///
+/// Each channel is reduced with its own mode.  The running sum and
+/// extremes are updated with every sample, and the result is
+/// published at the end of each period.
+class TelemetryDecimator {
+ public:
+  enum Mode : int8_t {
+    kMean,
+    kMin,
+    kMax,
+    kLast,
+  };
+
+  enum Channel {
+    kInputVoltage,
+    kOutputVoltage,
+    kOutputCurrent,
+    kPower,
+    kFetTemp,
+    kNumChannels,
+  };
+
+  struct Config {
+    // This follows the rate the host requests with "tel rate
+    // power_decimated", and is used until it does.
+    uint16_t period_ms = 100;
+
+    Mode input_voltage_V = kMean;
+    Mode output_voltage_V = kMean;
+    Mode output_current_A = kMean;
+    Mode power_W = kMean;
+    Mode fet_temp_C = kMax;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(period_ms));
+      a->Visit(MJ_NVP(input_voltage_V));
+      a->Visit(MJ_NVP(output_voltage_V));
+      a->Visit(MJ_NVP(output_current_A));
+      a->Visit(MJ_NVP(power_W));
+      a->Visit(MJ_NVP(fet_temp_C));
+    }
+  };
+
+  struct Status {
+    // The number of samples reduced into these values.
+    uint16_t count = 0;
+
+    float input_voltage_V = 0.0f;
+    float output_voltage_V = 0.0f;
+    float output_current_A = 0.0f;
+    float power_W = 0.0f;
+    float fet_temp_C = 0.0f;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(count));
+      a->Visit(MJ_NVP(input_voltage_V));
+      a->Visit(MJ_NVP(output_voltage_V));
+      a->Visit(MJ_NVP(output_current_A));
+      a->Visit(MJ_NVP(power_W));
+      a->Visit(MJ_NVP(fet_temp_C));
+    }
+  };
+
+  using Values = std::array<float, kNumChannels>;
+
+  explicit TelemetryDecimator(const Config* config) : config_(config) {}
+
+  const Status& status() const { return status_; }
+  Status* mutable_status() { return &status_; }
+
+  /// Add one sample of every channel.  Returns true when a period is
+  /// complete and the status has been updated.
+  bool Add(const Values& values) {
+    for (int i = 0; i < kNumChannels; i++) {
+      auto& item = accumulators_[i];
+      const float value = values[i];
+      if (count_ == 0) {
+        item.sum = value;
+        item.min = value;
+        item.max = value;
+      } else {
+        item.sum += value;
+        item.min = std::min(item.min, value);
+        item.max = std::max(item.max, value);
+      }
+      item.last = value;
+    }
+    count_++;
+
+    if (count_ < std::max<uint16_t>(1, config_->period_ms)) { return false; }
+
+    for (int i = 0; i < kNumChannels; i++) {
+      status_.*kFields[i] = Reduce(config_->*kModes[i], accumulators_[i]);
+    }
+    status_.count = count_;
+    count_ = 0;
+    return true;
+  }
+
+ private:
+  struct Accumulator {
+    float sum = 0.0f;
+    float min = 0.0f;
+    float max = 0.0f;
+    float last = 0.0f;
+  };
+
+  float Reduce(Mode mode, const Accumulator& item) const {
+    switch (mode) {
+      case kMean: return item.sum / static_cast<float>(count_);
+      case kMin: return item.min;
+      case kMax: return item.max;
+      case kLast: return item.last;
+    }
+    return item.last;
+  }
+
+  static constexpr std::array<Mode Config::*, kNumChannels> kModes = { {
+      &Config::input_voltage_V,
+      &Config::output_voltage_V,
+      &Config::output_current_A,
+      &Config::power_W,
+      &Config::fet_temp_C,
+    } };
+
+  static constexpr std::array<float Status::*, kNumChannels> kFields = { {
+      &Status::input_voltage_V,
+      &Status::output_voltage_V,
+      &Status::output_current_A,
+      &Status::power_W,
+      &Status::fet_temp_C,
+    } };
+
+  const Config* const config_;
+  Status status_;
+
+  std::array<Accumulator, kNumChannels> accumulators_ = {};
+  uint16_t count_ = 0;
+};
+
+}
+
+namespace mjlib {
+namespace base {
+
+template <>
+struct IsEnum<fw::TelemetryDecimator::Mode> {
+  static constexpr bool value = true;
+
+  using M = fw::TelemetryDecimator::Mode;
+  static std::array<std::pair<M, const char*>, 4> map() {
+    return { {
+        { M::kMean, "mean" },
+        { M::kMin, "min" },
+        { M::kMax, "max" },
+        { M::kLast, "last" },
+      } };
+  }
+};
+
+}
+}
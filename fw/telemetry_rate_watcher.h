@@ -0,0 +1,88 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdlib>
+#include <string_view>
+
+#include "mjlib/base/inplace_function.h"
+#include "mjlib/base/string_span.h"
+#include "mjlib/base/tokenizer.h"
+
+#include "mjlib/micro/async_stream.h"
+
+namespace fw {
+
+/// Passes a command stream through unchanged, while watching it for
+/// "tel rate NAME MS" commands, so that the firmware can follow the
+/// rate the host asked the telemetry manager for.
+class TelemetryRateWatcher : public mjlib::micro::AsyncReadStream {
+ public:
+  using Handler = mjlib::base::inplace_function<
+    void(const std::string_view& name, uint32_t rate_ms)>;
+
+  TelemetryRateWatcher(mjlib::micro::AsyncReadStream* base, Handler handler)
+      : base_(base), handler_(handler) {}
+
+  void AsyncReadSome(const mjlib::base::string_span& data,
+                     const mjlib::micro::SizeCallback& callback) override {
+    data_ = data.data();
+    callback_ = callback;
+    base_->AsyncReadSome(
+        data, [this](mjlib::micro::error_code error, std::size_t size) {
+          for (std::size_t i = 0; i < size; i++) { Scan(data_[i]); }
+          auto callback = callback_;
+          callback_ = {};
+          callback(error, size);
+        });
+  }
+
+ private:
+  void Scan(char c) {
+    if (c != '\r' && c != '\n') {
+      // Longer lines cannot be a rate command, and are ignored.
+      if (size_ < sizeof(line_)) { line_[size_] = c; }
+      size_++;
+      return;
+    }
+
+    if (size_ > 0 && size_ <= sizeof(line_)) {
+      mjlib::base::Tokenizer tokenizer(std::string_view(line_, size_), " ");
+      if (tokenizer.next() == "tel" && tokenizer.next() == "rate") {
+        const auto name = tokenizer.next();
+        const auto rate_str = tokenizer.next();
+        if (!name.empty() && !rate_str.empty()) {
+          // The line buffer is not terminated, so copy the number.
+          char number[12] = {};
+          rate_str.copy(number, sizeof(number) - 1);
+          handler_(name, static_cast<uint32_t>(
+                       std::strtoul(number, nullptr, 10)));
+        }
+      }
+    }
+    size_ = 0;
+  }
+
+  mjlib::micro::AsyncReadStream* const base_;
+  const Handler handler_;
+
+  char* data_ = nullptr;
+  mjlib::micro::SizeCallback callback_;
+
+  char line_[48] = {};
+  std::size_t size_ = 0;
+};
+
+}
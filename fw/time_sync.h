@@ -0,0 +1,137 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "mjlib/base/visitor.h"
+
+namespace fw {
+
+/// Estimates the offset and skew between the local microsecond clock
+/// and a host clock, from pairs of the local time a sync frame was
+/// received and the host time it carried.
+///
+/// Each sample is compared with the time predicted from the previous
+/// ones, and a fraction of the error is removed from the offset and
+/// the skew, like a phase locked loop, so that jitter in any one
+/// sample is averaged out.  Between samples the local clock is
+/// extrapolated with the estimated skew.
+class TimeSync {
+ public:
+  struct Config {
+    // The fraction of each error which is removed from the offset.
+    float offset_gain = 0.3f;
+    // The fraction of each error, as a rate over the time since the
+    // previous sample, which is removed from the skew.
+    float skew_gain = 0.05f;
+    // An error larger than this restarts synchronization from the
+    // latest sample, for instance when the host clock is stepped.
+    int32_t reset_threshold_us = 5000;
+    float max_skew_ppm = 500.0f;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(offset_gain));
+      a->Visit(MJ_NVP(skew_gain));
+      a->Visit(MJ_NVP(reset_threshold_us));
+      a->Visit(MJ_NVP(max_skew_ppm));
+    }
+  };
+
+  struct Status {
+    bool synchronized = false;
+    uint32_t count = 0;
+    uint32_t resets = 0;
+    int32_t last_error_us = 0;
+    // Positive when the local clock runs slower than the host.
+    float skew_ppm = 0.0f;
+
+    template <typename Archive>
+    void Serialize(Archive* a) {
+      a->Visit(MJ_NVP(synchronized));
+      a->Visit(MJ_NVP(count));
+      a->Visit(MJ_NVP(resets));
+      a->Visit(MJ_NVP(last_error_us));
+      a->Visit(MJ_NVP(skew_ppm));
+    }
+  };
+
+  explicit TimeSync(const Config* config) : config_(config) {}
+
+  const Status& status() const { return status_; }
+  Status* mutable_status() { return &status_; }
+
+  void Update(uint64_t local_us, int64_t host_us) {
+    if (!status_.synchronized) {
+      Reset(local_us, host_us);
+      return;
+    }
+
+    const int64_t interval_us = static_cast<int64_t>(local_us - local_us_);
+    if (interval_us <= 0) { return; }
+
+    const int64_t predicted_us = HostTime(local_us);
+    const int64_t error_us = host_us - predicted_us;
+    if (std::abs(error_us) > config_->reset_threshold_us) {
+      status_.resets++;
+      Reset(local_us, host_us);
+      return;
+    }
+
+    // The second sample is the first which can measure the skew at
+    // all, so it is taken in full.
+    const float skew_gain = (status_.count == 1) ? 1.0f : config_->skew_gain;
+    const float max_skew = config_->max_skew_ppm;
+    status_.skew_ppm = std::max(-max_skew, std::min(max_skew,
+        status_.skew_ppm + skew_gain * 1e6f *
+        static_cast<float>(error_us) / static_cast<float>(interval_us)));
+
+    local_us_ = local_us;
+    host_us_ = predicted_us + static_cast<int64_t>(
+        std::round(config_->offset_gain * static_cast<float>(error_us)));
+    status_.last_error_us = static_cast<int32_t>(error_us);
+    status_.count++;
+  }
+
+  /// The host time corresponding to a local time, or 0 if no sync
+  /// has been received.
+  int64_t HostTime(uint64_t local_us) const {
+    if (!status_.synchronized) { return 0; }
+    const int64_t delta_us = static_cast<int64_t>(local_us - local_us_);
+    return host_us_ + delta_us + static_cast<int64_t>(
+        std::round(static_cast<float>(delta_us) * status_.skew_ppm * 1e-6f));
+  }
+
+ private:
+  void Reset(uint64_t local_us, int64_t host_us) {
+    // The skew is a property of the oscillators, so it is kept.
+    local_us_ = local_us;
+    host_us_ = host_us;
+    status_.synchronized = true;
+    status_.last_error_us = 0;
+    status_.count = 1;
+  }
+
+  const Config* const config_;
+  Status status_;
+
+  uint64_t local_us_ = 0;
+  int64_t host_us_ = 0;
+};
+
+}
@@ -0,0 +1,129 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace host {
+
+inline int64_t NowNs() {
+  struct timespec ts = {};
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/// A non-blocking raw SocketCAN socket which sends and receives
+/// CAN-FD frames with extended ids.
+class CanSocket {
+ public:
+  CanSocket(const std::string& interface, bool brs) : brs_(brs) {
+    fd_ = ::socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (fd_ < 0) { Fail("socket"); }
+
+    struct ifreq ifr = {};
+    std::strncpy(ifr.ifr_name, interface.c_str(), IFNAMSIZ - 1);
+    if (::ioctl(fd_, SIOCGIFINDEX, &ifr) < 0) { Fail(interface.c_str()); }
+
+    const int enable = 1;
+    if (::setsockopt(fd_, SOL_CAN_RAW, CAN_RAW_FD_FRAMES,
+                     &enable, sizeof(enable)) < 0) {
+      Fail("CAN_RAW_FD_FRAMES");
+    }
+
+    struct sockaddr_can addr = {};
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    if (::bind(fd_, reinterpret_cast<struct sockaddr*>(&addr),
+               sizeof(addr)) < 0) {
+      Fail("bind");
+    }
+
+    ::fcntl(fd_, F_SETFL, ::fcntl(fd_, F_GETFL) | O_NONBLOCK);
+  }
+
+  ~CanSocket() { ::close(fd_); }
+
+  CanSocket(const CanSocket&) = delete;
+  CanSocket& operator=(const CanSocket&) = delete;
+
+  int fd() const { return fd_; }
+
+  /// Returns false if the frame could not be queued.
+  bool Send(uint32_t id, const std::vector<uint8_t>& data) {
+    struct canfd_frame frame = {};
+    frame.can_id = id | CAN_EFF_FLAG;
+    frame.len = static_cast<uint8_t>(data.size());
+    frame.flags = brs_ ? CANFD_BRS : 0;
+    std::memcpy(frame.data, data.data(), data.size());
+    const auto result = ::write(fd_, &frame, sizeof(frame));
+    if (result < 0) {
+      if (errno == ENOBUFS || errno == EAGAIN) { return false; }
+      Fail("write");
+    }
+    return true;
+  }
+
+  /// Returns false if no frame was available.
+  bool Receive(struct canfd_frame* frame) {
+    const auto result = ::read(fd_, frame, sizeof(*frame));
+    if (result < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) { return false; }
+      Fail("read");
+    }
+    // Classic frames have no FD flags.
+    if (result == CAN_MTU) { frame->flags = 0; }
+    return true;
+  }
+
+  /// Wait until a frame is available or 'deadline_ns' passes.
+  void Wait(int64_t deadline_ns) {
+    const int64_t delta_ns = std::max<int64_t>(0, deadline_ns - NowNs());
+    struct timespec timeout = {};
+    timeout.tv_sec = delta_ns / 1000000000;
+    timeout.tv_nsec = delta_ns % 1000000000;
+    struct pollfd pfd = {};
+    pfd.fd = fd_;
+    pfd.events = POLLIN;
+    ::ppoll(&pfd, 1, &timeout, nullptr);
+  }
+
+ private:
+  [[noreturn]] static void Fail(const char* what) {
+    std::fprintf(stderr, "%s: %s\n", what, std::strerror(errno));
+    std::exit(1);
+  }
+
+  int fd_ = -1;
+  const bool brs_;
+};
+
+}
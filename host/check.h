@@ -0,0 +1,132 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace host {
+
+/// Parses the command line of the host checks, which take only
+/// "--name value" options and "--name" flags.  Anything else prints
+/// the usage and exits.
+class OptionParser {
+ public:
+  using Handler = std::function<void (const char*)>;
+
+  OptionParser(const char* usage) : usage_(usage) {}
+
+  OptionParser& Value(const char* name, Handler handler) {
+    options_.push_back({name, true, std::move(handler)});
+    return *this;
+  }
+
+  OptionParser& Value(const char* name, int* value) {
+    return Value(name, [value](const char* s) { *value = std::atoi(s); });
+  }
+
+  OptionParser& Value(const char* name, unsigned* value) {
+    return Value(name, [value](const char* s) {
+        *value = static_cast<unsigned>(std::strtoul(s, nullptr, 10));
+      });
+  }
+
+  OptionParser& Value(const char* name, double* value) {
+    return Value(name, [value](const char* s) {
+        *value = std::strtod(s, nullptr);
+      });
+  }
+
+  OptionParser& Value(const char* name, std::string* value) {
+    return Value(name, [value](const char* s) { *value = s; });
+  }
+
+  OptionParser& Flag(const char* name, bool* value) {
+    options_.push_back({name, false, [value](const char*) { *value = true; }});
+    return *this;
+  }
+
+  void Parse(int argc, char** argv) const {
+    for (int i = 1; i < argc; i++) {
+      const std::string arg = argv[i];
+      const char* next = (i + 1 < argc) ? argv[i + 1] : nullptr;
+      const Option* match = nullptr;
+      for (const auto& option : options_) {
+        if (arg == option.name && (!option.has_value || next)) {
+          match = &option;
+          break;
+        }
+      }
+      if (!match) {
+        std::fprintf(stderr, "usage: %s %s\n", argv[0], usage_);
+        std::exit(1);
+      }
+      match->handler(next);
+      if (match->has_value) { i++; }
+    }
+  }
+
+ private:
+  struct Option {
+    std::string name;
+    bool has_value;
+    Handler handler;
+  };
+
+  const char* const usage_;
+  std::vector<Option> options_;
+};
+
+/// Counts the checks made by a host check program, so that it can
+/// report a summary and exit with a failure status when run as a
+/// test.
+class CheckCounter {
+ public:
+  /// Record the result of one check.  If 'format' is given, a line
+  /// is printed describing it.
+  bool operator()(bool pass, const char* format = nullptr, ...)
+      __attribute__((format(printf, 3, 4))) {
+    checks_++;
+    if (!pass) { failures_++; }
+    if (format) {
+      std::printf("%s: ", pass ? "PASS" : "FAIL");
+      va_list args;
+      va_start(args, format);
+      std::vprintf(format, args);
+      va_end(args);
+      std::printf("\n");
+    }
+    return pass;
+  }
+
+  int failures() const { return failures_; }
+
+  /// Print the summary, and return the exit status for main.
+  int Finish() const {
+    std::printf("%s: %d of %d checks passed\n",
+                failures_ ? "FAIL" : "PASS", checks_ - failures_, checks_);
+    return failures_ ? 1 : 0;
+  }
+
+ private:
+  int checks_ = 0;
+  int failures_ = 0;
+};
+
+}
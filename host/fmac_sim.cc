@@ -0,0 +1,207 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+///
+/// Checks the FMAC filter designs using a bit exact model of the
+/// FMAC arithmetic.
+///
+/// With no input file, each design in a sweep of cutoffs is run with
+/// four interleaved streams, as in the firmware, and is checked for:
+///
+///  * the mean error of a noisy constant input, in ADC counts
+///  * the reduction in noise
+///  * the 1% settling time of a full scale step
+///  * isolation, that no stream is affected by the others
+///
+/// With --input, the file is read as lines of up to four whitespace
+/// separated raw ADC counts, one column per stream, and the filtered
+/// counts are written as CSV to stdout.  The firmware order is input
+/// voltage, output voltage, amplified current, buffered current.
+///
+/// Usage: fmac_sim [--type iir|fir] [--cutoff HZ] [--taps N]
+///                 [--input FILE]
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "fw/fmac_filter.h"
+#include "host/check.h"
+
+namespace {
+
+using Filter = fw::FmacFilter;
+using Model = fw::FmacModel;
+
+constexpr int kStreams = 4;
+constexpr float kSampleRate_Hz = 1000.0f;
+
+struct Options {
+  bool sweep = true;
+  Filter::Config config;
+  std::string input;
+};
+
+Options ParseOptions(int argc, char** argv) {
+  Options result;
+  host::OptionParser("[--type iir|fir] [--cutoff HZ] [--taps N] "
+                     "[--input FILE]")
+      .Value("--type", [&](const char* value) {
+          result.config.type =
+              (std::string(value) == "fir") ? Filter::kFir : Filter::kIir;
+        })
+      .Value("--cutoff", [&](const char* value) {
+          result.config.cutoff_Hz = std::strtof(value, nullptr);
+          result.sweep = false;
+        })
+      .Value("--taps", [&](const char* value) {
+          result.config.fir_taps = static_cast<int8_t>(std::atoi(value));
+        })
+      .Value("--input", [&](const char* value) {
+          result.input = value;
+          result.sweep = false;
+        })
+      .Parse(argc, argv);
+  return result;
+}
+
+// Run 'count' samples of stream 0 through a model, with the other
+// streams driven by 'other', and return the filtered counts.
+template <typename Input, typename Other>
+std::vector<double> Run(const Filter::Coefficients& coefficients,
+                        int count, Input input, Other other) {
+  Model model{coefficients};
+  std::vector<double> result;
+  for (int n = 0; n < count; n++) {
+    result.push_back(static_cast<double>(Filter::ToCounts(
+        model.Push(Filter::FromCounts(input(n))), coefficients)));
+    for (int s = 1; s < kStreams; s++) {
+      model.Push(Filter::FromCounts(other(n, s)));
+    }
+  }
+  return result;
+}
+
+void Check(const Filter::Config& config, host::CheckCounter* check) {
+  const auto c = Filter::Design(config, kSampleRate_Hz, kStreams);
+
+  constexpr int kCount = 40000;
+  constexpr int kSkip = 4000;
+  constexpr double kTruth = 1234.3;
+  constexpr double kNoise = 1.5;
+
+  std::mt19937 rng(1);
+  std::normal_distribution<double> noise(0.0, kNoise);
+  std::vector<int> raw;
+  for (int n = 0; n < kCount; n++) {
+    raw.push_back(std::max(0, std::min(4095, static_cast<int>(
+        std::lround(kTruth + noise(rng))))));
+  }
+
+  const auto quiet = Run(
+      c, kCount, [&](int n) { return raw[n]; },
+      [](int, int) { return 0; });
+  const auto busy = Run(
+      c, kCount, [&](int n) { return raw[n]; },
+      [&](int n, int s) { return raw[(n * 7 + s * 101) % kCount] * s; });
+
+  double sum = 0.0;
+  double sum2 = 0.0;
+  bool isolated = true;
+  for (int n = kSkip; n < kCount; n++) {
+    const double error = quiet[n] - kTruth;
+    sum += error;
+    sum2 += error * error;
+    if (quiet[n] != busy[n]) { isolated = false; }
+  }
+  const double mean = sum / (kCount - kSkip);
+  const double rms = std::sqrt(sum2 / (kCount - kSkip));
+
+  const auto step = Run(
+      c, 2000, [](int n) { return n < 100 ? 0 : 4000; },
+      [](int, int) { return 0; });
+  int settle_ms = -1;
+  for (int n = static_cast<int>(step.size()) - 1; n >= 100; n--) {
+    if (std::abs(step[n] - 4000.0) > 40.0) {
+      settle_ms = n + 1 - 100;
+      break;
+    }
+  }
+
+  (*check)(std::abs(mean) < 0.25 && isolated && rms < kNoise,
+           "%-3s %7.1f Hz  mean %+6.3f  rms %5.3f  settle %4d ms  %s",
+           config.type == Filter::kFir ? "fir" : "iir",
+           static_cast<double>(config.cutoff_Hz), mean, rms, settle_ms,
+           isolated ? "isolated" : "CROSSTALK");
+}
+
+void RunSweep(const Options& options, host::CheckCounter* check) {
+  for (const auto type : { Filter::kIir, Filter::kFir }) {
+    for (const float cutoff_Hz : { 5.0f, 20.0f, 50.0f, 100.0f, 300.0f }) {
+      auto config = options.config;
+      config.type = type;
+      config.cutoff_Hz = cutoff_Hz;
+      Check(config, check);
+    }
+  }
+}
+
+int RunInput(const Options& options) {
+  std::ifstream input(options.input);
+  if (!input) {
+    std::fprintf(stderr, "could not open %s\n", options.input.c_str());
+    return 1;
+  }
+
+  const auto c = Filter::Design(options.config, kSampleRate_Hz, kStreams);
+  Model model{c};
+
+  std::printf("vin,vout,isamp,isamp_low\n");
+  std::string line;
+  while (std::getline(input, line)) {
+    std::istringstream fields(line);
+    for (int s = 0; s < kStreams; s++) {
+      int raw = 0;
+      fields >> raw;
+      const float value = Filter::ToCounts(
+          model.Push(Filter::FromCounts(
+                         static_cast<uint16_t>(std::max(0, raw)))), c);
+      std::printf("%s%.3f", s ? "," : "", static_cast<double>(value));
+    }
+    std::printf("\n");
+  }
+  return 0;
+}
+
+}
+
+int main(int argc, char** argv) {
+  const auto options = ParseOptions(argc, argv);
+  if (!options.input.empty()) { return RunInput(options); }
+
+  host::CheckCounter check;
+  if (options.sweep) {
+    RunSweep(options, &check);
+  } else {
+    Check(options.config, &check);
+  }
+  return check.Finish();
+}
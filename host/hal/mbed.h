@@ -0,0 +1,318 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+/// @file
+///
+/// A host stand-in for the parts of mbed and the STM32G4 HAL used by
+/// fw/lm5066.cc and fw/millisecond_timer.h, so that the driver can be
+/// built and run against host::Lm5066Model.
+///
+/// The SMBus peripheral completes one transfer each time its event
+/// interrupt is serviced, by host::hal::ServiceSmbus() or by the
+/// driver spinning on HAL_SMBUS_GetState().  Transfers are forwarded
+/// to host::hal::smbus_device.  Pin interrupts are delivered by
+/// host::hal::FallingEdge(), and TIM5 only counts when the test moves
+/// it.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "PinNames.h"
+
+#ifndef TARGET_STM32G4
+#define TARGET_STM32G4 1
+#endif
+
+// Cortex-M core
+
+inline bool g_host_irq_enabled = true;
+
+inline void __disable_irq() { g_host_irq_enabled = false; }
+inline void __enable_irq() { g_host_irq_enabled = true; }
+inline uint32_t __get_PRIMASK() { return g_host_irq_enabled ? 0 : 1; }
+
+typedef enum {
+  I2C2_EV_IRQn = 33,
+  I2C2_ER_IRQn = 34,
+} IRQn_Type;
+
+inline void NVIC_SetVector(IRQn_Type, uint32_t) {}
+inline void HAL_NVIC_EnableIRQ(IRQn_Type) {}
+
+inline uint32_t SystemCoreClock = 170000000;
+
+typedef enum {
+  HAL_OK = 0x00,
+  HAL_ERROR = 0x01,
+  HAL_BUSY = 0x02,
+  HAL_TIMEOUT = 0x03,
+} HAL_StatusTypeDef;
+
+// TIM
+
+struct TIM_TypeDef {
+  volatile uint32_t CNT = 0;
+};
+
+inline TIM_TypeDef g_host_tim5;
+#define TIM5 (&g_host_tim5)
+
+#define TIM_COUNTERMODE_UP 0x00000000U
+#define __HAL_RCC_TIM5_CLK_ENABLE() do {} while (0)
+
+struct TIM_Base_InitTypeDef {
+  uint32_t Prescaler;
+  uint32_t CounterMode;
+  uint32_t Period;
+  uint32_t ClockDivision;
+  uint32_t RepetitionCounter;
+};
+
+struct TIM_HandleTypeDef {
+  TIM_TypeDef* Instance;
+  TIM_Base_InitTypeDef Init;
+};
+
+inline HAL_StatusTypeDef HAL_TIM_Base_Init(TIM_HandleTypeDef*) {
+  return HAL_OK;
+}
+
+// SMBUS
+
+struct I2C_TypeDef {};
+inline I2C_TypeDef g_host_i2c2;
+#define I2C2 (&g_host_i2c2)
+
+#define SMBUS_ANALOGFILTER_ENABLE 0x00000000U
+#define SMBUS_PEC_ENABLE 0x00800000U
+#define SMBUS_PERIPHERAL_MODE_SMBUS_HOST 0x00100000U
+#define SMBUS_FASTMODEPLUS_I2C2 0x00000200U
+
+// The driver never asks the peripheral to append or check a PEC, so
+// only whether a frame ends with a stop matters.
+#define SMBUS_FIRST_FRAME 0x00000000U
+#define SMBUS_LAST_FRAME_NO_PEC 0x02000000U
+#define SMBUS_FIRST_AND_LAST_FRAME_NO_PEC 0x02000001U
+
+#define HAL_SMBUS_ERROR_NONE 0x00000000U
+#define HAL_SMBUS_ERROR_ACKF 0x00000004U
+
+typedef enum {
+  HAL_SMBUS_STATE_RESET = 0x00,
+  HAL_SMBUS_STATE_READY = 0x01,
+  HAL_SMBUS_STATE_MASTER_BUSY_TX = 0x12,
+  HAL_SMBUS_STATE_MASTER_BUSY_RX = 0x22,
+} HAL_SMBUS_StateTypeDef;
+
+struct SMBUS_InitTypeDef {
+  uint32_t Timing;
+  uint32_t AnalogFilter;
+  uint32_t OwnAddress1;
+  uint32_t AddressingMode;
+  uint32_t DualAddressMode;
+  uint32_t OwnAddress2;
+  uint32_t OwnAddress2Masks;
+  uint32_t GeneralCallMode;
+  uint32_t NoStretchMode;
+  uint32_t PacketErrorCheckMode;
+  uint32_t PeripheralMode;
+  uint32_t SMBusTimeout;
+};
+
+struct SMBUS_HandleTypeDef {
+  I2C_TypeDef* Instance;
+  SMBUS_InitTypeDef Init;
+  uint8_t* pBuffPtr;
+  uint16_t XferSize;
+  uint32_t XferOptions;
+  uint16_t Address;
+  volatile uint32_t State;
+  volatile uint32_t ErrorCode;
+};
+
+// Defined by the driver.
+void HAL_SMBUS_MasterTxCpltCallback(SMBUS_HandleTypeDef*);
+void HAL_SMBUS_MasterRxCpltCallback(SMBUS_HandleTypeDef*);
+void HAL_SMBUS_ErrorCallback(SMBUS_HandleTypeDef*);
+
+namespace host {
+namespace hal {
+
+/// The device on the bus, addressed with 7 bit addresses.  Write
+/// returns false if the transfer was not acknowledged, and Read
+/// returns fewer bytes than requested in the same case.
+struct SmbusDevice {
+  std::function<bool (uint8_t address, const uint8_t* data,
+                      size_t size)> write;
+  std::function<std::vector<uint8_t> (uint8_t address)> read;
+};
+
+inline SmbusDevice smbus_device;
+
+struct SmbusCounters {
+  int transfers = 0;
+  int nacks = 0;
+  int inits = 0;
+};
+
+inline SmbusCounters smbus_counters;
+
+inline SMBUS_HandleTypeDef* g_smbus_handle = nullptr;
+inline std::vector<uint8_t> g_smbus_tx;
+
+/// Complete the transfer in progress, if any, as the event interrupt
+/// would, and invoke the driver's completion callback.  Nothing
+/// happens while interrupts are disabled.
+inline void ServiceSmbus() {
+  auto* const h = g_smbus_handle;
+  if (!h || !g_host_irq_enabled) { return; }
+  const bool tx = h->State == HAL_SMBUS_STATE_MASTER_BUSY_TX;
+  const bool rx = h->State == HAL_SMBUS_STATE_MASTER_BUSY_RX;
+  if (!tx && !rx) { return; }
+
+  smbus_counters.transfers++;
+  const uint8_t address = static_cast<uint8_t>(h->Address >> 1);
+  bool ack = false;
+  if (tx) {
+    ack = smbus_device.write &&
+        smbus_device.write(address, g_smbus_tx.data(), g_smbus_tx.size());
+  } else if (smbus_device.read) {
+    const auto data = smbus_device.read(address);
+    ack = data.size() >= h->XferSize;
+    if (ack) { std::memcpy(h->pBuffPtr, data.data(), h->XferSize); }
+  }
+
+  h->State = HAL_SMBUS_STATE_READY;
+  if (!ack) {
+    smbus_counters.nacks++;
+    h->ErrorCode |= HAL_SMBUS_ERROR_ACKF;
+    HAL_SMBUS_ErrorCallback(h);
+  } else if (tx) {
+    HAL_SMBUS_MasterTxCpltCallback(h);
+  } else {
+    HAL_SMBUS_MasterRxCpltCallback(h);
+  }
+}
+
+}
+}
+
+inline HAL_StatusTypeDef HAL_SMBUS_Init(SMBUS_HandleTypeDef* h) {
+  host::hal::g_smbus_handle = h;
+  host::hal::smbus_counters.inits++;
+  h->State = HAL_SMBUS_STATE_READY;
+  h->ErrorCode = HAL_SMBUS_ERROR_NONE;
+  return HAL_OK;
+}
+
+inline HAL_StatusTypeDef HAL_SMBUS_DeInit(SMBUS_HandleTypeDef* h) {
+  h->State = HAL_SMBUS_STATE_RESET;
+  return HAL_OK;
+}
+
+inline HAL_StatusTypeDef HAL_SMBUS_Master_Transmit_IT(
+    SMBUS_HandleTypeDef* h, uint16_t address, uint8_t* data, uint16_t size,
+    uint32_t options) {
+  if (h->State != HAL_SMBUS_STATE_READY) { return HAL_BUSY; }
+  host::hal::g_smbus_tx.assign(data, data + size);
+  h->Address = address;
+  h->XferSize = size;
+  h->XferOptions = options;
+  h->ErrorCode = HAL_SMBUS_ERROR_NONE;
+  h->State = HAL_SMBUS_STATE_MASTER_BUSY_TX;
+  return HAL_OK;
+}
+
+inline HAL_StatusTypeDef HAL_SMBUS_Master_Receive_IT(
+    SMBUS_HandleTypeDef* h, uint16_t address, uint8_t* data, uint16_t size,
+    uint32_t options) {
+  if (h->State != HAL_SMBUS_STATE_READY) { return HAL_BUSY; }
+  h->Address = address;
+  h->pBuffPtr = data;
+  h->XferSize = size;
+  h->XferOptions = options;
+  h->ErrorCode = HAL_SMBUS_ERROR_NONE;
+  h->State = HAL_SMBUS_STATE_MASTER_BUSY_RX;
+  return HAL_OK;
+}
+
+/// A driver spinning on the state is interrupted by the completion.
+inline HAL_SMBUS_StateTypeDef HAL_SMBUS_GetState(SMBUS_HandleTypeDef* h) {
+  host::hal::ServiceSmbus();
+  return static_cast<HAL_SMBUS_StateTypeDef>(h->State);
+}
+
+inline uint32_t HAL_SMBUS_GetError(SMBUS_HandleTypeDef* h) {
+  return h->ErrorCode;
+}
+
+inline void HAL_SMBUS_EV_IRQHandler(SMBUS_HandleTypeDef*) {
+  host::hal::ServiceSmbus();
+}
+
+inline void HAL_SMBUS_ER_IRQHandler(SMBUS_HandleTypeDef*) {}
+
+inline void HAL_SMBUSEx_EnableFastModePlus(uint32_t) {}
+inline void HAL_SMBUSEx_DisableFastModePlus(uint32_t) {}
+
+// mbed
+
+[[noreturn]] inline void mbed_die() {
+  std::fprintf(stderr, "mbed_die\n");
+  std::abort();
+}
+
+class I2C {
+ public:
+  I2C(PinName, PinName) {}
+};
+
+namespace host {
+namespace hal {
+
+inline std::vector<std::pair<PinName, void (*)()>> g_fall_handlers;
+
+/// Deliver a falling edge on 'pin' to any InterruptIn watching it.
+inline void FallingEdge(PinName pin) {
+  if (!g_host_irq_enabled) { return; }
+  for (const auto& handler : g_fall_handlers) {
+    if (handler.first == pin) { handler.second(); }
+  }
+}
+
+}
+}
+
+/// Only falling edges are supported, and they are delivered by
+/// host::hal::FallingEdge().
+class InterruptIn {
+ public:
+  InterruptIn(PinName pin) : pin_(pin) {}
+
+  void fall(void (*callback)()) {
+    host::hal::g_fall_handlers.push_back({pin_, callback});
+  }
+
+ private:
+  const PinName pin_;
+};
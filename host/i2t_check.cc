@@ -0,0 +1,122 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+///
+/// Checks that the I^2t fuse emulation trips after the time given by
+/// its configured curve, for both the fast and slow models at a range
+/// of multiples of their limit.
+///
+/// Usage: i2t_check [--period-us N] [--tolerance X]
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "fw/i2t_limiter.h"
+#include "host/check.h"
+
+namespace {
+
+using fw::I2tLimiter;
+
+struct Options {
+  int period_us = 1000;
+  double tolerance = 0.01;
+};
+
+Options ParseOptions(int argc, char** argv) {
+  Options result;
+  host::OptionParser("[--period-us N] [--tolerance X]")
+      .Value("--period-us", &result.period_us)
+      .Value("--tolerance", &result.tolerance)
+      .Parse(argc, argv);
+  result.period_us = std::max(1, result.period_us);
+  return result;
+}
+
+// Apply 'current_A' from cold and return the time at which the
+// limiter first trips, or a negative value if it does not within
+// 'max_s'.
+double MeasureTripTime(const I2tLimiter::Config& config, float period_s,
+                       float current_A, double max_s) {
+  I2tLimiter limiter{&config};
+  limiter.Configure(period_s);
+  const long max_steps =
+      static_cast<long>(max_s / static_cast<double>(period_s));
+  for (long step = 1; step <= max_steps; step++) {
+    if (limiter.Update(current_A) == I2tLimiter::kTrip) {
+      return step * static_cast<double>(period_s);
+    }
+  }
+  return -1.0;
+}
+
+}
+
+int main(int argc, char** argv) {
+  const auto options = ParseOptions(argc, argv);
+  const float period_s = options.period_us * 1e-6f;
+
+  // A limit well above any current applied, so that only one model
+  // is exercised at a time.
+  constexpr float kDisabled_A = 1e6f;
+
+  const I2tLimiter::Config defaults;
+  struct Model {
+    const char* name;
+    bool fast;
+    float limit_A;
+    float time_constant_s;
+  };
+  const Model models[] = {
+    { "fast", true, defaults.fast_limit_A, defaults.fast_time_constant_s },
+    { "slow", false, defaults.slow_limit_A, defaults.slow_time_constant_s },
+  };
+  const float multiples[] = { 1.05f, 1.2f, 1.5f, 2.0f, 3.0f, 5.0f, 10.0f };
+
+  host::CheckCounter check;
+  for (const auto& model : models) {
+    I2tLimiter::Config config = defaults;
+    config.fast_limit_A = model.fast ? model.limit_A : kDisabled_A;
+    config.slow_limit_A = model.fast ? kDisabled_A : model.limit_A;
+
+    for (const float multiple : multiples) {
+      const float current_A = multiple * model.limit_A;
+      const double expected_s = I2tLimiter::TripTime(
+          current_A, model.limit_A, model.time_constant_s);
+      const double measured_s = MeasureTripTime(
+          config, period_s, current_A, 2.0 * expected_s + 1.0);
+
+      // The limiter can only trip on a sample boundary.
+      const double allowed_s =
+          options.tolerance * expected_s + static_cast<double>(period_s);
+      const double error_s = measured_s - expected_s;
+      check(measured_s >= 0.0 && std::abs(error_s) <= allowed_s,
+            "%s %.2fx %.1f A: expected %.4f s measured %.4f s",
+            model.name, static_cast<double>(multiple),
+            static_cast<double>(current_A), expected_s, measured_s);
+    }
+
+    // At or below the limit the model must never trip.
+    const float below_A = 0.99f * model.limit_A;
+    const double never_s = MeasureTripTime(
+        config, period_s, below_A,
+        10.0 * static_cast<double>(model.time_constant_s));
+    check(never_s < 0.0, "%s %.1f A never trips",
+          model.name, static_cast<double>(below_A));
+  }
+
+  return check.Finish();
+}
@@ -0,0 +1,321 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+///
+/// Runs the LM5066 driver, fw/lm5066.cc, against a model of the
+/// device through the HAL shim in host/hal.
+///
+///  * The startup configuration must reach the device.
+///  * Block reads must arrive at the configured rate, and the
+///    integrated energy must match the model.
+///  * Faults injected at every phase of the read cycle must be
+///    reported through the alert callback within a few milliseconds.
+///  * A device which stops responding must be reported, and reads
+///    must resume once it returns.
+///
+/// Usage: lm5066_driver_test [--seconds S] [--tolerance PERCENT]
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "mbed.h"
+
+#include "mjlib/micro/async_exclusive.h"
+#include "mjlib/micro/async_stream.h"
+#include "mjlib/micro/command_manager.h"
+#include "mjlib/micro/flash.h"
+#include "mjlib/micro/persistent_config.h"
+#include "mjlib/micro/pool_ptr.h"
+#include "mjlib/micro/telemetry_manager.h"
+
+#include "fw/lm5066.h"
+#include "fw/millisecond_timer.h"
+#include "host/check.h"
+#include "host/lm5066_model.h"
+
+namespace {
+
+namespace micro = mjlib::micro;
+
+using D = fw::Lm5066Decoder;
+using Model = host::Lm5066Model;
+
+constexpr double kPi = 3.14159265358979323846;
+
+constexpr PinName kSda = PA_0;
+constexpr PinName kScl = PB_0;
+constexpr PinName kSmba = PC_0;
+
+// Roughly what a 400kHz bus completes in a millisecond.
+constexpr int kTransfersPerMs = 2;
+
+struct Options {
+  double seconds = 60.0;
+  double tolerance = 0.5;
+};
+
+class NullStream : public micro::AsyncStream {
+ public:
+  void AsyncReadSome(const mjlib::base::string_span&,
+                     const micro::SizeCallback&) override {}
+
+  void AsyncWriteSome(const std::string_view& data,
+                      const micro::SizeCallback& callback) override {
+    callback(micro::error_code(), data.size());
+  }
+};
+
+class RamFlash : public micro::FlashInterface {
+ public:
+  Info GetInfo() override {
+    Info result;
+    result.start = data_;
+    result.end = data_ + sizeof(data_);
+    return result;
+  }
+
+  void Erase() override { std::memset(data_, 0xff, sizeof(data_)); }
+  void Unlock() override {}
+  void Lock() override {}
+  void ProgramByte(char* ptr, uint8_t value) override { *ptr = value; }
+
+ private:
+  char data_[4096] = {};
+};
+
+/// The driver and everything it is constructed with, connected to a
+/// model of the device.
+class Bench {
+ public:
+  Bench() {
+    Model::Waveforms waveforms;
+    // A load which varies on several time scales, with short pulses.
+    waveforms.current_A = [](double t) {
+      const double base = 10.0 + 5.0 * std::sin(2.0 * kPi * t / 7.0);
+      const double pulse = (std::fmod(t, 3.3) < 0.05) ? 30.0 : 0.0;
+      return base + pulse;
+    };
+    model_.emplace(Model::Options(), waveforms);
+
+    host::hal::smbus_device.write =
+        [this](uint8_t address, const uint8_t* data, size_t size) {
+          if (!connected_) { return false; }
+          return model_->Write(address, data, size, false);
+        };
+    host::hal::smbus_device.read = [this](uint8_t address) {
+      if (!connected_) { return std::vector<uint8_t>(); }
+      return model_->Read(address, false);
+    };
+
+    fw::Lm5066::Options options;
+    options.sda = kSda;
+    options.scl = kScl;
+    options.smba = kSmba;
+    lm5066_.emplace(&pool_, &command_manager_, &persistent_config_,
+                    &telemetry_manager_, &timer_, options);
+    lm5066_->set_alert_callback([this](fw::Lm5066::Fault fault) {
+        alerts_.push_back({now_ms_, fault});
+      });
+  }
+
+  struct Alert {
+    int64_t time_ms;
+    fw::Lm5066::Fault fault;
+  };
+
+  /// Advance by one millisecond, as the main loop would.
+  void Step() {
+    now_ms_++;
+    model_->Advance(0.001);
+    TIM5->CNT += 1000;
+
+    lm5066_->PollMillisecond();
+
+    for (int i = 0; i < kTransfersPerMs; i++) {
+      const bool alert = model_->alert();
+      if (alert && !last_alert_) { host::hal::FallingEdge(kSmba); }
+      last_alert_ = alert;
+      host::hal::ServiceSmbus();
+    }
+  }
+
+  void Run(double seconds) {
+    const int64_t end_ms = now_ms_ + static_cast<int64_t>(seconds * 1000.0);
+    while (now_ms_ < end_ms) { Step(); }
+  }
+
+  int64_t now_ms() const { return now_ms_; }
+  Model* model() { return &*model_; }
+  const fw::Lm5066::Status& status() const { return lm5066_->status(); }
+  const std::vector<Alert>& alerts() const { return alerts_; }
+
+  void set_connected(bool connected) { connected_ = connected; }
+
+  void ClearModelFaults() {
+    const uint8_t clear = D::kClearFaults;
+    model_->Write(0x40, &clear, 1, false);
+    last_alert_ = model_->alert();
+  }
+
+ private:
+  micro::SizedPool<8192> pool_;
+  NullStream stream_;
+  micro::AsyncExclusive<micro::AsyncWriteStream> write_stream_{&stream_};
+  micro::CommandManager command_manager_{&pool_, &stream_, &write_stream_};
+  char output_buffer_[2048] = {};
+  micro::TelemetryManager telemetry_manager_{
+    &pool_, &command_manager_, &write_stream_, output_buffer_};
+  RamFlash flash_;
+  micro::PersistentConfig persistent_config_{
+    pool_, command_manager_, flash_, output_buffer_};
+  fw::MillisecondTimer timer_;
+
+  std::optional<Model> model_;
+  std::optional<fw::Lm5066> lm5066_;
+
+  int64_t now_ms_ = 0;
+  bool connected_ = true;
+  bool last_alert_ = false;
+  std::vector<Alert> alerts_;
+};
+
+void CheckStartup(Bench* bench, host::CheckCounter* check) {
+  (*check)(bench->model()->device_setup() == 0x24,
+           "device setup written, 0x%02x",
+           bench->model()->device_setup());
+  (*check)(bench->model()->average_log2() == 4,
+           "averaging configured, 2^%d", bench->model()->average_log2());
+}
+
+void CheckUpdates(Bench* bench, const Options& options,
+                  host::CheckCounter* check) {
+  const auto start_count = bench->status().update_count;
+  const int64_t start_nacks = host::hal::smbus_counters.nacks;
+  bench->Run(options.seconds);
+
+  const double updates = bench->status().update_count - start_count;
+  const double expected = options.seconds * 100.0;
+  (*check)(std::abs(updates - expected) <= 2.0,
+           "%.0f block reads in %.0f s, expected %.0f",
+           updates, options.seconds, expected);
+  (*check)(std::abs(bench->status().update_rate_hz - 100.0f) < 1.0f,
+           "update rate %.2f Hz",
+           static_cast<double>(bench->status().update_rate_hz));
+  (*check)(bench->status().bus_errors == 0 &&
+           host::hal::smbus_counters.nacks == start_nacks,
+           "no bus errors, %d",
+           static_cast<int>(bench->status().bus_errors));
+
+  const double true_Wh = bench->model()->energy_Wh();
+  const double decoded_Wh = bench->status().energy_uW_hr * 1e-6;
+  const double error_percent = 100.0 * (decoded_Wh - true_Wh) / true_Wh;
+  (*check)(std::abs(error_percent) <= options.tolerance,
+           "energy true %.4f Wh, decoded %.4f Wh, error %.3f%%",
+           true_Wh, decoded_Wh, error_percent);
+}
+
+void CheckAlerts(Bench* bench, host::CheckCounter* check) {
+  struct Case {
+    const char* name;
+    uint16_t bits;
+    D::Fault expected;
+  };
+
+  const Case cases[] = {
+    { "over_current", Model::kIOcFault, D::Fault::kOverCurrent },
+    { "over_temp", Model::kOtempFault, D::Fault::kOverTemperature },
+    { "over_voltage", Model::kVinOvFault, D::Fault::kOverVoltage },
+    { "circuit_breaker", Model::kCbFault, D::Fault::kCircuitBreaker },
+    // STATUS_WORD reports both of these as a manufacturer specific
+    // fault, and only the next block read tells them apart.
+    { "mosfet_shorted", Model::kExtMosfetShorted, D::Fault::kCircuitBreaker },
+  };
+
+  // The injection times step through every millisecond of the read
+  // cycle, so that some arrive while a block read holds the bus.
+  constexpr int kMaxLatencyMs = 5;
+  int total = 0;
+  int correct = 0;
+  int64_t max_latency_ms = 0;
+  for (int phase = 0; phase < 10; phase++) {
+    for (const auto& test : cases) {
+      bench->Run(0.013);
+      const auto start_alerts = bench->alerts().size();
+      const auto start_ms = bench->now_ms();
+      bench->model()->InjectFault(test.bits);
+      bench->Run(0.001 * kMaxLatencyMs * 2);
+
+      total++;
+      const auto& alerts = bench->alerts();
+      if (alerts.size() == start_alerts + 1 &&
+          alerts.back().fault == test.expected) {
+        correct++;
+        max_latency_ms =
+            std::max(max_latency_ms, alerts.back().time_ms - start_ms);
+      } else {
+        std::printf("  %s at %lld ms: %d alerts\n", test.name,
+                    static_cast<long long>(start_ms),
+                    static_cast<int>(alerts.size() - start_alerts));
+      }
+      bench->ClearModelFaults();
+    }
+  }
+  (*check)(correct == total, "%d of %d alerts reported", correct, total);
+  (*check)(max_latency_ms <= kMaxLatencyMs, "alert latency at most %d ms",
+           static_cast<int>(max_latency_ms));
+}
+
+void CheckNoResponse(Bench* bench, host::CheckCounter* check) {
+  const auto start_errors = bench->status().bus_errors;
+  bench->set_connected(false);
+  bench->Run(0.1);
+  (*check)(bench->status().bus_errors > start_errors &&
+           bench->status().fault == D::Fault::kNoResponse,
+           "missing device reported, %d bus errors",
+           static_cast<int>(bench->status().bus_errors - start_errors));
+
+  bench->set_connected(true);
+  const auto start_count = bench->status().update_count;
+  bench->Run(0.1);
+  (*check)(bench->status().update_count > start_count &&
+           bench->status().fault == D::Fault::kNone,
+           "reads resume, %d since reconnect",
+           static_cast<int>(bench->status().update_count - start_count));
+}
+
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  host::OptionParser("[--seconds S] [--tolerance PERCENT]")
+      .Value("--seconds", &options.seconds)
+      .Value("--tolerance", &options.tolerance)
+      .Parse(argc, argv);
+
+  host::CheckCounter check;
+  Bench bench;
+
+  CheckStartup(&bench, &check);
+  CheckUpdates(&bench, options, &check);
+  CheckAlerts(&bench, &check);
+  CheckNoResponse(&bench, &check);
+
+  return check.Finish();
+}
@@ -0,0 +1,320 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "fw/lm5066_decoder.h"
+
+namespace host {
+
+/// A model of the LM5066 as seen from its SMBus interface.
+///
+/// The analog inputs are scripted as functions of time.  They are
+/// sampled at a fixed rate, averaged as configured by
+/// SAMPLES_FOR_AVG, and encoded using the inverse of the firmware's
+/// nominal conversions, so that a perfect decoder recovers the
+/// scripted values up to quantization.
+///
+/// Supported commands are DEVICE_SETUP, CLEAR_FAULTS, STATUS_WORD,
+/// SAMPLES_FOR_AVG, BLOCK_READ, AVG_BLOCK_READ, and reads from the
+/// alert response address.  Anything else sets the CML fault.
+class Lm5066Model {
+ public:
+  using D = fw::Lm5066Decoder;
+  using Waveform = std::function<double (double time_s)>;
+
+  struct Options {
+    uint8_t address = 0x40;
+
+    // How often the device samples each of its inputs.
+    double sample_period_s = 0.001;
+  };
+
+  struct Waveforms {
+    Waveform current_A = [](double) { return 0.0; };
+    Waveform vin_V = [](double) { return 48.0; };
+    Waveform vout_V = [](double) { return 48.0; };
+    Waveform temperature_C = [](double) { return 25.0; };
+  };
+
+  // Bits of the first two bytes of BLOCK_READ, the diagnostic word.
+  enum DiagnosticBits : uint16_t {
+    kCbFault = 1 << 0,
+    kCmlFault = 1 << 1,
+    kOtempFault = 1 << 2,
+    kIOcFault = 1 << 3,
+    kVinOvFault = 1 << 4,
+    kVinUvFault = 1 << 5,
+    kDeviceOff = 1 << 6,
+    kConfigPreset = 1 << 7,
+    kExtMosfetShorted = 1 << 8,
+    kTimerLatchedOff = 1 << 9,
+    kOtempWarn = 1 << 10,
+    kPowerGood = 1 << 11,
+    kVinOvWarn = 1 << 12,
+    kVinUvWarn = 1 << 13,
+    kIOpWarn = 1 << 14,
+    kVoutUvWarn = 1 << 15,
+  };
+
+  Lm5066Model(const Options& options, const Waveforms& waveforms)
+      : options_(options),
+        waveforms_(waveforms) {
+    Sample();
+  }
+
+  /// Advance the model time, sampling the inputs as the device would.
+  void Advance(double dt_s) {
+    const double end_s = time_s_ + dt_s;
+    while (next_sample_s_ <= end_s) {
+      time_s_ = next_sample_s_;
+      Sample();
+    }
+    time_s_ = end_s;
+  }
+
+  /// Latch the given diagnostic bits, as the device does when it
+  /// detects a fault, and assert SMBA.
+  void InjectFault(uint16_t bits) {
+    latched_ |= bits;
+    alert_ = true;
+  }
+
+  /// Set diagnostic bits which follow a condition rather than latch.
+  void SetLive(uint16_t bits) { live_ = bits; }
+
+  /// Whether SMBA is asserted.
+  bool alert() const { return alert_; }
+
+  double time_s() const { return time_s_; }
+
+  /// The exact energy delivered by the scripted waveforms at the
+  /// sample instants, for comparison against the decoded energy.
+  double energy_Wh() const { return energy_J_ / 3600.0; }
+
+  uint8_t device_setup() const { return device_setup_; }
+  int average_log2() const { return average_log2_; }
+
+  /// An SMBus write or send byte transaction: the command code
+  /// followed by any data, and the PEC if 'pec' is set.  Returns
+  /// false if the transaction was not acknowledged.
+  bool Write(uint8_t address, const uint8_t* data, size_t size, bool pec) {
+    if (address != options_.address || size < 1) { return false; }
+    if (pec) {
+      const uint8_t addr_w = static_cast<uint8_t>(address << 1);
+      uint8_t crc = D::Pec(&addr_w, 1);
+      crc = D::Pec(data, size - 1, crc);
+      if (crc != data[size - 1]) {
+        latched_ |= kCmlFault;
+        return false;
+      }
+      size--;
+    }
+
+    const uint8_t command = data[0];
+    switch (command) {
+      case D::kClearFaults: {
+        latched_ = 0;
+        alert_ = false;
+        return true;
+      }
+      case D::kDeviceSetup: {
+        if (size == 2) { device_setup_ = data[1]; }
+        command_ = command;
+        return true;
+      }
+      case D::kSamplesForAvg: {
+        if (size == 2) {
+          average_log2_ = std::min<int>(12, data[1]);
+        }
+        command_ = command;
+        return true;
+      }
+      case D::kStatusWord:
+      case D::kBlockRead:
+      case D::kAvgBlockRead: {
+        command_ = command;
+        return true;
+      }
+    }
+
+    latched_ |= kCmlFault;
+    alert_ = true;
+    return false;
+  }
+
+  /// An SMBus read following a write of the command code.  The
+  /// response, including a trailing PEC if 'pec' is set, is
+  /// returned.
+  std::vector<uint8_t> Read(uint8_t address, bool pec) {
+    std::vector<uint8_t> result;
+    if (address == D::kAlertResponseAddress) {
+      if (!alert_) { return result; }
+      alert_ = false;
+      result.push_back(static_cast<uint8_t>(options_.address << 1));
+      return result;
+    }
+    if (address != options_.address) { return result; }
+
+    switch (command_) {
+      case D::kDeviceSetup: {
+        result.push_back(device_setup_);
+        break;
+      }
+      case D::kSamplesForAvg: {
+        result.push_back(static_cast<uint8_t>(average_log2_));
+        break;
+      }
+      case D::kStatusWord: {
+        const uint16_t word = StatusWord();
+        result.push_back(word & 0xff);
+        result.push_back(word >> 8);
+        break;
+      }
+      case D::kBlockRead:
+      case D::kAvgBlockRead: {
+        const auto& values =
+            (command_ == D::kBlockRead) ? last_ : average_;
+        const uint16_t diag = latched_ | live_;
+        result.push_back(D::kBlockReadSize - 1);
+        result.push_back(diag & 0xff);
+        result.push_back(diag >> 8);
+        for (int i = 0; i < kNumChannels; i++) {
+          const uint16_t counts = static_cast<uint16_t>(values[i]);
+          result.push_back(counts & 0xff);
+          result.push_back(counts >> 8);
+        }
+        break;
+      }
+      default: {
+        latched_ |= kCmlFault;
+        return result;
+      }
+    }
+
+    if (pec) {
+      const uint8_t header[] = {
+        static_cast<uint8_t>(address << 1),
+        command_,
+        static_cast<uint8_t>((address << 1) | 1),
+      };
+      uint8_t crc = D::Pec(header, sizeof(header));
+      crc = D::Pec(result.data(), result.size(), crc);
+      result.push_back(crc);
+    }
+    return result;
+  }
+
+ private:
+  enum Channel {
+    kIin,
+    kVout,
+    kVin,
+    kPin,
+    kTemperature,
+    kNumChannels,
+  };
+
+  using Counts = std::array<int, kNumChannels>;
+
+  static int Quantize(double value) {
+    return std::max(0, std::min(4095, static_cast<int>(std::lround(value))));
+  }
+
+  void Sample() {
+    const double t = time_s_;
+    const double current_A = waveforms_.current_A(t);
+    const double vin_V = waveforms_.vin_V(t);
+    const double power_W = current_A * vin_V;
+
+    // Integrate exactly what was sampled, holding each sample until
+    // the next.
+    energy_J_ += power_W * options_.sample_period_s;
+    next_sample_s_ = t + options_.sample_period_s;
+
+    // These invert the nominal conversions in the firmware.
+    Counts sample;
+    sample[kIin] = Quantize(
+        (current_A - static_cast<double>(D::kIinOffset)) /
+        static_cast<double>(D::kIinScale));
+    sample[kVout] = Quantize(
+        (waveforms_.vout_V(t) * 4587.0 - 2400.0) / 100.0);
+    sample[kVin] = Quantize((vin_V * 4578.0 - 1200.0) / 100.0);
+    sample[kPin] = Quantize(
+        (power_W - static_cast<double>(D::kPinOffset)) /
+        static_cast<double>(D::kPinScale));
+    sample[kTemperature] = Quantize(waveforms_.temperature_C(t) * 16.0);
+    last_ = sample;
+
+    // The device reports the mean of the most recent block of
+    // 2^average_log2 samples.
+    const int block = 1 << average_log2_;
+    for (int i = 0; i < kNumChannels; i++) {
+      // Temperature is never averaged.
+      if (i == kTemperature) { continue; }
+      sum_[i] += sample[i];
+    }
+    sum_count_++;
+    if (sum_count_ >= block) {
+      for (int i = 0; i < kNumChannels; i++) {
+        average_[i] = (i == kTemperature) ?
+            sample[i] : (sum_[i] + block / 2) / block;
+        sum_[i] = 0;
+      }
+      sum_count_ = 0;
+    }
+  }
+
+  uint16_t StatusWord() const {
+    const uint16_t diag = latched_ | live_;
+    uint16_t result = 0;
+    if (diag & kCmlFault) { result |= D::kStatusCml; }
+    if (diag & (kOtempFault | kOtempWarn)) { result |= D::kStatusTemperature; }
+    if (diag & kVinUvFault) { result |= D::kStatusVinUv | D::kStatusInput; }
+    if (diag & kVinOvFault) { result |= D::kStatusInput; }
+    if (diag & kIOcFault) { result |= D::kStatusIoutOc; }
+    if (diag & (kCbFault | kExtMosfetShorted)) { result |= D::kStatusMfr; }
+    return result;
+  }
+
+  const Options options_;
+  const Waveforms waveforms_;
+
+  double time_s_ = 0.0;
+  double next_sample_s_ = 0.0;
+  double energy_J_ = 0.0;
+
+  uint8_t command_ = 0;
+  uint8_t device_setup_ = 0;
+  int average_log2_ = 0;
+
+  uint16_t latched_ = 0;
+  uint16_t live_ = 0;
+  bool alert_ = false;
+
+  Counts last_ = {};
+  Counts average_ = {};
+  Counts sum_ = {};
+  int sum_count_ = 0;
+};
+
+}
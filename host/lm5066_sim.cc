@@ -0,0 +1,257 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+///
+/// Runs the LM5066 decoder against a model of the device.
+///
+///  * Energy integration is checked over a long simulated run, and
+///    the cost of each decode is measured.
+///  * Faults are injected one at a time and in combination, and the
+///    decoded fault is checked against the priority order.
+///
+/// Usage: lm5066_sim [--hours H] [--period-ms P] [--average-log2 N] [--pec]
+///                   [--tolerance PERCENT]
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "fw/lm5066_decoder.h"
+#include "host/check.h"
+#include "host/lm5066_model.h"
+
+namespace {
+
+using D = fw::Lm5066Decoder;
+using Model = host::Lm5066Model;
+
+constexpr double kPi = 3.14159265358979323846;
+
+struct Options {
+  double hours = 1.0;
+  int period_ms = 10;
+  int average_log2 = 4;
+  bool pec = false;
+  double tolerance = 0.1;
+};
+
+Options ParseOptions(int argc, char** argv) {
+  Options result;
+  host::OptionParser("[--hours H] [--period-ms P] [--average-log2 N] "
+                     "[--pec] [--tolerance PERCENT]")
+      .Value("--hours", &result.hours)
+      .Value("--period-ms", &result.period_ms)
+      .Value("--average-log2", &result.average_log2)
+      .Flag("--pec", &result.pec)
+      .Value("--tolerance", &result.tolerance)
+      .Parse(argc, argv);
+  result.period_ms = std::max(1, result.period_ms);
+  return result;
+}
+
+// Issue the same transactions as the firmware driver, returning false
+// if the response was missing or failed its PEC.
+bool ReadCommand(Model* model, uint8_t command, bool pec,
+                 std::vector<uint8_t>* response) {
+  const uint8_t address = 0x40;
+  if (!model->Write(address, &command, 1, false)) { return false; }
+  *response = model->Read(address, pec);
+  if (response->empty()) { return false; }
+  if (!pec) { return true; }
+
+  const uint8_t header[] = {
+    static_cast<uint8_t>(address << 1),
+    command,
+    static_cast<uint8_t>((address << 1) | 1),
+  };
+  uint8_t crc = D::Pec(header, sizeof(header));
+  crc = D::Pec(response->data(), response->size() - 1, crc);
+  if (crc != response->back()) { return false; }
+  response->pop_back();
+  return true;
+}
+
+bool WriteByte(Model* model, uint8_t command, uint8_t value, bool pec) {
+  uint8_t data[3] = { command, value, 0 };
+  if (pec) {
+    const uint8_t addr_w = 0x40 << 1;
+    data[2] = D::Pec(data, 2, D::Pec(&addr_w, 1));
+  }
+  return model->Write(0x40, data, pec ? 3 : 2, pec);
+}
+
+void RunEnergy(const Options& options, host::CheckCounter* check) {
+  Model::Waveforms waveforms;
+  // A load which varies on several time scales, with short pulses.
+  waveforms.current_A = [](double t) {
+    const double base = 10.0 + 5.0 * std::sin(2.0 * kPi * t / 7.0);
+    const double pulse = (std::fmod(t, 3.3) < 0.05) ? 30.0 : 0.0;
+    return base + pulse;
+  };
+  waveforms.vin_V = [](double t) {
+    return 48.0 - 0.5 * std::sin(2.0 * kPi * t / 600.0);
+  };
+  waveforms.vout_V = waveforms.vin_V;
+  waveforms.temperature_C = [](double t) {
+    return 40.0 + 10.0 * std::sin(2.0 * kPi * t / 3600.0);
+  };
+
+  Model model{{}, waveforms};
+  if (!(*check)(WriteByte(&model, D::kSamplesForAvg,
+                          static_cast<uint8_t>(options.average_log2),
+                          options.pec),
+                "SAMPLES_FOR_AVG acknowledged")) {
+    return;
+  }
+
+  D decoder;
+  D::Status status;
+  std::vector<uint8_t> response;
+
+  const double period_s = options.period_ms * 1e-3;
+  const int64_t updates =
+      static_cast<int64_t>(options.hours * 3600.0 / period_s);
+  int64_t errors = 0;
+  std::chrono::nanoseconds decode_time{0};
+
+  for (int64_t i = 0; i < updates; i++) {
+    model.Advance(period_s);
+    if (!ReadCommand(&model, D::kAvgBlockRead, options.pec, &response) ||
+        response.size() != D::kBlockReadSize) {
+      errors++;
+      continue;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    decoder.DecodeBlock(response.data(), static_cast<float>(period_s),
+                        &status);
+    decode_time += std::chrono::steady_clock::now() - start;
+  }
+
+  const double true_Wh = model.energy_Wh();
+  const double decoded_Wh = status.energy_uW_hr * 1e-6;
+  const double error_percent = 100.0 * (decoded_Wh - true_Wh) / true_Wh;
+
+  std::printf("simulated %.2f hours, %lld updates at %d ms, "
+              "2^%d averaging%s\n",
+              options.hours, static_cast<long long>(updates),
+              options.period_ms, options.average_log2,
+              options.pec ? ", PEC" : "");
+  std::printf("  decode: %.1f ns per update\n",
+              static_cast<double>(decode_time.count()) /
+              std::max<int64_t>(1, updates - errors));
+  (*check)(std::abs(error_percent) <= options.tolerance,
+           "energy true %.3f Wh, decoded %.3f Wh, error %.3f%%",
+           true_Wh, decoded_Wh, error_percent);
+  (*check)(errors == 0, "bus errors %lld", static_cast<long long>(errors));
+}
+
+void RunFaults(const Options& options, host::CheckCounter* check) {
+  struct Case {
+    const char* name;
+    uint16_t bits;
+    D::Fault expected;
+  };
+
+  const Case cases[] = {
+    { "none", 0, D::Fault::kNone },
+    { "over_current", Model::kIOcFault, D::Fault::kOverCurrent },
+    { "under_voltage is ignored", Model::kVinUvFault, D::Fault::kNone },
+    { "over_temp", Model::kOtempFault, D::Fault::kOverTemperature },
+    { "over_voltage", Model::kVinOvFault, D::Fault::kOverVoltage },
+    { "circuit_breaker", Model::kCbFault, D::Fault::kCircuitBreaker },
+    { "mosfet_shorted", Model::kExtMosfetShorted, D::Fault::kMosfetShorted },
+    { "communications", Model::kCmlFault, D::Fault::kCommunications },
+    { "over_temp over over_current",
+      Model::kOtempFault | Model::kIOcFault, D::Fault::kOverTemperature },
+    { "over_voltage over over_temp",
+      Model::kVinOvFault | Model::kOtempFault, D::Fault::kOverVoltage },
+    { "mosfet_shorted over circuit_breaker",
+      Model::kExtMosfetShorted | Model::kCbFault, D::Fault::kMosfetShorted },
+    { "communications over everything", 0xffff, D::Fault::kCommunications },
+  };
+
+  for (const auto& test : cases) {
+    Model model{{}, {}};
+    model.InjectFault(test.bits);
+
+    D decoder;
+    D::Status status;
+    std::vector<uint8_t> response;
+
+    const bool block_ok =
+        ReadCommand(&model, D::kBlockRead, options.pec, &response);
+    if (block_ok) { decoder.DecodeBlock(response.data(), 0.0f, &status); }
+
+    // The alert path must agree that there is a fault whenever the
+    // block read does.
+    const bool ara_ok = test.bits == 0 ||
+        model.Read(D::kAlertResponseAddress, false).size() == 1;
+    const bool word_ok =
+        ReadCommand(&model, D::kStatusWord, options.pec, &response);
+    const uint16_t status_word =
+        word_ok ? static_cast<uint16_t>(response[0] | (response[1] << 8)) : 0;
+    const bool alert_agrees =
+        (D::DecodeStatusWord(status_word) == D::Fault::kNone) ==
+        (test.expected == D::Fault::kNone);
+
+    (*check)(block_ok && ara_ok && word_ok && alert_agrees &&
+             status.fault == test.expected,
+             "fault %s", test.name);
+  }
+
+  {
+    // CLEAR_FAULTS releases latched faults.
+    Model model{{}, {}};
+    model.InjectFault(Model::kIOcFault);
+    const uint8_t clear = D::kClearFaults;
+    model.Write(0x40, &clear, 1, false);
+
+    D decoder;
+    D::Status status;
+    std::vector<uint8_t> response;
+    (*check)(ReadCommand(&model, D::kBlockRead, options.pec, &response) &&
+             (decoder.DecodeBlock(response.data(), 0.0f, &status),
+              status.fault == D::Fault::kNone) &&
+             !model.alert(),
+             "clear faults");
+  }
+
+  {
+    // DEVICE_SETUP reads back what was written.
+    Model model{{}, {}};
+    std::vector<uint8_t> response;
+    (*check)(WriteByte(&model, D::kDeviceSetup, 0x24, options.pec) &&
+             ReadCommand(&model, D::kDeviceSetup, options.pec, &response) &&
+             response.size() == 1 && response[0] == 0x24,
+             "device setup");
+  }
+}
+
+}
+
+int main(int argc, char** argv) {
+  const auto options = ParseOptions(argc, argv);
+
+  host::CheckCounter check;
+  RunFaults(options, &check);
+  RunEnergy(options, &check);
+
+  return check.Finish();
+}
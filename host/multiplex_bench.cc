@@ -0,0 +1,665 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+///
+/// Sends register queries to a power_dist over SocketCAN at a fixed
+/// rate, matches the replies, and reports the round trip latency and
+/// loss rate as JSON.
+///
+/// Usage: multiplex_bench [options]
+///
+///  --interface NAME    the SocketCAN interface (default can0)
+///  --target ID         the multiplex id of the board (default 32)
+///  --source ID         our multiplex id (default 0)
+///  --prefix N          the CAN prefix configured on the board
+///  --rate HZ           queries per second (default 100)
+///  --sweep A:B:STEP    run once for each rate from A to B inclusive
+///  --duration S        seconds per run (default 10)
+///  --timeout-ms N      a query is lost if not answered in this time
+///  --mix KIND:W,...    relative weights of each query kind, from
+///                      single, multi, broadcast, and uuid
+///                      (default single:1)
+///  --uuid A,B,C,D      the board UUID as 4 int32 words, read from
+///                      the board if not given
+///  --no-brs            do not use bit rate switching
+///  --report FILE       write the report here instead of stdout
+///
+///  --respond ID        instead, answer queries as a board with this
+///                      id would, for exercising the tool on vcan
+///  --respond-delay-us N  delay each answer by this much
+///
+/// The query kinds are:
+///
+///  single     one int16 register (0x010)
+///  multi      every status register, 0x000-0x023, in four blocks
+///  broadcast  one int8 register (0x001) sent to id 0x7f
+///  uuid       one int8 register (0x002) sent to id 0x7f, prefixed
+///             by a write of the UUID mask so only the target
+///             answers
+///
+/// The board processes queries in order, so when a reply arrives all
+/// outstanding queries sent before the one it answers are counted as
+/// lost.
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "host/can_socket.h"
+#include "host/multiplex_protocol.h"
+
+namespace {
+
+namespace mp = host::multiplex;
+using host::CanSocket;
+using host::NowNs;
+
+enum Kind {
+  kSingle,
+  kMulti,
+  kBroadcast,
+  kUuidMasked,
+  kNumKinds,
+};
+
+const char* const kKindNames[kNumKinds] = {
+  "single", "multi", "broadcast", "uuid",
+};
+
+// The first register of each kind's reply, which identifies it.
+constexpr uint32_t kSignature[kNumKinds] = {
+  0x010, 0x000, 0x001, 0x002,
+};
+
+constexpr uint32_t kUuidRegister = 0x150;
+constexpr uint32_t kUuidMaskRegister = 0x154;
+
+using Uuid = std::array<int32_t, 4>;
+
+struct Options {
+  std::string interface = "can0";
+  int target = 32;
+  int source = 0;
+  uint32_t prefix = 0;
+  std::vector<double> rates = {100.0};
+  double duration_s = 10.0;
+  double timeout_ms = 20.0;
+  std::array<int, kNumKinds> mix = {1, 0, 0, 0};
+  bool have_uuid = false;
+  Uuid uuid = {};
+  bool brs = true;
+  std::string report;
+
+  int respond = -1;
+  int respond_delay_us = 0;
+};
+
+[[noreturn]] void Usage(const char* name) {
+  std::fprintf(stderr,
+               "usage: %s [--interface NAME] [--target ID] [--source ID] "
+               "[--prefix N] [--rate HZ | --sweep A:B:STEP] "
+               "[--duration S] [--timeout-ms N] [--mix KIND:W,...] "
+               "[--uuid A,B,C,D] [--no-brs] [--report FILE]\n"
+               "       %s [--interface NAME] [--prefix N] --respond ID "
+               "[--respond-delay-us N] [--uuid A,B,C,D]\n",
+               name, name);
+  std::exit(1);
+}
+
+std::vector<std::string> Split(const std::string& value, char delimiter) {
+  std::vector<std::string> result;
+  size_t start = 0;
+  while (true) {
+    const size_t end = value.find(delimiter, start);
+    result.push_back(value.substr(start, end - start));
+    if (end == std::string::npos) { break; }
+    start = end + 1;
+  }
+  return result;
+}
+
+bool ParseMix(const std::string& value, std::array<int, kNumKinds>* mix) {
+  *mix = {};
+  for (const auto& item : Split(value, ',')) {
+    const auto fields = Split(item, ':');
+    if (fields.size() > 2) { return false; }
+    const int weight = (fields.size() == 2) ? std::atoi(fields[1].c_str()) : 1;
+    const auto it = std::find_if(
+        std::begin(kKindNames), std::end(kKindNames),
+        [&](const char* name) { return fields[0] == name; });
+    if (it == std::end(kKindNames) || weight < 0) { return false; }
+    (*mix)[it - std::begin(kKindNames)] = weight;
+  }
+  return std::any_of(mix->begin(), mix->end(), [](int w) { return w > 0; });
+}
+
+Options ParseOptions(int argc, char** argv) {
+  Options result;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const char* next = (i + 1 < argc) ? argv[i + 1] : nullptr;
+    if (arg == "--interface" && next) {
+      result.interface = next;
+      i++;
+    } else if (arg == "--target" && next) {
+      result.target = std::atoi(next);
+      i++;
+    } else if (arg == "--source" && next) {
+      result.source = std::atoi(next);
+      i++;
+    } else if (arg == "--prefix" && next) {
+      result.prefix = static_cast<uint32_t>(std::strtoul(next, nullptr, 0));
+      i++;
+    } else if (arg == "--rate" && next) {
+      result.rates = {std::strtod(next, nullptr)};
+      i++;
+    } else if (arg == "--sweep" && next) {
+      const auto fields = Split(next, ':');
+      if (fields.size() != 3) { Usage(argv[0]); }
+      const double start = std::strtod(fields[0].c_str(), nullptr);
+      const double end = std::strtod(fields[1].c_str(), nullptr);
+      const double step = std::strtod(fields[2].c_str(), nullptr);
+      if (start <= 0.0 || step <= 0.0 || end < start) { Usage(argv[0]); }
+      result.rates.clear();
+      for (int j = 0; start + j * step <= end * (1.0 + 1e-9); j++) {
+        result.rates.push_back(start + j * step);
+      }
+      i++;
+    } else if (arg == "--duration" && next) {
+      result.duration_s = std::strtod(next, nullptr);
+      i++;
+    } else if (arg == "--timeout-ms" && next) {
+      result.timeout_ms = std::strtod(next, nullptr);
+      i++;
+    } else if (arg == "--mix" && next) {
+      if (!ParseMix(next, &result.mix)) { Usage(argv[0]); }
+      i++;
+    } else if (arg == "--uuid" && next) {
+      const auto fields = Split(next, ',');
+      if (fields.size() != 4) { Usage(argv[0]); }
+      for (size_t j = 0; j < 4; j++) {
+        result.uuid[j] = static_cast<int32_t>(
+            std::strtoul(fields[j].c_str(), nullptr, 0));
+      }
+      result.have_uuid = true;
+      i++;
+    } else if (arg == "--no-brs") {
+      result.brs = false;
+    } else if (arg == "--report" && next) {
+      result.report = next;
+      i++;
+    } else if (arg == "--respond" && next) {
+      result.respond = std::atoi(next);
+      i++;
+    } else if (arg == "--respond-delay-us" && next) {
+      result.respond_delay_us = std::max(0, std::atoi(next));
+      i++;
+    } else {
+      Usage(argv[0]);
+    }
+  }
+
+  const auto valid_id = [](int id) { return id >= 0 && id < 0x7f; };
+  if (!valid_id(result.target) || !valid_id(result.source) ||
+      (result.respond >= 0 && !valid_id(result.respond)) ||
+      result.prefix > 0x1fff ||
+      result.duration_s <= 0.0 || result.timeout_ms <= 0.0 ||
+      std::any_of(result.rates.begin(), result.rates.end(),
+                  [](double rate) { return rate <= 0.0; })) {
+    Usage(argv[0]);
+  }
+  return result;
+}
+
+struct Frame {
+  uint32_t id = 0;
+  std::vector<uint8_t> data;
+};
+
+Frame MakeQuery(const Options& options, Kind kind, const Uuid& uuid) {
+  mp::FrameWriter writer;
+  uint8_t destination = static_cast<uint8_t>(options.target);
+  switch (kind) {
+    case kSingle: {
+      writer.Read(mp::kInt16, 0x010, 1);
+      break;
+    }
+    case kMulti: {
+      writer.Read(mp::kInt8, 0x000, 3);
+      writer.Read(mp::kInt16, 0x003, 3);
+      writer.Read(mp::kInt16, 0x010, 8);
+      writer.Read(mp::kFloat, 0x020, 4);
+      break;
+    }
+    case kBroadcast: {
+      destination = mp::kBroadcastId;
+      writer.Read(mp::kInt8, 0x001, 1);
+      break;
+    }
+    case kUuidMasked: {
+      destination = mp::kBroadcastId;
+      writer.Write(mp::kInt32, kUuidMaskRegister, uuid.data(), uuid.size());
+      writer.Read(mp::kInt8, 0x002, 1);
+      break;
+    }
+    case kNumKinds: {
+      break;
+    }
+  }
+
+  Frame result;
+  result.id = mp::CanId(options.prefix, static_cast<uint8_t>(options.source),
+                        destination, true);
+  result.data = writer.Padded();
+  return result;
+}
+
+/// Whether 'frame' is a reply from 'board' to 'options.source', and
+/// if so, its subframes.
+bool ParseReply(const Options& options, const struct canfd_frame& frame,
+                std::vector<mp::Subframe>* subframes) {
+  if ((frame.can_id & CAN_EFF_FLAG) == 0) { return false; }
+  const uint32_t id = frame.can_id & CAN_EFF_MASK;
+  if ((id >> 16) != options.prefix ||
+      ((id >> 8) & 0x7f) != static_cast<uint32_t>(options.target) ||
+      (id & 0xff) != static_cast<uint32_t>(options.source)) {
+    return false;
+  }
+  return mp::Parse(frame.data, frame.len, subframes) && !subframes->empty();
+}
+
+struct Stats {
+  int64_t sent = 0;
+  int64_t tx_dropped = 0;
+  int64_t received = 0;
+  int64_t lost = 0;
+  int64_t errors = 0;
+  std::vector<double> latency_us;
+};
+
+double Percentile(const std::vector<double>& sorted, double fraction) {
+  if (sorted.empty()) { return 0.0; }
+  const size_t rank = static_cast<size_t>(
+      std::ceil(fraction * static_cast<double>(sorted.size())));
+  return sorted[std::min(sorted.size() - 1, rank == 0 ? 0 : rank - 1)];
+}
+
+void WriteStats(FILE* out, const Stats& stats, const char* indent) {
+  auto sorted = stats.latency_us;
+  std::sort(sorted.begin(), sorted.end());
+  double sum = 0.0;
+  for (const double value : sorted) { sum += value; }
+  const int64_t settled = stats.received + stats.lost;
+
+  std::fprintf(out, "%s\"sent\": %lld,\n", indent,
+               static_cast<long long>(stats.sent));
+  std::fprintf(out, "%s\"tx_dropped\": %lld,\n", indent,
+               static_cast<long long>(stats.tx_dropped));
+  std::fprintf(out, "%s\"received\": %lld,\n", indent,
+               static_cast<long long>(stats.received));
+  std::fprintf(out, "%s\"lost\": %lld,\n", indent,
+               static_cast<long long>(stats.lost));
+  std::fprintf(out, "%s\"errors\": %lld,\n", indent,
+               static_cast<long long>(stats.errors));
+  std::fprintf(out, "%s\"loss_rate\": %.6f,\n", indent,
+               settled ? static_cast<double>(stats.lost) /
+               static_cast<double>(settled) : 0.0);
+  std::fprintf(out,
+               "%s\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, "
+               "\"p999\": %.1f, \"max\": %.1f, \"mean\": %.1f}",
+               indent,
+               Percentile(sorted, 0.5), Percentile(sorted, 0.99),
+               Percentile(sorted, 0.999),
+               sorted.empty() ? 0.0 : sorted.back(),
+               sorted.empty() ? 0.0 : sum / static_cast<double>(sorted.size()));
+}
+
+class Benchmark {
+ public:
+  Benchmark(const Options& options, CanSocket* socket)
+      : options_(options), socket_(socket) {}
+
+  /// Read the UUID from the board.  Returns false if it did not
+  /// answer.
+  bool ReadUuid(Uuid* uuid) {
+    mp::FrameWriter writer;
+    writer.Read(mp::kInt32, kUuidRegister, 4);
+    const uint32_t id = mp::CanId(
+        options_.prefix, static_cast<uint8_t>(options_.source),
+        static_cast<uint8_t>(options_.target), true);
+
+    for (int attempt = 0; attempt < 3; attempt++) {
+      socket_->Send(id, writer.Padded());
+      const int64_t deadline_ns = NowNs() + 200000000;
+      while (NowNs() < deadline_ns) {
+        socket_->Wait(deadline_ns);
+        struct canfd_frame frame = {};
+        while (socket_->Receive(&frame)) {
+          if (!ParseReply(options_, frame, &subframes_)) { continue; }
+          const auto& reply = subframes_.front();
+          if (reply.code != mp::kReply || reply.reg != kUuidRegister ||
+              reply.count != 4 || reply.type != mp::kInt32) {
+            continue;
+          }
+          for (size_t i = 0; i < 4; i++) { (*uuid)[i] = reply.Int(i); }
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  void Run(double rate_hz, const Uuid& uuid) {
+    for (int kind = 0; kind < kNumKinds; kind++) {
+      queries_[kind] = MakeQuery(options_, static_cast<Kind>(kind), uuid);
+    }
+    total_ = {};
+    kinds_ = {};
+    credit_ = {};
+    outstanding_.clear();
+
+    const int64_t period_ns = static_cast<int64_t>(1e9 / rate_hz);
+    const int64_t timeout_ns =
+        static_cast<int64_t>(options_.timeout_ms * 1e6);
+    const int64_t start_ns = NowNs();
+    const int64_t end_ns =
+        start_ns + static_cast<int64_t>(options_.duration_s * 1e9);
+    int64_t next_send_ns = start_ns;
+
+    while (true) {
+      const int64_t now_ns = NowNs();
+      if (now_ns >= end_ns && outstanding_.empty()) { break; }
+
+      if (now_ns < end_ns && now_ns >= next_send_ns) {
+        Send(now_ns);
+        next_send_ns += period_ns;
+        // If we fell far behind, for instance when descheduled,
+        // don't try to catch up with a burst.
+        if (now_ns - next_send_ns > 100 * period_ns) {
+          next_send_ns = now_ns + period_ns;
+        }
+      }
+
+      struct canfd_frame frame = {};
+      while (socket_->Receive(&frame)) { HandleFrame(frame); }
+      Expire(NowNs(), timeout_ns);
+
+      int64_t deadline_ns =
+          outstanding_.empty() ? end_ns :
+          std::min(end_ns, outstanding_.front().sent_ns + timeout_ns);
+      if (NowNs() < end_ns) {
+        deadline_ns = std::min(deadline_ns, next_send_ns);
+      }
+      socket_->Wait(deadline_ns);
+    }
+
+    elapsed_s_ = static_cast<double>(NowNs() - start_ns) * 1e-9;
+  }
+
+  void WriteRun(FILE* out, double rate_hz) const {
+    std::fprintf(out, "    {\n");
+    std::fprintf(out, "      \"rate_hz\": %.3f,\n", rate_hz);
+    std::fprintf(out, "      \"achieved_rate_hz\": %.3f,\n",
+                 static_cast<double>(total_.sent) / options_.duration_s);
+    std::fprintf(out, "      \"elapsed_s\": %.3f,\n", elapsed_s_);
+    WriteStats(out, total_, "      ");
+    std::fprintf(out, ",\n      \"kinds\": {");
+    bool first = true;
+    for (int kind = 0; kind < kNumKinds; kind++) {
+      if (options_.mix[kind] == 0) { continue; }
+      std::fprintf(out, "%s\n        \"%s\": {\n",
+                   first ? "" : ",", kKindNames[kind]);
+      WriteStats(out, kinds_[kind], "          ");
+      std::fprintf(out, "\n        }");
+      first = false;
+    }
+    std::fprintf(out, "\n      }\n    }");
+  }
+
+  const Stats& total() const { return total_; }
+
+ private:
+  struct Outstanding {
+    Kind kind = kSingle;
+    int64_t sent_ns = 0;
+  };
+
+  // Smooth weighted round robin, so that the mix is interleaved
+  // evenly rather than in runs.
+  Kind NextKind() {
+    int total_weight = 0;
+    int best = 0;
+    for (int kind = 0; kind < kNumKinds; kind++) {
+      credit_[kind] += options_.mix[kind];
+      total_weight += options_.mix[kind];
+      if (credit_[kind] > credit_[best]) { best = kind; }
+    }
+    credit_[best] -= total_weight;
+    return static_cast<Kind>(best);
+  }
+
+  void Send(int64_t now_ns) {
+    const Kind kind = NextKind();
+    const auto& query = queries_[kind];
+    if (!socket_->Send(query.id, query.data)) {
+      total_.tx_dropped++;
+      kinds_[kind].tx_dropped++;
+      return;
+    }
+    total_.sent++;
+    kinds_[kind].sent++;
+    outstanding_.push_back({kind, now_ns});
+  }
+
+  void HandleFrame(const struct canfd_frame& frame) {
+    const int64_t now_ns = NowNs();
+    if (!ParseReply(options_, frame, &subframes_)) { return; }
+
+    const auto& first = subframes_.front();
+    const auto it = std::find_if(
+        outstanding_.begin(), outstanding_.end(),
+        [&](const Outstanding& item) {
+          return kSignature[item.kind] == first.reg;
+        });
+    if (it == outstanding_.end()) {
+      // A reply to something which already timed out.
+      return;
+    }
+
+    for (auto lost = outstanding_.begin(); lost != it; ++lost) {
+      total_.lost++;
+      kinds_[lost->kind].lost++;
+    }
+
+    const bool error = std::any_of(
+        subframes_.begin(), subframes_.end(),
+        [](const mp::Subframe& subframe) {
+          return subframe.code == mp::kWriteError ||
+              subframe.code == mp::kReadError;
+        });
+    const double latency_us = static_cast<double>(now_ns - it->sent_ns) * 1e-3;
+    for (auto* stats : {&total_, &kinds_[it->kind]}) {
+      stats->received++;
+      if (error) { stats->errors++; }
+      stats->latency_us.push_back(latency_us);
+    }
+
+    outstanding_.erase(outstanding_.begin(), it + 1);
+  }
+
+  void Expire(int64_t now_ns, int64_t timeout_ns) {
+    while (!outstanding_.empty() &&
+           now_ns - outstanding_.front().sent_ns >= timeout_ns) {
+      total_.lost++;
+      kinds_[outstanding_.front().kind].lost++;
+      outstanding_.pop_front();
+    }
+  }
+
+  const Options& options_;
+  CanSocket* const socket_;
+
+  std::array<Frame, kNumKinds> queries_;
+  std::array<int, kNumKinds> credit_ = {};
+  std::deque<Outstanding> outstanding_;
+  std::vector<mp::Subframe> subframes_;
+
+  Stats total_;
+  std::array<Stats, kNumKinds> kinds_;
+  double elapsed_s_ = 0.0;
+};
+
+/// Answers queries as a power_dist would, with dummy values, so the
+/// tool itself can be exercised on a virtual CAN interface.
+int Respond(const Options& options, CanSocket* socket) {
+  const Uuid uuid = options.have_uuid ?
+      options.uuid : Uuid{{0x12345678, 0x23456789, 0x3456789a, 0x456789ab}};
+
+  struct Pending {
+    int64_t due_ns = 0;
+    Frame frame;
+  };
+  std::deque<Pending> pending;
+  std::vector<mp::Subframe> subframes;
+  std::vector<int32_t> values;
+
+  while (true) {
+    const int64_t now_ns = NowNs();
+    while (!pending.empty() && pending.front().due_ns <= now_ns) {
+      socket->Send(pending.front().frame.id, pending.front().frame.data);
+      pending.pop_front();
+    }
+
+    struct canfd_frame frame = {};
+    while (socket->Receive(&frame)) {
+      if ((frame.can_id & CAN_EFF_FLAG) == 0) { continue; }
+      const uint32_t id = frame.can_id & CAN_EFF_MASK;
+      const uint8_t destination = id & 0x7f;
+      const uint8_t source = (id >> 8) & 0x7f;
+      if ((id >> 16) != options.prefix ||
+          (destination != options.respond &&
+           destination != mp::kBroadcastId) ||
+          (id & (mp::kReplyRequested << 8)) == 0) {
+        continue;
+      }
+      if (!mp::Parse(frame.data, frame.len, &subframes)) { continue; }
+
+      mp::FrameWriter writer;
+      bool discard = false;
+      for (const auto& subframe : subframes) {
+        if (subframe.code == mp::kWrite) {
+          for (uint32_t i = 0; i < subframe.count; i++) {
+            const uint32_t reg = subframe.reg + i;
+            if (reg >= kUuidMaskRegister && reg < kUuidMaskRegister + 4 &&
+                subframe.Int(i) != uuid[reg - kUuidMaskRegister]) {
+              discard = true;
+            }
+          }
+        } else if (subframe.code == mp::kRead) {
+          values.clear();
+          for (uint32_t i = 0; i < subframe.count; i++) {
+            const uint32_t reg = subframe.reg + i;
+            values.push_back(
+                (reg >= kUuidRegister && reg < kUuidRegister + 4) ?
+                uuid[reg - kUuidRegister] : static_cast<int32_t>(reg));
+          }
+          writer.Reply(subframe.type, subframe.reg,
+                       values.data(), values.size());
+        }
+      }
+      if (discard || writer.size() == 0 || writer.size() > 64) { continue; }
+
+      pending.push_back(
+          {NowNs() + options.respond_delay_us * 1000,
+           {mp::CanId(options.prefix, static_cast<uint8_t>(options.respond),
+                      source, false),
+            writer.Padded()}});
+    }
+
+    socket->Wait(pending.empty() ? NowNs() + 1000000000 :
+                 pending.front().due_ns);
+  }
+}
+
+}
+
+int main(int argc, char** argv) {
+  const auto options = ParseOptions(argc, argv);
+  CanSocket socket(options.interface, options.brs);
+
+  if (options.respond >= 0) {
+    return Respond(options, &socket);
+  }
+
+  Benchmark benchmark(options, &socket);
+
+  Uuid uuid = options.uuid;
+  if (options.mix[kUuidMasked] > 0 && !options.have_uuid) {
+    if (!benchmark.ReadUuid(&uuid)) {
+      std::fprintf(stderr, "could not read the UUID from id %d\n",
+                   options.target);
+      return 1;
+    }
+  }
+
+  FILE* out = stdout;
+  if (!options.report.empty()) {
+    out = std::fopen(options.report.c_str(), "w");
+    if (!out) {
+      std::fprintf(stderr, "could not open %s\n", options.report.c_str());
+      return 1;
+    }
+  }
+
+  std::fprintf(out, "{\n");
+  std::fprintf(out, "  \"interface\": \"%s\",\n", options.interface.c_str());
+  std::fprintf(out, "  \"target\": %d,\n", options.target);
+  std::fprintf(out, "  \"source\": %d,\n", options.source);
+  std::fprintf(out, "  \"prefix\": %u,\n", options.prefix);
+  std::fprintf(out, "  \"brs\": %s,\n", options.brs ? "true" : "false");
+  std::fprintf(out, "  \"duration_s\": %.3f,\n", options.duration_s);
+  std::fprintf(out, "  \"timeout_ms\": %.3f,\n", options.timeout_ms);
+  std::fprintf(out, "  \"mix\": {");
+  for (int kind = 0; kind < kNumKinds; kind++) {
+    std::fprintf(out, "%s\"%s\": %d", kind ? ", " : "",
+                 kKindNames[kind], options.mix[kind]);
+  }
+  std::fprintf(out, "},\n");
+  std::fprintf(out, "  \"runs\": [\n");
+
+  for (size_t i = 0; i < options.rates.size(); i++) {
+    const double rate_hz = options.rates[i];
+    benchmark.Run(rate_hz, uuid);
+    benchmark.WriteRun(out, rate_hz);
+    std::fprintf(out, "%s\n", (i + 1 < options.rates.size()) ? "," : "");
+    std::fflush(out);
+
+    const auto& total = benchmark.total();
+    std::fprintf(stderr, "%8.1f Hz: sent %lld received %lld lost %lld\n",
+                 rate_hz, static_cast<long long>(total.sent),
+                 static_cast<long long>(total.received),
+                 static_cast<long long>(total.lost));
+  }
+
+  std::fprintf(out, "  ]\n}\n");
+  if (out != stdout) { std::fclose(out); }
+  return 0;
+}
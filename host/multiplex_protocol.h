@@ -0,0 +1,277 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace host {
+
+/// Encodes and decodes frames of the multiplex register protocol, as
+/// carried in the data of a single CAN-FD frame.  See the moteus
+/// reference documentation, section "CAN Format".
+namespace multiplex {
+
+enum Type : uint8_t {
+  kInt8 = 0,
+  kInt16 = 1,
+  kInt32 = 2,
+  kFloat = 3,
+};
+
+enum Code : uint8_t {
+  kWrite = 0x00,
+  kRead = 0x10,
+  kReply = 0x20,
+  kWriteError = 0x30,
+  kReadError = 0x31,
+  kClientToServer = 0x40,
+  kServerToClient = 0x41,
+  kClientPollServer = 0x42,
+  kNop = 0x50,
+};
+
+constexpr uint8_t kBroadcastId = 0x7f;
+
+// Set in the source byte of the CAN ID when a reply is requested.
+constexpr uint8_t kReplyRequested = 0x80;
+
+inline size_t TypeSize(Type type) {
+  switch (type) {
+    case kInt8: return 1;
+    case kInt16: return 2;
+    case kInt32: return 4;
+    case kFloat: return 4;
+  }
+  return 0;
+}
+
+/// The smallest CAN-FD frame which can hold 'size' bytes, or 0 if
+/// none can.
+inline size_t RoundUpDlc(size_t size) {
+  if (size <= 8) { return size; }
+  for (size_t dlc : {12, 16, 20, 24, 32, 48, 64}) {
+    if (size <= dlc) { return dlc; }
+  }
+  return 0;
+}
+
+inline uint32_t CanId(uint32_t prefix, uint8_t source, uint8_t destination,
+                      bool reply_requested) {
+  return (prefix << 16) |
+      ((source | (reply_requested ? kReplyRequested : 0)) << 8) |
+      destination;
+}
+
+class FrameWriter {
+ public:
+  void Read(Type type, uint32_t reg, uint32_t count) {
+    Header(kRead, type, count);
+    Varuint(reg);
+  }
+
+  /// Write integer values, converted to 'type'.
+  void Write(Type type, uint32_t reg, const int32_t* values, size_t count) {
+    Header(kWrite, type, count);
+    Varuint(reg);
+    Values(type, values, count);
+  }
+
+  void Reply(Type type, uint32_t reg, const int32_t* values, size_t count) {
+    Header(kReply, type, count);
+    Varuint(reg);
+    Values(type, values, count);
+  }
+
+  /// Send 'size' bytes to a tunnel 'channel'.
+  void TunnelWrite(uint32_t channel, const uint8_t* data, size_t size) {
+    data_.push_back(kClientToServer);
+    Varuint(channel);
+    Varuint(static_cast<uint32_t>(size));
+    data_.insert(data_.end(), data, data + size);
+  }
+
+  /// Ask for up to 'max_size' bytes from a tunnel 'channel'.
+  void TunnelPoll(uint32_t channel, uint32_t max_size) {
+    data_.push_back(kClientPollServer);
+    Varuint(channel);
+    Varuint(max_size);
+  }
+
+  void Error(Code code, uint32_t reg, uint32_t error) {
+    data_.push_back(code);
+    Varuint(reg);
+    Varuint(error);
+  }
+
+  const std::vector<uint8_t>& data() const { return data_; }
+  size_t size() const { return data_.size(); }
+  void clear() { data_.clear(); }
+
+  /// The data padded with NOPs to a valid CAN-FD length.
+  std::vector<uint8_t> Padded() const {
+    auto result = data_;
+    result.resize(RoundUpDlc(data_.size()), kNop);
+    return result;
+  }
+
+ private:
+  void Header(Code code, Type type, uint32_t count) {
+    if (count >= 1 && count <= 3) {
+      data_.push_back(code | (type << 2) | count);
+    } else {
+      data_.push_back(code | (type << 2));
+      Varuint(count);
+    }
+  }
+
+  void Varuint(uint32_t value) {
+    do {
+      uint8_t byte = value & 0x7f;
+      value >>= 7;
+      if (value) { byte |= 0x80; }
+      data_.push_back(byte);
+    } while (value);
+  }
+
+  void Values(Type type, const int32_t* values, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+      if (type == kFloat) {
+        const float value = static_cast<float>(values[i]);
+        uint8_t bytes[4] = {};
+        std::memcpy(bytes, &value, sizeof(value));
+        data_.insert(data_.end(), bytes, bytes + 4);
+      } else {
+        const uint32_t value = static_cast<uint32_t>(values[i]);
+        for (size_t j = 0; j < TypeSize(type); j++) {
+          data_.push_back((value >> (8 * j)) & 0xff);
+        }
+      }
+    }
+  }
+
+  std::vector<uint8_t> data_;
+};
+
+struct Subframe {
+  Code code = kNop;
+  Type type = kInt8;
+
+  // For tunnel subframes, the channel.
+  uint32_t reg = 0;
+
+  // For tunnel subframes, the number of bytes.
+  uint32_t count = 0;
+
+  // For writes and replies, the encoded values, and for tunnel
+  // subframes, the bytes.
+  const uint8_t* values = nullptr;
+
+  // For errors, the error code.
+  uint32_t error = 0;
+
+  /// Decode value 'index' as a signed integer.
+  int32_t Int(size_t index) const {
+    const size_t size = TypeSize(type);
+    const uint8_t* data = values + index * size;
+    if (type == kFloat) {
+      float value = 0.0f;
+      std::memcpy(&value, data, sizeof(value));
+      return static_cast<int32_t>(value);
+    }
+    uint32_t value = 0;
+    for (size_t i = 0; i < size; i++) {
+      value |= static_cast<uint32_t>(data[i]) << (8 * i);
+    }
+    // Sign extend.
+    const int shift = 32 - 8 * static_cast<int>(size);
+    return static_cast<int32_t>(value << shift) >> shift;
+  }
+};
+
+/// Split a frame into its subframes, stopping at the first NOP.
+/// Returns false if the frame was malformed.
+inline bool Parse(const uint8_t* data, size_t size,
+                  std::vector<Subframe>* subframes) {
+  subframes->clear();
+  size_t pos = 0;
+
+  auto varuint = [&](uint32_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+      if (pos >= size) { return false; }
+      const uint8_t byte = data[pos++];
+      *value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) { return true; }
+    }
+    return false;
+  };
+
+  while (pos < size) {
+    const uint8_t byte = data[pos++];
+    Subframe subframe;
+
+    if (byte == kNop) { return true; }
+    if (byte == kWriteError || byte == kReadError) {
+      subframe.code = static_cast<Code>(byte);
+      if (!varuint(&subframe.reg) || !varuint(&subframe.error)) {
+        return false;
+      }
+      subframes->push_back(subframe);
+      continue;
+    }
+    if (byte == kClientToServer || byte == kServerToClient) {
+      subframe.code = static_cast<Code>(byte);
+      if (!varuint(&subframe.reg) || !varuint(&subframe.count)) {
+        return false;
+      }
+      if (pos + subframe.count > size) { return false; }
+      subframe.values = data + pos;
+      pos += subframe.count;
+      subframes->push_back(subframe);
+      continue;
+    }
+    if (byte == kClientPollServer) {
+      subframe.code = static_cast<Code>(byte);
+      if (!varuint(&subframe.reg) || !varuint(&subframe.count)) {
+        return false;
+      }
+      subframes->push_back(subframe);
+      continue;
+    }
+
+    const uint8_t code = byte & 0xf0;
+    if (code != kWrite && code != kRead && code != kReply) { return false; }
+    subframe.code = static_cast<Code>(code);
+    subframe.type = static_cast<Type>((byte >> 2) & 0x03);
+    subframe.count = byte & 0x03;
+    if (subframe.count == 0 && !varuint(&subframe.count)) { return false; }
+    if (!varuint(&subframe.reg)) { return false; }
+
+    if (subframe.code != kRead) {
+      const size_t bytes = subframe.count * TypeSize(subframe.type);
+      if (pos + bytes > size) { return false; }
+      subframe.values = data + pos;
+      pos += bytes;
+    }
+    subframes->push_back(subframe);
+  }
+  return true;
+}
+
+}
+}
@@ -0,0 +1,246 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+namespace host {
+
+/// A model of everything around the power_dist board: the battery on
+/// the input, the TPS2490 hot swap controller and its FETs, the load
+/// capacitance and load on the output, and the power switch.
+///
+/// All state advances only in Step(), so a given sequence of calls
+/// always produces the same result.
+class PowerDistModel {
+ public:
+  struct Options {
+    // The battery.  The open circuit voltage is interpolated from
+    // ocv_V at 0%, 10%, ... 100% state of charge, and matches the
+    // default of the firmware's estimator.
+    double capacity_Ah = 5.0;
+    double battery_resistance_ohm = 0.05;
+    double initial_soc = 1.0;
+    std::array<double, 11> ocv_V = { {
+        19.8, 21.6, 22.2, 22.5, 22.74, 22.98,
+        23.22, 23.52, 23.82, 24.36, 25.2,
+      } };
+
+    // The TPS2490.  Once enabled, the gate takes gate_delay_s to
+    // charge to the FET threshold, then the output is charged with
+    // a constant inrush current until it is within pgood_margin_V of
+    // the input.  Once on, if the current exceeds
+    // circuit_breaker_A for longer than fault_time_s, it latches off
+    // until disabled.
+    double gate_delay_s = 0.005;
+    double inrush_A = 5.0;
+    double pgood_margin_V = 0.5;
+    double circuit_breaker_A = 120.0;
+    double fault_time_s = 0.002;
+    double rds_on_ohm = 0.004;
+
+    // The output.
+    double capacitance_F = 1000e-6;
+
+    // Constant current and power loads draw nothing below this
+    // output voltage, as most regulators have an undervoltage
+    // lockout.
+    double load_min_V = 12.0;
+
+    // The FET temperature sensor rises by sensor_C_per_W of
+    // conduction loss with the time constant sensor_time_constant_s.
+    double ambient_C = 25.0;
+    double sensor_C_per_W = 10.0;
+    double sensor_time_constant_s = 30.0;
+  };
+
+  enum class LoadType {
+    kNone,
+    kResistance,
+    kCurrent,
+    kPower,
+  };
+
+  /// The levels driven by the firmware.
+  struct Drive {
+    bool override_pwr = false;
+  };
+
+  PowerDistModel(const Options& options)
+      : options_(options),
+        soc_(options.initial_soc),
+        sensor_C_(options.ambient_C) {}
+
+  Options* mutable_options() { return &options_; }
+
+  void set_switch(bool on) { switch_on_ = on; }
+  void set_load(LoadType type, double value) {
+    load_type_ = type;
+    load_value_ = value;
+  }
+  void set_short(bool shorted) { short_ = shorted; }
+  void set_soc(double soc) { soc_ = std::max(0.0, std::min(1.0, soc)); }
+
+  /// Latch the TPS2490 off, as if it had detected a fault.
+  void Tps2490Fault() {
+    tps2490_latched_ = true;
+  }
+
+  void Step(double dt_s, const Drive& drive) {
+    const double ocv_V = ocv();
+    const double r_batt = options_.battery_resistance_ohm;
+    const double r_path = r_batt + options_.rds_on_ohm;
+    const double c = options_.capacitance_F;
+    const double v = output_V_;
+
+    if (!drive.override_pwr) {
+      // Disabling the TPS2490 clears any latched fault.
+      tps2490_latched_ = false;
+      pgood_ = false;
+      overcurrent_s_ = 0.0;
+      gate_s_ = 0.0;
+    }
+    const bool enabled = drive.override_pwr && !tps2490_latched_ &&
+        gate_s_ >= options_.gate_delay_s;
+    if (drive.override_pwr) { gate_s_ += dt_s; }
+
+    // The load is evaluated at the start of the step, except that
+    // resistive loads and the short are handled implicitly so that
+    // they remain stable for any step.
+    double conductance_S = 0.0;
+    double load_A = 0.0;
+    switch (load_type_) {
+      case LoadType::kNone: {
+        break;
+      }
+      case LoadType::kResistance: {
+        if (load_value_ > 0.0) { conductance_S += 1.0 / load_value_; }
+        break;
+      }
+      case LoadType::kCurrent: {
+        if (v >= options_.load_min_V) { load_A = load_value_; }
+        break;
+      }
+      case LoadType::kPower: {
+        if (v >= options_.load_min_V) { load_A = load_value_ / v; }
+        break;
+      }
+    }
+    if (short_) { conductance_S += 1.0 / kShortOhm; }
+
+    double fet_A = 0.0;
+    double new_v = v;
+    if (enabled && pgood_) {
+      // Fully on, the output is connected to the battery through
+      // the FETs.  Solve this with implicit Euler, as the time
+      // constant can be much shorter than the step.
+      new_v = (c * v / dt_s + ocv_V / r_path - load_A) /
+          (c / dt_s + 1.0 / r_path + conductance_S);
+      fet_A = (ocv_V - new_v) / r_path;
+    } else {
+      if (enabled) {
+        // Starting, the output is charged with a constant current.
+        fet_A = (ocv_V - v > options_.pgood_margin_V) ?
+            options_.inrush_A : std::max(0.0, (ocv_V - v) / r_path);
+      }
+      new_v = (c * v / dt_s + fet_A - load_A) / (c / dt_s + conductance_S);
+      // Body diodes prevent the output from going negative.
+      new_v = std::max(0.0, new_v);
+      if (enabled && ocv_V - new_v <= options_.pgood_margin_V) {
+        pgood_ = true;
+      }
+    }
+    output_V_ = new_v;
+    current_A_ = fet_A;
+    input_V_ = ocv_V - fet_A * r_batt;
+
+    if (enabled && pgood_ && fet_A > options_.circuit_breaker_A) {
+      overcurrent_s_ += dt_s;
+      if (overcurrent_s_ >= options_.fault_time_s) {
+        tps2490_latched_ = true;
+        pgood_ = false;
+      }
+    } else {
+      overcurrent_s_ = 0.0;
+    }
+
+    soc_ -= fet_A * dt_s / (3600.0 * options_.capacity_Ah);
+    soc_ = std::max(0.0, std::min(1.0, soc_));
+
+    const double power_W = input_V_ * fet_A;
+    if (power_W >= 0.0) {
+      delivered_Wh_ += power_W * dt_s / 3600.0;
+    } else {
+      regenerated_Wh_ += -power_W * dt_s / 3600.0;
+    }
+
+    const double loss_W = fet_A * fet_A * options_.rds_on_ohm;
+    const double alpha = 1.0 - std::exp(-dt_s / options_.sensor_time_constant_s);
+    sensor_C_ += alpha *
+        (options_.ambient_C + loss_W * options_.sensor_C_per_W - sensor_C_);
+  }
+
+  bool switch_on() const { return switch_on_; }
+
+  /// The level of the TPS2490 fault pin as read by the firmware,
+  /// which is high only while the output is fully on.
+  bool tps2490_flt() const { return pgood_ && !tps2490_latched_; }
+
+  double input_V() const { return input_V_; }
+  double output_V() const { return output_V_; }
+  double current_A() const { return current_A_; }
+  double fet_temp_C() const { return sensor_C_; }
+  double soc() const { return soc_; }
+  double delivered_Wh() const { return delivered_Wh_; }
+  double regenerated_Wh() const { return regenerated_Wh_; }
+
+  double ocv() const {
+    const auto& table = options_.ocv_V;
+    const double position = soc_ * (table.size() - 1);
+    const int index = std::min<int>(table.size() - 2,
+                                    static_cast<int>(position));
+    const double fraction = position - index;
+    return table[index] + fraction * (table[index + 1] - table[index]);
+  }
+
+ private:
+  static constexpr double kShortOhm = 0.01;
+
+  Options options_;
+
+  bool switch_on_ = false;
+  LoadType load_type_ = LoadType::kNone;
+  double load_value_ = 0.0;
+  bool short_ = false;
+
+  double soc_ = 1.0;
+  double input_V_ = 0.0;
+  double output_V_ = 0.0;
+  double current_A_ = 0.0;
+  double sensor_C_ = 25.0;
+
+  bool pgood_ = false;
+  bool tps2490_latched_ = false;
+  double gate_s_ = 0.0;
+  double overcurrent_s_ = 0.0;
+
+  double delivered_Wh_ = 0.0;
+  double regenerated_Wh_ = 0.0;
+};
+
+}
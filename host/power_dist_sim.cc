@@ -0,0 +1,683 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+///
+/// Runs the firmware's power state machine against a model of the
+/// battery, TPS2490, load and switch in virtual time, driven by a
+/// scenario file, and writes a CSV trace of the state and
+/// measurements.
+///
+/// Usage: power_dist_sim [options] SCENARIO
+///
+///  --output FILE   write the trace here instead of stdout
+///  --trace-ms N    write a row every N ms, and on every state change
+///  --step-us N     the model time step, which must divide 1000
+///  --noise X       scale the measurement noise, 0 for none
+///  --seed N        seed for the measurement noise
+///
+/// Each scenario line is a time in seconds, or +seconds relative to
+/// the previous line, followed by a command:
+///
+///  switch on|off
+///  lock TIME_100MS
+///  force on|off|disable
+///  load none | load resistance OHM | load current A | load power W
+///  short on|off
+///  capacitance UF
+///  battery soc PERCENT | battery resistance OHM | battery capacity AH
+///  ambient C
+///  inrush A
+///  gate_delay MS
+///  fault tps2490
+///  lm5066 on|off
+///  fault lm5066 none|over_current|...
+///  config GROUP.FIELD VALUE   (groups: power i2t fet_thermal
+///                              battery precharge)
+///  expect state off|precharging|on|fault
+///  expect fault CODE
+///  end
+///
+/// A failed expectation is reported, and makes the simulator exit
+/// with a failure status, so that scenarios can be run as tests.  So
+/// does a history whose one second buckets do not sum to the
+/// integrated output power.
+///
+/// '#' begins a comment.
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "fw/power_dist_control.h"
+#include "fw/power_history.h"
+#include "host/power_dist_model.h"
+
+namespace {
+
+using Control = fw::PowerDistControl;
+using Model = host::PowerDistModel;
+using Lm5066Fault = fw::Lm5066Decoder::Fault;
+
+struct Options {
+  std::string scenario;
+  std::string output;
+  int trace_ms = 10;
+  int step_us = 50;
+  double noise = 0.0;
+  uint32_t seed = 1;
+};
+
+[[noreturn]] void Usage(const char* name) {
+  std::fprintf(stderr,
+               "usage: %s [--output FILE] [--trace-ms N] [--step-us N] "
+               "[--noise X] [--seed N] SCENARIO\n", name);
+  std::exit(1);
+}
+
+Options ParseOptions(int argc, char** argv) {
+  Options result;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const char* next = (i + 1 < argc) ? argv[i + 1] : nullptr;
+    if (arg == "--output" && next) {
+      result.output = next;
+      i++;
+    } else if (arg == "--trace-ms" && next) {
+      result.trace_ms = std::max(1, std::atoi(next));
+      i++;
+    } else if (arg == "--step-us" && next) {
+      result.step_us = std::atoi(next);
+      i++;
+    } else if (arg == "--noise" && next) {
+      result.noise = std::strtod(next, nullptr);
+      i++;
+    } else if (arg == "--seed" && next) {
+      result.seed = static_cast<uint32_t>(std::strtoul(next, nullptr, 10));
+      i++;
+    } else if (!arg.empty() && arg[0] != '-' && result.scenario.empty()) {
+      result.scenario = arg;
+    } else {
+      Usage(argv[0]);
+    }
+  }
+  if (result.scenario.empty() ||
+      result.step_us <= 0 || 1000 % result.step_us != 0) {
+    Usage(argv[0]);
+  }
+  return result;
+}
+
+struct Event {
+  int64_t time_us = 0;
+  int line = 0;
+  std::vector<std::string> args;
+};
+
+std::vector<Event> ReadScenario(const std::string& filename) {
+  std::ifstream in(filename);
+  if (!in) {
+    std::fprintf(stderr, "could not open %s\n", filename.c_str());
+    std::exit(1);
+  }
+
+  std::vector<Event> result;
+  int64_t last_us = 0;
+  std::string line;
+  int line_number = 0;
+  while (std::getline(in, line)) {
+    line_number++;
+    line = line.substr(0, line.find('#'));
+    std::istringstream tokens(line);
+    std::string time;
+    if (!(tokens >> time)) { continue; }
+
+    const bool relative = time[0] == '+';
+    const double time_s =
+        std::strtod(time.c_str() + (relative ? 1 : 0), nullptr);
+    Event event;
+    event.time_us = (relative ? last_us : 0) +
+        static_cast<int64_t>(std::llround(time_s * 1e6));
+    event.line = line_number;
+    std::string arg;
+    while (tokens >> arg) { event.args.push_back(arg); }
+
+    if (event.args.empty() || event.time_us < last_us) {
+      std::fprintf(stderr, "%s:%d: invalid event\n",
+                   filename.c_str(), line_number);
+      std::exit(1);
+    }
+    last_us = event.time_us;
+    result.push_back(event);
+  }
+  return result;
+}
+
+// Sets one field of a configuration structure by name.
+class FieldSetter {
+ public:
+  FieldSetter(const std::string& name, double value)
+      : name_(name), value_(value) {}
+
+  template <typename NameValuePair>
+  void Visit(const NameValuePair& nvp) {
+    if (name_ != nvp.name()) { return; }
+    found_ = Set(nvp.value());
+  }
+
+  bool found() const { return found_; }
+
+ private:
+  template <typename T>
+  bool Set(T* value) {
+    if constexpr (std::is_arithmetic_v<T>) {
+      *value = static_cast<T>(value_);
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  const std::string name_;
+  const double value_;
+  bool found_ = false;
+};
+
+// Writes the names, or the values, of every scalar field of a
+// structure as CSV columns.
+class CsvHeader {
+ public:
+  CsvHeader(FILE* out, const char* prefix) : out_(out), prefix_(prefix) {}
+
+  template <typename NameValuePair>
+  void Visit(const NameValuePair& nvp) {
+    using T = std::remove_pointer_t<decltype(nvp.value())>;
+    if constexpr (std::is_arithmetic_v<T> || std::is_enum_v<T>) {
+      std::fprintf(out_, ",%s%s", prefix_, nvp.name());
+    }
+  }
+
+ private:
+  FILE* const out_;
+  const char* const prefix_;
+};
+
+class CsvValues {
+ public:
+  CsvValues(FILE* out) : out_(out) {}
+
+  template <typename NameValuePair>
+  void Visit(const NameValuePair& nvp) {
+    Print(*nvp.value());
+  }
+
+ private:
+  template <typename T>
+  void Print(const T& value) {
+    if constexpr (std::is_floating_point_v<T>) {
+      std::fprintf(out_, ",%.6g", static_cast<double>(value));
+    } else if constexpr (std::is_enum_v<T>) {
+      std::fprintf(out_, ",%d", static_cast<int>(value));
+    } else if constexpr (std::is_unsigned_v<T>) {
+      std::fprintf(out_, ",%llu", static_cast<unsigned long long>(value));
+    } else if constexpr (std::is_integral_v<T>) {
+      std::fprintf(out_, ",%lld", static_cast<long long>(value));
+    }
+  }
+
+  FILE* const out_;
+};
+
+class Simulator {
+ public:
+  Simulator(const Options& options, FILE* out)
+      : options_(options),
+        out_(out),
+        model_(Model::Options()),
+        random_(options.seed) {}
+
+  int Run(const std::vector<Event>& events) {
+    WriteHeader();
+
+    const auto start = std::chrono::steady_clock::now();
+    size_t next_event = 0;
+    const int64_t end_us =
+        events.empty() ? 0 : events.back().time_us;
+
+    for (; now_us_ <= end_us; now_us_ += options_.step_us) {
+      while (next_event < events.size() &&
+             events[next_event].time_us <= now_us_) {
+        if (!Apply(events[next_event])) { return 1; }
+        next_event++;
+      }
+      Step();
+    }
+
+    const double wall_s = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    const double sim_s = static_cast<double>(now_us_) * 1e-6;
+    const auto& status = control_.status();
+    const double measured_Wh =
+        static_cast<double>(status.energy_delivered_uW_hr) * 1e-6;
+
+    std::fprintf(stderr,
+                 "simulated %.1f s in %.2f s (%.0fx), %d state changes, "
+                 "%d faults\n",
+                 sim_s, wall_s, sim_s / std::max(1e-9, wall_s),
+                 state_changes_, faults_);
+    std::fprintf(stderr,
+                 "energy delivered: model %.4f Wh, measured %.4f Wh\n",
+                 model_.delivered_Wh(), measured_Wh);
+    const bool history_ok = CheckHistoryEnergy();
+    if (expect_failures_) {
+      std::fprintf(stderr, "FAIL: %d expectations not met\n",
+                   expect_failures_);
+      return 1;
+    }
+    return history_ok ? 0 : 1;
+  }
+
+ private:
+  bool Apply(const Event& event) {
+    const auto& args = event.args;
+    auto arg = [&](size_t i) -> std::string {
+      return i < args.size() ? args[i] : std::string();
+    };
+    auto number = [&](size_t i) {
+      return std::strtod(arg(i).c_str(), nullptr);
+    };
+
+    const auto& cmd = args[0];
+    bool ok = true;
+    if (cmd == "switch") {
+      ok = arg(1) == "on" || arg(1) == "off";
+      model_.set_switch(arg(1) == "on");
+    } else if (cmd == "lock") {
+      control_.set_lock_time(static_cast<int16_t>(number(1)));
+    } else if (cmd == "force") {
+      const auto& value = arg(1);
+      ok = value == "off" || value == "on" || value == "disable";
+      control_.set_force_output(
+          value == "off" ? 1 : value == "on" ? 2 : 0);
+    } else if (cmd == "load") {
+      const auto& type = arg(1);
+      if (type == "none") {
+        model_.set_load(Model::LoadType::kNone, 0.0);
+      } else if (type == "resistance") {
+        model_.set_load(Model::LoadType::kResistance, number(2));
+      } else if (type == "current") {
+        model_.set_load(Model::LoadType::kCurrent, number(2));
+      } else if (type == "power") {
+        model_.set_load(Model::LoadType::kPower, number(2));
+      } else {
+        ok = false;
+      }
+    } else if (cmd == "short") {
+      model_.set_short(arg(1) == "on");
+    } else if (cmd == "capacitance") {
+      model_.mutable_options()->capacitance_F = number(1) * 1e-6;
+    } else if (cmd == "battery") {
+      const auto& what = arg(1);
+      if (what == "soc") {
+        model_.set_soc(number(2) * 0.01);
+      } else if (what == "resistance") {
+        model_.mutable_options()->battery_resistance_ohm = number(2);
+      } else if (what == "capacity") {
+        model_.mutable_options()->capacity_Ah = number(2);
+      } else {
+        ok = false;
+      }
+    } else if (cmd == "ambient") {
+      model_.mutable_options()->ambient_C = number(1);
+    } else if (cmd == "inrush") {
+      model_.mutable_options()->inrush_A = number(1);
+    } else if (cmd == "gate_delay") {
+      model_.mutable_options()->gate_delay_s = number(1) * 1e-3;
+    } else if (cmd == "lm5066") {
+      lm5066_present_ = arg(1) == "on";
+    } else if (cmd == "fault" && arg(1) == "tps2490") {
+      model_.Tps2490Fault();
+    } else if (cmd == "fault" && arg(1) == "lm5066") {
+      ok = ParseLm5066Fault(arg(2), &lm5066_fault_);
+      if (ok && lm5066_present_) {
+        control_.HandleLm5066Alert(lm5066_fault_);
+      }
+    } else if (cmd == "config") {
+      ok = SetConfig(arg(1), number(2));
+    } else if (cmd == "expect") {
+      ok = Expect(arg(1), arg(2), event);
+    } else if (cmd == "end") {
+    } else {
+      ok = false;
+    }
+
+    if (!ok) {
+      std::fprintf(stderr, "%s:%d: invalid command\n",
+                   options_.scenario.c_str(), event.line);
+    }
+    return ok;
+  }
+
+  bool Expect(const std::string& what, const std::string& value,
+              const Event& event) {
+    const auto& status = control_.status();
+    int expected = 0;
+    int actual = 0;
+    if (what == "state") {
+      const char* const names[] = { "off", "precharging", "on", "fault" };
+      expected = -1;
+      for (int i = 0; i < fw::kNumStates; i++) {
+        if (value == names[i]) { expected = i; }
+      }
+      if (expected < 0) { return false; }
+      actual = status.state;
+    } else if (what == "fault" && !value.empty()) {
+      expected = std::atoi(value.c_str());
+      actual = status.fault_code;
+    } else {
+      return false;
+    }
+
+    if (actual != expected) {
+      std::fprintf(stderr, "%s:%d: at %.3f s expected %s %d, was %d\n",
+                   options_.scenario.c_str(), event.line,
+                   static_cast<double>(now_us_) * 1e-6,
+                   what.c_str(), expected, actual);
+      expect_failures_++;
+    }
+    return true;
+  }
+
+  static bool ParseLm5066Fault(const std::string& name, Lm5066Fault* fault) {
+    const std::pair<const char*, Lm5066Fault> names[] = {
+      { "none", Lm5066Fault::kNone },
+      { "over_current", Lm5066Fault::kOverCurrent },
+      { "under_voltage", Lm5066Fault::kUnderVoltage },
+      { "over_temp", Lm5066Fault::kOverTemperature },
+      { "over_voltage", Lm5066Fault::kOverVoltage },
+      { "circuit_breaker", Lm5066Fault::kCircuitBreaker },
+      { "mosfet_shorted", Lm5066Fault::kMosfetShorted },
+      { "communications", Lm5066Fault::kCommunications },
+      { "no_response", Lm5066Fault::kNoResponse },
+    };
+    for (const auto& pair : names) {
+      if (name == pair.first) {
+        *fault = pair.second;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool SetConfig(const std::string& path, double value) {
+    const auto dot = path.find('.');
+    if (dot == std::string::npos) { return false; }
+    const auto group = path.substr(0, dot);
+    FieldSetter setter(path.substr(dot + 1), value);
+
+    if (group == "power") {
+      control_.mutable_config()->Serialize(&setter);
+    } else if (group == "i2t") {
+      control_.mutable_i2t_config()->Serialize(&setter);
+    } else if (group == "fet_thermal") {
+      control_.mutable_fet_thermal_config()->Serialize(&setter);
+    } else if (group == "battery") {
+      control_.mutable_battery_config()->Serialize(&setter);
+    } else if (group == "precharge") {
+      control_.mutable_precharge_config()->Serialize(&setter);
+    } else {
+      return false;
+    }
+    control_.Configure();
+    return setter.found();
+  }
+
+  // What the firmware would measure, with optional noise.
+  Control::Measurement Measure() {
+    std::normal_distribution<double> normal;
+    const double noise = options_.noise;
+    auto sample = [&](double value, double stddev) {
+      return static_cast<float>(value + noise * stddev * normal(random_));
+    };
+
+    Control::Measurement result;
+    result.input_voltage_V = sample(model_.input_V(), 0.02);
+    result.output_voltage_V = sample(model_.output_V(), 0.02);
+    result.current_A = sample(model_.current_A(), 0.05);
+    result.fet_temp_C = sample(model_.fet_temp_C(), 0.2);
+
+    // The current sense is inverting about mid scale.
+    const double counts_per_A =
+        static_cast<double>(control_.config().current_sense_ohm) * 8 * 7 /
+        (3.3 / 4096.0);
+    result.isamp_raw = static_cast<uint16_t>(std::max(
+        0.0, std::min(4095.0, std::round(
+            2048.0 - static_cast<double>(result.current_A) * counts_per_A))));
+    return result;
+  }
+
+  // The ADC analog watchdogs are evaluated on each conversion, and
+  // so act before the firmware sees the measurement.
+  void AnalogWatchdogs(const Control::Measurement& m, bool input) {
+    const auto& config = control_.config();
+    const auto state = control_.status().state;
+    if (state != fw::kPrecharging && state != fw::kPowerOn) { return; }
+
+    if (state == fw::kPowerOn &&
+        m.output_voltage_V < config.output_undervoltage_V) {
+      control_.AsyncFault(fw::kFaultOutputUnderVoltage);
+    } else if (m.output_voltage_V > config.output_overvoltage_V) {
+      control_.AsyncFault(fw::kFaultOutputOverVoltage);
+    }
+    if (input && m.input_voltage_V < config.input_undervoltage_V) {
+      control_.AsyncFault(fw::kFaultInputUnderVoltage);
+    } else if (input && m.input_voltage_V > config.input_overvoltage_V) {
+      control_.AsyncFault(fw::kFaultInputOverVoltage);
+    }
+    if (m.current_A > config.overcurrent_A) {
+      control_.AsyncFault(fw::kFaultOverCurrent);
+    } else if (m.current_A < -config.regen_overcurrent_A) {
+      control_.AsyncFault(fw::kFaultRegenOverCurrent);
+    }
+  }
+
+  // The history buckets are differences of the firmware's running
+  // energy total, so any energy it drops between them shows up here
+  // as a shortfall against the power integrated over the same span.
+  bool CheckHistoryEnergy() const {
+    const double integrated_uW_hr =
+        history_end_uW_hr_ - history_start_uW_hr_;
+    const double error_uW_hr =
+        static_cast<double>(history_bucket_sum_uW_hr_) - integrated_uW_hr;
+    const bool ok =
+        std::abs(error_uW_hr) <= 1.0 + 1e-3 * std::abs(integrated_uW_hr);
+    std::fprintf(stderr,
+                 "%s: history energy over %u s: buckets %lld uWh, "
+                 "integrated %.1f uWh\n",
+                 ok ? "PASS" : "FAIL",
+                 static_cast<unsigned>(
+                     history_.total(fw::PowerHistory::kSeconds)),
+                 static_cast<long long>(history_bucket_sum_uW_hr_),
+                 integrated_uW_hr);
+    return ok;
+  }
+
+  // Feed the history as the firmware does, and integrate the power
+  // each millisecond up to the end of the last complete bucket.
+  void AddHistory() {
+    const auto& status = control_.status();
+    integrated_uW_hr_ +=
+        static_cast<double>(status.power_W) * 1e-3 / 3600.0 * 1e6;
+
+    const auto before = history_.total(fw::PowerHistory::kSeconds);
+    history_.Add(status.output_current_A, status.output_voltage_V,
+                 status.energy_uW_hr);
+    if (!history_started_) {
+      history_started_ = true;
+      history_start_uW_hr_ = integrated_uW_hr_;
+      history_end_uW_hr_ = integrated_uW_hr_;
+    }
+    if (history_.total(fw::PowerHistory::kSeconds) != before) {
+      fw::PowerHistory::Bucket bucket;
+      history_.Get(fw::PowerHistory::kSeconds, 0, &bucket);
+      history_bucket_sum_uW_hr_ += bucket.energy_uW_hr;
+      history_end_uW_hr_ = integrated_uW_hr_;
+    }
+  }
+
+  // One pass of the firmware's main loop, in the same order.
+  void Step() {
+    model_.Step(options_.step_us * 1e-6, drive_);
+
+    // The TPS2490 fault pin interrupts on a falling edge.
+    const bool flt = model_.tps2490_flt();
+    if (last_flt_ && !flt) {
+      control_.AsyncFault(fw::kFaultTps2490Interrupt);
+    }
+    last_flt_ = flt;
+
+    // The firmware timer is a free running 32 bit microsecond
+    // counter, so it wraps the same way here.
+    const auto now_us = static_cast<uint32_t>(now_us_);
+
+    Control::Inputs inputs;
+    inputs.now_us = now_us;
+    inputs.switch_status = model_.switch_on() ? 1 : 0;
+    inputs.tps2490_fault = flt ? 1 : 0;
+    inputs.lm5066_fault = lm5066_present_ ? lm5066_fault_ : Lm5066Fault::kNone;
+    control_.SetInputs(inputs);
+
+    if (control_.PrechargeSampleDue()) {
+      const auto m = Measure();
+      AnalogWatchdogs(m, false);
+      control_.SamplePrecharge(now_us, m.output_voltage_V, m.current_A);
+    }
+
+    drive_.override_pwr = control_.SetOutputsFromState().override_pwr;
+    control_.MaybeChangeState();
+
+    const uint32_t new_time = now_us / 1000;
+    if (new_time != old_time_) {
+      old_time_ = new_time;
+
+      control_.PollMillisecond();
+      const auto m = Measure();
+      AnalogWatchdogs(m, true);
+      control_.MeasureEnergy(m);
+      AddHistory();
+
+      if (new_time % 100 == 0) {
+        control_.PollHundredMillisecond();
+        lm5066_status_.fault = lm5066_fault_;
+        lm5066_status_.pin_100mW = static_cast<int16_t>(
+            std::round(model_.input_V() * model_.current_A() * 10.0));
+        control_.CheckLm5066(lm5066_present_ ? &lm5066_status_ : nullptr);
+      }
+    }
+
+    const auto& status = control_.status();
+    const bool state_changed = status.state != last_state_;
+    if (state_changed) {
+      state_changes_++;
+      if (status.state == fw::kFault) { faults_++; }
+      last_state_ = status.state;
+    }
+    if (state_changed ||
+        (now_us_ % (1000 * options_.trace_ms)) == 0) {
+      WriteRow();
+    }
+  }
+
+  void WriteHeader() {
+    std::fprintf(out_, "time_s,model_soc,model_ocv_V,model_input_V,"
+                 "model_output_V,model_current_A,model_fet_temp_C,"
+                 "model_tps2490_flt,override_pwr");
+    CsvHeader power(out_, "");
+    Control::Status().Serialize(&power);
+    CsvHeader battery(out_, "battery_");
+    fw::BatteryEstimator::Status().Serialize(&battery);
+    std::fprintf(out_, "\n");
+  }
+
+  void WriteRow() {
+    std::fprintf(out_, "%.6f,%.6f,%.4f,%.4f,%.4f,%.4f,%.3f,%d,%d",
+                 static_cast<double>(now_us_) * 1e-6,
+                 model_.soc(), model_.ocv(), model_.input_V(),
+                 model_.output_V(), model_.current_A(), model_.fet_temp_C(),
+                 model_.tps2490_flt() ? 1 : 0, drive_.override_pwr ? 1 : 0);
+    CsvValues values(out_);
+    auto status = control_.status();
+    status.Serialize(&values);
+    auto battery = control_.battery_status();
+    battery.Serialize(&values);
+    std::fprintf(out_, "\n");
+  }
+
+  const Options options_;
+  FILE* const out_;
+
+  Control control_;
+  Model model_;
+  Model::Drive drive_;
+  std::mt19937 random_;
+
+  int64_t now_us_ = 0;
+  uint32_t old_time_ = 0;
+  bool last_flt_ = false;
+
+  bool lm5066_present_ = false;
+  Lm5066Fault lm5066_fault_ = Lm5066Fault::kNone;
+  fw::Lm5066Decoder::Status lm5066_status_;
+
+  fw::State last_state_ = fw::kPowerOff;
+  int state_changes_ = 0;
+  int faults_ = 0;
+  int expect_failures_ = 0;
+
+  fw::PowerHistory history_;
+  bool history_started_ = false;
+  double integrated_uW_hr_ = 0.0;
+  double history_start_uW_hr_ = 0.0;
+  double history_end_uW_hr_ = 0.0;
+  int64_t history_bucket_sum_uW_hr_ = 0;
+};
+
+}
+
+int main(int argc, char** argv) {
+  const auto options = ParseOptions(argc, argv);
+  const auto events = ReadScenario(options.scenario);
+
+  FILE* out = stdout;
+  if (!options.output.empty()) {
+    out = std::fopen(options.output.c_str(), "w");
+    if (!out) {
+      std::fprintf(stderr, "could not open %s\n", options.output.c_str());
+      return 1;
+    }
+  }
+
+  Simulator simulator(options, out);
+  const int result = simulator.Run(events);
+
+  if (out != stdout) { std::fclose(out); }
+  return result;
+}
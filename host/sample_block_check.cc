@@ -0,0 +1,120 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+///
+/// Checks that the packed sample block reductions produce exactly the
+/// same results as the scalar ones.
+///
+///  * The self test which the firmware runs on the target, over a
+///    number of seeds.
+///  * Every block length up to a limit, over a range of patterns.
+///
+/// Usage: sample_block_check [--max-length N] [--seed S] [--seeds N]
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "fw/sample_block.h"
+#include "host/check.h"
+
+namespace {
+
+using fw::SampleBlock;
+
+struct Options {
+  int max_length = 256;
+  unsigned seed = 1;
+  int seeds = 16;
+};
+
+Options ParseOptions(int argc, char** argv) {
+  Options result;
+  host::OptionParser("[--max-length N] [--seed S] [--seeds N]")
+      .Value("--max-length", &result.max_length)
+      .Value("--seed", &result.seed)
+      .Value("--seeds", &result.seeds)
+      .Parse(argc, argv);
+  result.max_length = std::max(1, result.max_length);
+  return result;
+}
+
+void CheckSelfTest(const Options& options, host::CheckCounter* check) {
+  for (int i = 0; i < options.seeds; i++) {
+    const uint32_t seed = options.seed + static_cast<uint32_t>(i);
+    const auto result = SampleBlock::SelfTest(seed);
+    (*check)(result.failures == 0,
+             "self test seed %u: %d of %d%s%s",
+             static_cast<unsigned>(seed),
+             result.checks - result.failures, result.checks,
+             result.failed_pattern ? ", first failure " : "",
+             result.failed_pattern ? result.failed_pattern : "");
+  }
+}
+
+void CheckLengths(const Options& options, host::CheckCounter* check) {
+  std::mt19937 rng(options.seed);
+  std::uniform_int_distribution<int> counts(0, 4095);
+
+  // Each pattern fills a block, given the index of the sample.
+  using Pattern = uint16_t (*)(std::mt19937&, int);
+  const std::pair<const char*, Pattern> patterns[] = {
+    { "random", [](std::mt19937& r, int) {
+        return static_cast<uint16_t>(
+            std::uniform_int_distribution<int>(0, 4095)(r)); } },
+    { "zero", [](std::mt19937&, int) { return uint16_t(0); } },
+    { "full", [](std::mt19937&, int) { return uint16_t(4095); } },
+    { "ramp", [](std::mt19937&, int i) {
+        return static_cast<uint16_t>((i * 37) % 4096); } },
+    { "alternate", [](std::mt19937&, int i) {
+        return static_cast<uint16_t>((i % 2) ? 4095 : 0); } },
+  };
+
+  const int start_failures = check->failures();
+  for (const auto& pattern : patterns) {
+    for (int length = 0; length <= options.max_length; length++) {
+      std::vector<uint16_t> a(length);
+      std::vector<uint16_t> b(length);
+      for (int i = 0; i < length; i++) {
+        a[i] = pattern.second(rng, i);
+        b[i] = static_cast<uint16_t>(counts(rng));
+      }
+      const uint32_t n = static_cast<uint32_t>(length);
+
+      if (!(*check)(SampleBlock::Reduce(a.data(), n) ==
+                    SampleBlock::ReduceScalar(a.data(), n))) {
+        std::printf("FAIL: reduce %s length %d\n", pattern.first, length);
+      }
+      if (!(*check)(SampleBlock::Dot(a.data(), b.data(), n) ==
+                    SampleBlock::DotScalar(a.data(), b.data(), n))) {
+        std::printf("FAIL: dot %s length %d\n", pattern.first, length);
+      }
+    }
+  }
+  if (check->failures() == start_failures) {
+    std::printf("PASS: all lengths up to %d\n", options.max_length);
+  }
+}
+
+}
+
+int main(int argc, char** argv) {
+  const auto options = ParseOptions(argc, argv);
+
+  host::CheckCounter check;
+  CheckSelfTest(options, &check);
+  CheckLengths(options, &check);
+  return check.Finish();
+}
@@ -0,0 +1,440 @@
+// Copyright 2023 mjbots Robotic Systems, LLC.  info@mjbots.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+///
+/// Receives the ADC sample stream of a power_dist over the diagnostic
+/// tunnel of SocketCAN, and writes the samples to disk as CSV.
+///
+/// Usage: sample_stream_receiver [options] --output FILE
+///
+///  --interface NAME    the SocketCAN interface (default can0)
+///  --target ID         the multiplex id of the board (default 32)
+///  --source ID         our multiplex id (default 0)
+///  --prefix N          the CAN prefix configured on the board
+///  --no-brs            do not use bit rate switching
+///  --duration S        stop after this long, otherwise at SIGINT
+///  --no-start          do not send "p stream start" and "p stream
+///                      stop", for when the stream is already running
+///  --sync              broadcast this host's monotonic clock each
+///                      second, so the board reports host times
+///  --raw FILE          also write the tunnel bytes as received
+///  --input FILE        instead, decode a file written with --raw
+///
+/// The CSV has one row per sample, with the board time and the host
+/// time in microseconds, the frame sequence number, and each channel
+/// in ADC counts.  The host time is left empty until the board has
+/// been synchronized, as are channels which are not streamed.
+///
+/// Other tunnel output, such as command replies, is skipped.  A
+/// summary of frames, gaps in the sequence, and frames the board
+/// reported as dropped is written to stderr.
+
+#include <signal.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "fw/sample_stream.h"
+#include "host/can_socket.h"
+#include "host/multiplex_protocol.h"
+
+namespace {
+
+namespace mp = host::multiplex;
+using host::CanSocket;
+using host::NowNs;
+using fw::SampleStream;
+
+constexpr uint32_t kTunnelChannel = 1;
+constexpr uint32_t kHostTimeRegister = 0x008;
+
+// The most tunnel data which fits in one CAN-FD reply, after the
+// subframe code, channel, and size.
+constexpr uint32_t kMaxPollSize = 61;
+
+const char* const kChannelNames[SampleStream::kNumChannels] = {
+  "vin", "vout", "isamp", "isamp_low", "fet_temp",
+};
+
+struct Options {
+  std::string interface = "can0";
+  int target = 32;
+  int source = 0;
+  uint32_t prefix = 0;
+  bool brs = true;
+  double duration_s = 0.0;
+  bool start = true;
+  bool sync = false;
+  std::string output;
+  std::string raw;
+  std::string input;
+};
+
+[[noreturn]] void Usage(const char* name) {
+  std::fprintf(stderr,
+               "usage: %s [--interface NAME] [--target ID] [--source ID] "
+               "[--prefix N] [--no-brs] [--duration S] [--no-start] "
+               "[--sync] [--raw FILE] --output FILE\n"
+               "       %s --input FILE --output FILE\n",
+               name, name);
+  std::exit(1);
+}
+
+Options ParseOptions(int argc, char** argv) {
+  Options result;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const char* next = (i + 1 < argc) ? argv[i + 1] : nullptr;
+    if (arg == "--interface" && next) {
+      result.interface = next;
+      i++;
+    } else if (arg == "--target" && next) {
+      result.target = std::atoi(next);
+      i++;
+    } else if (arg == "--source" && next) {
+      result.source = std::atoi(next);
+      i++;
+    } else if (arg == "--prefix" && next) {
+      result.prefix = static_cast<uint32_t>(std::strtoul(next, nullptr, 0));
+      i++;
+    } else if (arg == "--no-brs") {
+      result.brs = false;
+    } else if (arg == "--duration" && next) {
+      result.duration_s = std::strtod(next, nullptr);
+      i++;
+    } else if (arg == "--no-start") {
+      result.start = false;
+    } else if (arg == "--sync") {
+      result.sync = true;
+    } else if (arg == "--output" && next) {
+      result.output = next;
+      i++;
+    } else if (arg == "--raw" && next) {
+      result.raw = next;
+      i++;
+    } else if (arg == "--input" && next) {
+      result.input = next;
+      i++;
+    } else {
+      Usage(argv[0]);
+    }
+  }
+
+  const auto valid_id = [](int id) { return id >= 0 && id < 0x7f; };
+  if (result.output.empty() ||
+      !valid_id(result.target) || !valid_id(result.source) ||
+      result.prefix > 0x1fff || result.duration_s < 0.0) {
+    Usage(argv[0]);
+  }
+  return result;
+}
+
+struct Stats {
+  int64_t frames = 0;
+  int64_t samples = 0;
+  int64_t missing = 0;
+  int64_t checksum_errors = 0;
+  int64_t skipped_bytes = 0;
+  uint16_t board_dropped = 0;
+};
+
+/// Finds frames in the tunnel bytes and writes their samples as CSV.
+class Decoder {
+ public:
+  explicit Decoder(FILE* out) : out_(out) {
+    std::fprintf(out_, "time_us,host_time_us,sequence");
+    for (const char* name : kChannelNames) { std::fprintf(out_, ",%s", name); }
+    std::fprintf(out_, "\n");
+  }
+
+  void Push(const uint8_t* data, size_t size) {
+    buffer_.insert(buffer_.end(), data, data + size);
+
+    size_t pos = 0;
+    while (true) {
+      // Resynchronize on the magic bytes.
+      while (pos < buffer_.size() &&
+             !(buffer_[pos] == SampleStream::kMagic0 &&
+               (pos + 1 == buffer_.size() ||
+                buffer_[pos + 1] == SampleStream::kMagic1))) {
+        pos++;
+        stats_.skipped_bytes++;
+      }
+      const size_t available = buffer_.size() - pos;
+      if (available < SampleStream::kHeaderSize) { break; }
+
+      const uint8_t* const frame = &buffer_[pos];
+      const size_t payload = Read16(frame + 4);
+      const size_t total =
+          SampleStream::kHeaderSize + payload + SampleStream::kChecksumSize;
+      if (frame[2] != SampleStream::kVersion ||
+          total > SampleStream::kMaxFrameSize) {
+        pos++;
+        stats_.skipped_bytes++;
+        continue;
+      }
+      if (available < total) { break; }
+
+      const size_t checksum_pos = total - SampleStream::kChecksumSize;
+      if (SampleStream::Checksum(frame, checksum_pos) !=
+          Read16(frame + checksum_pos)) {
+        pos++;
+        stats_.checksum_errors++;
+        stats_.skipped_bytes++;
+        continue;
+      }
+
+      Decode(frame, payload);
+      pos += total;
+    }
+    buffer_.erase(buffer_.begin(), buffer_.begin() + pos);
+  }
+
+  const Stats& stats() const { return stats_; }
+
+ private:
+  static uint16_t Read16(const uint8_t* data) {
+    return static_cast<uint16_t>(data[0] | (data[1] << 8));
+  }
+
+  static uint32_t Read32(const uint8_t* data) {
+    return Read16(data) | (static_cast<uint32_t>(Read16(data + 2)) << 16);
+  }
+
+  static int64_t Read64(const uint8_t* data) {
+    return static_cast<int64_t>(
+        Read32(data) | (static_cast<uint64_t>(Read32(data + 4)) << 32));
+  }
+
+  void Decode(const uint8_t* frame, size_t payload) {
+    const uint8_t channels = frame[3];
+    const uint16_t sequence = Read16(frame + 6);
+    const uint16_t decimation = Read16(frame + 10);
+    const uint32_t timestamp_us = Read32(frame + 12);
+    const int64_t host_time_us = Read64(frame + 16);
+
+    if (stats_.frames > 0) {
+      stats_.missing += static_cast<uint16_t>(sequence - next_sequence_);
+    }
+    next_sequence_ = static_cast<uint16_t>(sequence + 1);
+    stats_.board_dropped = Read16(frame + 8);
+    stats_.frames++;
+
+    const int count = SampleStream::ChannelCount(channels);
+    if (count == 0) { return; }
+    const size_t sample_size = 2 * static_cast<size_t>(count);
+    const uint8_t* data = frame + SampleStream::kHeaderSize;
+    for (size_t i = 0; i + sample_size <= payload; i += sample_size) {
+      const uint32_t offset_us = static_cast<uint32_t>(
+          (i / sample_size) * decimation * 1000u);
+      std::fprintf(out_, "%u,", timestamp_us + offset_us);
+      if (host_time_us != 0) {
+        std::fprintf(out_, "%lld",
+                     static_cast<long long>(host_time_us + offset_us));
+      }
+      std::fprintf(out_, ",%u", sequence);
+      for (int c = 0; c < SampleStream::kNumChannels; c++) {
+        if ((channels & (1 << c)) == 0) {
+          std::fprintf(out_, ",");
+          continue;
+        }
+        std::fprintf(out_, ",%.4f",
+                     Read16(data) / static_cast<double>(
+                         1 << SampleStream::kFractionBits));
+        data += 2;
+      }
+      std::fprintf(out_, "\n");
+      stats_.samples++;
+    }
+  }
+
+  FILE* const out_;
+  std::vector<uint8_t> buffer_;
+  uint16_t next_sequence_ = 0;
+  Stats stats_;
+};
+
+volatile sig_atomic_t g_stop = 0;
+
+void HandleSignal(int) { g_stop = 1; }
+
+class Receiver {
+ public:
+  Receiver(const Options& options, CanSocket* socket)
+      : options_(options), socket_(socket) {}
+
+  void Command(const char* command) {
+    const std::string text = std::string(command) + "\n";
+    mp::FrameWriter writer;
+    writer.TunnelWrite(kTunnelChannel,
+                       reinterpret_cast<const uint8_t*>(text.data()),
+                       text.size());
+    socket_->Send(Id(false), writer.Padded());
+  }
+
+  /// Poll the tunnel until stopped, passing everything received to
+  /// 'handler'.
+  template <typename Handler>
+  void Run(Handler handler) {
+    const int64_t end_ns = (options_.duration_s > 0.0) ?
+        NowNs() + static_cast<int64_t>(options_.duration_s * 1e9) : 0;
+    mp::FrameWriter poll;
+    poll.TunnelPoll(kTunnelChannel, kMaxPollSize);
+    const auto poll_data = poll.Padded();
+    int64_t next_sync_ns = 0;
+
+    while (!g_stop && (end_ns == 0 || NowNs() < end_ns)) {
+      if (options_.sync && NowNs() >= next_sync_ns) {
+        SendSync();
+        next_sync_ns = NowNs() + 1000000000;
+      }
+      socket_->Send(Id(true), poll_data);
+
+      // Each poll is answered at once, with whatever is waiting.
+      const int64_t deadline_ns = NowNs() + 20000000;
+      bool answered = false;
+      while (!answered && NowNs() < deadline_ns) {
+        socket_->Wait(deadline_ns);
+        struct canfd_frame frame = {};
+        while (socket_->Receive(&frame)) {
+          if (!IsReply(frame)) { continue; }
+          answered = true;
+          for (const auto& subframe : subframes_) {
+            if (subframe.code == mp::kServerToClient &&
+                subframe.reg == kTunnelChannel && subframe.count) {
+              handler(subframe.values, subframe.count);
+            }
+          }
+        }
+      }
+    }
+  }
+
+ private:
+  // Every board on the bus takes the time from the same frame.  The
+  // time is read as late as possible before sending, but the host's
+  // send latency is still an offset common to all boards.
+  void SendSync() {
+    const uint64_t host_us = static_cast<uint64_t>(NowNs() / 1000);
+    const int32_t values[2] = {
+      static_cast<int32_t>(host_us & 0xffffffff),
+      static_cast<int32_t>(host_us >> 32),
+    };
+    mp::FrameWriter writer;
+    writer.Write(mp::kInt32, kHostTimeRegister, values, 2);
+    socket_->Send(mp::CanId(options_.prefix,
+                            static_cast<uint8_t>(options_.source),
+                            mp::kBroadcastId, false),
+                  writer.Padded());
+  }
+
+  uint32_t Id(bool reply_requested) const {
+    return mp::CanId(options_.prefix, static_cast<uint8_t>(options_.source),
+                     static_cast<uint8_t>(options_.target), reply_requested);
+  }
+
+  bool IsReply(const struct canfd_frame& frame) {
+    if ((frame.can_id & CAN_EFF_FLAG) == 0) { return false; }
+    const uint32_t id = frame.can_id & CAN_EFF_MASK;
+    if ((id >> 16) != options_.prefix ||
+        ((id >> 8) & 0x7f) != static_cast<uint32_t>(options_.target) ||
+        (id & 0xff) != static_cast<uint32_t>(options_.source)) {
+      return false;
+    }
+    return mp::Parse(frame.data, frame.len, &subframes_);
+  }
+
+  const Options& options_;
+  CanSocket* const socket_;
+  std::vector<mp::Subframe> subframes_;
+};
+
+void WriteSummary(const Stats& stats) {
+  std::fprintf(stderr,
+               "frames %lld  samples %lld  missing %lld  "
+               "board dropped %u  checksum errors %lld  "
+               "skipped bytes %lld\n",
+               static_cast<long long>(stats.frames),
+               static_cast<long long>(stats.samples),
+               static_cast<long long>(stats.missing),
+               stats.board_dropped,
+               static_cast<long long>(stats.checksum_errors),
+               static_cast<long long>(stats.skipped_bytes));
+}
+
+int DecodeFile(const Options& options, Decoder* decoder) {
+  std::ifstream input(options.input, std::ios::binary);
+  if (!input) {
+    std::fprintf(stderr, "could not open %s\n", options.input.c_str());
+    return 1;
+  }
+  std::vector<char> buffer(4096);
+  while (input.read(buffer.data(), buffer.size()) || input.gcount() > 0) {
+    decoder->Push(reinterpret_cast<const uint8_t*>(buffer.data()),
+                  static_cast<size_t>(input.gcount()));
+  }
+  return 0;
+}
+
+}
+
+int main(int argc, char** argv) {
+  const auto options = ParseOptions(argc, argv);
+
+  FILE* const out = std::fopen(options.output.c_str(), "w");
+  if (!out) {
+    std::fprintf(stderr, "could not open %s\n", options.output.c_str());
+    return 1;
+  }
+  Decoder decoder(out);
+
+  if (!options.input.empty()) {
+    const int result = DecodeFile(options, &decoder);
+    std::fclose(out);
+    WriteSummary(decoder.stats());
+    return result;
+  }
+
+  FILE* raw = nullptr;
+  if (!options.raw.empty()) {
+    raw = std::fopen(options.raw.c_str(), "wb");
+    if (!raw) {
+      std::fprintf(stderr, "could not open %s\n", options.raw.c_str());
+      return 1;
+    }
+  }
+
+  ::signal(SIGINT, HandleSignal);
+  ::signal(SIGTERM, HandleSignal);
+
+  CanSocket socket(options.interface, options.brs);
+  Receiver receiver(options, &socket);
+  if (options.start) { receiver.Command("p stream start"); }
+
+  receiver.Run([&](const uint8_t* data, size_t size) {
+      if (raw) { std::fwrite(data, 1, size, raw); }
+      decoder.Push(data, size);
+    });
+
+  if (options.start) { receiver.Command("p stream stop"); }
+  if (raw) { std::fclose(raw); }
+  std::fclose(out);
+  WriteSummary(decoder.stats());
+  return 0;
+}